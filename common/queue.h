@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <condition_variable>
 #include <mutex>
 #include <queue>
@@ -50,3 +51,52 @@ private:
   std::condition_variable cv;
   std::queue<T> q;
 };
+
+// A lock-free queue of many producers and one consumer, of nodes with a
+// std::atomic<T *> next. pop() returns nullptr when empty, and also while a
+// push() is halfway, which a later pop() returns.
+template <class T>
+class MpscQueue {
+public:
+  MpscQueue() : head(&stub), tail(&stub) {}
+
+  void push(T *node) {
+    node->next.store(nullptr, std::memory_order_relaxed);
+    T *prev = head.exchange(node, std::memory_order_acq_rel);
+    prev->next.store(node, std::memory_order_release);
+  }
+
+  // only from the consumer
+  T *pop() {
+    T *t = tail;
+    T *next = t->next.load(std::memory_order_acquire);
+    if (t == &stub) {
+      if (next == nullptr) return nullptr;
+      tail = t = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next != nullptr) {
+      tail = next;
+      return t;
+    }
+    if (t != head.load(std::memory_order_acquire)) return nullptr;
+
+    // t is the last, the stub goes behind it to take it out
+    push(&stub);
+    next = t->next.load(std::memory_order_acquire);
+    if (next != nullptr) {
+      tail = next;
+      return t;
+    }
+    return nullptr;
+  }
+
+  bool empty() const {
+    return tail == &stub && head.load(std::memory_order_acquire) == &stub;
+  }
+
+private:
+  std::atomic<T *> head;
+  T *tail;
+  T stub;
+};
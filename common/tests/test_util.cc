@@ -7,9 +7,12 @@
 #include <climits>
 #include <random>
 #include <string>
+#include <thread>
+#include <vector>
 
 #define CATCH_CONFIG_MAIN
 #include "catch2/catch.hpp"
+#include "common/queue.h"
 #include "common/util.h"
 
 std::string random_bytes(int size) {
@@ -160,3 +163,49 @@ TEST_CASE("util::remove_files_in_dir") {
   util::remove_files_in_dir(tmp_dir);
   REQUIRE(util::read_files_in_dir(tmp_dir).empty());
 }
+
+struct QueueNode {
+  std::atomic<QueueNode *> next = nullptr;
+  int producer = 0;
+  int seq = 0;
+};
+
+TEST_CASE("MpscQueue") {
+  const int producers = 4, count = 100000;
+  MpscQueue<QueueNode> q;
+  REQUIRE(q.empty());
+  REQUIRE(q.pop() == nullptr);
+
+  std::vector<QueueNode> nodes(producers * count);
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; ++p) {
+    threads.emplace_back([&, p]() {
+      for (int i = 0; i < count; ++i) {
+        QueueNode &node = nodes[p * count + i];
+        node.producer = p;
+        node.seq = i;
+        q.push(&node);
+      }
+    });
+  }
+
+  // all of them, each producer's in order
+  std::vector<int> next_seq(producers, 0);
+  int popped = 0;
+  while (popped < producers * count) {
+    if (QueueNode *node = q.pop()) {
+      REQUIRE(node->seq == next_seq[node->producer]);
+      next_seq[node->producer]++;
+      popped++;
+    }
+  }
+  for (auto &t : threads) t.join();
+  REQUIRE(q.pop() == nullptr);
+  REQUIRE(q.empty());
+
+  // and again once empty
+  q.push(&nodes[0]);
+  REQUIRE_FALSE(q.empty());
+  REQUIRE(q.pop() == &nodes[0]);
+  REQUIRE(q.empty());
+}
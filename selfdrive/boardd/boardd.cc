@@ -14,15 +14,19 @@
 #include <cerrno>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <future>
+#include <memory>
+#include <mutex>
 #include <thread>
 
 #include "cereal/gen/cpp/car.capnp.h"
 #include "cereal/messaging/messaging.h"
 #include "common/params.h"
+#include "common/queue.h"
 #include "common/swaglog.h"
 #include "common/timing.h"
 #include "common/util.h"
@@ -212,6 +216,12 @@ void can_send_thread(std::vector<Panda *> pandas, bool fake_send) {
   assert(subscriber != NULL);
   subscriber->setTimeout(100);
 
+  // how long to wait for more sendcan to go out with the first, 0 to only take what is already waiting
+  uint64_t window = 0;
+  if (const char *window_us = getenv("BOARDD_SENDCAN_WINDOW_US")) {
+    window = std::atoll(window_us) * 1000ULL;
+  }
+
   // run as fast as messages come in
   while (!do_exit && check_all_connected(pandas)) {
     std::unique_ptr<Message> msg(subscriber->receive());
@@ -222,65 +232,330 @@ void can_send_thread(std::vector<Panda *> pandas, bool fake_send) {
       continue;
     }
 
-    capnp::FlatArrayMessageReader cmsg(aligned_buf.align(msg.get()));
-    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+    // the messages are packed as they come, and written out together
+    const uint64_t window_end = nanos_since_boot() + window;
+    bool queued = false;
+    while (msg) {
+      capnp::FlatArrayMessageReader cmsg(aligned_buf.align(msg.get()));
+      cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+
+      //Dont send if older than 1 second
+      if ((nanos_since_boot() - event.getLogMonoTime() < 1e9) && !fake_send) {
+        for (const auto& panda : pandas) {
+          panda->can_queue(event.getSendcan());
+        }
+        queued = true;
+      }
+
+      msg.reset(subscriber->receive(true));
+      while (!msg && nanos_since_boot() < window_end) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+        msg.reset(subscriber->receive(true));
+      }
+    }
 
-    //Dont send if older than 1 second
-    if ((nanos_since_boot() - event.getLogMonoTime() < 1e9) && !fake_send) {
+    if (queued) {
       for (const auto& panda : pandas) {
         LOGT("sending sendcan to panda: %s", (panda->hw_serial()).c_str());
-        panda->can_send(event.getSendcan());
+        panda->can_flush();
         LOGT("sendcan sent to panda: %s", (panda->hw_serial()).c_str());
       }
     }
   }
 }
 
-void can_recv_thread(std::vector<Panda *> pandas) {
-  util::set_thread_name("boardd_can_recv");
+// the frames of one read of a panda
+struct CanRecvBatch {
+  std::atomic<CanRecvBatch *> next = nullptr;
+  size_t panda = 0;
+  // when the frames were on the panda: the end of the read less the quickest transfer seen, as
+  // the panda doesn't tell
+  uint64_t bus_time = 0;
+  bool valid = true;
+  uint32_t frames = 0;
+  std::vector<uint8_t> data;
+};
+
+// Reads each panda on its own thread, so a slow transfer on one doesn't hold back the others.
+// The reads go to the can thread through a lock-free queue, and come back to be reused.
+class CanRecvWorkers {
+public:
+  CanRecvWorkers(const std::vector<Panda *> &pandas, const CanRecvBatching &batching)
+    : pandas(pandas), batching(batching), free_batches(pandas.size()), health(pandas.size()), device_stats(pandas.size()) {
+    for (size_t i = 0; i < pandas.size(); ++i) {
+      threads.emplace_back(&CanRecvWorkers::recv_thread, this, i);
+    }
+  }
 
-  // can = 8006
-  PubMaster pm({"can"});
+  ~CanRecvWorkers() {
+    stop();
+    for (CanRecvBatch *batch; (batch = batches.pop()) != nullptr;) delete batch;
+    for (auto &q : free_batches) {
+      for (CanRecvBatch *batch; (batch = q.pop()) != nullptr;) delete batch;
+    }
+  }
+
+  void stop() {
+    running = false;
+    for (auto &t : threads) t.join();
+    threads.clear();
+  }
+
+  bool ready() const { return !batches.empty(); }
 
-  // run at 100hz
-  const uint64_t dt = 10000000ULL;
-  uint64_t next_frame_time = nanos_since_boot() + dt;
-  std::vector<can_frame> raw_can_data;
+  // waits until there are reads, or the deadline
+  bool wait(uint64_t deadline) {
+    std::unique_lock lk(lock);
+    consumer_waiting = true;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    uint64_t cur_time;
+    while (!ready() && (cur_time = nanos_since_boot()) < deadline) {
+      cv.wait_for(lk, std::chrono::nanoseconds(deadline - cur_time));
+    }
+    consumer_waiting = false;
+    return ready();
+  }
+
+  // the reads so far, ordered by when the frames were on the pandas
+  void take(std::vector<CanRecvBatch *> &out) {
+    out.clear();
+    for (CanRecvBatch *batch; (batch = batches.pop()) != nullptr;) {
+      out.push_back(batch);
+    }
+    std::stable_sort(out.begin(), out.end(), [](const CanRecvBatch *a, const CanRecvBatch *b) {
+      return a->bus_time < b->bus_time;
+    });
+    messages++;
+    queue_depth += out.size();
+    queue_depth_max = std::max<uint64_t>(queue_depth_max, out.size());
+  }
+
+  void release(CanRecvBatch *batch) {
+    free_batches[batch->panda].push(batch);
+  }
+
+  // whether every panda's reads were fine since the last call
+  bool comms_healthy() {
+    bool ret = true;
+    for (auto &h : health) {
+      ret &= h.healthy && !h.failed.exchange(false);
+    }
+    return ret;
+  }
+
+  // after stop()
+  CanRecvStats stats() const {
+    CanRecvStats s;
+    s.devices = device_stats;
+    s.messages = messages;
+    s.queue_depth = queue_depth;
+    s.queue_depth_max = queue_depth_max;
+    return s;
+  }
+
+private:
+  void recv_thread(size_t i) {
+    util::set_thread_name("boardd_can_recv_worker");
+    Panda *panda = pandas[i];
+    CanRecvStats::Device &s = device_stats[i];
+
+    uint64_t next_read = 0;
+    while (running && panda->connected()) {
+      // like the single panda loop, a read brings frames at most every min_interval. on SPI
+      // every read is a transfer, so they'd come back nearly empty at the poll interval otherwise
+      uint64_t start_time = nanos_since_boot();
+      if (start_time < next_read) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(next_read - start_time));
+        start_time = nanos_since_boot();
+      }
+      const bool healthy = panda->can_read_wait(100);
+      health[i].healthy = healthy;
+      if (!healthy) {
+        // the messages are invalid until it reads fine again, it's given max_interval to recover
+        health[i].failed = true;
+        next_read = start_time + batching.max_interval;
+        continue;
+      }
+      if (!panda->can_unpack_pending()) continue;
+      next_read = start_time + batching.min_interval;
+      const uint64_t recv_time = nanos_since_boot();
+      const uint64_t read_time = recv_time - start_time;
+      s.read_time_min = std::min(s.read_time_min, read_time);
+
+      CanRecvBatch *batch = free_batches[i].pop();
+      if (batch == nullptr) {
+        batch = new CanRecvBatch;
+      }
+      batch->panda = i;
+      batch->bus_time = recv_time - s.read_time_min;
+      batch->valid = panda->can_move_frames(batch->data, batch->frames);
+
+      s.reads++;
+      s.frames += batch->frames;
+      s.read_time += read_time;
+      s.read_time_max = std::max(s.read_time_max, read_time);
+
+      batches.push(batch);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (consumer_waiting) {
+        std::lock_guard lk(lock);
+        cv.notify_one();
+      }
+    }
+  }
+
+  const std::vector<Panda *> pandas;
+  const CanRecvBatching batching;
+  std::atomic<bool> running = true;
+  std::vector<std::thread> threads;
+
+  MpscQueue<CanRecvBatch> batches;
+  std::vector<MpscQueue<CanRecvBatch>> free_batches;
+  std::mutex lock;
+  std::condition_variable cv;
+  std::atomic<bool> consumer_waiting = false;
+
+  struct Health {
+    std::atomic<bool> healthy = true;
+    std::atomic<bool> failed = false;  // a read failed, until the next message
+  };
+  std::vector<Health> health;
+  std::vector<CanRecvStats::Device> device_stats;
+  uint64_t messages = 0, queue_depth = 0, queue_depth_max = 0;
+};
+
+void can_recv_loop(const std::vector<Panda *> &pandas, const CanRecvBatching &batching, std::function<void(MessageBuilder &)> send,
+                   CanRecvStats *stats, const CanRecvClock &clock) {
+  std::unique_ptr<CanRecvWorkers> workers;
+  if (pandas.size() > 1) {
+    workers = std::make_unique<CanRecvWorkers>(pandas, batching);
+  }
+  std::vector<CanRecvBatch *> batches;
+  uint64_t window_start = clock.now();
 
   while (!do_exit && check_all_connected(pandas)) {
+    // the frames are held back until min_interval after the last message, the reads stay in flight meanwhile
+    const uint64_t min_time = window_start + batching.min_interval;
+    const uint64_t max_time = window_start + batching.max_interval;
+    uint64_t cur_time = clock.now();
+    if (cur_time < min_time) {
+      clock.sleep_for(min_time - cur_time);
+    }
+
+    // then sent as soon as any panda has some, or at max_interval without
     bool comms_healthy = true;
-    raw_can_data.clear();
-    for (const auto& panda : pandas) {
-      comms_healthy &= panda->can_receive(raw_can_data);
+    bool waited = false;
+    if (workers) {
+      if (!workers->ready()) {
+        waited = true;
+        // with the frames of the others read around the same time
+        if (workers->wait(max_time)) {
+          cur_time = clock.now();
+          if (cur_time < max_time) {
+            clock.sleep_for(std::min(batching.merge_wait, max_time - cur_time));
+          }
+        }
+      }
+    } else {
+      bool pending = false;
+      while (true) {
+        for (const auto& panda : pandas) {
+          cur_time = clock.now();
+          const uint64_t wait = (pending || cur_time >= max_time) ? 0 : max_time - cur_time;
+          comms_healthy &= panda->can_read_wait((wait + 999999ULL) / 1000000ULL);
+          pending |= panda->can_unpack_pending();
+        }
+        if (pending || !comms_healthy) break;
+        // no frames until max_interval is waiting too, the next window starts from the empty message
+        waited = true;
+        if (clock.now() >= max_time) break;
+      }
+    }
+
+    // the next window starts now, or keeps the cadence if the frames were waiting already
+    cur_time = clock.now();
+    if (waited) {
+      window_start = cur_time;
+    } else if (cur_time - min_time > batching.max_interval) {
+      if (ignition) {
+        LOGW("missed cycles (%d) %lld", (int)((cur_time - min_time) / batching.max_interval), (long long)(cur_time - min_time));
+      }
+      window_start = cur_time;
+    } else {
+      window_start = min_time;
     }
 
+    // the frames are unpacked straight into the message
     MessageBuilder msg;
     auto evt = msg.initEvent();
-    evt.setValid(comms_healthy);
-    auto canData = evt.initCan(raw_can_data.size());
-    for (uint i = 0; i<raw_can_data.size(); i++) {
-      canData[i].setAddress(raw_can_data[i].address);
-      canData[i].setBusTime(raw_can_data[i].busTime);
-      canData[i].setDat(kj::arrayPtr((uint8_t*)raw_can_data[i].dat.data(), raw_can_data[i].dat.size()));
-      canData[i].setSrc(raw_can_data[i].src);
-    }
-    pm.send("can", msg);
+    if (workers) {
+      workers->take(batches);
+      comms_healthy &= workers->comms_healthy();
+      uint32_t can_frames = 0;
+      for (const CanRecvBatch *batch : batches) {
+        can_frames += batch->frames;
+      }
 
-    uint64_t cur_time = nanos_since_boot();
-    int64_t remaining = next_frame_time - cur_time;
-    if (remaining > 0) {
-      std::this_thread::sleep_for(std::chrono::nanoseconds(remaining));
+      auto canData = evt.initCan(can_frames);
+      uint32_t offset = 0;
+      for (CanRecvBatch *batch : batches) {
+        pandas[batch->panda]->can_unpack_frames(batch->data.data(), batch->frames, canData, offset);
+        offset += batch->frames;
+        comms_healthy &= batch->valid;
+        workers->release(batch);
+      }
     } else {
-      if (ignition) {
-        LOGW("missed cycles (%d) %lld", (int)-1*remaining/dt, remaining);
+      uint32_t can_frames = 0;
+      for (const auto& panda : pandas) {
+        can_frames += panda->can_frames_ready();
+      }
+
+      auto canData = evt.initCan(can_frames);
+      uint32_t offset = 0;
+      for (const auto& panda : pandas) {
+        const uint32_t frames = panda->can_frames_ready();
+        comms_healthy &= panda->can_unpack(canData, offset);
+        offset += frames;
       }
-      next_frame_time = cur_time;
     }
+    evt.setValid(comms_healthy);
+    send(msg);
+  }
 
-    next_frame_time += dt;
+  if (workers) {
+    workers->stop();
+    if (stats) {
+      *stats = workers->stats();
+    }
   }
 }
 
+void can_recv_thread(std::vector<Panda *> pandas, CanRecvBatching batching) {
+  util::set_thread_name("boardd_can_recv");
+
+  // can = 8006
+  PubMaster pm({"can"});
+
+  can_recv_loop(pandas, batching, [&](MessageBuilder &msg) {
+    pm.send("can", msg);
+  });
+}
+
+CanRecvBatching can_recv_batching() {
+  CanRecvBatching batching;
+  if (const char *min_interval = getenv("BOARDD_CAN_MIN_INTERVAL_US")) {
+    batching.min_interval = std::atoll(min_interval) * 1000ULL;
+  }
+  if (const char *max_interval = getenv("BOARDD_CAN_MAX_INTERVAL_US")) {
+    batching.max_interval = std::atoll(max_interval) * 1000ULL;
+  }
+  if (const char *merge_wait = getenv("BOARDD_CAN_MERGE_WAIT_US")) {
+    batching.merge_wait = std::atoll(merge_wait) * 1000ULL;
+  }
+  batching.max_interval = std::max(batching.max_interval, std::max(batching.min_interval, 1000000ULL));
+  return batching;
+}
+
 void send_empty_peripheral_state(PubMaster *pm) {
   MessageBuilder msg;
   auto peripheralState  = msg.initEvent().initPeripheralState();
@@ -311,21 +586,11 @@ std::optional<bool> send_panda_states(PubMaster *pm, const std::vector<Panda *>
   pandaCanStates.reserve(pandas_cnt);
 
   for (const auto& panda : pandas){
-    auto health_opt = panda->get_state();
-    if (!health_opt) {
+    health_t health;
+    std::array<can_health_t, PANDA_CAN_CNT> can_health;
+    if (!panda->get_states(health, can_health)) {
       return std::nullopt;
     }
-
-    health_t health = *health_opt;
-
-    std::array<can_health_t, PANDA_CAN_CNT> can_health{};
-    for (uint32_t i = 0; i < PANDA_CAN_CNT; i++) {
-      auto can_health_opt = panda->get_can_state(i);
-      if (!can_health_opt) {
-        return std::nullopt;
-      }
-      can_health[i] = *can_health_opt;
-    }
     pandaCanStates.push_back(can_health);
 
     if (spoofing_started) {
@@ -632,7 +897,7 @@ void boardd_main_thread(std::vector<std::string> serials) {
     threads.emplace_back(peripheral_control_thread, peripheral_panda, getenv("NO_FAN_CONTROL") != nullptr);
 
     threads.emplace_back(can_send_thread, pandas, getenv("FAKESEND") != nullptr);
-    threads.emplace_back(can_recv_thread, pandas);
+    threads.emplace_back(can_recv_thread, pandas, can_recv_batching());
 
     for (auto &t : threads) t.join();
   }
@@ -1,6 +1,52 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "cereal/messaging/messaging.h"
+#include "common/timing.h"
 #include "selfdrive/boardd/panda.h"
 
 bool safety_setter_thread(std::vector<Panda *> pandas);
 void boardd_main_thread(std::vector<std::string> serials);
+
+// When the can messages go out. A message is sent as soon as a panda has frames, but not
+// sooner than min_interval after the last one, and at max_interval without frames. The
+// defaults keep the 100hz of can that controlsd runs on, a lower min_interval trades that
+// for latency.
+// With several pandas, each is read on its own thread at most every min_interval, and a
+// message waits up to merge_wait after the first frames for the frames the others are
+// reading at the same time.
+struct CanRecvBatching {
+  uint64_t min_interval = 10000000ULL;  // nanoseconds
+  uint64_t max_interval = 10000000ULL;
+  uint64_t merge_wait = 500000ULL;
+};
+
+// the reads of each panda on its own thread, with several pandas
+struct CanRecvStats {
+  struct Device {
+    uint64_t reads = 0;          // that brought frames
+    uint64_t frames = 0;
+    uint64_t read_time = 0;      // nanoseconds in those reads, with the wait for the frames
+    uint64_t read_time_min = UINT64_MAX;
+    uint64_t read_time_max = 0;
+  };
+  std::vector<Device> devices;
+  uint64_t messages = 0;
+  uint64_t queue_depth = 0;      // reads waiting for the can thread, over all messages
+  uint64_t queue_depth_max = 0;
+};
+
+// the time can_recv_loop goes by. tests simulate it with one panda, the reads of several
+// pandas wait on their threads in real time
+struct CanRecvClock {
+  std::function<uint64_t()> now = nanos_since_boot;
+  std::function<void(uint64_t)> sleep_for = [](uint64_t ns) { std::this_thread::sleep_for(std::chrono::nanoseconds(ns)); };
+};
+
+void can_recv_loop(const std::vector<Panda *> &pandas, const CanRecvBatching &batching, std::function<void(MessageBuilder &)> send,
+                   CanRecvStats *stats = nullptr, const CanRecvClock &clock = {});
@@ -3,26 +3,59 @@
 from libcpp.vector cimport vector
 from libcpp.string cimport string
 from libcpp cimport bool
+from libc.stdint cimport uint8_t, uint16_t, uint32_t, uintptr_t
+from libc.string cimport memcpy
 
 cdef struct can_frame:
   long address
-  string dat
   long busTime
   long src
+  uint8_t len
+  uint8_t dat[64]
 
 cdef extern void can_list_to_can_capnp_cpp(const vector[can_frame] &can_list, string &out, bool sendCan, bool valid)
+cdef extern size_t can_arrays_to_can_capnp_cpp(size_t count, const uint32_t *addresses, const uint16_t *bus_times, const uint8_t *srcs,
+                                               const uint32_t *offsets, const uint8_t *dat, uint8_t *out, size_t out_size, bool sendCan, bool valid)
 
 def can_list_to_can_capnp(can_msgs, msgtype='can', valid=True):
   cdef vector[can_frame] can_list
   can_list.reserve(len(can_msgs))
 
   cdef can_frame f
+  cdef string dat
   for can_msg in can_msgs:
     f.address = can_msg[0]
     f.busTime = can_msg[1]
-    f.dat = can_msg[2]
+    dat = can_msg[2]
+    if dat.size() > sizeof(f.dat):
+      raise ValueError("CAN data longer than 64 bytes")
+    f.len = dat.size()
+    memcpy(f.dat, dat.data(), dat.size())
     f.src = can_msg[3]
     can_list.push_back(f)
   cdef string out
   can_list_to_can_capnp_cpp(can_list, out, msgtype == 'sendcan', valid)
   return out
+
+def can_arrays_to_can_capnp(const uint32_t[::1] addresses, const uint16_t[::1] bus_times, const uint8_t[::1] srcs,
+                            const uint32_t[::1] offsets, const uint8_t[::1] dat, uint8_t[::1] out, msgtype='can', valid=True):
+  """can_list_to_can_capnp from frames packed in arrays, the data of frame i being dat[offsets[i]:offsets[i + 1]].
+  The message is written to the start of out, an 8 byte aligned buffer reused between calls. Returns its size,
+  or if out is too small, the size needed without writing anything."""
+  cdef Py_ssize_t count = addresses.shape[0]
+  if bus_times.shape[0] != count or srcs.shape[0] != count or offsets.shape[0] != count + 1:
+    raise ValueError("frame arrays differ in length")
+  cdef Py_ssize_t i
+  for i in range(count):
+    if offsets[i + 1] < offsets[i]:
+      raise ValueError("offsets decreasing")
+    if offsets[i + 1] - offsets[i] > 64:
+      raise ValueError("CAN data longer than 64 bytes")
+  if offsets[count] > dat.shape[0]:
+    raise ValueError("offsets past the end of the data")
+  if out.shape[0] > 0 and <uintptr_t>&out[0] % 8 != 0:
+    raise ValueError("output buffer not 8 byte aligned")
+
+  return can_arrays_to_can_capnp_cpp(count, &addresses[0] if count > 0 else NULL, &bus_times[0] if count > 0 else NULL,
+                                     &srcs[0] if count > 0 else NULL, &offsets[0], &dat[0] if dat.shape[0] > 0 else NULL,
+                                     &out[0] if out.shape[0] > 0 else NULL, out.shape[0], msgtype == 'sendcan', valid)
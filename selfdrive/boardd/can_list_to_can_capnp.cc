@@ -1,4 +1,8 @@
+#include <cassert>
+#include <cstring>
+
 #include "cereal/messaging/messaging.h"
+#include "common/timing.h"
 #include "panda.h"
 
 extern "C" {
@@ -13,7 +17,7 @@ void can_list_to_can_capnp_cpp(const std::vector<can_frame> &can_list, std::stri
     auto c = canData[j];
     c.setAddress(it->address);
     c.setBusTime(it->busTime);
-    c.setDat(kj::arrayPtr((uint8_t*)it->dat.data(), it->dat.size()));
+    c.setDat(kj::arrayPtr(it->dat, it->len));
     c.setSrc(it->src);
   }
   const uint64_t msg_size = capnp::computeSerializedSizeInWords(msg) * sizeof(capnp::word);
@@ -22,4 +26,43 @@ void can_list_to_can_capnp_cpp(const std::vector<can_frame> &can_list, std::stri
   capnp::writeMessage(output_stream, msg);
 }
 
+// the same from frames packed in arrays, the data of frame i is dat[offsets[i]:offsets[i + 1]]. the
+// message is built in place in out, which must be word aligned. returns its size, or the size needed
+// without writing anything if out is too small
+size_t can_arrays_to_can_capnp_cpp(size_t count, const uint32_t *addresses, const uint16_t *bus_times, const uint8_t *srcs,
+                                   const uint32_t *offsets, const uint8_t *dat, uint8_t *out, size_t out_size, bool sendCan, bool valid) {
+  // the root pointer, the event, the list with its tag, and the data
+  size_t words = 1 + cereal::Event::_capnpPrivate::dataWordSize + cereal::Event::_capnpPrivate::pointerCount +
+                 1 + count * (cereal::CanData::_capnpPrivate::dataWordSize + cereal::CanData::_capnpPrivate::pointerCount);
+  for (size_t i = 0; i < count; ++i) {
+    words += (offsets[i + 1] - offsets[i] + sizeof(capnp::word) - 1) / sizeof(capnp::word);
+  }
+  // after the segment table of a single segment
+  const size_t size = (1 + words) * sizeof(capnp::word);
+  if (size > out_size) {
+    return size;
+  }
+
+  memset(out, 0, size);
+  capnp::FlatMessageBuilder msg(kj::arrayPtr((capnp::word *)out + 1, words));
+  auto event = msg.initRoot<cereal::Event>();
+  event.setLogMonoTime(nanos_since_boot());
+  event.setValid(valid);
+
+  auto canData = sendCan ? event.initSendcan(count) : event.initCan(count);
+  for (size_t i = 0; i < count; ++i) {
+    auto c = canData[i];
+    c.setAddress(addresses[i]);
+    c.setBusTime(bus_times[i]);
+    c.setDat(kj::arrayPtr(&dat[offsets[i]], offsets[i + 1] - offsets[i]));
+    c.setSrc(srcs[i]);
+  }
+
+  auto segments = msg.getSegmentsForOutput();
+  assert(segments.size() == 1);
+  const uint32_t segment_table[2] = {0, (uint32_t)segments[0].size()};
+  memcpy(out, segment_table, sizeof(segment_table));
+  return sizeof(segment_table) + segments[0].size() * sizeof(capnp::word);
+}
+
 }
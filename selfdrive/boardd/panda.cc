@@ -1,26 +1,34 @@
 #include "selfdrive/boardd/panda.h"
 
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <stdexcept>
 
 #include "cereal/messaging/messaging.h"
 #include "common/swaglog.h"
 #include "common/util.h"
 
-Panda::Panda(std::string serial, uint32_t bus_offset) : bus_offset(bus_offset) {
-  // try USB first, then SPI
-  try {
-    handle = std::make_unique<PandaUsbHandle>(serial);
-    LOGW("conntected to %s over USB", serial.c_str());
-  } catch (std::exception &e) {
-#ifndef __APPLE__
-    handle = std::make_unique<PandaSpiHandle>(serial);
-    LOGW("conntected to %s over SPI", serial.c_str());
-#endif
+can_send_buffer::can_send_buffer() : data((uint8_t *)aligned_alloc(sysconf(_SC_PAGESIZE), SEND_SIZE)) {
+  assert(data != nullptr);
+  if (mlock(data, SEND_SIZE) != 0) {
+    LOGW("failed to lock the can send buffer: %s", strerror(errno));
   }
+}
+
+can_send_buffer::~can_send_buffer() {
+  munlock(data, SEND_SIZE);
+  free(data);
+}
 
+Panda::Panda(std::string serial, uint32_t bus_offset) : Panda(connect(serial), bus_offset) {}
+
+Panda::Panda(std::unique_ptr<PandaCommsHandle> handle, uint32_t bus_offset) : handle(std::move(handle)), bus_offset(bus_offset) {
   hw_type = get_hw_type();
 
   has_rtc = (hw_type == cereal::PandaState::PandaType::UNO) ||
@@ -32,6 +40,23 @@ Panda::Panda(std::string serial, uint32_t bus_offset) : bus_offset(bus_offset) {
   return;
 }
 
+std::unique_ptr<PandaCommsHandle> Panda::connect(std::string serial) {
+  // try USB first, then SPI
+  try {
+    auto handle = std::make_unique<PandaUsbHandle>(serial);
+    LOGW("conntected to %s over USB", serial.c_str());
+    return handle;
+  } catch (std::exception &e) {
+#ifndef __APPLE__
+    auto handle = std::make_unique<PandaSpiHandle>(serial);
+    LOGW("conntected to %s over SPI", serial.c_str());
+    return handle;
+#else
+    throw;
+#endif
+  }
+}
+
 bool Panda::connected() {
   return handle->connected;
 }
@@ -134,6 +159,18 @@ std::optional<can_health_t> Panda::get_can_state(uint16_t can_number) {
   return err >= 0 ? std::make_optional(can_health) : std::nullopt;
 }
 
+bool Panda::get_states(health_t &health, std::array<can_health_t, PANDA_CAN_CNT> &can_health) {
+  health = {0};
+  can_health = {};
+  PandaCommsBatch batch;
+  batch.control_read(0xd2, 0, 0, (unsigned char*)&health, sizeof(health));
+  for (uint16_t i = 0; i < PANDA_CAN_CNT; i++) {
+    batch.control_read(0xc2, i, 0, (unsigned char*)&can_health[i], sizeof(can_health[i]));
+  }
+  handle->transfer_batch(batch);
+  return std::all_of(batch.transfers.begin(), batch.transfers.end(), [](auto &t) { return t.result >= 0; });
+}
+
 void Panda::set_loopback(bool loopback) {
   handle->control_write(0xe5, loopback, 0);
 }
@@ -175,70 +212,82 @@ void Panda::set_canfd_non_iso(uint16_t bus, bool non_iso) {
   handle->control_write(0xfc, bus, non_iso);
 }
 
-static uint8_t len_to_dlc(uint8_t len) {
-  if (len <= 8) {
-    return len;
-  }
-  if (len <= 24) {
-    return 8 + ((len - 8) / 4) + ((len % 4) ? 1 : 0);
-  } else {
-    return 11 + (len / 16) + ((len % 16) ? 1 : 0);
+// the frames checked by scan_can_buffer
+template <typename F>
+static void for_each_can_frame(const uint8_t *data, uint32_t frames, F f) {
+  uint32_t pos = 0;
+  for (uint32_t i = 0; i < frames; ++i) {
+    can_header header;
+    memcpy(&header, &data[pos], sizeof(can_header));
+    const uint8_t data_len = dlc_to_len[header.data_len_code];
+    f(header, &data[pos + sizeof(can_header)], data_len);
+    pos += sizeof(can_header) + data_len;
   }
 }
 
-void Panda::pack_can_buffer(const capnp::List<cereal::CanData>::Reader &can_data_list,
-                            std::function<void(uint8_t *, size_t)> write_func) {
-  int32_t pos = 0;
-  uint8_t send_buf[2 * USB_TX_SOFT_LIMIT];
-
-  for (auto cmsg : can_data_list) {
-    // check if the message is intended for this panda
-    uint8_t bus = cmsg.getSrc();
-    if (bus < bus_offset || bus >= (bus_offset + PANDA_BUS_CNT)) {
-      continue;
-    }
-    auto can_data = cmsg.getDat();
-    uint8_t data_len_code = len_to_dlc(can_data.size());
-    assert(can_data.size() <= 64);
-    assert(can_data.size() == dlc_to_len[data_len_code]);
-
-    can_header header = {};
-    header.addr = cmsg.getAddress();
-    header.extended = (cmsg.getAddress() >= 0x800) ? 1 : 0;
-    header.data_len_code = data_len_code;
-    header.bus = bus - bus_offset;
-    header.checksum = 0;
-
-    memcpy(&send_buf[pos], (uint8_t *)&header, sizeof(can_header));
-    memcpy(&send_buf[pos + sizeof(can_header)], (uint8_t *)can_data.begin(), can_data.size());
-    uint32_t msg_size = sizeof(can_header) + can_data.size();
-
-    // set checksum
-    ((can_header *) &send_buf[pos])->checksum = calculate_checksum(&send_buf[pos], msg_size);
-
-    pos += msg_size;
-
-    if (pos >= USB_TX_SOFT_LIMIT) {
-      write_func(send_buf, pos);
-      pos = 0;
-    }
+long Panda::can_frame_src(const can_header &header) const {
+  long src = header.bus + bus_offset;
+  if (header.rejected) {
+    src += CAN_REJECTED_BUS_OFFSET;
+  }
+  if (header.returned) {
+    src += CAN_RETURNED_BUS_OFFSET;
   }
+  return src;
+}
 
-  // send remaining packets
-  if (pos > 0) write_func(send_buf, pos);
+void Panda::fill_can_frame(can_frame &frame, const can_header &header, const uint8_t *dat, uint8_t len) const {
+  frame.address = header.addr;
+  frame.busTime = 0;
+  frame.src = can_frame_src(header);
+  frame.len = len;
+  memcpy(frame.dat, dat, len);
+}
+
+void Panda::can_write(uint8_t *data, size_t size) {
+  handle->bulk_write(3, data, size, 5);
 }
 
 void Panda::can_send(capnp::List<cereal::CanData>::Reader can_data_list) {
-  pack_can_buffer(can_data_list, [=](uint8_t* data, size_t size) {
-    handle->bulk_write(3, data, size, 5);
-  });
+  can_queue(can_data_list);
+  can_flush();
+}
+
+void Panda::can_queue(capnp::List<cereal::CanData>::Reader can_data_list) {
+  queue_can_buffer(can_data_list, [this](uint8_t *data, size_t size) { can_write(data, size); });
+}
+
+void Panda::can_flush() {
+  flush_can_buffer([this](uint8_t *data, size_t size) { can_write(data, size); });
 }
 
 bool Panda::can_receive(std::vector<can_frame>& out_vec) {
+  if (!can_read()) {
+    return false;
+  }
+  for_each_can_frame(receive_buffer, receive_frames, [&](const can_header &header, const uint8_t *dat, uint8_t len) {
+    fill_can_frame(out_vec.emplace_back(), header, dat, len);
+  });
+  return consume_can_buffer(receive_buffer, receive_buffer_size, receive_frames_size, receive_frames_ok);
+}
+
+bool Panda::can_read() {
   // Check if enough space left in buffer to store RECV_SIZE data
   assert(receive_buffer_size + RECV_SIZE <= sizeof(receive_buffer));
 
-  int recv = handle->bulk_read(0x81, &receive_buffer[receive_buffer_size], RECV_SIZE);
+  return can_read_done(handle->bulk_read(0x81, &receive_buffer[receive_buffer_size], RECV_SIZE));
+}
+
+bool Panda::can_read_wait(unsigned int timeout) {
+  assert(receive_buffer_size + RECV_SIZE <= sizeof(receive_buffer));
+
+  return can_read_done(handle->bulk_read_wait(0x81, &receive_buffer[receive_buffer_size], RECV_SIZE, timeout));
+}
+
+bool Panda::can_read_done(int recv) {
+  receive_frames = 0;
+  receive_frames_size = 0;
+  receive_frames_ok = true;
   if (!comms_healthy()) {
     return false;
   }
@@ -247,17 +296,55 @@ bool Panda::can_receive(std::vector<can_frame>& out_vec) {
   }
   receive_buffer_size += recv;
 
-  return (recv <= 0) ? true : unpack_can_buffer(receive_buffer, receive_buffer_size, out_vec);
+  if (recv > 0) {
+    scan_receive_buffer();
+  }
+  return true;
+}
+
+bool Panda::can_unpack(capnp::List<cereal::CanData>::Builder &can_data_list, uint32_t offset) {
+  can_unpack_frames(receive_buffer, receive_frames, can_data_list, offset);
+  return can_consume_frames();
+}
+
+bool Panda::can_move_frames(std::vector<uint8_t> &data, uint32_t &frames) {
+  data.assign(receive_buffer, receive_buffer + receive_frames_size);
+  frames = receive_frames;
+  return can_consume_frames();
+}
+
+void Panda::can_unpack_frames(const uint8_t *data, uint32_t frames, capnp::List<cereal::CanData>::Builder &can_data_list, uint32_t offset) const {
+  assert(offset + frames <= can_data_list.size());
+  uint32_t i = offset;
+  for_each_can_frame(data, frames, [&](const can_header &header, const uint8_t *dat, uint8_t len) {
+    auto c = can_data_list[i++];
+    c.setAddress(header.addr);
+    c.setBusTime(0);
+    c.setDat(kj::arrayPtr(dat, len));
+    c.setSrc(can_frame_src(header));
+  });
+}
+
+bool Panda::can_consume_frames() {
+  const bool ret = consume_can_buffer(receive_buffer, receive_buffer_size, receive_frames_size, receive_frames_ok);
+  receive_frames = 0;
+  receive_frames_size = 0;
+  receive_frames_ok = true;
+  return ret;
 }
 
 void Panda::can_reset_communications() {
   handle->control_write(0xc0, 0, 0);
 }
 
-bool Panda::unpack_can_buffer(uint8_t *data, uint32_t &size, std::vector<can_frame> &out_vec) {
-  int pos = 0;
+void Panda::scan_receive_buffer() {
+  receive_frames_ok = scan_can_buffer(receive_buffer, receive_buffer_size, receive_frames, receive_frames_size);
+}
 
-  while (pos <= size - sizeof(can_header)) {
+bool Panda::scan_can_buffer(const uint8_t *data, uint32_t size, uint32_t &frames, uint32_t &frames_size) {
+  uint32_t pos = 0;
+  frames = 0;
+  while (pos + sizeof(can_header) <= size) {
     can_header header;
     memcpy(&header, &data[pos], sizeof(can_header));
 
@@ -267,39 +354,36 @@ bool Panda::unpack_can_buffer(uint8_t *data, uint32_t &size, std::vector<can_fra
       break;
     }
 
-    can_frame &canData = out_vec.emplace_back();
-    canData.busTime = 0;
-    canData.address = header.addr;
-    canData.src = header.bus + bus_offset;
-    if (header.rejected) {
-      canData.src += CAN_REJECTED_BUS_OFFSET;
-    }
-    if (header.returned) {
-      canData.src += CAN_RETURNED_BUS_OFFSET;
-    }
-
-    if (calculate_checksum(&data[pos], sizeof(can_header) + data_len) != 0) {
-      LOGE("Panda CAN checksum failed");
-      size = 0;
+    if (calculate_checksum((uint8_t *)&data[pos], sizeof(can_header) + data_len) != 0) {
+      frames_size = pos;
       return false;
     }
 
-    canData.dat.assign((char *)&data[pos + sizeof(can_header)], data_len);
-
     pos += sizeof(can_header) + data_len;
+    frames++;
   }
+  frames_size = pos;
+  return true;
+}
 
-  // move the overflowing data to the beginning of the buffer for the next round
-  memmove(data, &data[pos], size - pos);
-  size -= pos;
+bool Panda::consume_can_buffer(uint8_t *data, uint32_t &size, uint32_t frames_size, bool frames_ok) {
+  if (!frames_ok) {
+    LOGE("Panda CAN checksum failed");
+    size = 0;
+    return false;
+  }
 
+  // move the overflowing data to the beginning of the buffer for the next round
+  memmove(data, &data[frames_size], size - frames_size);
+  size -= frames_size;
   return true;
 }
 
-uint8_t Panda::calculate_checksum(uint8_t *data, uint32_t len) {
-  uint8_t checksum = 0U;
-  for (uint32_t i = 0U; i < len; i++) {
-    checksum ^= data[i];
-  }
-  return checksum;
+bool Panda::unpack_can_buffer(uint8_t *data, uint32_t &size, std::vector<can_frame> &out_vec) {
+  uint32_t frames, frames_size;
+  const bool frames_ok = scan_can_buffer(data, size, frames, frames_size);
+  for_each_can_frame(data, frames, [&](const can_header &header, const uint8_t *dat, uint8_t len) {
+    fill_can_frame(out_vec.emplace_back(), header, dat, len);
+  });
+  return consume_can_buffer(data, size, frames_size, frames_ok);
 }
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <array>
+#include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <ctime>
-#include <functional>
 #include <list>
 #include <memory>
 #include <optional>
@@ -18,6 +20,8 @@
 #define USBPACKET_MAX_SIZE  (0x40)
 
 #define RECV_SIZE (0x4000U)
+#define SEND_SIZE (0x4000U)
+#define CAN_DATA_SIZE_MAX (64U)
 
 #define CAN_REJECTED_BUS_OFFSET   0xC0U
 #define CAN_RETURNED_BUS_OFFSET 0x80U
@@ -33,20 +37,42 @@ struct __attribute__((packed)) can_header {
   uint8_t checksum : 8;
 };
 
+// the payload is inline, a vector of frames allocates only when it grows
 struct can_frame {
+  // left uninitialized, so emplace_back() doesn't clear the payload
+  can_frame() {}
   long address;
-  std::string dat;
   long busTime;
   long src;
+  uint8_t len;
+  uint8_t dat[CAN_DATA_SIZE_MAX];
 };
 
+// the most frames a receive buffer can hold, to reserve the vector passed to can_receive once
+#define CAN_RECV_FRAMES_MAX ((RECV_SIZE + sizeof(can_header) + CAN_DATA_SIZE_MAX) / sizeof(can_header))
+
+// the transmit buffer: page aligned and locked in memory, so packing into it never faults
+struct can_send_buffer {
+  can_send_buffer();
+  ~can_send_buffer();
+  can_send_buffer(const can_send_buffer &) = delete;
+  can_send_buffer &operator=(const can_send_buffer &) = delete;
+
+  uint8_t *const data;
+  uint32_t size = 0;
+};
 
 class Panda {
 private:
   std::unique_ptr<PandaCommsHandle> handle;
+  static std::unique_ptr<PandaCommsHandle> connect(std::string serial);
+  bool can_read_done(int recv);
+  bool can_consume_frames();
+  void can_write(uint8_t *data, size_t size);
 
 public:
   Panda(std::string serial="", uint32_t bus_offset=0);
+  Panda(std::unique_ptr<PandaCommsHandle> handle, uint32_t bus_offset=0);
 
   cereal::PandaState::PandaType hw_type = cereal::PandaState::PandaType::UNKNOWN;
   bool has_rtc = false;
@@ -70,6 +96,8 @@ public:
   void set_ir_pwr(uint16_t ir_pwr);
   std::optional<health_t> get_state();
   std::optional<can_health_t> get_can_state(uint16_t can_number);
+  // the state and the state of each CAN, in one batch of transfers
+  bool get_states(health_t &health, std::array<can_health_t, PANDA_CAN_CNT> &can_health);
   void set_loopback(bool loopback);
   std::optional<std::vector<uint8_t>> get_firmware_version();
   std::optional<std::string> get_serial();
@@ -80,17 +108,133 @@ public:
   void set_data_speed_kbps(uint16_t bus, uint16_t speed);
   void set_canfd_non_iso(uint16_t bus, bool non_iso);
   void can_send(capnp::List<cereal::CanData>::Reader can_data_list);
+  // the same for several lists in one go: can_queue() packs the frames for this
+  // panda into the transmit buffer, can_flush() writes them out
+  void can_queue(capnp::List<cereal::CanData>::Reader can_data_list);
+  void can_flush();
   bool can_receive(std::vector<can_frame>& out_vec);
+  // the same without the frames in between: can_read() reads into the receive
+  // buffer, and can_unpack() writes the can_frames_ready() complete frames in
+  // it straight to the list from offset
+  bool can_read();
+  // can_read(), returning as soon as there is data or after timeout ms
+  bool can_read_wait(unsigned int timeout);
+  uint32_t can_frames_ready() const { return receive_frames; }
+  // frames, or a bad checksum, for can_unpack()
+  bool can_unpack_pending() const { return receive_frames > 0 || !receive_frames_ok; }
+  bool can_unpack(capnp::List<cereal::CanData>::Builder &can_data_list, uint32_t offset);
+  // or the complete frames moved out as they are, to unpack on another thread
+  bool can_move_frames(std::vector<uint8_t> &data, uint32_t &frames);
+  void can_unpack_frames(const uint8_t *data, uint32_t frames, capnp::List<cereal::CanData>::Builder &can_data_list, uint32_t offset) const;
   void can_reset_communications();
 
 protected:
   // for unit tests
-  uint8_t receive_buffer[RECV_SIZE + sizeof(can_header) + 64];
+  uint8_t receive_buffer[RECV_SIZE + sizeof(can_header) + CAN_DATA_SIZE_MAX];
   uint32_t receive_buffer_size = 0;
+  // the complete frames at the start of the receive buffer, up to a bad checksum
+  uint32_t receive_frames = 0;
+  uint32_t receive_frames_size = 0;
+  bool receive_frames_ok = true;
+
+  can_send_buffer send_buffer;
 
   Panda(uint32_t bus_offset) : bus_offset(bus_offset) {}
-  void pack_can_buffer(const capnp::List<cereal::CanData>::Reader &can_data_list,
-                         std::function<void(uint8_t *, size_t)> write_func);
+
+  // packs into the transmit buffer, writing it out only when it is full
+  template <typename F>
+  void queue_can_buffer(const capnp::List<cereal::CanData>::Reader &can_data_list, F &&write_func) {
+    for (auto cmsg : can_data_list) {
+      if (send_buffer.size + sizeof(can_header) + CAN_DATA_SIZE_MAX > SEND_SIZE) {
+        flush_can_buffer(write_func);
+      }
+      send_buffer.size += pack_can_frame(cmsg, &send_buffer.data[send_buffer.size]);
+    }
+  }
+
+  // writes the transmit buffer in chunks of USB_TX_SOFT_LIMIT, plus the frame crossing it,
+  // as the firmware only takes a transfer it has room for
+  template <typename F>
+  void flush_can_buffer(F &&write_func) {
+    uint32_t chunk_start = 0, pos = 0;
+    while (pos < send_buffer.size) {
+      can_header header;
+      memcpy(&header, &send_buffer.data[pos], sizeof(can_header));
+      pos += sizeof(can_header) + dlc_to_len[header.data_len_code];
+      if (pos - chunk_start >= USB_TX_SOFT_LIMIT || pos == send_buffer.size) {
+        write_func(&send_buffer.data[chunk_start], pos - chunk_start);
+        chunk_start = pos;
+      }
+    }
+    send_buffer.size = 0;
+  }
+
+  template <typename F>
+  void pack_can_buffer(const capnp::List<cereal::CanData>::Reader &can_data_list, F &&write_func) {
+    queue_can_buffer(can_data_list, write_func);
+    flush_can_buffer(write_func);
+  }
+
+  // the frame with its header and checksum, 0 bytes if it isn't for this panda
+  uint32_t pack_can_frame(const cereal::CanData::Reader &cmsg, uint8_t *buf) const {
+    const uint8_t bus = cmsg.getSrc();
+    if (bus < bus_offset || bus >= (bus_offset + PANDA_BUS_CNT)) {
+      return 0;
+    }
+    auto can_data = cmsg.getDat();
+    const uint8_t data_len_code = len_to_dlc(can_data.size());
+    assert(can_data.size() <= CAN_DATA_SIZE_MAX);
+    assert(can_data.size() == dlc_to_len[data_len_code]);
+
+    can_header header = {};
+    header.addr = cmsg.getAddress();
+    header.extended = (cmsg.getAddress() >= 0x800) ? 1 : 0;
+    header.data_len_code = data_len_code;
+    header.bus = bus - bus_offset;
+    header.checksum = 0;
+
+    memcpy(buf, &header, sizeof(can_header));
+    memcpy(&buf[sizeof(can_header)], can_data.begin(), can_data.size());
+    const uint32_t size = sizeof(can_header) + can_data.size();
+    ((can_header *)buf)->checksum = calculate_checksum(buf, size);
+    return size;
+  }
+
+  static uint8_t len_to_dlc(uint8_t len) {
+    if (len <= 8) {
+      return len;
+    }
+    if (len <= 24) {
+      return 8 + ((len - 8) / 4) + ((len % 4) ? 1 : 0);
+    } else {
+      return 11 + (len / 16) + ((len % 16) ? 1 : 0);
+    }
+  }
+
+  // XOR of the bytes, eight at a time
+  static uint8_t calculate_checksum(const uint8_t *data, uint32_t len) {
+    uint64_t word_checksum = 0;
+    uint32_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+      uint64_t word;
+      memcpy(&word, &data[i], sizeof(word));
+      word_checksum ^= word;
+    }
+    word_checksum ^= word_checksum >> 32;
+    word_checksum ^= word_checksum >> 16;
+    word_checksum ^= word_checksum >> 8;
+
+    uint8_t checksum = word_checksum;
+    for (; i < len; i++) {
+      checksum ^= data[i];
+    }
+    return checksum;
+  }
+
   bool unpack_can_buffer(uint8_t *data, uint32_t &size, std::vector<can_frame> &out_vec);
-  uint8_t calculate_checksum(uint8_t *data, uint32_t len);
+  void scan_receive_buffer();
+  bool scan_can_buffer(const uint8_t *data, uint32_t size, uint32_t &frames, uint32_t &frames_size);
+  bool consume_can_buffer(uint8_t *data, uint32_t &size, uint32_t frames_size, bool frames_ok);
+  long can_frame_src(const can_header &header) const;
+  void fill_can_frame(can_frame &frame, const can_header &header, const uint8_t *dat, uint8_t len) const;
 };
@@ -1,9 +1,49 @@
 #include "selfdrive/boardd/panda.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstring>
 #include <stdexcept>
 
 #include "common/swaglog.h"
+#include "common/timing.h"
+#include "common/util.h"
+
+// reads kept in flight on the receive endpoint, each up to the length of a read
+const int USB_ASYNC_READS = 4;
+// how often a handle without async reads checks for data while waiting
+const int POLL_INTERVAL = 1; // milliseconds
+
+int PandaCommsHandle::bulk_read_wait(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) {
+  const double deadline = millis_since_boot() + timeout;
+  while (true) {
+    int ret = bulk_read(endpoint, data, length);
+    if (ret != 0 || !connected || millis_since_boot() >= deadline) {
+      return ret;
+    }
+    util::sleep_for(POLL_INTERVAL);
+  }
+}
+
+void PandaCommsHandle::transfer_batch(PandaCommsBatch &batch) {
+  for (auto &t : batch.transfers) {
+    switch (t.type) {
+      case PandaCommsBatch::Type::CONTROL_WRITE:
+        t.result = control_write(t.request, t.param1, t.param2);
+        break;
+      case PandaCommsBatch::Type::CONTROL_READ:
+        t.result = control_read(t.request, t.param1, t.param2, t.data, t.length);
+        break;
+      case PandaCommsBatch::Type::BULK_WRITE:
+        t.result = bulk_write(t.request, t.data, t.length);
+        break;
+      case PandaCommsBatch::Type::BULK_READ:
+        t.result = bulk_read(t.request, t.data, t.length);
+        break;
+    }
+  }
+}
 
 static int init_usb_ctx(libusb_context **context) {
   assert(context != nullptr);
@@ -83,6 +123,8 @@ PandaUsbHandle::~PandaUsbHandle() {
 }
 
 void PandaUsbHandle::cleanup() {
+  cancel_async_reads();
+
   if (dev_handle) {
     libusb_release_interface(dev_handle, 0);
     libusb_close(dev_handle);
@@ -230,3 +272,115 @@ int PandaUsbHandle::bulk_read(unsigned char endpoint, unsigned char* data, int l
 
   return transferred;
 }
+
+// the completion flag is set from whichever thread is handling libusb events
+static void LIBUSB_CALL async_read_done(libusb_transfer *transfer) {
+  __atomic_store_n((int *)transfer->user_data, 1, __ATOMIC_RELEASE);
+}
+
+static bool async_read_completed(const int &completed) {
+  return __atomic_load_n(&completed, __ATOMIC_ACQUIRE);
+}
+
+bool PandaUsbHandle::submit_async_read(AsyncRead &r) {
+  r.completed = 0;
+  int err = libusb_submit_transfer(r.transfer);
+  if (err != 0) {
+    // already reported, taken as an empty read and retried on the next wait
+    handle_usb_issue(err, __func__);
+    r.completed = 1;
+    r.transfer->status = LIBUSB_TRANSFER_CANCELLED;
+    r.transfer->actual_length = 0;
+    return false;
+  }
+  return true;
+}
+
+int PandaUsbHandle::finish_async_read(AsyncRead &r, unsigned char *data) {
+  libusb_transfer *transfer = r.transfer;
+  switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+    case LIBUSB_TRANSFER_TIMED_OUT:
+    case LIBUSB_TRANSFER_CANCELLED:
+      memcpy(data, r.buf.data(), transfer->actual_length);
+      return transfer->actual_length;
+    case LIBUSB_TRANSFER_OVERFLOW:
+      comms_healthy = false;
+      LOGE_100("overflow got 0x%x", transfer->actual_length);
+      return 0;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      handle_usb_issue(LIBUSB_ERROR_NO_DEVICE, __func__);
+      return 0;
+    default:
+      handle_usb_issue(LIBUSB_ERROR_IO, __func__);
+      return 0;
+  }
+}
+
+int PandaUsbHandle::bulk_read_wait(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) {
+  if (!connected) {
+    return 0;
+  }
+
+  // the reads don't take hw_lock, so control and write transfers go on while they are in flight
+  if (async_reads.empty()) {
+    async_reads.resize(USB_ASYNC_READS);
+    for (auto &r : async_reads) {
+      r.buf.resize(length);
+      r.transfer = libusb_alloc_transfer(0);
+      assert(r.transfer != NULL);
+      libusb_fill_bulk_transfer(r.transfer, dev_handle, endpoint, r.buf.data(), length, async_read_done, &r.completed, TIMEOUT);
+      submit_async_read(r);
+    }
+  }
+  assert(async_reads[0].transfer->endpoint == endpoint && length >= (int)async_reads[0].buf.size());
+
+  // wait for the oldest read
+  AsyncRead &oldest = async_reads[next_async_read];
+  const double deadline = millis_since_boot() + timeout;
+  while (!async_read_completed(oldest.completed) && connected) {
+    const double remaining = std::max(deadline - millis_since_boot(), 0.0);
+    timeval tv = {.tv_sec = (time_t)(remaining / 1000), .tv_usec = (suseconds_t)(std::fmod(remaining, 1000.0) * 1000)};
+    int err = libusb_handle_events_timeout_completed(ctx, &tv, &oldest.completed);
+    if (err != 0) {
+      handle_usb_issue(err, __func__);
+      break;
+    }
+    if (remaining == 0) break;
+  }
+
+  // and take every read done since, in order, as long as they fit
+  int transferred = 0;
+  for (size_t i = 0; i < async_reads.size() && connected; ++i) {
+    AsyncRead &r = async_reads[next_async_read];
+    if (!async_read_completed(r.completed) || r.transfer->actual_length > length - transferred) {
+      break;
+    }
+    transferred += finish_async_read(r, data + transferred);
+    submit_async_read(r);
+    next_async_read = (next_async_read + 1) % async_reads.size();
+  }
+  return transferred;
+}
+
+void PandaUsbHandle::cancel_async_reads() {
+  for (auto &r : async_reads) {
+    if (!async_read_completed(r.completed)) {
+      libusb_cancel_transfer(r.transfer);
+    }
+  }
+  for (auto &r : async_reads) {
+    // a transfer can only be freed once libusb is done with it
+    for (int i = 0; i < 10 && !async_read_completed(r.completed); ++i) {
+      timeval tv = {.tv_sec = 0, .tv_usec = 100000};
+      libusb_handle_events_timeout_completed(ctx, &tv, &r.completed);
+    }
+    if (async_read_completed(r.completed)) {
+      libusb_free_transfer(r.transfer);
+    } else {
+      LOGE("usb read not cancelled, leaking it");
+    }
+  }
+  async_reads.clear();
+  next_async_read = 0;
+}
@@ -1,8 +1,10 @@
 #pragma once
 
-#include <mutex>
+#include <array>
 #include <atomic>
+#include <mutex>
 #include <cstdint>
+#include <string>
 #include <vector>
 
 #ifndef __APPLE__
@@ -14,7 +16,39 @@
 
 #define TIMEOUT 0
 #define SPI_BUF_SIZE 1024
-
+#define SPI_DEVICE "/dev/spidev0.0"
+#define SPI_LOCK_HIST_SIZE 16
+
+
+// Transfers queued to run together, in order. A handle may run them in one go, as
+// PandaSpiHandle does in one locked SPI session. The result of each is what its
+// own call would have returned.
+struct PandaCommsBatch {
+  enum class Type { CONTROL_WRITE, CONTROL_READ, BULK_WRITE, BULK_READ };
+  struct Transfer {
+    Type type;
+    uint8_t request;  // or the endpoint
+    uint16_t param1 = 0;
+    uint16_t param2 = 0;
+    unsigned char *data = nullptr;
+    int length = 0;
+    int result = 0;
+  };
+  std::vector<Transfer> transfers;
+
+  void control_write(uint8_t request, uint16_t param1, uint16_t param2) {
+    transfers.push_back({.type = Type::CONTROL_WRITE, .request = request, .param1 = param1, .param2 = param2});
+  }
+  void control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length) {
+    transfers.push_back({.type = Type::CONTROL_READ, .request = request, .param1 = param1, .param2 = param2, .data = data, .length = length});
+  }
+  void bulk_write(unsigned char endpoint, unsigned char *data, int length) {
+    transfers.push_back({.type = Type::BULK_WRITE, .request = endpoint, .data = data, .length = length});
+  }
+  void bulk_read(unsigned char endpoint, unsigned char *data, int length) {
+    transfers.push_back({.type = Type::BULK_READ, .request = endpoint, .data = data, .length = length});
+  }
+};
 
 // comms base class
 class PandaCommsHandle {
@@ -33,6 +67,11 @@ public:
   virtual int control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length, unsigned int timeout=TIMEOUT) = 0;
   virtual int bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT) = 0;
   virtual int bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT) = 0;
+  // returns as soon as there is data, waiting up to timeout ms for it. polls bulk_read unless
+  // the handle can keep reads in flight
+  virtual int bulk_read_wait(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout);
+  // the transfers one at a time, unless the handle can do better
+  virtual void transfer_batch(PandaCommsBatch &batch);
 };
 
 class PandaUsbHandle : public PandaCommsHandle {
@@ -43,6 +82,7 @@ public:
   int control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length, unsigned int timeout=TIMEOUT);
   int bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
   int bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
+  int bulk_read_wait(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout);
   void cleanup();
 
   static std::vector<std::string> list();
@@ -52,27 +92,47 @@ private:
   libusb_device_handle *dev_handle = NULL;
   std::recursive_mutex hw_lock;
   void handle_usb_issue(int err, const char func[]);
+
+  // async reads kept in flight on one endpoint, completing in the order they were submitted
+  struct AsyncRead {
+    libusb_transfer *transfer = NULL;
+    std::vector<unsigned char> buf;
+    int completed = 0;
+  };
+  std::vector<AsyncRead> async_reads;
+  size_t next_async_read = 0;
+  bool submit_async_read(AsyncRead &r);
+  int finish_async_read(AsyncRead &r, unsigned char *data);
+  void cancel_async_reads();
 };
 
 #ifndef __APPLE__
 class PandaSpiHandle : public PandaCommsHandle {
 public:
-  PandaSpiHandle(std::string serial);
+  PandaSpiHandle(std::string serial, std::string device=SPI_DEVICE);
   ~PandaSpiHandle();
   int control_write(uint8_t request, uint16_t param1, uint16_t param2, unsigned int timeout=TIMEOUT);
   int control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length, unsigned int timeout=TIMEOUT);
   int bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
   int bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
+  // all of them in one locked session
+  void transfer_batch(PandaCommsBatch &batch);
   void cleanup();
 
   static std::vector<std::string> list();
+  // how long the bus was held for each call or batch: bucket i counts the holds
+  // under 2^i us and from 2^(i-1) us, the last one everything longer
+  static std::array<uint64_t, SPI_LOCK_HIST_SIZE> lock_hold_histogram();
 
 private:
   int spi_fd = -1;
   uint8_t tx_buf[SPI_BUF_SIZE];
   uint8_t rx_buf[SPI_BUF_SIZE];
   inline static std::recursive_mutex hw_lock;
+  inline static std::array<std::atomic<uint64_t>, SPI_LOCK_HIST_SIZE> lock_hold_hist{};
+  friend class LockEx;
 
+  int control_transfer(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length);
   int wait_for_ack(spi_ioc_transfer &transfer, uint8_t ack);
   int bulk_transfer(uint8_t endpoint, uint8_t *tx_data, uint16_t tx_len, uint8_t *rx_data, uint16_t rx_len);
   int spi_transfer(uint8_t endpoint, uint8_t *tx_data, uint16_t tx_len, uint8_t *rx_data, uint16_t max_rx_len);
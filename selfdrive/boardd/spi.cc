@@ -3,6 +3,7 @@
 #include <sys/ioctl.h>
 #include <linux/spi/spidev.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstring>
@@ -31,16 +32,20 @@ struct __attribute__((packed)) spi_header {
 
 const int SPI_MAX_RETRIES = 5;
 const int SPI_ACK_TIMEOUT = 50; // milliseconds
-const std::string SPI_DEVICE = "/dev/spidev0.0";
 
 class LockEx {
 public:
   LockEx(int fd, std::recursive_mutex &m) : fd(fd), m(m) {
     m.lock();
     flock(fd, LOCK_EX);
+    start_time = nanos_since_boot();
   };
 
   ~LockEx() {
+    const uint64_t hold_us = (nanos_since_boot() - start_time) / 1000;
+    const int bucket = hold_us == 0 ? 0 : std::min(64 - __builtin_clzll(hold_us), SPI_LOCK_HIST_SIZE - 1);
+    PandaSpiHandle::lock_hold_hist[bucket]++;
+
     m.unlock();
     flock(fd, LOCK_UN);
   }
@@ -48,10 +53,11 @@ public:
 private:
   int fd;
   std::recursive_mutex &m;
+  uint64_t start_time;
 };
 
 
-PandaSpiHandle::PandaSpiHandle(std::string serial) : PandaCommsHandle(serial) {
+PandaSpiHandle::PandaSpiHandle(std::string serial, std::string device) : PandaCommsHandle(serial) {
   int ret;
   const int uid_len = 12;
   uint8_t uid[uid_len] = {0};
@@ -63,7 +69,7 @@ PandaSpiHandle::PandaSpiHandle(std::string serial) : PandaCommsHandle(serial) {
   // revs of the comma three may not support this speed
   uint32_t spi_speed = 50000000;
 
-  spi_fd = open(SPI_DEVICE.c_str(), O_RDWR);
+  spi_fd = open(device.c_str(), O_RDWR);
   if (spi_fd < 0) {
     LOGE("failed opening SPI device %d", spi_fd);
     goto fail;
@@ -126,19 +132,25 @@ void PandaSpiHandle::cleanup() {
 
 
 
+std::array<uint64_t, SPI_LOCK_HIST_SIZE> PandaSpiHandle::lock_hold_histogram() {
+  std::array<uint64_t, SPI_LOCK_HIST_SIZE> hist;
+  for (int i = 0; i < SPI_LOCK_HIST_SIZE; i++) {
+    hist[i] = lock_hold_hist[i];
+  }
+  return hist;
+}
+
 int PandaSpiHandle::control_write(uint8_t request, uint16_t param1, uint16_t param2, unsigned int timeout) {
   LockEx lock(spi_fd, hw_lock);
-  ControlPacket_t packet = {
-    .request = request,
-    .param1 = param1,
-    .param2 = param2,
-    .length = 0
-  };
-  return spi_transfer_retry(0, (uint8_t *) &packet, sizeof(packet), NULL, 0);
+  return control_transfer(request, param1, param2, NULL, 0);
 }
 
 int PandaSpiHandle::control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length, unsigned int timeout) {
   LockEx lock(spi_fd, hw_lock);
+  return control_transfer(request, param1, param2, data, length);
+}
+
+int PandaSpiHandle::control_transfer(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length) {
   ControlPacket_t packet = {
     .request = request,
     .param1 = param1,
@@ -157,6 +169,26 @@ int PandaSpiHandle::bulk_read(unsigned char endpoint, unsigned char* data, int l
   return bulk_transfer(endpoint, NULL, 0, data, length);
 }
 
+void PandaSpiHandle::transfer_batch(PandaCommsBatch &batch) {
+  LockEx lock(spi_fd, hw_lock);
+  for (auto &t : batch.transfers) {
+    switch (t.type) {
+      case PandaCommsBatch::Type::CONTROL_WRITE:
+        t.result = control_transfer(t.request, t.param1, t.param2, NULL, 0);
+        break;
+      case PandaCommsBatch::Type::CONTROL_READ:
+        t.result = control_transfer(t.request, t.param1, t.param2, t.data, t.length);
+        break;
+      case PandaCommsBatch::Type::BULK_WRITE:
+        t.result = bulk_transfer(t.request, t.data, t.length, NULL, 0);
+        break;
+      case PandaCommsBatch::Type::BULK_READ:
+        t.result = bulk_transfer(t.request, NULL, 0, t.data, t.length);
+        break;
+    }
+  }
+}
+
 int PandaSpiHandle::bulk_transfer(uint8_t endpoint, uint8_t *tx_data, uint16_t tx_len, uint8_t *rx_data, uint16_t rx_len) {
   const int xfer_size = 0x40 * 15;
 
@@ -272,7 +304,9 @@ int PandaSpiHandle::spi_transfer(uint8_t endpoint, uint8_t *tx_data, uint16_t tx
     .rx_buf = (uint64_t)rx_buf
   };
 
-  // Send header
+  // Send header. the ACK polls are messages of their own, a poll in the same message
+  // only gets the gap the controller leaves with cs_change, and that wasn't validated
+  // against the panda's firmware
   memcpy(tx_buf, &header, sizeof(header));
   add_checksum(tx_buf, sizeof(header));
   transfer.len = sizeof(header) + 1;
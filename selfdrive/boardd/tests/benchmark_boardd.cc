@@ -0,0 +1,169 @@
+// benchmark of boardd's can threads against simulated pandas: the frames received and their
+// latency from the bus to the can message, while sendcan goes out at 100hz
+// usage: benchmark_boardd [--pandas N] [--seconds N] [--rate frames/s per bus] [--fd] [--spi]
+//                         [--sendcan frames] [--min-interval us] [--max-interval us]
+//                         [--corrupt p] [--error p] [--stall p]
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/timing.h"
+#include "selfdrive/boardd/boardd.h"
+#include "selfdrive/boardd/tests/panda_sim.h"
+
+static double cpu_time() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void report(const char *name, std::vector<double> &ms) {
+  if (ms.empty()) return;
+  std::sort(ms.begin(), ms.end());
+  printf("  %-12s p50 %7.3f ms, p99 %7.3f ms, max %7.3f ms\n",
+         name, ms[ms.size() / 2], ms[std::min(ms.size() - 1, ms.size() * 99 / 100)], ms.back());
+}
+
+int main(int argc, char **argv) {
+  PandaSimConfig config;
+  CanRecvBatching batching;
+  int num_pandas = 1, seconds = 5, sendcan = 20;
+  for (int i = 1; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--fd") == 0) {
+      config.can_fd = true;
+      config.hw_type = cereal::PandaState::PandaType::RED_PANDA;
+      config.dlcs = {8, 8, 12, 15};
+    } else if (strcmp(argv[i], "--spi") == 0) {
+      config.transport = PandaSimConfig::Transport::SPI;
+      config.hw_type = cereal::PandaState::PandaType::TRES;
+      config.transfer_latency = 300000;
+      config.bandwidth = 5e6;
+    } else if (strcmp(argv[i], "--pandas") == 0 && has_value) {
+      num_pandas = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--seconds") == 0 && has_value) {
+      seconds = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--rate") == 0 && has_value) {
+      config.rate = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--sendcan") == 0 && has_value) {
+      sendcan = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--min-interval") == 0 && has_value) {
+      batching.min_interval = atoll(argv[++i]) * 1000ULL;
+    } else if (strcmp(argv[i], "--max-interval") == 0 && has_value) {
+      batching.max_interval = atoll(argv[++i]) * 1000ULL;
+    } else if (strcmp(argv[i], "--corrupt") == 0 && has_value) {
+      config.corrupt_rate = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--error") == 0 && has_value) {
+      config.error_rate = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--stall") == 0 && has_value) {
+      config.stall_rate = atof(argv[++i]);
+    } else {
+      printf("unknown argument %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  std::vector<PandaSimHandle *> sims;
+  std::vector<Panda *> pandas;
+  for (int i = 0; i < num_pandas; ++i) {
+    PandaSimConfig c = config;
+    c.seed = i;
+    auto handle = std::make_unique<PandaSimHandle>(c, "sim" + std::to_string(i));
+    sims.push_back(handle.get());
+    pandas.push_back(new Panda(std::move(handle), i * PANDA_BUS_CNT));
+  }
+  printf("%d panda(s) over %s, %d buses at %.0f frames/s each%s, sendcan of %d frames at 100hz, can every %.1f to %.1f ms\n",
+         num_pandas, config.transport == PandaSimConfig::Transport::USB ? "USB" : "SPI", config.bus_count, config.rate,
+         config.can_fd ? " with CAN FD" : "", sendcan, batching.min_interval / 1e6, batching.max_interval / 1e6);
+
+  // sendcan as can_send_thread does it
+  std::atomic<bool> exit = false;
+  std::vector<double> sendcan_ms;
+  std::thread send_thread([&]() {
+    uint64_t next_time = nanos_since_boot();
+    uint8_t dat[CAN_DATA_SIZE_MAX] = {};
+    while (!exit) {
+      MessageBuilder msg;
+      auto can = msg.initEvent().initSendcan(sendcan * num_pandas);
+      for (int i = 0; i < sendcan * num_pandas; ++i) {
+        const uint8_t len = config.can_fd ? 32 : 8;
+        can[i].setAddress(0x200 + i);
+        can[i].setSrc((i / sendcan) * PANDA_BUS_CNT + i % config.bus_count);
+        can[i].setDat(kj::arrayPtr((const uint8_t *)dat, len));
+      }
+      const double start = millis_since_boot();
+      for (Panda *panda : pandas) {
+        panda->can_send(can.asReader());
+      }
+      sendcan_ms.push_back(millis_since_boot() - start);
+
+      next_time += 10000000ULL;
+      std::this_thread::sleep_for(std::chrono::nanoseconds(std::max<int64_t>(next_time - nanos_since_boot(), 0)));
+    }
+  });
+
+  // disconnecting the simulated pandas ends can_recv_loop
+  std::thread timer([&]() {
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    for (PandaSimHandle *sim : sims) sim->cleanup();
+  });
+
+  int messages = 0, invalid = 0;
+  uint64_t frames = 0, lost = 0;
+  std::vector<double> latency_ms;
+  std::vector<int64_t> last_seq(num_pandas, -1);
+  CanRecvStats stats;
+  const double cpu_start = cpu_time(), start = millis_since_boot();
+  can_recv_loop(pandas, batching, [&](MessageBuilder &msg) {
+    const uint32_t now_us = nanos_since_boot() / 1000;
+    auto event = msg.getRoot<cereal::Event>();
+    messages++;
+    invalid += !event.getValid();
+    for (auto c : event.getCan()) {
+      uint32_t seq, bus_time_us;
+      const int p = c.getSrc() / PANDA_BUS_CNT;
+      if (p >= num_pandas || !PandaSimHandle::decode_frame(c.getDat().begin(), c.getDat().size(), seq, bus_time_us)) continue;
+      frames++;
+      lost += seq - last_seq[p] - 1;
+      last_seq[p] = seq;
+      latency_ms.push_back((uint32_t)(now_us - bus_time_us) / 1000.0);
+    }
+  }, &stats);
+  const double elapsed = (millis_since_boot() - start) / 1000.0, cpu = cpu_time() - cpu_start;
+  exit = true;
+  send_thread.join();
+  timer.join();
+
+  printf("  received %.0f frames/s in %.1f can/s, %d invalid, %lu lost\n", frames / elapsed, messages / elapsed, invalid, lost);
+  report("latency", latency_ms);
+  report("sendcan", sendcan_ms);
+  printf("  cpu %.1f%% of a core, with the simulation\n", cpu / elapsed * 100);
+  if (stats.messages > 0) {
+    printf("  %.2f reads waiting per can, max %lu\n", (double)stats.queue_depth / stats.messages, stats.queue_depth_max);
+  }
+  for (int i = 0; i < stats.devices.size(); ++i) {
+    const CanRecvStats::Device &d = stats.devices[i];
+    printf("  %s: %lu reads of %.0f frames, in %.3f ms, min %.3f ms, max %.3f ms\n", sims[i]->hw_serial.c_str(), d.reads,
+           (double)d.frames / std::max<uint64_t>(d.reads, 1), d.read_time / 1e6 / std::max<uint64_t>(d.reads, 1),
+           d.reads > 0 ? d.read_time_min / 1e6 : 0, d.read_time_max / 1e6);
+  }
+  for (PandaSimHandle *sim : sims) {
+    PandaSimStats s = sim->stats();
+    printf("  %s: %lu transfers, %lu faults, %lu frames read, %lu dropped, %lu sent, %lu bad sendcan checksums\n", sim->hw_serial.c_str(),
+           s.transfers, s.faults, s.rx_frames, s.rx_dropped, s.tx_frames, s.tx_checksum_errors);
+  }
+
+  for (Panda *panda : pandas) {
+    delete panda;
+  }
+  return 0;
+}
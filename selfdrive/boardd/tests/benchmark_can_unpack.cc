@@ -0,0 +1,181 @@
+// benchmark of boardd's CAN receive path, from the bytes read from the panda to the can message.
+// compares unpacking into frames with a heap allocated payload (as before), into a reused vector
+// of frames with an inline payload, and straight into the capnp list
+// usage: benchmark_can_unpack [--cycles N] [captured bulk reads]
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "cereal/messaging/messaging.h"
+#include "common/timing.h"
+#include "common/util.h"
+#include "selfdrive/boardd/panda.h"
+
+static std::atomic<uint64_t> allocations{0};
+
+void *operator new(size_t size) {
+  allocations++;
+  if (void *p = malloc(size)) return p;
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+// the frame boardd used before, with the payload in a std::string
+struct legacy_can_frame {
+  long address;
+  std::string dat;
+  long busTime;
+  long src;
+};
+
+struct PandaBenchmark : public Panda {
+  PandaBenchmark() : Panda(0) {}
+  void synthesize(int frames, int reads, int seed);
+  void feed(const std::string &chunk);
+  bool unpack_legacy(std::vector<legacy_can_frame> &out_vec);
+  bool unpack_vector(std::vector<can_frame> &out_vec);
+  using Panda::receive_buffer_size;
+  using Panda::scan_receive_buffer;
+
+  // the bytes of each bulk read, as they come from the panda
+  std::vector<std::string> chunks;
+};
+
+// a bus load of random ids and lengths, split into reads
+void PandaBenchmark::synthesize(int frames, int reads, int seed) {
+  std::mt19937 gen(seed);
+  std::vector<std::string> dats(frames);
+  MessageBuilder msg;
+  auto can_list = msg.initEvent().initSendcan(frames);
+  for (int i = 0; i < frames; ++i) {
+    dats[i].resize(dlc_to_len[gen() % std::size(dlc_to_len)]);
+    std::generate(dats[i].begin(), dats[i].end(), [&]() { return (char)gen(); });
+    auto can = can_list[i];
+    can.setAddress(gen() % 0x800);
+    can.setSrc(gen() % PANDA_BUS_CNT);
+    can.setDat(kj::ArrayPtr((uint8_t *)dats[i].data(), dats[i].size()));
+  }
+
+  std::string stream;
+  pack_can_buffer(can_list.asReader(), [&](uint8_t *data, size_t size) {
+    stream.append((char *)data, size);
+  });
+  const size_t read_size = std::min<size_t>(RECV_SIZE, stream.size() / reads + 1);
+  for (size_t pos = 0; pos < stream.size(); pos += read_size) {
+    chunks.push_back(stream.substr(pos, read_size));
+  }
+}
+
+void PandaBenchmark::feed(const std::string &chunk) {
+  memcpy(&receive_buffer[receive_buffer_size], chunk.data(), chunk.size());
+  receive_buffer_size += chunk.size();
+}
+
+bool PandaBenchmark::unpack_legacy(std::vector<legacy_can_frame> &out_vec) {
+  uint32_t pos = 0;
+  while (pos + sizeof(can_header) <= receive_buffer_size) {
+    can_header header;
+    memcpy(&header, &receive_buffer[pos], sizeof(can_header));
+    const uint8_t data_len = dlc_to_len[header.data_len_code];
+    if (pos + sizeof(can_header) + data_len > receive_buffer_size) break;
+
+    legacy_can_frame &frame = out_vec.emplace_back();
+    frame.busTime = 0;
+    frame.address = header.addr;
+    frame.src = can_frame_src(header);
+    if (calculate_checksum(&receive_buffer[pos], sizeof(can_header) + data_len) != 0) {
+      receive_buffer_size = 0;
+      return false;
+    }
+    frame.dat.assign((char *)&receive_buffer[pos + sizeof(can_header)], data_len);
+    pos += sizeof(can_header) + data_len;
+  }
+  memmove(receive_buffer, &receive_buffer[pos], receive_buffer_size - pos);
+  receive_buffer_size -= pos;
+  return true;
+}
+
+bool PandaBenchmark::unpack_vector(std::vector<can_frame> &out_vec) {
+  uint32_t size = receive_buffer_size;
+  const bool ret = unpack_can_buffer(receive_buffer, size, out_vec);
+  receive_buffer_size = size;
+  return ret;
+}
+
+template <typename F>
+static void run(const char *name, PandaBenchmark &p, int cycles, F unpack) {
+  size_t frames = 0;
+  p.receive_buffer_size = 0;
+  const uint64_t allocations_start = allocations;
+  const double start = millis_since_boot();
+  for (int i = 0; i < cycles; ++i) {
+    p.feed(p.chunks[i % p.chunks.size()]);
+    frames += unpack();
+  }
+  const double ms = millis_since_boot() - start;
+  printf("  %-8s %10.0f frames/s, %8.3f us/cycle, %6.2f allocations/cycle\n", name,
+         frames * 1000.0 / ms, ms * 1000.0 / cycles, (double)(allocations - allocations_start) / cycles);
+}
+
+int main(int argc, char **argv) {
+  int cycles = 20000;
+  std::string fn;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+      cycles = atoi(argv[++i]);
+    } else {
+      fn = argv[i];
+    }
+  }
+
+  PandaBenchmark p;
+  p.hw_type = cereal::PandaState::PandaType::RED_PANDA;
+  if (fn.empty()) {
+    // a busy car, about 100 frames in each 10ms read
+    p.synthesize(100 * 64, 64, 0);
+  } else {
+    std::string dat = util::read_file(fn);
+    for (size_t pos = 0; pos < dat.size(); pos += RECV_SIZE) {
+      p.chunks.push_back(dat.substr(pos, RECV_SIZE));
+    }
+  }
+  if (p.chunks.empty()) {
+    printf("no data to unpack\n");
+    return 1;
+  }
+  printf("%zu reads in the source, %d cycles\n", p.chunks.size(), cycles);
+
+  std::vector<legacy_can_frame> legacy_frames;
+  run("legacy", p, cycles, [&]() {
+    legacy_frames.clear();
+    p.unpack_legacy(legacy_frames);
+    return legacy_frames.size();
+  });
+
+  std::vector<can_frame> frames;
+  frames.reserve(CAN_RECV_FRAMES_MAX);
+  run("vector", p, cycles, [&]() {
+    frames.clear();
+    p.unpack_vector(frames);
+    return frames.size();
+  });
+
+  run("capnp", p, cycles, [&]() {
+    MessageBuilder msg;
+    auto evt = msg.initEvent();
+    p.scan_receive_buffer();
+    const uint32_t n = p.can_frames_ready();
+    auto can_data = evt.initCan(n);
+    p.can_unpack(can_data, 0);
+    return n;
+  });
+  return 0;
+}
@@ -0,0 +1,284 @@
+#include "selfdrive/boardd/tests/panda_sim.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <thread>
+
+#include "common/timing.h"
+
+// as PandaSpiHandle splits bulk transfers, and retries the failed ones
+const int SPI_XFER_SIZE = 0x40 * 15;
+const int SPI_MAX_RETRIES = 5;
+
+PandaSimHandle::PandaSimHandle(const PandaSimConfig &config, std::string serial)
+    : PandaCommsHandle(serial), config(config), gen(config.seed), start_time(nanos_since_boot()) {
+  assert(config.bus_count > 0 && config.bus_count <= PANDA_BUS_CNT);
+  assert(!config.dlcs.empty());
+  for (uint8_t dlc : config.dlcs) {
+    assert(dlc < std::size(dlc_to_len) && (config.can_fd || dlc <= 8));
+  }
+  hw_serial = serial;
+  next_frame_time = config.rate > 0 ? start_time : std::numeric_limits<uint64_t>::max();
+}
+
+void PandaSimHandle::cleanup() {
+  connected = false;
+  rx_cv.notify_all();
+}
+
+bool PandaSimHandle::check_connected() {
+  if (connected && config.disconnect_after > 0 && nanos_since_boot() - start_time >= config.disconnect_after) {
+    cleanup();
+  }
+  return connected;
+}
+
+bool PandaSimHandle::fault(double rate) {
+  return rate > 0 && std::uniform_real_distribution<double>(0, 1)(gen) < rate;
+}
+
+void PandaSimHandle::transfer(size_t size) {
+  uint64_t t = config.transfer_latency + (uint64_t)(size * 1e9 / config.bandwidth);
+  if (fault(config.stall_rate)) {
+    sim_stats.faults++;
+    t += config.stall_time;
+  }
+  sim_stats.transfers++;
+  std::this_thread::sleep_for(std::chrono::nanoseconds(t));
+}
+
+// the frames put on the buses since the last time, round robin
+void PandaSimHandle::generate(uint64_t now) {
+  const uint64_t interval = 1e9 / (config.rate * config.bus_count);
+  while (next_frame_time <= now) {
+    const uint8_t dlc = config.dlcs[gen() % config.dlcs.size()];
+    uint8_t dat[CAN_DATA_SIZE_MAX];
+    const uint32_t bus_time_us = next_frame_time / 1000;
+    memcpy(&dat[0], &next_seq, sizeof(next_seq));
+    memcpy(&dat[4], &bus_time_us, sizeof(bus_time_us));
+    for (int i = 8; i < dlc_to_len[dlc]; ++i) {
+      dat[i] = next_seq + i;
+    }
+    push_frame(next_seq % config.bus_count, 0x100 + next_seq % 0x600, dlc, dat);
+    next_seq++;
+    next_frame_time += interval;
+  }
+}
+
+void PandaSimHandle::push_frame(uint8_t bus, uint32_t addr, uint8_t data_len_code, const uint8_t *dat) {
+  if (rx_frame_sizes.size() >= config.rx_queue_size) {
+    sim_stats.rx_dropped++;
+    return;
+  }
+
+  const uint8_t data_len = dlc_to_len[data_len_code];
+  uint8_t frame[sizeof(can_header) + CAN_DATA_SIZE_MAX];
+  can_header header = {};
+  header.addr = addr;
+  header.extended = (addr >= 0x800) ? 1 : 0;
+  header.data_len_code = data_len_code;
+  header.bus = bus;
+  memcpy(frame, &header, sizeof(header));
+  memcpy(&frame[sizeof(header)], dat, data_len);
+
+  uint8_t checksum = 0;
+  for (size_t i = 0; i < sizeof(header) + data_len; ++i) {
+    checksum ^= frame[i];
+  }
+  ((can_header *)frame)->checksum = checksum;
+
+  rx_stream.insert(rx_stream.end(), frame, frame + sizeof(header) + data_len);
+  rx_frame_sizes.push_back(sizeof(header) + data_len);
+  rx_cv.notify_all();
+}
+
+int PandaSimHandle::read_stream(unsigned char *data, int length) {
+  const int n = std::min<size_t>(length, rx_stream.size());
+  std::copy_n(rx_stream.begin(), n, data);
+  rx_stream.erase(rx_stream.begin(), rx_stream.begin() + n);
+
+  // a frame is out once its last byte is
+  rx_front_read += n;
+  while (!rx_frame_sizes.empty() && rx_front_read >= rx_frame_sizes.front()) {
+    rx_front_read -= rx_frame_sizes.front();
+    rx_frame_sizes.pop_front();
+    sim_stats.rx_frames++;
+  }
+  return n;
+}
+
+// one transfer, which may fail
+int PandaSimHandle::read_chunk(unsigned char *data, int length) {
+  generate(nanos_since_boot());
+  if (fault(config.error_rate)) {
+    sim_stats.faults++;
+    transfer(0);
+    return -1;
+  }
+
+  const int n = read_stream(data, length);
+  if (n > 0 && fault(config.corrupt_rate)) {
+    sim_stats.faults++;
+    data[gen() % n] ^= 1 << (gen() % 8);
+  }
+  transfer(n);
+  return n;
+}
+
+int PandaSimHandle::bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) {
+  std::lock_guard lk(lock);
+  if (!check_connected()) {
+    return 0;
+  }
+
+  if (config.transport == PandaSimConfig::Transport::USB) {
+    // libusb retries until it goes through
+    int ret;
+    while ((ret = read_chunk(data, length)) < 0 && check_connected()) {}
+    return std::max(ret, 0);
+  }
+
+  int ret = 0;
+  while (ret < length) {
+    const int to_read = std::min(SPI_XFER_SIZE, length - ret);
+    int d = -1;
+    for (int i = 0; i < SPI_MAX_RETRIES && d < 0; ++i) {
+      d = read_chunk(data + ret, to_read);
+    }
+    if (d < 0) {
+      comms_healthy = false;
+      return -1;
+    }
+    ret += d;
+    if (d < to_read) break;
+  }
+  return ret;
+}
+
+int PandaSimHandle::bulk_read_wait(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) {
+  // without async transfers over SPI it polls, as the real one
+  if (config.transport == PandaSimConfig::Transport::SPI) {
+    return PandaCommsHandle::bulk_read_wait(endpoint, data, length, timeout);
+  }
+
+  // with reads in flight, one comes back as soon as there is something to read
+  const uint64_t deadline = nanos_since_boot() + timeout * 1000000ULL;
+  {
+    std::unique_lock lk(lock);
+    while (check_connected()) {
+      const uint64_t now = nanos_since_boot();
+      generate(now);
+      if (!rx_stream.empty() || now >= deadline) break;
+      rx_cv.wait_for(lk, std::chrono::nanoseconds(std::min(deadline, next_frame_time) - now));
+    }
+  }
+  return bulk_read(endpoint, data, length, timeout);
+}
+
+int PandaSimHandle::bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) {
+  std::lock_guard lk(lock);
+  if (!check_connected()) {
+    return 0;
+  }
+  while (fault(config.error_rate)) {
+    sim_stats.faults++;
+    transfer(0);
+  }
+  transfer(length);
+
+  // the firmware drops what it has on a bad checksum
+  tx_partial.insert(tx_partial.end(), data, data + length);
+  size_t pos = 0;
+  while (pos + sizeof(can_header) <= tx_partial.size()) {
+    can_header header;
+    memcpy(&header, &tx_partial[pos], sizeof(header));
+    const uint8_t data_len = dlc_to_len[header.data_len_code];
+    if (pos + sizeof(header) + data_len > tx_partial.size()) break;
+
+    uint8_t checksum = 0;
+    for (size_t i = 0; i < sizeof(header) + data_len; ++i) {
+      checksum ^= tx_partial[pos + i];
+    }
+    if (checksum != 0) {
+      sim_stats.tx_checksum_errors++;
+      pos = tx_partial.size();
+      break;
+    }
+
+    sim_stats.tx_frames++;
+    if (loopback) {
+      push_frame(header.bus, header.addr, header.data_len_code, &tx_partial[pos + sizeof(header)]);
+    }
+    pos += sizeof(header) + data_len;
+  }
+  tx_partial.erase(tx_partial.begin(), tx_partial.begin() + pos);
+  return length;
+}
+
+int PandaSimHandle::control_write(uint8_t request, uint16_t param1, uint16_t param2, unsigned int timeout) {
+  std::lock_guard lk(lock);
+  if (!check_connected()) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  transfer(0);
+
+  switch (request) {
+    case 0xc0:  // reset communications
+      rx_stream.clear();
+      rx_frame_sizes.clear();
+      rx_front_read = 0;
+      tx_partial.clear();
+      break;
+    case 0xdc:
+      safety_model = param1;
+      break;
+    case 0xe5:
+      loopback = param1;
+      break;
+  }
+  return 0;
+}
+
+int PandaSimHandle::control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length, unsigned int timeout) {
+  std::lock_guard lk(lock);
+  if (!check_connected()) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  transfer(length);
+
+  memset(data, 0, length);
+  switch (request) {
+    case 0xc1:
+      data[0] = (uint8_t)config.hw_type;
+      return 1;
+    case 0xd2: {
+      health_t health = {};
+      health.uptime_pkt = (nanos_since_boot() - start_time) / 1000000000ULL;
+      health.voltage_pkt = 12000;
+      health.safety_mode_pkt = safety_model;
+      health.rx_buffer_overflow_pkt = sim_stats.rx_dropped;
+      memcpy(data, &health, std::min<size_t>(length, sizeof(health)));
+      return sizeof(health);
+    }
+    case 0xd0:
+      memcpy(data, hw_serial.data(), std::min<size_t>(length, hw_serial.size()));
+      return std::min<int>(length, 16);
+    default:
+      return length;
+  }
+}
+
+PandaSimStats PandaSimHandle::stats() {
+  std::lock_guard lk(lock);
+  return sim_stats;
+}
+
+bool PandaSimHandle::decode_frame(const uint8_t *dat, uint8_t len, uint32_t &seq, uint32_t &bus_time_us) {
+  if (len < 8) return false;
+  memcpy(&seq, &dat[0], sizeof(seq));
+  memcpy(&bus_time_us, &dat[4], sizeof(bus_time_us));
+  return true;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "selfdrive/boardd/panda.h"
+
+// The traffic a simulated panda sees on its buses, and the faults of its link
+struct PandaSimConfig {
+  enum class Transport { USB, SPI };
+  Transport transport = Transport::USB;
+  cereal::PandaState::PandaType hw_type = cereal::PandaState::PandaType::DOS;
+
+  int bus_count = 3;
+  double rate = 1000;                 // frames per second on each bus
+  std::vector<uint8_t> dlcs = {8};    // picked at random for each frame, over 8 needs can_fd
+  bool can_fd = false;
+  uint32_t rx_queue_size = 0x1000;    // frames the panda holds before dropping
+
+  // the link: every transfer takes latency, plus its bytes at bandwidth
+  uint64_t transfer_latency = 100000;  // nanoseconds
+  double bandwidth = 1e6;              // bytes per second
+
+  // faults
+  double corrupt_rate = 0;             // chance of a flipped bit in a read
+  double error_rate = 0;               // chance of a transfer failing, the data is kept for the next
+  double stall_rate = 0;               // chance of a transfer taking stall_time longer
+  uint64_t stall_time = 5000000;
+  uint64_t disconnect_after = 0;       // nanoseconds, 0 to stay connected
+
+  uint32_t seed = 0;
+};
+
+struct PandaSimStats {
+  uint64_t rx_frames = 0;
+  uint64_t rx_dropped = 0;
+  uint64_t tx_frames = 0;
+  uint64_t tx_checksum_errors = 0;
+  uint64_t transfers = 0;
+  uint64_t faults = 0;
+};
+
+// A panda in process, speaking the CAN framing of the real one: frames with a
+// header and a checksum, in a stream that reads and writes cut anywhere. Reads
+// are split into transfers like PandaSpiHandle does over SPI. The payload of
+// the frames generated is their sequence number and the time they were put on
+// the bus, in microseconds, as far as the length allows.
+class PandaSimHandle : public PandaCommsHandle {
+public:
+  PandaSimHandle(const PandaSimConfig &config, std::string serial = "sim");
+  void cleanup() override;
+
+  int control_write(uint8_t request, uint16_t param1, uint16_t param2, unsigned int timeout=TIMEOUT) override;
+  int control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length, unsigned int timeout=TIMEOUT) override;
+  int bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT) override;
+  int bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT) override;
+  int bulk_read_wait(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) override;
+
+  PandaSimStats stats();
+  // what the payload of a generated frame says
+  static bool decode_frame(const uint8_t *dat, uint8_t len, uint32_t &seq, uint32_t &bus_time_us);
+
+  const PandaSimConfig config;
+
+private:
+  bool check_connected();
+  void generate(uint64_t now);
+  void push_frame(uint8_t bus, uint32_t addr, uint8_t data_len_code, const uint8_t *dat);
+  void transfer(size_t size);
+  bool fault(double rate);
+  int read_chunk(unsigned char *data, int length);
+  int read_stream(unsigned char *data, int length);
+
+  std::mutex lock;
+  std::condition_variable rx_cv;
+  std::mt19937 gen;
+  const uint64_t start_time;
+  uint64_t next_frame_time;
+  uint32_t next_seq = 0;
+  bool loopback = false;
+  uint16_t safety_model = 0;
+
+  // frames in the panda waiting to be read, as the stream it sends them in
+  std::deque<uint32_t> rx_frame_sizes;
+  uint32_t rx_front_read = 0;
+  std::deque<uint8_t> rx_stream;
+  // a frame cut by the end of a write, finished by the next one
+  std::vector<uint8_t> tx_partial;
+  PandaSimStats sim_stats;
+};
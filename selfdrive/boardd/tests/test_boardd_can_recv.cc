@@ -0,0 +1,245 @@
+#define CATCH_CONFIG_MAIN
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <thread>
+
+#include "catch2/catch.hpp"
+#include "common/timing.h"
+#include "common/util.h"
+#include "selfdrive/boardd/boardd.h"
+#include "selfdrive/boardd/tests/panda_sim.h"
+
+extern ExitHandler do_exit;
+
+// the time of the tests with one panda. it only moves when can_recv_loop sleeps or its reads wait
+struct SimClock {
+  uint64_t now = 0;
+
+  CanRecvClock clock() {
+    return {[this]() { return now; }, [this](uint64_t ns) { now += ns; }};
+  }
+};
+
+// a panda on a bus that loops back what is sent after a delay. a read that waits moves the
+// clock to when the data arrives, like the async USB reads wake up for it. the panda is
+// unplugged at end_time, the reads after that wait out their timeout
+class LoopbackHandle : public PandaCommsHandle {
+public:
+  LoopbackHandle(SimClock &clock, uint64_t bus_delay) : PandaCommsHandle("loopback"), clock(clock), bus_delay(bus_delay) {}
+  void cleanup() override {}
+
+  int control_write(uint8_t request, uint16_t param1, uint16_t param2, unsigned int timeout) override {
+    return 0;
+  }
+  int control_read(uint8_t request, uint16_t param1, uint16_t param2, unsigned char *data, uint16_t length, unsigned int timeout) override {
+    if (request == 0xc1 && length > 0) {
+      data[0] = (uint8_t)cereal::PandaState::PandaType::RED_PANDA;
+      return 1;
+    }
+    return 0;
+  }
+  int bulk_write(unsigned char endpoint, unsigned char *data, int length, unsigned int timeout) override {
+    bus.push_back({clock.now + bus_delay, std::string((char *)data, length)});
+    return length;
+  }
+  int bulk_read(unsigned char endpoint, unsigned char *data, int length, unsigned int timeout) override {
+    return bulk_read_wait(endpoint, data, length, 0);
+  }
+  int bulk_read_wait(unsigned char endpoint, unsigned char *data, int length, unsigned int timeout) override {
+    uint64_t wake = clock.now + timeout * 1000000ULL;
+    if (!bus.empty()) {
+      wake = std::min(wake, std::max(clock.now, bus.front().first));
+    }
+    if (wake >= end_time) {
+      clock.now = wake;
+      connected = false;
+      return 0;
+    }
+    clock.now = wake;
+
+    int ret = 0;
+    while (!bus.empty() && bus.front().first <= clock.now && ret + bus.front().second.size() <= length) {
+      memcpy(data + ret, bus.front().second.data(), bus.front().second.size());
+      ret += bus.front().second.size();
+      bus.pop_front();
+    }
+    return ret;
+  }
+
+  SimClock &clock;
+  const uint64_t bus_delay;
+  uint64_t end_time = UINT64_MAX;
+  std::deque<std::pair<uint64_t, std::string>> bus;
+};
+
+struct LatencyResult {
+  std::vector<double> latency_ms;
+  std::vector<double> message_ms;
+  int messages = 0;
+  double duration_ms = 0;
+
+  double percentile(int p) const { return latency_ms[std::min(latency_ms.size() - 1, latency_ms.size() * p / 100)]; }
+};
+
+// frames sent with their send time as the payload, received through can_recv_loop
+LatencyResult run_loopback(const CanRecvBatching &batching, int frames, uint64_t frame_interval, uint64_t bus_delay) {
+  SimClock sim;
+  auto handle = std::make_unique<LoopbackHandle>(sim, bus_delay);
+  LoopbackHandle *loopback = handle.get();
+  Panda panda(std::move(handle), 0);
+  do_exit = false;
+
+  // the frames are all put on the bus first, at the times they are sent
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<uint64_t> jitter(0, frame_interval);
+  for (int i = 0; i < frames; ++i) {
+    sim.now += frame_interval / 2 + jitter(gen);
+    MessageBuilder msg;
+    auto can = msg.initEvent().initSendcan(1);
+    can[0].setAddress(i);
+    can[0].setSrc(0);
+    can[0].setDat(kj::arrayPtr((const uint8_t *)&sim.now, sizeof(sim.now)));
+    panda.can_send(can.asReader());
+  }
+  // unplugging the panda ends the loop
+  loopback->end_time = sim.now + bus_delay + batching.max_interval + 20000000ULL;
+  sim.now = 0;
+
+  LatencyResult result;
+  std::vector<int> received;
+  bool valid = true;
+  can_recv_loop({&panda}, batching, [&](MessageBuilder &msg) {
+    auto event = msg.getRoot<cereal::Event>();
+    valid &= event.getValid();
+    for (auto c : event.getCan()) {
+      uint64_t sent;
+      valid &= c.getDat().size() == sizeof(sent) && c.getAddress() < (uint32_t)frames;
+      if (!valid) break;
+      memcpy(&sent, c.getDat().begin(), sizeof(sent));
+      received.push_back(c.getAddress());
+      result.latency_ms.push_back((sim.now - sent) / 1e6);
+    }
+    result.message_ms.push_back(sim.now / 1e6);
+    result.messages++;
+  }, nullptr, sim.clock());
+  do_exit = false;
+
+  result.duration_ms = sim.now / 1e6;
+  REQUIRE(valid);
+  REQUIRE(received.size() == (size_t)frames);
+  for (int i = 0; i < frames; ++i) REQUIRE(received[i] == i);
+  std::sort(result.latency_ms.begin(), result.latency_ms.end());
+  printf("min interval %.1f ms, max interval %.1f ms: %d messages in %.0f ms, frame latency p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+         batching.min_interval / 1e6, batching.max_interval / 1e6, result.messages, result.duration_ms,
+         result.percentile(50), result.percentile(90), result.percentile(99), result.latency_ms.back());
+  return result;
+}
+
+TEST_CASE("can_recv_loop") {
+  const int frames = 1000;
+  const uint64_t frame_interval = 1000000ULL, bus_delay = 200000ULL;
+
+  SECTION("default batching keeps 100hz") {
+    CanRecvBatching batching;
+    auto result = run_loopback(batching, frames, frame_interval, bus_delay);
+    // a message every max_interval from the start, the last one when the panda is unplugged
+    REQUIRE(result.messages == (int)(result.duration_ms / (batching.max_interval / 1e6)));
+    REQUIRE(result.latency_ms.front() >= bus_delay / 1e6);
+    REQUIRE(result.latency_ms.back() <= (batching.max_interval + bus_delay) / 1e6);
+  }
+
+  SECTION("data triggered") {
+    // the frames are further apart than the bus delay, each is sent the moment it arrives
+    auto batched = run_loopback(CanRecvBatching{}, frames, frame_interval, bus_delay);
+    auto triggered = run_loopback(CanRecvBatching{.min_interval = 0, .max_interval = 10000000ULL}, frames, frame_interval, bus_delay);
+    REQUIRE(triggered.latency_ms.front() == Approx(bus_delay / 1e6));
+    REQUIRE(triggered.latency_ms.back() == Approx(bus_delay / 1e6));
+    REQUIRE(triggered.messages > frames);
+    REQUIRE(batched.percentile(50) > triggered.percentile(50));
+  }
+
+  SECTION("quiet bus") {
+    // nothing to send still gives a message every max_interval
+    CanRecvBatching batching{.min_interval = 0, .max_interval = 5000000ULL};
+    auto result = run_loopback(batching, 1, 100000000ULL, bus_delay);
+    REQUIRE(result.latency_ms[0] == Approx(bus_delay / 1e6));
+    double gap_ms = result.message_ms[0];
+    for (int i = 1; i < result.messages; ++i) {
+      gap_ms = std::max(gap_ms, result.message_ms[i] - result.message_ms[i - 1]);
+    }
+    // give or take the rounding of the reads' timeout to milliseconds
+    REQUIRE(gap_ms <= batching.max_interval / 1e6 + 1);
+  }
+}
+
+TEST_CASE("can_recv_loop with several pandas") {
+  // transfers from fast to slow, the fast one on SPI where every read is a transfer
+  const std::vector<uint64_t> transfer_latency = {100000ULL, 1000000ULL, 5000000ULL};
+  std::vector<PandaSimHandle *> sims;
+  std::vector<std::unique_ptr<Panda>> pandas;
+  for (int i = 0; i < transfer_latency.size(); ++i) {
+    PandaSimConfig config;
+    if (i == 0) {
+      config.transport = PandaSimConfig::Transport::SPI;
+      config.hw_type = cereal::PandaState::PandaType::TRES;
+    }
+    config.transfer_latency = transfer_latency[i];
+    config.seed = i;
+    auto handle = std::make_unique<PandaSimHandle>(config, "sim" + std::to_string(i));
+    sims.push_back(handle.get());
+    pandas.push_back(std::make_unique<Panda>(std::move(handle), i * PANDA_BUS_CNT));
+  }
+  do_exit = false;
+
+  std::thread timer([&]() {
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    for (PandaSimHandle *sim : sims) sim->cleanup();
+  });
+
+  const int n = pandas.size();
+  bool valid = true;
+  int out_of_sequence = 0;
+  std::vector<int64_t> last_seq(n, -1);
+  std::vector<int> received(n, 0);
+  CanRecvStats stats;
+  CanRecvBatching batching{.min_interval = 5000000ULL, .max_interval = 10000000ULL};
+  const uint64_t start = nanos_since_boot();
+  can_recv_loop({pandas[0].get(), pandas[1].get(), pandas[2].get()}, batching, [&](MessageBuilder &msg) {
+    auto event = msg.getRoot<cereal::Event>();
+    valid &= event.getValid();
+    for (auto c : event.getCan()) {
+      uint32_t seq, bus_time_us;
+      const int p = c.getSrc() / PANDA_BUS_CNT;
+      if (p >= n || !PandaSimHandle::decode_frame(c.getDat().begin(), c.getDat().size(), seq, bus_time_us)) {
+        valid = false;
+        continue;
+      }
+      out_of_sequence += seq != last_seq[p] + 1;
+      last_seq[p] = seq;
+      received[p]++;
+    }
+  }, &stats);
+  const uint64_t duration = nanos_since_boot() - start;
+  timer.join();
+  do_exit = false;
+
+  // every frame read once and in order, however the threads were scheduled
+  REQUIRE(valid);
+  REQUIRE(out_of_sequence == 0);
+  REQUIRE(stats.devices.size() == n);
+  for (int p = 0; p < n; ++p) {
+    const CanRecvStats::Device &d = stats.devices[p];
+    printf("panda %d, %.1f ms transfers: %lu frames in %lu reads of %.2f ms, max %.2f ms\n",
+           p, transfer_latency[p] / 1e6, d.frames, d.reads, d.read_time / 1e6 / d.reads, d.read_time_max / 1e6);
+    // the reads after the last message are dropped with the panda
+    REQUIRE(received[p] > 0);
+    REQUIRE(received[p] <= d.frames);
+    // the reads that bring frames are paced to min_interval
+    REQUIRE(d.reads <= duration / batching.min_interval + 1);
+  }
+  printf("%lu messages in %.0f ms, queue depth %.2f, max %lu\n",
+         stats.messages, duration / 1e6, (double)stats.queue_depth / stats.messages, stats.queue_depth_max);
+}
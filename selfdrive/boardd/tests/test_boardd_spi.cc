@@ -0,0 +1,364 @@
+#define CATCH_CONFIG_MAIN
+#ifndef __APPLE__
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/spi/spidev.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "panda/board/comms_definitions.h"
+#include "selfdrive/boardd/panda.h"
+
+#define SPI_SYNC 0x5AU
+#define SPI_HACK 0x79U
+#define SPI_DACK 0x85U
+#define SPI_NACK 0x1FU
+#define SPI_CHECKSUM_START 0xABU
+
+const int UID_LEN = 12;
+
+// A panda on the other end of spidev. It frames by chip select: a header, polls until
+// it (N)ACKs, the data, polls until it ACKs, then the response as the bytes clocked out
+// of it. What goes out on each frame is set by where it was when the frame started.
+struct SpiMock {
+  std::mutex lock;
+  ino_t inode = 0;
+
+  enum class State { HEADER, HEADER_ACK, DATA, DATA_ACK, RESPONSE };
+  State state = State::HEADER;
+  uint8_t endpoint;
+  uint16_t tx_len, max_rx_len;
+  int polls = 0;
+  std::deque<uint8_t> response;
+  std::deque<uint8_t> loopback;
+
+  // polls answered with nothing before the (N)ACK, and the ACKs to answer with a NACK
+  int ack_delay = 0;
+  int nacks = 0;
+
+  int ioctls = 0;
+  int frames = 0;
+  int bad_frames = 0;
+
+  void reset(int delay = 0) {
+    std::lock_guard lk(lock);
+    state = State::HEADER;
+    response.clear();
+    loopback.clear();
+    ack_delay = delay;
+    nacks = 0;
+    ioctls = frames = bad_frames = 0;
+  }
+
+  static bool checksum_ok(const std::vector<uint8_t> &frame) {
+    uint8_t checksum = SPI_CHECKSUM_START;
+    for (uint8_t b : frame) checksum ^= b;
+    return checksum == 0;
+  }
+
+  uint8_t ack(uint8_t ack, State next) {
+    if (polls++ < ack_delay) {
+      return 0;
+    }
+    if (nacks > 0) {
+      nacks--;
+      state = State::HEADER;
+      return SPI_NACK;
+    }
+    state = next;
+    return ack;
+  }
+
+  std::vector<uint8_t> handle_request(const std::vector<uint8_t> &data) {
+    std::vector<uint8_t> ret;
+    if (endpoint == 0) {
+      ControlPacket_t packet;
+      memcpy(&packet, data.data(), sizeof(packet));
+      switch (packet.request) {
+        case 0xc3:
+          for (int i = 0; i < UID_LEN; i++) ret.push_back(0xa0 + i);
+          break;
+        case 0xc2:  // the number of the CAN in every byte
+          ret.assign(packet.length, packet.param1 + 1);
+          break;
+        default:
+          ret.assign(packet.length, packet.request);
+          break;
+      }
+    } else if (endpoint == 1) {
+      while (!loopback.empty() && ret.size() < max_rx_len) {
+        ret.push_back(loopback.front());
+        loopback.pop_front();
+      }
+    } else {
+      loopback.insert(loopback.end(), data.begin(), data.end());
+    }
+    ret.resize(std::min<size_t>(ret.size(), max_rx_len));
+    return ret;
+  }
+
+  // what goes out while the frame comes in
+  std::vector<uint8_t> frame(const std::vector<uint8_t> &mosi) {
+    frames++;
+    std::vector<uint8_t> miso(mosi.size(), 0);
+    switch (state) {
+      case State::HEADER:
+        if (mosi.size() != 7 || mosi[0] != SPI_SYNC || !checksum_ok(mosi)) {
+          bad_frames++;
+          break;
+        }
+        endpoint = mosi[1];
+        memcpy(&tx_len, &mosi[2], sizeof(tx_len));
+        memcpy(&max_rx_len, &mosi[4], sizeof(max_rx_len));
+        polls = 0;
+        state = State::HEADER_ACK;
+        break;
+      case State::HEADER_ACK:
+        if (mosi.size() != 1 || mosi[0] != 0x12) {
+          bad_frames++;
+          state = State::HEADER;
+          break;
+        }
+        miso[0] = ack(SPI_HACK, State::DATA);
+        break;
+      case State::DATA: {
+        if (mosi.size() != tx_len + 1 || !checksum_ok(mosi)) {
+          bad_frames++;
+          state = State::HEADER;
+          break;
+        }
+        auto data = handle_request(std::vector<uint8_t>(mosi.begin(), mosi.end() - 1));
+        uint16_t len = data.size();
+        response.clear();
+        response.push_back(len & 0xff);
+        response.push_back(len >> 8);
+        response.insert(response.end(), data.begin(), data.end());
+        uint8_t checksum = SPI_CHECKSUM_START ^ SPI_DACK;
+        for (uint8_t b : response) checksum ^= b;
+        response.push_back(checksum);
+        polls = 0;
+        state = State::DATA_ACK;
+        break;
+      }
+      case State::DATA_ACK:
+        if (mosi.size() != 1 || mosi[0] != 0xab) {
+          bad_frames++;
+          state = State::HEADER;
+          break;
+        }
+        miso[0] = ack(SPI_DACK, State::RESPONSE);
+        break;
+      case State::RESPONSE:
+        for (auto &b : miso) {
+          if (response.empty()) break;
+          b = response.front();
+          response.pop_front();
+        }
+        if (response.empty()) {
+          state = State::HEADER;
+        }
+        break;
+    }
+    return miso;
+  }
+
+  // a message of transfers, chip select released after the ones with cs_change and the last
+  int message(spi_ioc_transfer *transfers, int n) {
+    std::lock_guard lk(lock);
+    ioctls++;
+    std::vector<uint8_t> mosi;
+    std::vector<spi_ioc_transfer *> in_frame;
+    for (int i = 0; i < n; i++) {
+      const uint8_t *tx = (const uint8_t *)transfers[i].tx_buf;
+      mosi.insert(mosi.end(), tx, tx + transfers[i].len);
+      in_frame.push_back(&transfers[i]);
+      if (transfers[i].cs_change || i == n - 1) {
+        auto miso = frame(mosi);
+        size_t pos = 0;
+        for (auto t : in_frame) {
+          memcpy((uint8_t *)t->rx_buf, &miso[pos], t->len);
+          pos += t->len;
+        }
+        mosi.clear();
+        in_frame.clear();
+      }
+    }
+    return std::accumulate(transfers, transfers + n, 0, [](int s, const spi_ioc_transfer &t) { return s + t.len; });
+  }
+};
+
+static SpiMock mock;
+
+// spidev calls on the mock device go to the mock, the rest to the kernel
+extern "C" int ioctl(int fd, unsigned long request, ...) __THROW {
+  va_list args;
+  va_start(args, request);
+  void *argp = va_arg(args, void *);
+  va_end(args);
+
+  struct stat st;
+  if (_IOC_TYPE(request) == SPI_IOC_MAGIC && fstat(fd, &st) == 0 && st.st_ino == mock.inode) {
+    if (_IOC_NR(request) == 0) {
+      return mock.message((spi_ioc_transfer *)argp, _IOC_SIZE(request) / sizeof(spi_ioc_transfer));
+    }
+    return 0;
+  }
+  return syscall(SYS_ioctl, fd, request, argp);
+}
+
+struct SpiDevice {
+  SpiDevice() {
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    struct stat st;
+    fstat(fd, &st);
+    mock.inode = st.st_ino;
+    close(fd);
+  }
+  ~SpiDevice() {
+    unlink(path);
+  }
+  char path[32] = "/tmp/test_boardd_spi_XXXXXX";
+};
+
+static uint64_t histogram_total() {
+  auto hist = PandaSpiHandle::lock_hold_histogram();
+  return std::accumulate(hist.begin(), hist.end(), 0ULL);
+}
+
+TEST_CASE("PandaSpiHandle") {
+  SpiDevice device;
+  mock.reset();
+  PandaSpiHandle handle("a0a1a2a3a4a5a6a7a8a9aaab", device.path);
+  REQUIRE(handle.hw_serial == "a0a1a2a3a4a5a6a7a8a9aaab");
+  REQUIRE_THROWS(PandaSpiHandle("a0a1a2a3a4a5a6a7a8a9aaac", device.path));
+
+  SECTION("control transfers") {
+    mock.reset();
+    uint8_t data[16] = {};
+    REQUIRE(handle.control_read(0xd2, 0, 0, data, sizeof(data)) == sizeof(data));
+    REQUIRE(std::all_of(data, data + sizeof(data), [](uint8_t b) { return b == 0xd2; }));
+    REQUIRE(handle.control_write(0xc0, 0, 0) == 0);
+    REQUIRE(mock.bad_frames == 0);
+
+    // header, poll, data, poll, length and response
+    REQUIRE(mock.ioctls == 2 * 6);
+  }
+
+  SECTION("polling for a late ACK") {
+    mock.reset(3);
+    uint8_t data[16] = {};
+    REQUIRE(handle.control_read(0xd2, 0, 0, data, sizeof(data)) == sizeof(data));
+    REQUIRE(mock.bad_frames == 0);
+    REQUIRE(mock.ioctls == 6 + 2 * 3);
+  }
+
+  SECTION("NACK is retried") {
+    mock.reset();
+    mock.nacks = 2;
+    uint8_t data[16] = {};
+    REQUIRE(handle.control_read(0xd2, 0, 0, data, sizeof(data)) == sizeof(data));
+    REQUIRE(mock.nacks == 0);
+    REQUIRE(mock.bad_frames == 0);
+  }
+
+  SECTION("bulk transfers") {
+    mock.reset();
+    for (int len : {1, 100, 0x40 * 15, 0x40 * 15 + 1, 3000}) {
+      std::vector<uint8_t> tx(len), rx(4096);
+      for (int i = 0; i < len; i++) tx[i] = rand();
+      REQUIRE(handle.bulk_write(3, tx.data(), tx.size()) >= 0);
+      REQUIRE(handle.bulk_read(1, rx.data(), rx.size()) == len);
+      rx.resize(len);
+      REQUIRE(rx == tx);
+    }
+    REQUIRE(mock.bad_frames == 0);
+  }
+
+  SECTION("batch") {
+    mock.reset();
+    const uint64_t holds = histogram_total();
+    uint8_t health[16] = {}, can_health[PANDA_CAN_CNT][8] = {}, rx[64] = {};
+    uint8_t tx[32];
+    memset(tx, 0x33, sizeof(tx));
+
+    PandaCommsBatch batch;
+    batch.control_read(0xd2, 0, 0, health, sizeof(health));
+    for (uint16_t i = 0; i < PANDA_CAN_CNT; i++) {
+      batch.control_read(0xc2, i, 0, can_health[i], sizeof(can_health[i]));
+    }
+    batch.bulk_write(2, tx, sizeof(tx));
+    batch.bulk_read(1, rx, sizeof(rx));
+    batch.control_write(0xc0, 0, 0);
+    handle.transfer_batch(batch);
+
+    // one hold of the bus for all of it
+    REQUIRE(histogram_total() == holds + 1);
+    REQUIRE(batch.transfers[0].result == sizeof(health));
+    REQUIRE(health[0] == 0xd2);
+    for (uint16_t i = 0; i < PANDA_CAN_CNT; i++) {
+      REQUIRE(batch.transfers[1 + i].result == sizeof(can_health[i]));
+      REQUIRE(can_health[i][0] == i + 1);
+    }
+    REQUIRE(batch.transfers[PANDA_CAN_CNT + 1].result >= 0);
+    REQUIRE(batch.transfers[PANDA_CAN_CNT + 2].result == sizeof(tx));
+    REQUIRE(memcmp(rx, tx, sizeof(tx)) == 0);
+    REQUIRE(batch.transfers[PANDA_CAN_CNT + 3].result == 0);
+    REQUIRE(mock.bad_frames == 0);
+  }
+
+  SECTION("threads share the bus") {
+    mock.reset(1);
+    PandaSpiHandle other("", device.path);
+    std::vector<std::thread> threads;
+    std::atomic<int> failed = 0;
+    for (int t = 0; t < 4; t++) {
+      threads.emplace_back([&, t]() {
+        PandaSpiHandle &h = (t % 2) ? handle : other;
+        for (int i = 0; i < 200; i++) {
+          uint8_t data[32] = {};
+          failed += h.control_read(0xd2, 0, 0, data, sizeof(data)) != sizeof(data) || data[31] != 0xd2;
+          PandaCommsBatch batch;
+          batch.control_read(0xc2, t % PANDA_CAN_CNT, 0, data, 8);
+          batch.control_write(0xc0, 0, 0);
+          h.transfer_batch(batch);
+          failed += batch.transfers[0].result != 8 || data[0] != t % PANDA_CAN_CNT + 1;
+        }
+      });
+    }
+    for (auto &t : threads) t.join();
+    REQUIRE(failed == 0);
+    REQUIRE(mock.bad_frames == 0);
+  }
+}
+
+TEST_CASE("Panda::get_states") {
+  SpiDevice device;
+  mock.reset();
+  Panda panda(std::make_unique<PandaSpiHandle>("", device.path), 0);
+
+  mock.reset();
+  const uint64_t holds = histogram_total();
+  health_t health;
+  std::array<can_health_t, PANDA_CAN_CNT> can_health;
+  REQUIRE(panda.get_states(health, can_health));
+  REQUIRE(histogram_total() == holds + 1);
+  REQUIRE(((uint8_t *)&health)[0] == 0xd2);
+  for (uint32_t i = 0; i < PANDA_CAN_CNT; i++) {
+    REQUIRE(((uint8_t *)&can_health[i])[0] == i + 1);
+  }
+  REQUIRE(mock.bad_frames == 0);
+}
+#endif
@@ -1,5 +1,8 @@
 #define CATCH_CONFIG_MAIN
 #define CATCH_CONFIG_ENABLE_BENCHMARKING
+#include <algorithm>
+#include <climits>
+#include <numeric>
 #include <random>
 
 #include "catch2/catch.hpp"
@@ -17,6 +20,7 @@ struct PandaTest : public Panda {
   PandaTest(uint32_t bus_offset, int can_list_size, cereal::PandaState::PandaType hw_type);
   void test_can_send();
   void test_can_recv(uint32_t chunk_size = 0);
+  void test_can_unpack(uint32_t chunk_size = 0);
   void test_chunked_can_recv();
 
   std::map<int, std::string> test_data;
@@ -103,9 +107,58 @@ void PandaTest::test_can_recv(uint32_t rx_chunk_size) {
   REQUIRE(frames.size() == can_list_size);
   for (int i = 0; i < frames.size(); ++i) {
     REQUIRE(frames[i].address == i);
-    REQUIRE(test_data.find(frames[i].dat.size()) != test_data.end());
-    const std::string &dat = test_data[frames[i].dat.size()];
-    REQUIRE(memcmp(dat.data(), frames[i].dat.data(), dat.size()) == 0);
+    REQUIRE(frames[i].src == can_data_list[i].getSrc());
+    REQUIRE(test_data.find(frames[i].len) != test_data.end());
+    const std::string &dat = test_data[frames[i].len];
+    REQUIRE(memcmp(dat.data(), frames[i].dat, dat.size()) == 0);
+  }
+}
+
+void PandaTest::test_can_unpack(uint32_t rx_chunk_size) {
+  MessageBuilder out_msg;
+  auto out = out_msg.initEvent().initCan(can_list_size);
+  uint32_t offset = 0;
+  this->pack_can_buffer(can_data_list, [&](uint8_t *data, uint32_t size) {
+    this->receive_buffer_size = 0;
+    uint32_t pos = 0;
+    while (pos < size) {
+      uint32_t chunk_size = rx_chunk_size == 0 ? size : std::min(rx_chunk_size, size - pos);
+      memcpy(&this->receive_buffer[this->receive_buffer_size], &data[pos], chunk_size);
+      this->receive_buffer_size += chunk_size;
+      pos += chunk_size;
+
+      this->scan_receive_buffer();
+      const uint32_t frames = this->can_frames_ready();
+      REQUIRE(this->can_unpack(out, offset));
+      REQUIRE(this->can_frames_ready() == 0);
+      offset += frames;
+    }
+    REQUIRE(this->receive_buffer_size == 0);
+  });
+
+  REQUIRE(offset == can_list_size);
+  auto unpacked = out.asReader();
+  for (int i = 0; i < can_list_size; ++i) {
+    REQUIRE(unpacked[i].getAddress() == i);
+    REQUIRE(unpacked[i].getSrc() == can_data_list[i].getSrc());
+    REQUIRE(unpacked[i].getBusTime() == 0);
+    REQUIRE(unpacked[i].getDat() == can_data_list[i].getDat());
+  }
+
+  // a bad checksum drops the buffer, after the frames before it
+  this->pack_can_buffer(can_data_list, [&](uint8_t *data, uint32_t size) {
+    memcpy(this->receive_buffer, data, size);
+    this->receive_buffer_size = size;
+  });
+  can_header header;
+  memcpy(&header, this->receive_buffer, sizeof(header));
+  const uint32_t first_size = sizeof(can_header) + dlc_to_len[header.data_len_code];
+  if (this->receive_buffer_size > first_size) {
+    this->receive_buffer[first_size + 1] ^= 0xff;
+    this->scan_receive_buffer();
+    REQUIRE(this->can_frames_ready() == 1);
+    REQUIRE_FALSE(this->can_unpack(out, 0));
+    REQUIRE(this->receive_buffer_size == 0);
   }
 }
 
@@ -123,6 +176,12 @@ TEST_CASE("send/recv CAN 2.0 packets") {
   SECTION("chunked_can_receive") {
     test.test_can_recv(0x40);
   }
+  SECTION("can_unpack") {
+    test.test_can_unpack();
+  }
+  SECTION("chunked_can_unpack") {
+    test.test_can_unpack(0x40);
+  }
 }
 
 TEST_CASE("send/recv CAN FD packets") {
@@ -139,4 +198,136 @@ TEST_CASE("send/recv CAN FD packets") {
   SECTION("chunked_can_receive") {
     test.test_can_recv(0x40);
   }
+  SECTION("can_unpack") {
+    test.test_can_unpack();
+  }
+  SECTION("chunked_can_unpack") {
+    test.test_can_unpack(0x40);
+  }
+}
+
+uint8_t bytewise_checksum(const uint8_t *data, uint32_t len) {
+  uint8_t checksum = 0U;
+  for (uint32_t i = 0U; i < len; i++) {
+    checksum ^= data[i];
+  }
+  return checksum;
+}
+
+struct PandaSendTest : public Panda {
+  PandaSendTest(uint32_t bus_offset) : Panda(bus_offset) {
+    hw_type = cereal::PandaState::PandaType::RED_PANDA;
+  }
+  using Panda::calculate_checksum;
+  using Panda::flush_can_buffer;
+  using Panda::pack_can_buffer;
+  using Panda::queue_can_buffer;
+  using Panda::unpack_can_buffer;
+};
+
+TEST_CASE("calculate_checksum") {
+  std::mt19937 gen(0);
+  uint8_t data[8 + sizeof(can_header) + CAN_DATA_SIZE_MAX];
+  std::generate(std::begin(data), std::end(data), [&]() { return (uint8_t)gen(); });
+
+  for (uint32_t offset = 0; offset < 8; ++offset) {
+    for (uint32_t len = 0; len <= sizeof(can_header) + CAN_DATA_SIZE_MAX; ++len) {
+      INFO("offset " << offset << ", length " << len);
+      REQUIRE(PandaSendTest::calculate_checksum(&data[offset], len) == bytewise_checksum(&data[offset], len));
+    }
+  }
+}
+
+TEST_CASE("coalesced sendcan") {
+  auto bus_offset = GENERATE(0, 4);
+  // enough lists to go past the transmit buffer
+  auto lists = GENERATE(1, 3, 50);
+  PandaSendTest panda(bus_offset);
+  std::mt19937 gen(lists);
+
+  // every CAN FD length on every bus, some for the other panda
+  std::vector<MessageBuilder> msgs(lists);
+  std::vector<capnp::List<cereal::CanData>::Reader> can_lists;
+  std::vector<std::pair<uint32_t, std::string>> expected;
+  for (int l = 0; l < lists; ++l) {
+    const int size = std::size(dlc_to_len) * 2;
+    auto can_list = msgs[l].initEvent().initSendcan(size);
+    for (int i = 0; i < size; ++i) {
+      std::string dat(dlc_to_len[i % std::size(dlc_to_len)], '\0');
+      std::generate(dat.begin(), dat.end(), [&]() { return (char)gen(); });
+      const uint32_t src = gen() % (PANDA_BUS_CNT * 2);
+      const uint32_t address = l * size + i;
+      can_list[i].setAddress(address);
+      can_list[i].setSrc(src);
+      can_list[i].setDat(kj::ArrayPtr((uint8_t *)dat.data(), dat.size()));
+      if (src >= bus_offset && src < bus_offset + PANDA_BUS_CNT) {
+        expected.emplace_back(address, dat);
+      }
+    }
+    can_lists.push_back(can_list.asReader());
+  }
+
+  std::vector<can_frame> frames;
+  std::vector<size_t> chunks;
+  auto receive = [&](uint8_t *data, size_t size) {
+    chunks.push_back(size);
+    uint32_t recv_size = size;
+    REQUIRE(panda.unpack_can_buffer(data, recv_size, frames));
+    REQUIRE(recv_size == 0);
+  };
+  for (auto &can_list : can_lists) {
+    panda.queue_can_buffer(can_list, receive);
+  }
+  panda.flush_can_buffer(receive);
+
+  // cut as the firmware takes them, and no more transfers than that needs
+  const size_t total = std::accumulate(chunks.begin(), chunks.end(), size_t(0));
+  const size_t flushes = total / (SEND_SIZE - sizeof(can_header) - CAN_DATA_SIZE_MAX) + 1;
+  int short_chunks = 0;
+  for (size_t chunk : chunks) {
+    REQUIRE(chunk < USB_TX_SOFT_LIMIT + sizeof(can_header) + CAN_DATA_SIZE_MAX);
+    short_chunks += chunk < USB_TX_SOFT_LIMIT;
+  }
+  REQUIRE(short_chunks <= flushes);
+
+  REQUIRE(frames.size() == expected.size());
+  for (int i = 0; i < frames.size(); ++i) {
+    REQUIRE(frames[i].address == expected[i].first);
+    REQUIRE(frames[i].src >= bus_offset);
+    REQUIRE(frames[i].src < bus_offset + PANDA_BUS_CNT);
+    REQUIRE(std::string((char *)frames[i].dat, frames[i].len) == expected[i].second);
+  }
+
+  // nothing is left queued
+  chunks.clear();
+  panda.flush_can_buffer(receive);
+  REQUIRE(chunks.empty());
+}
+
+TEST_CASE("sendcan throughput") {
+  std::mt19937 gen(0);
+  uint8_t frame[sizeof(can_header) + CAN_DATA_SIZE_MAX];
+  std::generate(std::begin(frame), std::end(frame), [&]() { return (uint8_t)gen(); });
+
+  MessageBuilder msg;
+  const int size = 100;
+  auto can_list = msg.initEvent().initSendcan(size);
+  for (int i = 0; i < size; ++i) {
+    can_list[i].setAddress(0x100 + i);
+    can_list[i].setSrc(i % PANDA_BUS_CNT);
+    can_list[i].setDat(kj::ArrayPtr(&frame[sizeof(can_header)], dlc_to_len[i % std::size(dlc_to_len)]));
+  }
+  PandaSendTest panda(0);
+  size_t written = 0;
+
+  BENCHMARK("checksum of a 64 byte frame, bytewise") {
+    return bytewise_checksum(frame, sizeof(frame));
+  };
+  BENCHMARK("checksum of a 64 byte frame") {
+    return PandaSendTest::calculate_checksum(frame, sizeof(frame));
+  };
+  BENCHMARK("pack 100 CAN FD frames") {
+    panda.pack_can_buffer(can_list.asReader(), [&](uint8_t *data, size_t size) { written += size; });
+    return written;
+  };
 }
@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+import random
+import timeit
+import unittest
+
+import numpy as np
+
+from cereal import log
+from selfdrive.boardd.boardd import can_list_to_can_capnp, can_arrays_to_can_capnp
+
+CAN_FD_LENGTHS = [0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64]
+
+
+def random_can_list(count):
+  return [[random.randint(0, 0x1fffffff), random.randint(0, 0xffff),
+           bytes(random.getrandbits(8) for _ in range(random.choice(CAN_FD_LENGTHS))), random.randint(0, 255)]
+          for _ in range(count)]
+
+
+def pack_can_list(can_list):
+  addresses = np.array([c[0] for c in can_list], dtype=np.uint32)
+  bus_times = np.array([c[1] for c in can_list], dtype=np.uint16)
+  srcs = np.array([c[3] for c in can_list], dtype=np.uint8)
+  offsets = np.cumsum([0] + [len(c[2]) for c in can_list], dtype=np.uint32)
+  dat = np.frombuffer(b"".join(c[2] for c in can_list), dtype=np.uint8)
+  return addresses, bus_times, srcs, offsets, dat
+
+
+def event_can_list(dat, msgtype):
+  evt = log.Event.from_bytes(dat)
+  return evt.valid, [[c.address, c.busTime, c.dat, c.src] for c in getattr(evt, msgtype)]
+
+
+class TestCanListToCanCapnp(unittest.TestCase):
+
+  def test_same_message(self):
+    out = bytearray(0x10000)
+    for msgtype in ('can', 'sendcan'):
+      for valid in (True, False):
+        for count in (0, 1, 10, 100, 500):
+          can_list = random_can_list(count)
+          size = can_arrays_to_can_capnp(*pack_can_list(can_list), out, msgtype=msgtype, valid=valid)
+          self.assertEqual(size % 8, 0)
+          self.assertEqual(event_can_list(bytes(out[:size]), msgtype),
+                           event_can_list(can_list_to_can_capnp(can_list, msgtype=msgtype, valid=valid), msgtype))
+          self.assertEqual(event_can_list(bytes(out[:size]), msgtype), (valid, can_list))
+
+  def test_output_too_small(self):
+    arrays = pack_can_list(random_can_list(100))
+    size = can_arrays_to_can_capnp(*arrays, bytearray(0))
+    out = bytearray(b"\xff" * (size - 8))
+    self.assertEqual(can_arrays_to_can_capnp(*arrays, out), size)
+    self.assertEqual(out, bytearray(b"\xff" * (size - 8)))
+
+    out = bytearray(size)
+    self.assertEqual(can_arrays_to_can_capnp(*arrays, out), size)
+
+  def test_reused_output(self):
+    # a smaller message over a bigger one is cleared of it
+    out = bytearray(0x10000)
+    for count in (100, 1, 50, 0, 10):
+      can_list = random_can_list(count)
+      size = can_arrays_to_can_capnp(*pack_can_list(can_list), out)
+      self.assertEqual(event_can_list(bytes(out[:size]), 'can'), (True, can_list))
+
+  def test_bad_arrays(self):
+    out = bytearray(0x1000)
+    addresses, bus_times, srcs, offsets, dat = pack_can_list(random_can_list(10))
+    with self.assertRaises(ValueError):
+      can_arrays_to_can_capnp(addresses[:5], bus_times, srcs, offsets, dat, out)
+    with self.assertRaises(ValueError):
+      can_arrays_to_can_capnp(addresses, bus_times, srcs, offsets[:-1], dat, out)
+    with self.assertRaises(ValueError):
+      can_arrays_to_can_capnp(addresses, bus_times, srcs, offsets, dat[:-1], out)
+    with self.assertRaises(ValueError):
+      long_offsets = np.array([0, 65], dtype=np.uint32)
+      can_arrays_to_can_capnp(addresses[:1], bus_times[:1], srcs[:1], long_offsets, np.zeros(65, dtype=np.uint8), out)
+    with self.assertRaises(ValueError):
+      can_arrays_to_can_capnp(addresses, bus_times, srcs, offsets, dat, memoryview(out)[1:])
+
+  def test_speed(self):
+    out = bytearray(0x10000)
+    for count in (1, 10, 100):
+      can_list = random_can_list(count)
+      arrays = pack_can_list(can_list)
+      number = 10000 // count
+      list_time = timeit.timeit(lambda: can_list_to_can_capnp(can_list), number=number) / number
+      arrays_time = timeit.timeit(lambda: bytes(out[:can_arrays_to_can_capnp(*arrays, out)]), number=number) / number
+      print(f"{count} frames: can_list_to_can_capnp {list_time * 1e6:.1f} us, can_arrays_to_can_capnp {arrays_time * 1e6:.1f} us")
+      if count == 100:
+        self.assertLess(arrays_time, list_time)
+
+
+if __name__ == "__main__":
+  unittest.main()
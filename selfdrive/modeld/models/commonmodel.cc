@@ -9,8 +9,19 @@
 #include "common/mat.h"
 #include "common/timing.h"
 
-ModelFrame::ModelFrame(cl_device_id device_id, cl_context context) {
+static int frame_depth(int depth) {
+  if (depth <= 0) {
+    const char *depth_env = getenv("MODEL_FRAME_DEPTH");
+    depth = depth_env != nullptr ? atoi(depth_env) : 2;
+  }
+  return std::max(depth, 1);
+}
+
+ModelFrame::ModelFrame(cl_device_id device_id, cl_context context, int _depth) : depth(frame_depth(_depth)), slots(depth) {
   input_frames = std::make_unique<float[]>(buf_size);
+  for (Slot &slot : slots) {
+    slot.frame = std::make_unique<float[]>(MODEL_FRAME_SIZE);
+  }
 
   q = CL_CHECK_ERR(clCreateCommandQueue(context, device_id, 0, &err));
   y_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_WRITE, MODEL_WIDTH * MODEL_HEIGHT, NULL, &err));
@@ -23,26 +34,58 @@ ModelFrame::ModelFrame(cl_device_id device_id, cl_context context) {
 }
 
 float* ModelFrame::prepare(cl_mem yuv_cl, int frame_width, int frame_height, int frame_stride, int frame_uv_offset, const mat3 &projection, cl_mem *output) {
+  queue(yuv_cl, frame_width, frame_height, frame_stride, frame_uv_offset, projection, output);
+  return wait();
+}
+
+void ModelFrame::queue(cl_mem yuv_cl, int frame_width, int frame_height, int frame_stride, int frame_uv_offset, const mat3 &projection, cl_mem *output) {
+  assert(queued < depth);
+  Slot &slot = slots[(oldest + queued) % depth];
+
+  // the queue is in order, so the device buffers are only ever used by one frame at a time.
+  // it's the frames read back that wait in their slots for the model
   transform_queue(&this->transform, q,
                   yuv_cl, frame_width, frame_height, frame_stride, frame_uv_offset,
                   y_cl, u_cl, v_cl, MODEL_WIDTH, MODEL_HEIGHT, projection);
 
   if (output == NULL) {
     loadyuv_queue(&loadyuv, q, y_cl, u_cl, v_cl, net_input_cl);
-
-    std::memmove(&input_frames[0], &input_frames[MODEL_FRAME_SIZE], sizeof(float) * MODEL_FRAME_SIZE);
-    CL_CHECK(clEnqueueReadBuffer(q, net_input_cl, CL_TRUE, 0, MODEL_FRAME_SIZE * sizeof(float), &input_frames[MODEL_FRAME_SIZE], 0, nullptr, nullptr));
-    clFinish(q);
-    return &input_frames[0];
+    CL_CHECK(clEnqueueReadBuffer(q, net_input_cl, CL_FALSE, 0, MODEL_FRAME_SIZE * sizeof(float), slot.frame.get(), 0, nullptr, &slot.done));
   } else {
-    loadyuv_queue(&loadyuv, q, y_cl, u_cl, v_cl, *output, true);
-    // NOTE: Since thneed is using a different command queue, this clFinish is needed to ensure the image is ready.
-    clFinish(q);
+    loadyuv_queue(&loadyuv, q, y_cl, u_cl, v_cl, *output, true, &slot.done);
+  }
+  slot.to_output = output != NULL;
+  queued++;
+
+  // start it now, not when it's waited for
+  CL_CHECK(clFlush(q));
+}
+
+float* ModelFrame::wait() {
+  assert(queued > 0);
+  Slot &slot = slots[oldest];
+  oldest = (oldest + 1) % depth;
+  queued--;
+
+  // NOTE: Since thneed is using a different command queue, the image has to be ready before this returns.
+  CL_CHECK(clWaitForEvents(1, &slot.done));
+  CL_CHECK(clReleaseEvent(slot.done));
+  slot.done = NULL;
+  if (slot.to_output) {
     return NULL;
   }
+
+  std::memmove(&input_frames[0], &input_frames[MODEL_FRAME_SIZE], sizeof(float) * MODEL_FRAME_SIZE);
+  std::memcpy(&input_frames[MODEL_FRAME_SIZE], slot.frame.get(), sizeof(float) * MODEL_FRAME_SIZE);
+  return &input_frames[0];
 }
 
 ModelFrame::~ModelFrame() {
+  // the frames still queued read into their slots
+  CL_CHECK(clFinish(q));
+  for (Slot &slot : slots) {
+    if (slot.done != NULL) CL_CHECK(clReleaseEvent(slot.done));
+  }
   transform_destroy(&transform);
   loadyuv_destroy(&loadyuv);
   CL_CHECK(clReleaseMemObject(net_input_cl));
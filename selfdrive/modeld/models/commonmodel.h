@@ -4,6 +4,7 @@
 #include <cstdlib>
 
 #include <memory>
+#include <vector>
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 #ifdef __APPLE__
@@ -27,18 +28,37 @@ constexpr const kj::ArrayPtr<const T> to_kj_array_ptr(const std::array<T, size>
   return kj::ArrayPtr(arr.data(), arr.size());
 }
 
+// Warps a camera frame to the model's input and loads it as YUV. Frames are
+// queued without waiting, up to depth of them, so one can be prepared while the
+// model still runs on the last one.
 class ModelFrame {
 public:
-  ModelFrame(cl_device_id device_id, cl_context context);
+  // depth of 0 takes MODEL_FRAME_DEPTH from the environment, or 2
+  ModelFrame(cl_device_id device_id, cl_context context, int depth = 0);
   ~ModelFrame();
   float* prepare(cl_mem yuv_cl, int width, int height, int frame_stride, int frame_uv_offset, const mat3& transform, cl_mem *output);
+  // queue takes the same as prepare, and wait returns what prepare would for the oldest frame queued.
+  // a frame going to an output is shifted into it on the device, so it has to be waited for before
+  // anything else reads the output
+  void queue(cl_mem yuv_cl, int width, int height, int frame_stride, int frame_uv_offset, const mat3& transform, cl_mem *output);
+  float* wait();
 
   const int MODEL_WIDTH = 512;
   const int MODEL_HEIGHT = 256;
   const int MODEL_FRAME_SIZE = MODEL_WIDTH * MODEL_HEIGHT * 3 / 2;
   const int buf_size = MODEL_FRAME_SIZE * 2;
+  const int depth;
 
 private:
+  // a frame in flight, read back into frame unless it went to an output
+  struct Slot {
+    std::unique_ptr<float[]> frame;
+    cl_event done = NULL;
+    bool to_output = false;
+  };
+  std::vector<Slot> slots;
+  int oldest = 0, queued = 0;
+
   Transform transform;
   LoadYUVState loadyuv;
   cl_command_queue q;
@@ -28,6 +28,8 @@ void model_init(ModelState* s, cl_device_id device_id, cl_context context) {
 
 #ifdef USE_THNEED
   s->m = std::make_unique<ThneedModel>("models/supercombo.thneed",
+#elif USE_ONNXRUNTIME_MODEL
+  s->m = std::make_unique<ONNXRuntimeModel>("models/supercombo.onnx",
 #elif USE_ONNX_MODEL
   s->m = std::make_unique<ONNXModel>("models/supercombo.onnx",
 #else
@@ -36,11 +38,11 @@ void model_init(ModelState* s, cl_device_id device_id, cl_context context) {
    &s->output[0], NET_OUTPUT_SIZE, USE_GPU_RUNTIME, true, false, context);
 
 #ifdef TEMPORAL
-  s->m->addRecurrent(&s->feature_buffer[0], TEMPORAL_SIZE);
+  s->m->addRecurrent(s->feature_buffer.data(), TEMPORAL_SIZE);
 #endif
 
 #ifdef DESIRE
-  s->m->addDesire(s->pulse_desire, DESIRE_LEN*(HISTORY_BUFFER_LEN+1));
+  s->m->addDesire(s->pulse_desire.data(), DESIRE_LEN*(HISTORY_BUFFER_LEN+1));
 #endif
 
 #ifdef TRAFFIC_CONVENTION
@@ -60,19 +62,22 @@ void model_init(ModelState* s, cl_device_id device_id, cl_context context) {
 ModelOutput* model_eval_frame(ModelState* s, VisionBuf* buf, VisionBuf* wbuf,
                               const mat3 &transform, const mat3 &transform_wide, float *desire_in, bool is_rhd, float *driving_style, float *nav_features, bool prepare_only) {
 #ifdef DESIRE
-  std::memmove(&s->pulse_desire[0], &s->pulse_desire[DESIRE_LEN], sizeof(float) * DESIRE_LEN*HISTORY_BUFFER_LEN);
+  s->pulse_desire.push();
+  float *pulse_desire = s->pulse_desire.back();
   if (desire_in != NULL) {
     for (int i = 1; i < DESIRE_LEN; i++) {
       // Model decides when action is completed
       // so desire input is just a pulse triggered on rising edge
       if (desire_in[i] - s->prev_desire[i] > .99) {
-        s->pulse_desire[DESIRE_LEN*HISTORY_BUFFER_LEN+i] = desire_in[i];
+        pulse_desire[i] = desire_in[i];
       } else {
-        s->pulse_desire[DESIRE_LEN*HISTORY_BUFFER_LEN+i] = 0.0;
+        pulse_desire[i] = 0.0;
       }
       s->prev_desire[i] = desire_in[i];
     }
   }
+  // the history moved on, without a copy
+  s->m->addDesire(s->pulse_desire.data(), DESIRE_LEN*(HISTORY_BUFFER_LEN+1));
 LOGT("Desire enqueued");
 #endif
 
@@ -88,13 +93,19 @@ LOGT("Desire enqueued");
   s->traffic_convention[rhd_idx] = 1.0;
   s->traffic_convention[1-rhd_idx] = 0.0;
 
+  // both frames are queued before either is waited for, so the wide one is prepared alongside
   // if getInputBuf is not NULL, net_input_buf will be
-  auto net_input_buf = s->frame->prepare(buf->buf_cl, buf->width, buf->height, buf->stride, buf->uv_offset, transform, static_cast<cl_mem*>(s->m->getInputBuf()));
+  s->frame->queue(buf->buf_cl, buf->width, buf->height, buf->stride, buf->uv_offset, transform, static_cast<cl_mem*>(s->m->getInputBuf()));
+  if (wbuf != nullptr) {
+    s->wide_frame->queue(wbuf->buf_cl, wbuf->width, wbuf->height, wbuf->stride, wbuf->uv_offset, transform_wide, static_cast<cl_mem*>(s->m->getExtraBuf()));
+  }
+
+  auto net_input_buf = s->frame->wait();
   s->m->addImage(net_input_buf, s->frame->buf_size);
   LOGT("Image added");
 
   if (wbuf != nullptr) {
-    auto net_extra_buf = s->wide_frame->prepare(wbuf->buf_cl, wbuf->width, wbuf->height, wbuf->stride, wbuf->uv_offset, transform_wide, static_cast<cl_mem*>(s->m->getExtraBuf()));
+    auto net_extra_buf = s->wide_frame->wait();
     s->m->addExtra(net_extra_buf, s->wide_frame->buf_size);
     LOGT("Extra image added");
   }
@@ -103,12 +114,15 @@ LOGT("Desire enqueued");
     return nullptr;
   }
 
+#ifdef TEMPORAL
+  s->m->addRecurrent(s->feature_buffer.data(), TEMPORAL_SIZE);
+#endif
   s->m->execute();
   LOGT("Execution finished");
 
   #ifdef TEMPORAL
-    std::memmove(&s->feature_buffer[0], &s->feature_buffer[FEATURE_LEN], sizeof(float) * FEATURE_LEN*(HISTORY_BUFFER_LEN-1));
-    std::memcpy(&s->feature_buffer[FEATURE_LEN*(HISTORY_BUFFER_LEN-1)], &s->output[OUTPUT_SIZE], sizeof(float) * FEATURE_LEN);
+    s->feature_buffer.push();
+    std::memcpy(s->feature_buffer.back(), &s->output[OUTPUT_SIZE], sizeof(float) * FEATURE_LEN);
     LOGT("Features enqueued");
   #endif
 
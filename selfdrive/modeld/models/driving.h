@@ -14,6 +14,7 @@
 #include "common/modeldata.h"
 #include "common/util.h"
 #include "selfdrive/modeld/models/commonmodel.h"
+#include "selfdrive/modeld/models/history.h"
 #include "selfdrive/modeld/models/nav.h"
 #include "selfdrive/modeld/runners/run.h"
 
@@ -251,12 +252,12 @@ constexpr int NET_OUTPUT_SIZE = OUTPUT_SIZE + FEATURE_LEN + PAD_SIZE;
 struct ModelState {
   ModelFrame *frame = nullptr;
   ModelFrame *wide_frame = nullptr;
-  std::array<float, HISTORY_BUFFER_LEN * FEATURE_LEN> feature_buffer = {};
+  HistoryBuffer feature_buffer{HISTORY_BUFFER_LEN * FEATURE_LEN, FEATURE_LEN};
   std::array<float, NET_OUTPUT_SIZE> output = {};
   std::unique_ptr<RunModel> m;
 #ifdef DESIRE
   float prev_desire[DESIRE_LEN] = {};
-  float pulse_desire[DESIRE_LEN*(HISTORY_BUFFER_LEN+1)] = {};
+  HistoryBuffer pulse_desire{DESIRE_LEN*(HISTORY_BUFFER_LEN+1), DESIRE_LEN};
 #endif
 #ifdef TRAFFIC_CONVENTION
   float traffic_convention[TRAFFIC_CONVENTION_LEN] = {};
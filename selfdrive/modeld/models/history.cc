@@ -0,0 +1,51 @@
+#include "selfdrive/modeld/models/history.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+HistoryBuffer::HistoryBuffer(size_t _size, size_t _step) : size(_size), step(_step) {
+  assert(step > 0 && size >= 2 * step);
+
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  const size_t bytes = (size * sizeof(float) + page_size - 1) / page_size * page_size;
+  ring_size = bytes / sizeof(float);
+
+#ifdef __APPLE__
+  // no memfd, an unlinked shm object is the same
+  static int count = 0;
+  const std::string name = "/history_" + std::to_string(getpid()) + "_" + std::to_string(count++);
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  shm_unlink(name.c_str());
+#else
+  int fd = memfd_create("history", MFD_CLOEXEC);
+#endif
+  assert(fd >= 0);
+  int err = ftruncate(fd, bytes);
+  assert(err == 0);
+
+  // reserve room for both, then map the ring over each half
+  uint8_t *addr = (uint8_t *)mmap(NULL, 2 * bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(addr != MAP_FAILED);
+  void *first = mmap(addr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+  void *second = mmap(addr + bytes, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+  assert(first == addr && second == addr + bytes);
+  close(fd);
+
+  // zeros, as a new file is
+  ring = (float *)addr;
+}
+
+HistoryBuffer::~HistoryBuffer() {
+  munmap(ring, 2 * ring_size * sizeof(float));
+}
+
+void HistoryBuffer::push() {
+  start = (start + step) % ring_size;
+  memcpy(back(), back() - step, step * sizeof(float));
+}
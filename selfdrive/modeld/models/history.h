@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+
+// The last size floats of a history that moves on step floats at a time, always
+// contiguous. The ring behind it is mapped twice back to back, so a window
+// starting anywhere in the ring runs on into the second mapping instead of
+// wrapping, and moving on is moving where it starts.
+class HistoryBuffer {
+public:
+  HistoryBuffer(size_t size, size_t step);
+  ~HistoryBuffer();
+  HistoryBuffer(const HistoryBuffer&) = delete;
+  HistoryBuffer &operator=(const HistoryBuffer&) = delete;
+
+  float *data() { return ring + start; }
+  // the newest step, at the end of the window
+  float *back() { return data() + size - step; }
+  // drops the oldest step and starts a new one that is a copy of the newest, as
+  // shifting the window down by step in place would leave it
+  void push();
+
+  const size_t size;
+  const size_t step;
+
+private:
+  float *ring;
+  size_t ring_size;
+  size_t start = 0;
+};
@@ -9,7 +9,9 @@
 
 
 void navmodel_init(NavModelState* s) {
-  #ifdef USE_ONNX_MODEL
+  #if defined(USE_ONNXRUNTIME_MODEL)
+    s->m = new ONNXRuntimeModel("models/navmodel.onnx", &s->output[0], NAV_NET_OUTPUT_SIZE, USE_DSP_RUNTIME, false, true);
+  #elif defined(USE_ONNX_MODEL)
     s->m = new ONNXModel("models/navmodel.onnx", &s->output[0], NAV_NET_OUTPUT_SIZE, USE_DSP_RUNTIME, false, true);
   #else
     s->m = new SNPEModel("models/navmodel_q.dlc", &s->output[0], NAV_NET_OUTPUT_SIZE, USE_DSP_RUNTIME, false, true);
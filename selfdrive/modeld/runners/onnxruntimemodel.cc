@@ -0,0 +1,245 @@
+#include "selfdrive/modeld/runners/onnxruntimemodel.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include "common/swaglog.h"
+
+// IEEE half precision, rounding to nearest even
+static uint16_t float_to_half(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  const uint32_t sign = (x >> 16) & 0x8000;
+  const int32_t exp = (int32_t)((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mant = x & 0x7fffff;
+
+  if (((x >> 23) & 0xff) == 0xff) {
+    return sign | 0x7c00 | (mant ? 0x200 : 0);
+  } else if (exp >= 0x1f) {
+    return sign | 0x7c00;
+  } else if (exp <= 0) {
+    // subnormal, or zero
+    if (exp < -10) return sign;
+    mant |= 0x800000;
+    const int shift = 14 - exp;
+    uint32_t h = mant >> shift;
+    const uint32_t rem = mant & ((1U << shift) - 1), halfway = 1U << (shift - 1);
+    if (rem > halfway || (rem == halfway && (h & 1))) h++;
+    return sign | h;
+  }
+
+  // rounding up may carry into the exponent, up to inf
+  uint32_t h = ((uint32_t)exp << 10) | (mant >> 13);
+  const uint32_t rem = mant & 0x1fff;
+  if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+  return sign | h;
+}
+
+static float half_to_float(uint16_t h) {
+  const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  const uint32_t exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+  if (exp == 0) {
+    const float f = std::ldexp((float)mant, -24);
+    return sign ? -f : f;
+  }
+
+  const uint32_t x = sign | ((exp == 0x1f ? 0xffU : exp - 15 + 127) << 23) | (mant << 13);
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+ONNXRuntimeModel::ONNXRuntimeModel(const char *path, float *_output, size_t _output_size, int runtime, bool _use_extra, bool _use_tf8, cl_context context, int intra_op_threads) {
+  LOGD("loading model %s", path);
+
+  output = _output;
+  output_size = _output_size;
+  use_tf8 = _use_tf8;
+
+  if (intra_op_threads <= 0) {
+    const char *threads_env = getenv("ONNX_INTRA_OP_THREADS");
+    intra_op_threads = threads_env != nullptr ? atoi(threads_env) : 2;
+  }
+
+  api = OrtGetApiBase()->GetApi(ORT_API_VERSION);
+  check(api->CreateEnv(ORT_LOGGING_LEVEL_WARNING, "modeld", &env));
+  check(api->CreateSessionOptions(&options));
+  check(api->SetIntraOpNumThreads(options, intra_op_threads));
+  check(api->SetSessionExecutionMode(options, ORT_SEQUENTIAL));
+  check(api->SetSessionGraphOptimizationLevel(options, ORT_ENABLE_ALL));
+  check(api->CreateSession(env, path, options, &session));
+  check(api->CreateCpuMemoryInfo(OrtArenaAllocator, OrtMemTypeDefault, &memory_info));
+  check(api->CreateIoBinding(session, &binding));
+
+  inputs = get_tensors(true);
+  outputs = get_tensors(false);
+
+  // the outputs one after the other, as onnx_runner.py writes them
+  size_t offset = 0;
+  for (Tensor &t : outputs) {
+    assert(offset + t.size <= output_size);
+    bind(t, output + offset, false, false);
+    offset += t.size;
+  }
+  assert(offset == output_size);
+
+  LOGD("onnxruntime model with %zu inputs, %zu outputs, %d intra op threads", inputs.size(), outputs.size(), intra_op_threads);
+}
+
+ONNXRuntimeModel::~ONNXRuntimeModel() {
+  for (auto tensors : {&inputs, &outputs}) {
+    for (Tensor &t : *tensors) {
+      if (t.value != nullptr) api->ReleaseValue(t.value);
+    }
+  }
+  if (binding != nullptr) api->ReleaseIoBinding(binding);
+  if (memory_info != nullptr) api->ReleaseMemoryInfo(memory_info);
+  if (session != nullptr) api->ReleaseSession(session);
+  if (options != nullptr) api->ReleaseSessionOptions(options);
+  if (env != nullptr) api->ReleaseEnv(env);
+}
+
+void ONNXRuntimeModel::check(OrtStatus *status) {
+  if (status != nullptr) {
+    std::string err = api->GetErrorMessage(status);
+    api->ReleaseStatus(status);
+    LOGE("onnxruntime: %s", err.c_str());
+    throw std::runtime_error("onnxruntime: " + err);
+  }
+}
+
+std::vector<ONNXRuntimeModel::Tensor> ONNXRuntimeModel::get_tensors(bool input) {
+  size_t count;
+  check(input ? api->SessionGetInputCount(session, &count) : api->SessionGetOutputCount(session, &count));
+  OrtAllocator *allocator;
+  check(api->GetAllocatorWithDefaultOptions(&allocator));
+
+  std::vector<Tensor> tensors(count);
+  for (size_t i = 0; i < count; i++) {
+    Tensor &t = tensors[i];
+    char *name;
+    check(input ? api->SessionGetInputName(session, i, allocator, &name) : api->SessionGetOutputName(session, i, allocator, &name));
+    t.name = name;
+    check(api->AllocatorFree(allocator, name));
+
+    OrtTypeInfo *type_info;
+    check(input ? api->SessionGetInputTypeInfo(session, i, &type_info) : api->SessionGetOutputTypeInfo(session, i, &type_info));
+    const OrtTensorTypeAndShapeInfo *info;
+    check(api->CastTypeInfoToTensorInfo(type_info, &info));
+    check(api->GetTensorElementType(info, &t.type));
+    size_t dims;
+    check(api->GetDimensionsCount(info, &dims));
+    t.shape.resize(dims);
+    check(api->GetDimensions(info, t.shape.data(), dims));
+    api->ReleaseTypeInfo(type_info);
+
+    if (t.type != ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT && t.type != ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16) {
+      LOGE("onnxruntime: %s has unsupported type %d", t.name.c_str(), t.type);
+      throw std::runtime_error("onnxruntime: unsupported tensor type");
+    }
+
+    // a batch of one, as onnx_runner.py runs
+    if (!t.shape.empty()) t.shape[0] = 1;
+    t.size = 1;
+    for (int64_t &d : t.shape) {
+      if (d <= 0) d = 1;
+      t.size *= d;
+    }
+  }
+  return tensors;
+}
+
+void ONNXRuntimeModel::bind(Tensor &t, float *buf, bool tf8, bool input) {
+  t.buf = buf;
+  t.tf8 = tf8;
+
+  // floats straight from the buffer, anything else converted through staging
+  const bool half = t.type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16;
+  const size_t bytes = t.size * (half ? sizeof(uint16_t) : sizeof(float));
+  void *data = buf;
+  if (half || tf8) {
+    t.staging.resize(bytes);
+    data = t.staging.data();
+  }
+
+  OrtValue *old_value = t.value;
+  check(api->CreateTensorWithDataAsOrtValue(memory_info, data, bytes, t.shape.data(), t.shape.size(), t.type, &t.value));
+  check(input ? api->BindInput(binding, t.name.c_str(), t.value) : api->BindOutput(binding, t.name.c_str(), t.value));
+  if (old_value != nullptr) api->ReleaseValue(old_value);
+}
+
+void ONNXRuntimeModel::addRecurrent(float *state, int state_size) {
+  input_bufs[RECURRENT] = {state, state_size};
+}
+
+void ONNXRuntimeModel::addDesire(float *state, int state_size) {
+  input_bufs[DESIRE] = {state, state_size};
+}
+
+void ONNXRuntimeModel::addNavFeatures(float *state, int state_size) {
+  input_bufs[NAV_FEATURES] = {state, state_size};
+}
+
+void ONNXRuntimeModel::addDrivingStyle(float *state, int state_size) {
+  input_bufs[DRIVING_STYLE] = {state, state_size};
+}
+
+void ONNXRuntimeModel::addTrafficConvention(float *state, int state_size) {
+  input_bufs[TRAFFIC_CONVENTION] = {state, state_size};
+}
+
+void ONNXRuntimeModel::addCalib(float *state, int state_size) {
+  input_bufs[CALIB] = {state, state_size};
+}
+
+void ONNXRuntimeModel::addImage(float *image_buf, int buf_size) {
+  input_bufs[IMAGE] = {image_buf, buf_size};
+}
+
+void ONNXRuntimeModel::addExtra(float *image_buf, int buf_size) {
+  input_bufs[EXTRA] = {image_buf, buf_size};
+}
+
+void ONNXRuntimeModel::execute() {
+  // the buffers given go to the inputs in order. they are bound again only when they move
+  size_t i = 0;
+  for (int type = 0; type < INPUT_TYPE_CNT; type++) {
+    auto [buf, size] = input_bufs[type];
+    if (buf == nullptr) continue;
+
+    assert(i < inputs.size());
+    Tensor &t = inputs[i++];
+    const bool tf8 = use_tf8 && type == IMAGE;
+    assert((tf8 ? size * sizeof(float) : size) == t.size);
+    if (buf != t.buf || tf8 != t.tf8) {
+      bind(t, buf, tf8, true);
+    }
+
+    // the tf8 image is bytes, scaled to [0, 1] like onnx_runner.py does
+    const bool half = t.type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16;
+    const uint8_t *bytes = (const uint8_t *)buf;
+    if (tf8 && half) {
+      uint16_t *dst = (uint16_t *)t.staging.data();
+      for (size_t j = 0; j < t.size; j++) dst[j] = float_to_half(bytes[j] / 255.0);
+    } else if (tf8) {
+      float *dst = (float *)t.staging.data();
+      for (size_t j = 0; j < t.size; j++) dst[j] = bytes[j] / 255.0;
+    } else if (half) {
+      uint16_t *dst = (uint16_t *)t.staging.data();
+      for (size_t j = 0; j < t.size; j++) dst[j] = float_to_half(buf[j]);
+    }
+  }
+  assert(i == inputs.size());
+
+  check(api->RunWithBinding(session, nullptr, binding));
+
+  for (Tensor &t : outputs) {
+    if (t.type == ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT16) {
+      const uint16_t *src = (const uint16_t *)t.staging.data();
+      for (size_t j = 0; j < t.size; j++) t.buf[j] = half_to_float(src[j]);
+    }
+  }
+}
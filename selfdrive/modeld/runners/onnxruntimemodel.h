@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include <onnxruntime_c_api.h>
+
+#include "selfdrive/modeld/runners/runmodel.h"
+
+// Runs an ONNX model in process with onnxruntime's CPU execution provider. The
+// inputs and outputs are bound to the buffers given, so nothing is copied
+// unless the model wants another type, like float16 or the tf8 image.
+class ONNXRuntimeModel : public RunModel {
+public:
+  // intra_op_threads of 0 takes ONNX_INTRA_OP_THREADS from the environment, or 2 as onnx_runner.py does
+  ONNXRuntimeModel(const char *path, float *output, size_t output_size, int runtime, bool use_extra = false, bool _use_tf8 = false, cl_context context = NULL, int intra_op_threads = 0);
+  ~ONNXRuntimeModel();
+  void addRecurrent(float *state, int state_size);
+  void addDesire(float *state, int state_size);
+  void addNavFeatures(float *state, int state_size);
+  void addDrivingStyle(float *state, int state_size);
+  void addTrafficConvention(float *state, int state_size);
+  void addCalib(float *state, int state_size);
+  void addImage(float *image_buf, int buf_size);
+  void addExtra(float *image_buf, int buf_size);
+  void execute();
+
+private:
+  // the inputs go to the model in this order, as with ONNXModel
+  enum InputType { IMAGE, EXTRA, DESIRE, NAV_FEATURES, DRIVING_STYLE, TRAFFIC_CONVENTION, CALIB, RECURRENT, INPUT_TYPE_CNT };
+  std::array<std::pair<float *, int>, INPUT_TYPE_CNT> input_bufs = {};
+
+  struct Tensor {
+    std::string name;
+    ONNXTensorElementDataType type;
+    std::vector<int64_t> shape;
+    size_t size;
+    // what it is bound to, and the buffer it is converted through if it isn't a float one
+    float *buf = nullptr;
+    bool tf8 = false;
+    std::vector<uint8_t> staging;
+    OrtValue *value = nullptr;
+  };
+  std::vector<Tensor> inputs;
+  std::vector<Tensor> outputs;
+
+  float *output;
+  size_t output_size;
+  bool use_tf8;
+
+  const OrtApi *api;
+  OrtEnv *env = nullptr;
+  OrtSessionOptions *options = nullptr;
+  OrtSession *session = nullptr;
+  OrtMemoryInfo *memory_info = nullptr;
+  OrtIoBinding *binding = nullptr;
+
+  void check(OrtStatus *status);
+  std::vector<Tensor> get_tensors(bool input);
+  void bind(Tensor &t, float *buf, bool tf8, bool input);
+};
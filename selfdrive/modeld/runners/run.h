@@ -8,3 +8,7 @@
 #elif defined(USE_ONNX_MODEL)
 #include "onnxmodel.h"
 #endif
+
+#ifdef USE_ONNXRUNTIME_MODEL
+#include "onnxruntimemodel.h"
+#endif
@@ -5,6 +5,7 @@
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
+#include <utility>
 
 #include "common/util.h"
 #include "common/timing.h"
@@ -140,32 +141,32 @@ SNPEModel::SNPEModel(const char *path, float *loutput, size_t loutput_size, int
 void SNPEModel::addRecurrent(float *state, int state_size) {
   recurrent = state;
   recurrent_size = state_size;
-  recurrentBuffer = this->addExtra(state, state_size, 3);
+  if (!recurrentBuffer) recurrentBuffer = this->addExtra(state, state_size, 3);
 }
 
 void SNPEModel::addTrafficConvention(float *state, int state_size) {
   trafficConvention = state;
-  trafficConventionBuffer = this->addExtra(state, state_size, 2);
+  if (!trafficConventionBuffer) trafficConventionBuffer = this->addExtra(state, state_size, 2);
 }
 
 void SNPEModel::addDesire(float *state, int state_size) {
   desire = state;
-  desireBuffer = this->addExtra(state, state_size, 1);
+  if (!desireBuffer) desireBuffer = this->addExtra(state, state_size, 1);
 }
 
 void SNPEModel::addNavFeatures(float *state, int state_size) {
   navFeatures = state;
-  navFeaturesBuffer = this->addExtra(state, state_size, 1);
+  if (!navFeaturesBuffer) navFeaturesBuffer = this->addExtra(state, state_size, 1);
 }
 
 void SNPEModel::addDrivingStyle(float *state, int state_size) {
     drivingStyle = state;
-    drivingStyleBuffer = this->addExtra(state, state_size, 2);
+    if (!drivingStyleBuffer) drivingStyleBuffer = this->addExtra(state, state_size, 2);
 }
 
 void SNPEModel::addCalib(float *state, int state_size) {
   calib = state;
-  calibBuffer = this->addExtra(state, state_size, 1);
+  if (!calibBuffer) calibBuffer = this->addExtra(state, state_size, 1);
 }
 
 void SNPEModel::addImage(float *image_buf, int buf_size) {
@@ -202,6 +203,17 @@ void SNPEModel::execute() {
     bool extra_ret = extraBuffer->setBufferAddress(extra);
     assert(extra_ret == true);
   }
+  // the inputs added again since their buffer was made may have moved, like the desire history does every frame
+  const std::pair<zdl::DlSystem::IUserBuffer*, float*> states[] = {
+    {recurrentBuffer.get(), recurrent}, {trafficConventionBuffer.get(), trafficConvention}, {desireBuffer.get(), desire},
+    {navFeaturesBuffer.get(), navFeatures}, {drivingStyleBuffer.get(), drivingStyle}, {calibBuffer.get(), calib},
+  };
+  for (auto [buf, state] : states) {
+    if (buf) {
+      bool state_ret = buf->setBufferAddress(state);
+      assert(state_ret == true);
+    }
+  }
   if (!snpe->execute(inputMap, outputMap)) {
     PrintErrorStringAndExit();
   }
@@ -70,17 +70,17 @@ private:
 
   // recurrent and desire
   std::unique_ptr<zdl::DlSystem::IUserBuffer> addExtra(float *state, int state_size, int idx);
-  float *recurrent;
+  float *recurrent = nullptr;
   size_t recurrent_size;
   std::unique_ptr<zdl::DlSystem::IUserBuffer> recurrentBuffer;
-  float *trafficConvention;
+  float *trafficConvention = nullptr;
   std::unique_ptr<zdl::DlSystem::IUserBuffer> trafficConventionBuffer;
-  float *desire;
+  float *desire = nullptr;
   std::unique_ptr<zdl::DlSystem::IUserBuffer> desireBuffer;
-  float *navFeatures;
+  float *navFeatures = nullptr;
   std::unique_ptr<zdl::DlSystem::IUserBuffer> navFeaturesBuffer;
-  float *drivingStyle;
+  float *drivingStyle = nullptr;
   std::unique_ptr<zdl::DlSystem::IUserBuffer> drivingStyleBuffer;
-  float *calib;
+  float *calib = nullptr;
   std::unique_ptr<zdl::DlSystem::IUserBuffer> calibBuffer;
 };
@@ -0,0 +1,156 @@
+// ModelFrame on the default OpenCL device, like PoCL's CPU one: how long the warp and the
+// loadyuv each take, and how much of that a deeper pipeline hides behind a model that
+// takes --model-ms. the frames from every depth have to match the ones prepared one at a time
+// usage: ./tests/benchmark_modelframe [--frames N] [--model-ms N] [--depth N], from selfdrive/modeld
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "common/timing.h"
+#include "selfdrive/modeld/models/commonmodel.h"
+
+// the road camera, as camerad gives it
+constexpr int WIDTH = 1928, HEIGHT = 1208, STRIDE = 2048, UV_OFFSET = STRIDE * HEIGHT;
+constexpr int YUV_SIZE = STRIDE * HEIGHT * 3 / 2;
+constexpr int CAMERA_BUFS = 4;
+// the model's input, as ModelFrame makes it
+constexpr int MODEL_WIDTH = 512, MODEL_HEIGHT = 256, MODEL_FRAME_SIZE = MODEL_WIDTH * MODEL_HEIGHT * 3 / 2;
+
+static void report(const char *name, std::vector<double> &ms) {
+  std::sort(ms.begin(), ms.end());
+  double mean = 0;
+  for (double t : ms) mean += t / ms.size();
+  printf("  %-22s mean %7.3f ms, p50 %7.3f ms, p99 %7.3f ms, max %7.3f ms\n", name, mean, ms[ms.size() / 2],
+         ms[std::min(ms.size() - 1, ms.size() * 99 / 100)], ms.back());
+}
+
+// from the model's input to the camera frame, moving a little every frame
+static mat3 projection(int frame) {
+  const float shift = (frame % 20) * 0.5;
+  return {{
+    2.5, 0.0, 320.0f + shift,
+    0.0, 2.5, 280.0f - shift,
+    0.0, 0.0, 1.0,
+  }};
+}
+
+int main(int argc, char **argv) {
+  int frames = 200, max_depth = 3;
+  double model_ms = 10;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--model-ms") == 0 && i + 1 < argc) {
+      model_ms = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+      max_depth = atoi(argv[++i]);
+    } else {
+      printf("unknown argument %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  cl_device_id device_id = cl_get_device_id(CL_DEVICE_TYPE_DEFAULT);
+  cl_context context = CL_CHECK_ERR(clCreateContext(NULL, 1, &device_id, NULL, NULL, &err));
+
+  std::mt19937 gen(0);
+  std::uniform_int_distribution<int> pixel(0, 255);
+  std::vector<cl_mem> camera_bufs;
+  for (int i = 0; i < CAMERA_BUFS; i++) {
+    std::vector<uint8_t> yuv(YUV_SIZE);
+    std::generate(yuv.begin(), yuv.end(), [&]() { return pixel(gen); });
+    camera_bufs.push_back(CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, YUV_SIZE, yuv.data(), &err)));
+  }
+
+  // each stage on its own, waiting for it to finish
+  {
+    cl_command_queue q = CL_CHECK_ERR(clCreateCommandQueue(context, device_id, 0, &err));
+    const int w = MODEL_WIDTH, h = MODEL_HEIGHT;
+    cl_mem y_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_WRITE, w * h, NULL, &err));
+    cl_mem u_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_WRITE, (w / 2) * (h / 2), NULL, &err));
+    cl_mem v_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_WRITE, (w / 2) * (h / 2), NULL, &err));
+    cl_mem net_input_cl = CL_CHECK_ERR(clCreateBuffer(context, CL_MEM_READ_WRITE, MODEL_FRAME_SIZE * sizeof(float), NULL, &err));
+    std::vector<float> net_input(MODEL_FRAME_SIZE);
+
+    Transform transform;
+    LoadYUVState loadyuv;
+    transform_init(&transform, context, device_id);
+    loadyuv_init(&loadyuv, context, device_id, w, h);
+
+    std::vector<double> warp_ms, loadyuv_ms;
+    for (int i = 0; i < frames; i++) {
+      double start = millis_since_boot();
+      transform_queue(&transform, q, camera_bufs[i % CAMERA_BUFS], WIDTH, HEIGHT, STRIDE, UV_OFFSET,
+                      y_cl, u_cl, v_cl, w, h, projection(i));
+      CL_CHECK(clFinish(q));
+      warp_ms.push_back(millis_since_boot() - start);
+
+      start = millis_since_boot();
+      loadyuv_queue(&loadyuv, q, y_cl, u_cl, v_cl, net_input_cl);
+      CL_CHECK(clEnqueueReadBuffer(q, net_input_cl, CL_TRUE, 0, net_input.size() * sizeof(float), net_input.data(), 0, NULL, NULL));
+      loadyuv_ms.push_back(millis_since_boot() - start);
+    }
+    printf("stages, one at a time:\n");
+    report("warp", warp_ms);
+    report("loadyuv and read", loadyuv_ms);
+
+    transform_destroy(&transform);
+    loadyuv_destroy(&loadyuv);
+    for (cl_mem m : {y_cl, u_cl, v_cl, net_input_cl}) CL_CHECK(clReleaseMemObject(m));
+    CL_CHECK(clReleaseCommandQueue(q));
+  }
+
+  // frames queued up to depth ahead of the model. the latency is from a frame being queued to
+  // it being ready for the model, the period is how often the model gets one
+  std::vector<std::vector<float>> expected;
+  for (int depth = 1; depth <= max_depth; depth++) {
+    ModelFrame frame(device_id, context, depth);
+    std::vector<double> latency_ms;
+    std::deque<double> queued_at;
+    int next = 0, mismatches = 0;
+
+    const double start = millis_since_boot();
+    for (int i = 0; i < frames; i++) {
+      while (next < frames && next - i < depth) {
+        queued_at.push_back(millis_since_boot());
+        frame.queue(camera_bufs[next % CAMERA_BUFS], WIDTH, HEIGHT, STRIDE, UV_OFFSET, projection(next), NULL);
+        next++;
+      }
+
+      const float *input = frame.wait();
+      latency_ms.push_back(millis_since_boot() - queued_at.front());
+      queued_at.pop_front();
+
+      const float *newest = input + MODEL_FRAME_SIZE;
+      if (depth == 1) {
+        expected.emplace_back(newest, newest + MODEL_FRAME_SIZE);
+      } else if (!std::equal(newest, newest + MODEL_FRAME_SIZE, expected[i].begin())) {
+        mismatches++;
+      }
+
+      // the model, on its own device
+      std::this_thread::sleep_for(std::chrono::microseconds((int64_t)(model_ms * 1000)));
+    }
+    const double period = (millis_since_boot() - start) / frames;
+
+    printf("depth %d, with a %.1f ms model:\n", depth, model_ms);
+    report("latency", latency_ms);
+    printf("  %-22s %7.3f ms, %.3f ms over the model\n", "period", period, period - model_ms);
+    if (mismatches > 0) {
+      printf("  %d frames differ from depth 1\n", mismatches);
+      return 1;
+    }
+  }
+
+  for (cl_mem m : camera_bufs) CL_CHECK(clReleaseMemObject(m));
+  CL_CHECK(clReleaseContext(context));
+  return 0;
+}
@@ -0,0 +1,100 @@
+// supercombo.onnx with fixed inputs, through the onnx_runner.py pipe and in process with
+// onnxruntime: the time of each execute, and how far apart their outputs are
+// usage: ./onnx_benchmark [--runs N] [--threads N,...], from selfdrive/modeld
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common/timing.h"
+#include "selfdrive/modeld/models/driving.h"
+
+// ModelFrame::buf_size, the two frames of the image
+constexpr int IMAGE_SIZE = 512 * 256 * 3 / 2 * 2;
+
+struct Inputs {
+  std::vector<float> image, extra, recurrent, desire, traffic_convention;
+
+  Inputs() : image(IMAGE_SIZE), extra(IMAGE_SIZE), recurrent(TEMPORAL_SIZE), desire(DESIRE_LEN * (HISTORY_BUFFER_LEN + 1)),
+             traffic_convention(TRAFFIC_CONVENTION_LEN) {
+    std::mt19937 gen(0);
+    std::uniform_real_distribution<float> pixel(0, 255), feature(-1, 1);
+    for (auto *v : {&image, &extra}) std::generate(v->begin(), v->end(), [&]() { return std::round(pixel(gen)); });
+    std::generate(recurrent.begin(), recurrent.end(), [&]() { return feature(gen); });
+    desire[DESIRE_LEN * HISTORY_BUFFER_LEN + 1] = 1;
+    traffic_convention[0] = 1;
+  }
+
+  // as model_init and model_eval_frame give them
+  void add(RunModel *m) {
+    m->addRecurrent(recurrent.data(), recurrent.size());
+    m->addDesire(desire.data(), desire.size());
+    m->addTrafficConvention(traffic_convention.data(), traffic_convention.size());
+    m->addImage(image.data(), image.size());
+    m->addExtra(extra.data(), extra.size());
+  }
+};
+
+static void run(const char *name, RunModel *m, Inputs &inputs, int runs) {
+  std::vector<double> ms;
+  inputs.add(m);
+  for (int i = 0; i < runs + 3; i++) {
+    const double start = millis_since_boot();
+    m->execute();
+    // the first few warm up
+    if (i >= 3) ms.push_back(millis_since_boot() - start);
+  }
+  std::sort(ms.begin(), ms.end());
+  double mean = 0;
+  for (double t : ms) mean += t / ms.size();
+  printf("%-28s mean %7.2f ms, p50 %7.2f ms, p99 %7.2f ms, max %7.2f ms\n", name, mean, ms[ms.size() / 2],
+         ms[std::min(ms.size() - 1, ms.size() * 99 / 100)], ms.back());
+}
+
+int main(int argc, char **argv) {
+  int runs = 100;
+  std::vector<int> threads = {1, 2, 4};
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+      runs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads.clear();
+      for (char *t = strtok(argv[++i], ","); t != nullptr; t = strtok(nullptr, ",")) {
+        threads.push_back(atoi(t));
+      }
+    } else {
+      printf("unknown argument %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  // both on the CPU execution provider
+  setenv("ONNXCPU", "1", 1);
+
+  Inputs inputs;
+  std::array<float, NET_OUTPUT_SIZE> pipe_output = {};
+  {
+    ONNXModel m("models/supercombo.onnx", pipe_output.data(), NET_OUTPUT_SIZE, USE_GPU_RUNTIME, true, false);
+    run("onnx_runner.py pipe", &m, inputs, runs);
+  }
+
+  for (int n : threads) {
+    std::array<float, NET_OUTPUT_SIZE> output = {};
+    ONNXRuntimeModel m("models/supercombo.onnx", output.data(), NET_OUTPUT_SIZE, USE_GPU_RUNTIME, true, false, NULL, n);
+    run(("onnxruntime, " + std::to_string(n) + " intra op threads").c_str(), &m, inputs, runs);
+
+    float max_diff = 0;
+    for (int i = 0; i < NET_OUTPUT_SIZE; i++) {
+      max_diff = std::max(max_diff, std::abs(output[i] - pipe_output[i]));
+    }
+    printf("%-28s max difference from the pipe %g\n", "", max_diff);
+  }
+  return 0;
+}
@@ -0,0 +1,103 @@
+#define CATCH_CONFIG_MAIN
+#include <cstring>
+#include <random>
+
+#include "catch2/catch.hpp"
+#include "selfdrive/modeld/models/history.h"
+
+constexpr int FEATURE_LEN = 128;
+constexpr int HISTORY_BUFFER_LEN = 99;
+constexpr int DESIRE_LEN = 8;
+
+// the history of model_eval_frame as it was, shifted down in place each frame
+struct MemmoveHistory {
+  float feature_buffer[HISTORY_BUFFER_LEN * FEATURE_LEN] = {};
+  float pulse_desire[DESIRE_LEN*(HISTORY_BUFFER_LEN+1)] = {};
+  float prev_desire[DESIRE_LEN] = {};
+
+  void update_desire(const float *desire_in) {
+    std::memmove(&pulse_desire[0], &pulse_desire[DESIRE_LEN], sizeof(float) * DESIRE_LEN*HISTORY_BUFFER_LEN);
+    if (desire_in != NULL) {
+      for (int i = 1; i < DESIRE_LEN; i++) {
+        if (desire_in[i] - prev_desire[i] > .99) {
+          pulse_desire[DESIRE_LEN*HISTORY_BUFFER_LEN+i] = desire_in[i];
+        } else {
+          pulse_desire[DESIRE_LEN*HISTORY_BUFFER_LEN+i] = 0.0;
+        }
+        prev_desire[i] = desire_in[i];
+      }
+    }
+  }
+
+  void update_features(const float *features) {
+    std::memmove(&feature_buffer[0], &feature_buffer[FEATURE_LEN], sizeof(float) * FEATURE_LEN*(HISTORY_BUFFER_LEN-1));
+    std::memcpy(&feature_buffer[FEATURE_LEN*(HISTORY_BUFFER_LEN-1)], features, sizeof(float) * FEATURE_LEN);
+  }
+};
+
+// and as it is now
+struct RingHistory {
+  HistoryBuffer feature_buffer{HISTORY_BUFFER_LEN * FEATURE_LEN, FEATURE_LEN};
+  HistoryBuffer pulse_desire{DESIRE_LEN*(HISTORY_BUFFER_LEN+1), DESIRE_LEN};
+  float prev_desire[DESIRE_LEN] = {};
+
+  void update_desire(const float *desire_in) {
+    pulse_desire.push();
+    float *pulse = pulse_desire.back();
+    if (desire_in != NULL) {
+      for (int i = 1; i < DESIRE_LEN; i++) {
+        if (desire_in[i] - prev_desire[i] > .99) {
+          pulse[i] = desire_in[i];
+        } else {
+          pulse[i] = 0.0;
+        }
+        prev_desire[i] = desire_in[i];
+      }
+    }
+  }
+
+  void update_features(const float *features) {
+    feature_buffer.push();
+    std::memcpy(feature_buffer.back(), features, sizeof(float) * FEATURE_LEN);
+  }
+};
+
+TEST_CASE("HistoryBuffer") {
+  SECTION("window runs on past the end of the ring") {
+    HistoryBuffer history(1000, 10);
+    for (int i = 0; i < 1000; i++) {
+      REQUIRE(history.data()[0] == (i < 100 ? 0 : i - 100));
+      history.push();
+      for (int j = 0; j < 10; j++) history.back()[j] = i;
+      REQUIRE(history.back()[9] == i);
+    }
+  }
+
+  SECTION("bit identical to memmove over 10k frames") {
+    MemmoveHistory memmove_history;
+    RingHistory ring_history;
+    std::mt19937 gen(0);
+    std::uniform_real_distribution<float> dist(-10, 10);
+    std::uniform_int_distribution<int> coin(0, 9);
+
+    int mismatches = 0;
+    float desire[DESIRE_LEN], features[FEATURE_LEN];
+    for (int frame = 0; frame < 10000; frame++) {
+      // desires that come and go, sometimes none, and a frame prepared but not run now and then
+      for (int i = 0; i < DESIRE_LEN; i++) desire[i] = coin(gen) < 3 ? 1.0 : (coin(gen) < 5 ? dist(gen) : 0.0);
+      const float *desire_in = coin(gen) == 0 ? nullptr : desire;
+      memmove_history.update_desire(desire_in);
+      ring_history.update_desire(desire_in);
+
+      if (coin(gen) != 0) {
+        for (int i = 0; i < FEATURE_LEN; i++) features[i] = dist(gen);
+        memmove_history.update_features(features);
+        ring_history.update_features(features);
+      }
+
+      mismatches += memcmp(memmove_history.pulse_desire, ring_history.pulse_desire.data(), sizeof(memmove_history.pulse_desire)) != 0;
+      mismatches += memcmp(memmove_history.feature_buffer, ring_history.feature_buffer.data(), sizeof(memmove_history.feature_buffer)) != 0;
+    }
+    REQUIRE(mismatches == 0);
+  }
+}
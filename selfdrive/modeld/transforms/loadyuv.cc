@@ -33,7 +33,7 @@ void loadyuv_destroy(LoadYUVState* s) {
 
 void loadyuv_queue(LoadYUVState* s, cl_command_queue q,
                    cl_mem y_cl, cl_mem u_cl, cl_mem v_cl,
-                   cl_mem out_cl, bool do_shift) {
+                   cl_mem out_cl, bool do_shift, cl_event *event) {
   cl_int global_out_off = 0;
   if (do_shift) {
     // shift the image in slot 1 to slot 0, then place the new image in slot 1
@@ -70,5 +70,5 @@ void loadyuv_queue(LoadYUVState* s, cl_command_queue q,
   CL_CHECK(clSetKernelArg(s->loaduv_krnl, 2, sizeof(cl_int), &global_out_off));
 
   CL_CHECK(clEnqueueNDRangeKernel(q, s->loaduv_krnl, 1, NULL,
-                               &loaduv_work_size, NULL, 0, 0, NULL));
+                               &loaduv_work_size, NULL, 0, 0, event));
 }
@@ -18,6 +18,9 @@ void transform_init(Transform* s, cl_context ctx, cl_device_id device_id) {
 }
 
 void transform_destroy(Transform* s) {
+  for (cl_event &e : s->m_events) {
+    if (e != NULL) CL_CHECK(clReleaseEvent(e));
+  }
   CL_CHECK(clReleaseMemObject(s->m_y_cl));
   CL_CHECK(clReleaseMemObject(s->m_uv_cl));
   CL_CHECK(clReleaseKernel(s->krnl));
@@ -31,16 +34,23 @@ void transform_queue(Transform* s,
                      const mat3& projection) {
   const int zero = 0;
 
+  // the last frame's writes are long done by now, unless it is still queued
+  if (s->m_events[0] != NULL) {
+    CL_CHECK(clWaitForEvents(2, s->m_events));
+    CL_CHECK(clReleaseEvent(s->m_events[0]));
+    CL_CHECK(clReleaseEvent(s->m_events[1]));
+  }
+
   // sampled using pixel center origin
   // (because that's how fastcv and opencv does it)
 
-  mat3 projection_y = projection;
+  s->m_y = projection;
 
   // in and out uv is half the size of y.
-  mat3 projection_uv = transform_scale_buffer(projection, 0.5);
+  s->m_uv = transform_scale_buffer(projection, 0.5);
 
-  CL_CHECK(clEnqueueWriteBuffer(q, s->m_y_cl, CL_TRUE, 0, 3*3*sizeof(float), (void*)projection_y.v, 0, NULL, NULL));
-  CL_CHECK(clEnqueueWriteBuffer(q, s->m_uv_cl, CL_TRUE, 0, 3*3*sizeof(float), (void*)projection_uv.v, 0, NULL, NULL));
+  CL_CHECK(clEnqueueWriteBuffer(q, s->m_y_cl, CL_FALSE, 0, 3*3*sizeof(float), (void*)s->m_y.v, 0, NULL, &s->m_events[0]));
+  CL_CHECK(clEnqueueWriteBuffer(q, s->m_uv_cl, CL_FALSE, 0, 3*3*sizeof(float), (void*)s->m_uv.v, 0, NULL, &s->m_events[1]));
 
   const int in_y_width = in_width;
   const int in_y_height = in_height;
@@ -72,7 +82,7 @@ void transform_queue(Transform* s,
   const size_t work_size_y[2] = {(size_t)out_y_width, (size_t)out_y_height};
 
   CL_CHECK(clEnqueueNDRangeKernel(q, s->krnl, 2, NULL,
-                              (const size_t*)&work_size_y, NULL, 0, 0, NULL));
+                              (const size_t*)&work_size_y, NULL, 1, &s->m_events[0], NULL));
 
   const size_t work_size_uv[2] = {(size_t)out_uv_width, (size_t)out_uv_height};
 
@@ -88,10 +98,10 @@ void transform_queue(Transform* s,
   CL_CHECK(clSetKernelArg(s->krnl, 11, sizeof(cl_mem), &s->m_uv_cl));  // M
 
   CL_CHECK(clEnqueueNDRangeKernel(q, s->krnl, 2, NULL,
-                              (const size_t*)&work_size_uv, NULL, 0, 0, NULL));
+                              (const size_t*)&work_size_uv, NULL, 1, &s->m_events[1], NULL));
   CL_CHECK(clSetKernelArg(s->krnl, 3, sizeof(cl_int), &in_v_offset));  // src_ofset
   CL_CHECK(clSetKernelArg(s->krnl, 6, sizeof(cl_mem), &out_v));  // dst
 
   CL_CHECK(clEnqueueNDRangeKernel(q, s->krnl, 2, NULL,
-                              (const size_t*)&work_size_uv, NULL, 0, 0, NULL));
+                              (const size_t*)&work_size_uv, NULL, 1, &s->m_events[1], NULL));
 }
@@ -12,6 +12,9 @@
 typedef struct {
   cl_kernel krnl;
   cl_mem m_y_cl, m_uv_cl;
+  // the matrices are written from here without blocking, so they stay put until the writes are done
+  mat3 m_y, m_uv;
+  cl_event m_events[2];
 } Transform;
 
 void transform_init(Transform* s, cl_context ctx, cl_device_id device_id);
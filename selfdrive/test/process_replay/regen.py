@@ -1,5 +1,4 @@
 #!/usr/bin/env python3
-import bz2
 import os
 import time
 import multiprocessing
@@ -345,7 +344,7 @@ def regen_segment(lr, frs=None, daemons="all", outdir=FAKEDATA, disable_tqdm=Fal
   segment = params.get("CurrentRoute", encoding='utf-8') + "--0"
   seg_path = os.path.join(outdir, segment)
   # check to make sure openpilot is engaged in the route
-  if not check_enabled(LogReader(os.path.join(seg_path, "rlog"))):
+  if not check_enabled(LogReader(os.path.join(seg_path, "rlog.bz2"))):
     raise Exception(f"Route did not engage for long enough: {segment}")
 
   return seg_path
@@ -374,13 +373,6 @@ def regen_and_save(route, sidx, daemons="all", upload=False, use_route_meta=Fals
     frs['wideRoadCameraState'] = wfr
   rpath = regen_segment(lr, frs, daemons, outdir=outdir, disable_tqdm=disable_tqdm)
 
-  # compress raw rlog before uploading
-  with open(os.path.join(rpath, "rlog"), "rb") as f:
-    data = bz2.compress(f.read())
-  with open(os.path.join(rpath, "rlog.bz2"), "wb") as f:
-    f.write(data)
-  os.remove(os.path.join(rpath, "rlog"))
-
   lr = LogReader(os.path.join(rpath, 'rlog.bz2'))
   controls_state_active = [m.controlsState.active for m in lr if m.which() == 'controlsState']
   assert any(controls_state_active), "Segment did not engage"
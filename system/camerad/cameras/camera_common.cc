@@ -8,7 +8,6 @@
 #include <thread>
 
 #include "libyuv.h"
-#include <jpeglib.h>
 
 #include "system/camerad/imgproc/utils.h"
 #include "common/clutil.h"
@@ -19,6 +18,9 @@
 #include "msm_media_info.h"
 
 #include "system/camerad/cameras/camera_qcom2.h"
+#include "system/camerad/cameras/cpu_debayer.h"
+#include "system/camerad/cameras/exposure_stats.h"
+#include "system/camerad/cameras/jpeg_encoder.h"
 #ifdef QCOM2
 #include "CL/cl_ext_qcom.h"
 #endif
@@ -30,6 +32,11 @@ public:
   Debayer(cl_device_id device_id, cl_context context, const CameraBuf *b, const CameraState *s, int buf_width, int uv_offset) {
     char args[4096];
     const CameraInfo *ci = &s->ci;
+    if (env_cpu_debayer) {
+      cpu = std::make_unique<CpuDebayer>(ci->frame_width, ci->frame_height, ci->frame_stride, ci->frame_offset, buf_width, uv_offset,
+                                         s->camera_id == CAMERA_ID_OX03C10, s->camera_num == 1);
+      return;
+    }
     snprintf(args, sizeof(args),
              "-cl-fast-relaxed-math -cl-denorms-are-zero "
              "-DFRAME_WIDTH=%d -DFRAME_HEIGHT=%d -DFRAME_STRIDE=%d -DFRAME_OFFSET=%d "
@@ -55,11 +62,13 @@ public:
   }
 
   ~Debayer() {
-    CL_CHECK(clReleaseKernel(krnl_));
+    if (krnl_) CL_CHECK(clReleaseKernel(krnl_));
   }
 
+  std::unique_ptr<CpuDebayer> cpu;
+
 private:
-  cl_kernel krnl_;
+  cl_kernel krnl_ = nullptr;
 };
 
 void CameraBuf::init(cl_device_id device_id, cl_context context, CameraState *s, VisionIpcServer * v, int frame_cnt, VisionStreamType init_yuv_type) {
@@ -75,7 +84,7 @@ void CameraBuf::init(cl_device_id device_id, cl_context context, CameraState *s,
 
   for (int i = 0; i < frame_buf_count; i++) {
     camera_bufs[i].allocate(frame_size);
-    camera_bufs[i].init_cl(device_id, context);
+    if (device_id) camera_bufs[i].init_cl(device_id, context);
   }
   LOGD("allocated %d CL buffers", frame_buf_count);
 
@@ -94,6 +103,11 @@ void CameraBuf::init(cl_device_id device_id, cl_context context, CameraState *s,
   LOGD("created %d YUV vipc buffers with size %dx%d", YUV_BUFFER_COUNT, nv12_width, nv12_height);
 
   debayer = new Debayer(device_id, context, this, s, nv12_width, nv12_uv_offset);
+  // the CPU debayer runs without an OpenCL device
+  if (!device_id) {
+    assert(debayer->cpu);
+    return;
+  }
 
 #ifdef __APPLE__
   q = CL_CHECK_ERR(clCreateCommandQueue(context, device_id, 0, &err));
@@ -124,10 +138,14 @@ bool CameraBuf::acquire() {
   cur_camera_buf = &camera_bufs[cur_buf_idx];
 
   double start_time = millis_since_boot();
-  cl_event event;
-  debayer->queue(q, camera_bufs[cur_buf_idx].buf_cl, cur_yuv_buf->buf_cl, rgb_width, rgb_height, &event);
-  clWaitForEvents(1, &event);
-  CL_CHECK(clReleaseEvent(event));
+  if (debayer->cpu) {
+    debayer->cpu->run((const uint8_t *)cur_camera_buf->addr, (uint8_t *)cur_yuv_buf->addr);
+  } else {
+    cl_event event;
+    debayer->queue(q, camera_bufs[cur_buf_idx].buf_cl, cur_yuv_buf->buf_cl, rgb_width, rgb_height, &event);
+    clWaitForEvents(1, &event);
+    CL_CHECK(clReleaseEvent(event));
+  }
   cur_frame_data.processing_time = (millis_since_boot() - start_time) / 1000.0;
 
   VisionIpcBufExtra extra = {
@@ -181,121 +199,23 @@ kj::Array<uint8_t> get_raw_frame_image(const CameraBuf *b) {
   return kj::mv(frame_image);
 }
 
-static kj::Array<capnp::byte> yuv420_to_jpeg(const CameraBuf *b, int thumbnail_width, int thumbnail_height) {
-  int downscale = b->cur_yuv_buf->width / thumbnail_width;
-  assert(downscale * thumbnail_height == b->cur_yuv_buf->height);
-  int in_stride = b->cur_yuv_buf->stride;
-
-  // make the buffer big enough. jpeg_write_raw_data requires 16-pixels aligned height to be used.
-  std::unique_ptr<uint8[]> buf(new uint8_t[(thumbnail_width * ((thumbnail_height + 15) & ~15) * 3) / 2]);
-  uint8_t *y_plane = buf.get();
-  uint8_t *u_plane = y_plane + thumbnail_width * thumbnail_height;
-  uint8_t *v_plane = u_plane + (thumbnail_width * thumbnail_height) / 4;
-  {
-    // subsampled conversion from nv12 to yuv
-    for (int hy = 0; hy < thumbnail_height/2; hy++) {
-      for (int hx = 0; hx < thumbnail_width/2; hx++) {
-        int ix = hx * downscale + (downscale-1)/2;
-        int iy = hy * downscale + (downscale-1)/2;
-        y_plane[(hy*2 + 0)*thumbnail_width + (hx*2 + 0)] = b->cur_yuv_buf->y[(iy*2 + 0) * in_stride + ix*2 + 0];
-        y_plane[(hy*2 + 0)*thumbnail_width + (hx*2 + 1)] = b->cur_yuv_buf->y[(iy*2 + 0) * in_stride + ix*2 + 1];
-        y_plane[(hy*2 + 1)*thumbnail_width + (hx*2 + 0)] = b->cur_yuv_buf->y[(iy*2 + 1) * in_stride + ix*2 + 0];
-        y_plane[(hy*2 + 1)*thumbnail_width + (hx*2 + 1)] = b->cur_yuv_buf->y[(iy*2 + 1) * in_stride + ix*2 + 1];
-        u_plane[hy*thumbnail_width/2 + hx] = b->cur_yuv_buf->uv[iy*in_stride + ix*2 + 0];
-        v_plane[hy*thumbnail_width/2 + hx] = b->cur_yuv_buf->uv[iy*in_stride + ix*2 + 1];
-      }
-    }
-  }
-
-  struct jpeg_compress_struct cinfo;
-  struct jpeg_error_mgr jerr;
-  cinfo.err = jpeg_std_error(&jerr);
-  jpeg_create_compress(&cinfo);
-
-  uint8_t *thumbnail_buffer = nullptr;
-  size_t thumbnail_len = 0;
-  jpeg_mem_dest(&cinfo, &thumbnail_buffer, &thumbnail_len);
-
-  cinfo.image_width = thumbnail_width;
-  cinfo.image_height = thumbnail_height;
-  cinfo.input_components = 3;
-
-  jpeg_set_defaults(&cinfo);
-  jpeg_set_colorspace(&cinfo, JCS_YCbCr);
-  // configure sampling factors for yuv420.
-  cinfo.comp_info[0].h_samp_factor = 2;  // Y
-  cinfo.comp_info[0].v_samp_factor = 2;
-  cinfo.comp_info[1].h_samp_factor = 1;  // U
-  cinfo.comp_info[1].v_samp_factor = 1;
-  cinfo.comp_info[2].h_samp_factor = 1;  // V
-  cinfo.comp_info[2].v_samp_factor = 1;
-  cinfo.raw_data_in = TRUE;
-
-  jpeg_set_quality(&cinfo, 50, TRUE);
-  jpeg_start_compress(&cinfo, TRUE);
-
-  JSAMPROW y[16], u[8], v[8];
-  JSAMPARRAY planes[3]{y, u, v};
-
-  for (int line = 0; line < cinfo.image_height; line += 16) {
-    for (int i = 0; i < 16; ++i) {
-      y[i] = y_plane + (line + i) * cinfo.image_width;
-      if (i % 2 == 0) {
-        int offset = (cinfo.image_width / 2) * ((i + line) / 2);
-        u[i / 2] = u_plane + offset;
-        v[i / 2] = v_plane + offset;
-      }
-    }
-    jpeg_write_raw_data(&cinfo, planes, 16);
-  }
-
-  jpeg_finish_compress(&cinfo);
-  jpeg_destroy_compress(&cinfo);
-
-  kj::Array<capnp::byte> dat = kj::heapArray<capnp::byte>(thumbnail_buffer, thumbnail_len);
-  free(thumbnail_buffer);
-  return dat;
-}
-
-static void publish_thumbnail(PubMaster *pm, const CameraBuf *b) {
-  auto thumbnail = yuv420_to_jpeg(b, b->rgb_width / 4, b->rgb_height / 4);
+static void publish_thumbnail(PubMaster *pm, const CameraBuf *b, JpegEncoder *jpeg) {
+  const auto &thumbnail = jpeg->encode(b->cur_yuv_buf->y, b->cur_yuv_buf->uv, b->cur_yuv_buf->stride);
   if (thumbnail.size() == 0) return;
 
   MessageBuilder msg;
   auto thumbnaild = msg.initEvent().initThumbnail();
   thumbnaild.setFrameId(b->cur_frame_data.frame_id);
   thumbnaild.setTimestampEof(b->cur_frame_data.timestamp_eof);
-  thumbnaild.setThumbnail(thumbnail);
+  thumbnaild.setThumbnail(kj::arrayPtr(thumbnail.data(), thumbnail.size()));
 
   pm->send("thumbnail", msg);
 }
 
 float set_exposure_target(const CameraBuf *b, int x_start, int x_end, int x_skip, int y_start, int y_end, int y_skip) {
-  int lum_med;
   uint32_t lum_binning[256] = {0};
-  const uint8_t *pix_ptr = b->cur_yuv_buf->y;
-
-  unsigned int lum_total = 0;
-  for (int y = y_start; y < y_end; y += y_skip) {
-    for (int x = x_start; x < x_end; x += x_skip) {
-      uint8_t lum = pix_ptr[(y * b->rgb_width) + x];
-      lum_binning[lum]++;
-      lum_total += 1;
-    }
-  }
-
-
-  // Find mean lumimance value
-  unsigned int lum_cur = 0;
-  for (lum_med = 255; lum_med >= 0; lum_med--) {
-    lum_cur += lum_binning[lum_med];
-
-    if (lum_cur >= lum_total / 2) {
-      break;
-    }
-  }
-
-  return lum_med / 256.0;
+  luma_histogram(b->cur_yuv_buf->y, b->rgb_width, x_start, x_end, x_skip, y_start, y_end, y_skip, lum_binning);
+  return histogram_median(lum_binning);
 }
 
 void *processing_thread(MultiCameraState *cameras, CameraState *cs, process_thread_cb callback) {
@@ -309,6 +229,7 @@ void *processing_thread(MultiCameraState *cameras, CameraState *cs, process_thre
   }
   util::set_thread_name(thread_name);
 
+  std::unique_ptr<JpegEncoder> jpeg;
   uint32_t cnt = 0;
   while (!do_exit) {
     if (!cs->buf.acquire()) continue;
@@ -316,8 +237,8 @@ void *processing_thread(MultiCameraState *cameras, CameraState *cs, process_thre
     callback(cameras, cs, cnt);
 
     if (cs == &(cameras->road_cam) && cameras->pm && cnt % 100 == 3) {
-      // this takes 10ms???
-      publish_thumbnail(cameras->pm, &(cs->buf));
+      if (!jpeg) jpeg.reset(new JpegEncoder(cs->buf.cur_yuv_buf->width, cs->buf.cur_yuv_buf->height, 4));
+      publish_thumbnail(cameras->pm, &(cs->buf), jpeg.get());
     }
     ++cnt;
   }
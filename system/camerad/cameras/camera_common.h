@@ -41,6 +41,7 @@ const bool env_disable_driver = getenv("DISABLE_DRIVER") != NULL;
 const bool env_debug_frames = getenv("DEBUG_FRAMES") != NULL;
 const bool env_log_raw_frames = getenv("LOG_RAW_FRAMES") != NULL;
 const bool env_ctrl_exp_from_params = getenv("CTRL_EXP_FROM_PARAMS") != NULL;
+const bool env_cpu_debayer = getenv("CPU_DEBAYER") != NULL;
 
 typedef struct CameraInfo {
   uint32_t frame_width, frame_height;
@@ -83,7 +84,7 @@ private:
   int frame_buf_count;
 
 public:
-  cl_command_queue q;
+  cl_command_queue q = nullptr;
   FrameMetadata cur_frame_data;
   VisionBuf *cur_yuv_buf;
   VisionBuf *cur_camera_buf;
@@ -95,6 +96,7 @@ public:
 
   CameraBuf() = default;
   ~CameraBuf();
+  // device_id may be null with CPU_DEBAYER
   void init(cl_device_id device_id, cl_context context, CameraState *s, VisionIpcServer * v, int frame_cnt, VisionStreamType yuv_type);
   bool acquire();
   void queue(size_t buf_idx);
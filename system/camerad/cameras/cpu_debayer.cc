@@ -0,0 +1,348 @@
+#include "system/camerad/cameras/cpu_debayer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "common/swaglog.h"
+#include "common/util.h"
+
+// a*b+c stays two roundings like in the kernel source, in both paths
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#endif
+
+// the rows of blocks a thread takes at a time
+const int BAND_ROWS = 16;
+
+typedef float f4 __attribute__((vector_size(16)));
+typedef int32_t i4 __attribute__((vector_size(16)));
+
+// The kernel is written once, for a block in floats and for 4 blocks in
+// vectors, with the helpers below so that both do the same operations.
+
+static inline f4 blend(i4 mask, f4 a, f4 b) { return (f4)(((i4)a & mask) | ((i4)b & ~mask)); }
+
+// a NaN turns into b, like fmax and fmin in OpenCL
+static inline float vmax(float a, float b) { return a > b ? a : b; }
+static inline f4 vmax(f4 a, f4 b) { return blend(a > b, a, b); }
+static inline float vmin(float a, float b) { return a < b ? a : b; }
+static inline f4 vmin(f4 a, f4 b) { return blend(a < b, a, b); }
+static inline float vabs(float a) { return std::fabs(a); }
+static inline f4 vabs(f4 a) { return (f4)((i4)a & 0x7fffffff); }
+static inline float vexp(float a) { return expf(a); }
+static inline f4 vexp(f4 a) { return f4{expf(a[0]), expf(a[1]), expf(a[2]), expf(a[3])}; }
+static inline float vsqrt_pow(float a) { return powf(a, 0.5f); }
+static inline f4 vsqrt_pow(f4 a) { return f4{powf(a[0], 0.5f), powf(a[1], 0.5f), powf(a[2], 0.5f), powf(a[3], 0.5f)}; }
+// x > t ? a : b
+static inline float select_gt(float x, float t, float a, float b) { return x > t ? a : b; }
+static inline f4 select_gt(f4 x, float t, f4 a, f4 b) { return blend(x > t, a, b); }
+static inline int to_int(float a) { return (int)a; }
+static inline i4 to_int(f4 a) { return __builtin_convertvector(a, i4); }
+
+template <typename F>
+static inline F clamp01(F x) { return vmin(vmax(x, F{} + 0.0f), F{} + 1.0f); }
+
+template <typename F>
+static inline F get_k(F a, F b, F c, F d) { return 2.0f - (vabs(a - b) + vabs(c - d)); }
+
+template <typename F>
+static inline F tone_map(F x, bool is_ox) {
+  if (is_ox) {
+    return -0.507089f * vexp(-12.54124638f * x) + 0.9655f * vsqrt_pow(x) - 0.472597f * x + 0.507089f;
+  }
+  // tone mapping params
+  const float gamma_k = 0.75f;
+  const float gamma_b = 0.125f;
+  const float mp = 0.01f;
+  const float rk = 9 - 100 * mp;
+
+  // poly approximation for s curve
+  return select_gt(x, mp,
+    (rk * (x - mp) * (1 - (gamma_k * mp + gamma_b)) * (1 + 1 / (rk * (1 - mp))) / (1 + rk * (x - mp))) + gamma_k * mp + gamma_b,
+    (rk * (x - mp) * (gamma_k * mp + gamma_b) * (1 + 1 / (rk * mp)) / (1 - rk * (x - mp))) + gamma_k * mp + gamma_b);
+}
+
+// color_correct and convert_uchar3_sat(... * 255.0)
+template <typename F, typename I>
+static inline void color_correct(F r, F g, F b, bool is_ox, I out[3]) {
+  r = clamp01(r);
+  g = clamp01(g);
+  b = clamp01(b);
+  F x[3];
+  if (is_ox) {
+    x[0] = r * 1.5664815f + g * -0.48672447f + b * -0.07975703f;
+    x[1] = r * -0.29808738f + g * 1.41914433f + b * -0.12105695f;
+    x[2] = r * -0.03973474f + g * -0.40295248f + b * 1.44268722f;
+  } else {
+    x[0] = r * 1.82717181f + g * -0.5743977f + b * -0.25277411f;
+    x[1] = r * -0.31231438f + g * 1.36858544f + b * -0.05627105f;
+    x[2] = r * 0.07307673f + g * -0.53183455f + b * 1.45875782f;
+  }
+  for (int i = 0; i < 3; ++i) {
+    out[i] = to_int(vmin(vmax(tone_map(x[i], is_ox) * 255.0f, F{} + 0.0f), F{} + 255.0f));
+  }
+}
+
+// the 2x2 block at s1/s2 of rows b and c. a and d are the rows above and below
+template <typename F, typename I>
+static inline void debayer_block(const F va[4], const F vb[4], const F vc[4], const F vd[4], bool is_ox, I y[4], I uv[2]) {
+  // a simplified version of https://opensignalprocessingjournal.com/contents/volumes/V6/TOSIGPJ-6-1/TOSIGPJ-6-1.pdf
+  I rgb_out[4][3];
+  const F k01 = get_k(va[0], vb[1], va[2], vb[1]);
+  const F k02 = get_k(va[2], vb[1], vc[2], vb[1]);
+  const F k03 = get_k(vc[0], vb[1], vc[2], vb[1]);
+  const F k04 = get_k(va[0], vb[1], vc[0], vb[1]);
+  color_correct((k02 * vb[2] + k04 * vb[0]) / (k02 + k04),  // R_G1
+                vb[1],  // G1(R)
+                (k01 * va[1] + k03 * vc[1]) / (k01 + k03),  // B_G1
+                is_ox, rgb_out[0]);
+
+  const F k11 = get_k(va[1], vc[1], va[3], vc[3]);
+  const F k12 = get_k(va[2], vb[1], vb[3], vc[2]);
+  const F k13 = get_k(va[1], va[3], vc[1], vc[3]);
+  const F k14 = get_k(va[2], vb[3], vc[2], vb[1]);
+  color_correct(vb[2],  // R
+                (k11 * (va[2] + vc[2]) * 0.5f + k13 * (vb[3] + vb[1]) * 0.5f) / (k11 + k13),  // G_R
+                (k12 * (va[3] + vc[1]) * 0.5f + k14 * (va[1] + vc[3]) * 0.5f) / (k12 + k14),  // B_R
+                is_ox, rgb_out[1]);
+
+  const F k21 = get_k(vb[0], vd[0], vb[2], vd[2]);
+  const F k22 = get_k(vb[1], vc[0], vc[2], vd[1]);
+  const F k23 = get_k(vb[0], vb[2], vd[0], vd[2]);
+  const F k24 = get_k(vb[1], vc[2], vd[1], vc[0]);
+  color_correct((k22 * (vb[2] + vd[0]) * 0.5f + k24 * (vb[0] + vd[2]) * 0.5f) / (k22 + k24),  // R_B
+                (k21 * (vb[1] + vd[1]) * 0.5f + k23 * (vc[2] + vc[0]) * 0.5f) / (k21 + k23),  // G_B
+                vc[1],  // B
+                is_ox, rgb_out[2]);
+
+  const F k31 = get_k(vb[1], vc[2], vb[3], vc[2]);
+  const F k32 = get_k(vb[3], vc[2], vd[3], vc[2]);
+  const F k33 = get_k(vd[1], vc[2], vd[3], vc[2]);
+  const F k34 = get_k(vb[1], vc[2], vd[1], vc[2]);
+  color_correct((k31 * vb[2] + k33 * vd[2]) / (k31 + k33),  // R_G2
+                vc[2],  // G2(B)
+                (k32 * vc[3] + k34 * vc[1]) / (k32 + k34),  // B_G2
+                is_ox, rgb_out[3]);
+
+  for (int i = 0; i < 4; ++i) {
+    y[i] = ((rgb_out[i][2] * 13 + rgb_out[i][1] * 65 + rgb_out[i][0] * 33 + 64) >> 7) + 16;
+  }
+  I avg[3];
+  for (int c = 0; c < 3; ++c) {
+    avg[c] = (rgb_out[0][c] + rgb_out[1][c] + rgb_out[2][c] + rgb_out[3][c] + 1) >> 1;
+  }
+  uv[0] = (avg[2] * 56 - avg[1] * 37 - avg[0] * 19 + 0x8080) >> 8;
+  uv[1] = (avg[0] * 56 - avg[1] * 47 - avg[2] * 9 + 0x8080) >> 8;
+}
+
+static float get_vignetting_s(float r) {
+  if (r < 62500) {
+    return (1.0f + 0.0000008f * r);
+  } else if (r < 490000) {
+    return (0.9625f + 0.0000014f * r);
+  } else if (r < 1102500) {
+    return (1.26434f + 0.0000000000016f * r * r);
+  } else {
+    return (0.53503625f + 0.0000000000022f * r * r);
+  }
+}
+
+// the values of a row for the 4 blocks from gx, with the gain of each block
+template <typename F>
+static inline void load_row(const float *even, const float *odd, const float *gains, int gx, bool is_ox, F v[4]);
+
+template <>
+inline void load_row(const float *even, const float *odd, const float *gains, int gx, bool is_ox, float v[4]) {
+  const float pv[4] = {odd[gx - 1], even[gx], odd[gx], even[gx + 1]};
+  for (int i = 0; i < 4; ++i) {
+    v[i] = is_ox ? clamp01(pv[i] * gains[gx] * 256.0f) : clamp01(pv[i] * gains[gx]);
+  }
+}
+
+template <>
+inline void load_row(const float *even, const float *odd, const float *gains, int gx, bool is_ox, f4 v[4]) {
+  f4 pv[4], gain;
+  memcpy(&pv[0], odd + gx - 1, sizeof(f4));
+  memcpy(&pv[1], even + gx, sizeof(f4));
+  memcpy(&pv[2], odd + gx, sizeof(f4));
+  memcpy(&pv[3], even + gx + 1, sizeof(f4));
+  memcpy(&gain, gains + gx, sizeof(f4));
+  for (int i = 0; i < 4; ++i) {
+    v[i] = is_ox ? clamp01(pv[i] * gain * 256.0f) : clamp01(pv[i] * gain);
+  }
+}
+
+template <typename F, typename I>
+static inline void debayer_blocks(const float *const even[4], const float *const odd[4], const float *gains, int gx, bool is_ox,
+                                  uint8_t *y0, uint8_t *y1, uint8_t *uv) {
+  F v[4][4];
+  for (int r = 0; r < 4; ++r) load_row(even[r], odd[r], gains, gx, is_ox, v[r]);
+  I y[4], c[2];
+  debayer_block(v[0], v[1], v[2], v[3], is_ox, y, c);
+  constexpr int n = sizeof(F) / sizeof(float);
+  for (int i = 0; i < n; ++i) {
+    const int x = (gx + i) * 2;
+    y0[x] = ((const int32_t *)&y[0])[i];
+    y0[x + 1] = ((const int32_t *)&y[1])[i];
+    y1[x] = ((const int32_t *)&y[2])[i];
+    y1[x + 1] = ((const int32_t *)&y[3])[i];
+    uv[x] = ((const int32_t *)&c[0])[i];
+    uv[x + 1] = ((const int32_t *)&c[1])[i];
+  }
+}
+
+// the float of every pixel before the gain, with a column of the edge repeated
+// on the sides for the first and the last block
+void CpuDebayer::decode_row(const uint8_t *raw, int row, float *even, float *odd) const {
+  const uint8_t *p = raw + (row + frame_offset) * frame_stride;
+  const int n = width / 2;
+  for (int i = 0; i < n; ++i, p += 3) {
+    const uint32_t parsed[2] = {((uint32_t)p[0] << 4) + (p[2] & 0xF), ((uint32_t)p[1] << 4) + (p[2] >> 4)};
+    if (is_ox) {
+      even[i] = lut[parsed[0]];
+      odd[i] = lut[parsed[1]];
+    } else {
+      // normalize and scale
+      even[i] = ((float)parsed[0] - 168.0f) / (4096.0f - 168.0f);
+      odd[i] = ((float)parsed[1] - 168.0f) / (4096.0f - 168.0f);
+    }
+  }
+  odd[-1] = odd[0];
+  even[n] = even[n - 1];
+}
+
+std::vector<float> read_ox03c10_lut(const char *kernel_file) {
+  const std::string src = util::read_file(kernel_file);
+  size_t pos = src.find("ox03c10_lut[]");
+  assert(pos != std::string::npos);
+  const char *p = src.c_str() + src.find('{', pos) + 1;
+  std::vector<float> lut;
+  while (true) {
+    char *end;
+    const float v = strtof(p, &end);
+    if (end == p) break;
+    lut.push_back(v);
+    p = end;
+    while (*p == ',' || isspace(*p)) ++p;
+  }
+  return lut;
+}
+
+CpuDebayer::CpuDebayer(int width, int height, int frame_stride, int frame_offset, int yuv_stride, int uv_offset,
+                       bool is_ox, bool vignetting, int num_threads, const char *kernel_file)
+  : width(width), height(height), frame_stride(frame_stride), frame_offset(frame_offset), yuv_stride(yuv_stride),
+    uv_offset(uv_offset), is_ox(is_ox), vignetting(vignetting) {
+  assert(width % 2 == 0 && height % 2 == 0 && width >= 4);
+  if (is_ox) {
+    lut = read_ox03c10_lut(kernel_file);
+    assert(lut.size() == 4096);
+  }
+  if (num_threads <= 0) num_threads = std::clamp((int)std::thread::hardware_concurrency() / 2, 1, 4);
+  for (int i = 1; i < num_threads; ++i) {
+    workers.emplace_back(&CpuDebayer::worker_thread, this);
+  }
+  LOGD("cpu debayer %dx%d on %d threads", width, height, num_threads);
+}
+
+CpuDebayer::~CpuDebayer() {
+  {
+    std::lock_guard lk(lock);
+    exit = true;
+  }
+  cv.notify_all();
+  for (auto &t : workers) t.join();
+}
+
+void CpuDebayer::process_rows(const uint8_t *raw, uint8_t *yuv, int gy_start, int gy_end, bool vectorized, Scratch *s) {
+  const int n = width / 2;
+  // 4 rows of the even and the odd pixels, with room for the repeated edges
+  const int row_size = n + 2;
+  s->rows.resize(row_size * 8);
+  s->gains.resize(n + 4, 1.0f);
+  const float *even[4], *odd[4];
+
+  for (int gy = gy_start; gy < gy_end; ++gy) {
+    const int rows[4] = {gy == 0 ? 1 : gy * 2 - 1, gy * 2, gy * 2 + 1, gy == height / 2 - 1 ? gy * 2 : gy * 2 + 2};
+    for (int r = 0; r < 4; ++r) {
+      float *e = s->rows.data() + r * 2 * row_size, *o = e + row_size + 1;
+      decode_row(raw, rows[r], e, o);
+      even[r] = e;
+      odd[r] = o;
+    }
+    // correct vignetting
+    if (vignetting) {
+      for (int gx = 0; gx < n; ++gx) {
+        const int x = gx * 2 - width / 2, y = gy * 2 - height / 2;
+        s->gains[gx] = get_vignetting_s(x * x + y * y);
+      }
+    }
+
+    uint8_t *y0 = yuv + gy * 2 * yuv_stride, *y1 = y0 + yuv_stride, *uv = yuv + uv_offset + gy * yuv_stride;
+    int gx = 0;
+    if (vectorized) {
+      for (; gx + 4 <= n; gx += 4) {
+        debayer_blocks<f4, i4>(even, odd, s->gains.data(), gx, is_ox, y0, y1, uv);
+      }
+    }
+    for (; gx < n; ++gx) {
+      debayer_blocks<float, int>(even, odd, s->gains.data(), gx, is_ox, y0, y1, uv);
+    }
+  }
+}
+
+void CpuDebayer::process_bands(Scratch *s) {
+  const int bands = (height / 2 + BAND_ROWS - 1) / BAND_ROWS;
+  while (true) {
+    int band;
+    {
+      std::lock_guard lk(lock);
+      if (next_band >= bands) break;
+      band = next_band++;
+    }
+    process_rows(job_raw, job_yuv, band * BAND_ROWS, std::min((band + 1) * BAND_ROWS, height / 2), true, s);
+  }
+}
+
+void CpuDebayer::worker_thread() {
+  util::set_thread_name("camerad_debayer");
+  Scratch s;
+  int seen = 0;
+  while (true) {
+    {
+      std::unique_lock lk(lock);
+      cv.wait(lk, [&] { return exit || generation != seen; });
+      if (exit) return;
+      seen = generation;
+    }
+    process_bands(&s);
+    {
+      std::lock_guard lk(lock);
+      if (--busy == 0) done_cv.notify_one();
+    }
+  }
+}
+
+void CpuDebayer::run(const uint8_t *raw, uint8_t *yuv) {
+  {
+    std::lock_guard lk(lock);
+    job_raw = raw;
+    job_yuv = yuv;
+    next_band = 0;
+    busy = workers.size();
+    generation++;
+  }
+  cv.notify_all();
+  process_bands(&scratch);
+
+  std::unique_lock lk(lock);
+  done_cv.wait(lk, [&] { return busy == 0; });
+}
+
+void CpuDebayer::run_reference(const uint8_t *raw, uint8_t *yuv) {
+  process_rows(raw, yuv, 0, height / 2, false, &scratch);
+}
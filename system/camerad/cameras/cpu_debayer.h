@@ -0,0 +1,50 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// the PWL table of the OX03C10 from the kernel source
+std::vector<float> read_ox03c10_lut(const char *kernel_file);
+
+// debayer10 from real_debayer.cl on the CPU, for running camerad's processing
+// without a GPU. The float math follows the kernel operation by operation;
+// 4 blocks are computed at once in SSE/NEON registers, and the rows are
+// split between threads.
+class CpuDebayer {
+public:
+  CpuDebayer(int width, int height, int frame_stride, int frame_offset, int yuv_stride, int uv_offset,
+             bool is_ox, bool vignetting, int num_threads = 0, const char *kernel_file = "cameras/real_debayer.cl");
+  ~CpuDebayer();
+
+  // raw: the frame as read out of the sensor, yuv: the NV12 output
+  void run(const uint8_t *raw, uint8_t *yuv);
+  // the same, a block at a time on the calling thread
+  void run_reference(const uint8_t *raw, uint8_t *yuv);
+
+  const int width, height;
+
+private:
+  struct Scratch {
+    std::vector<float> rows, gains;
+  };
+  void process_rows(const uint8_t *raw, uint8_t *yuv, int gy_start, int gy_end, bool vectorized, Scratch *scratch);
+  void process_bands(Scratch *scratch);
+  void decode_row(const uint8_t *raw, int row, float *even, float *odd) const;
+  void worker_thread();
+
+  const int frame_stride, frame_offset, yuv_stride, uv_offset;
+  const bool is_ox, vignetting;
+  std::vector<float> lut;  // ox03c10_lut, read from the kernel source
+
+  std::vector<std::thread> workers;
+  Scratch scratch;
+  std::mutex lock;
+  std::condition_variable cv, done_cv;
+  const uint8_t *job_raw = nullptr;
+  uint8_t *job_yuv = nullptr;
+  int generation = 0, busy = 0, next_band = 0;
+  bool exit = false;
+};
@@ -0,0 +1,183 @@
+#include "system/camerad/cameras/exposure_stats.h"
+
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Consecutive pixels are counted in different sub-histograms, so that a run
+// of equal pixels doesn't wait on the increment of the previous one.
+struct SubHistograms {
+  uint32_t h[4][256];
+
+  void clear() { memset(h, 0, sizeof(h)); }
+  inline void add4(const uint8_t *p) {
+    h[0][p[0]]++;
+    h[1][p[1]]++;
+    h[2][p[2]]++;
+    h[3][p[3]]++;
+  }
+  void merge(uint32_t *hist) const {
+    for (int i = 0; i < 256; ++i) hist[i] += h[0][i] + h[1][i] + h[2][i] + h[3][i];
+  }
+};
+
+#if defined(__x86_64__)
+static const bool cpu_avx2 = __builtin_cpu_supports("avx2");
+
+// 32 pixels at a time, the pixels are gathered from every other byte for a skip of 2
+__attribute__((target("avx2"))) static int histogram_row_avx2(const uint8_t *row, int n, int x_skip, SubHistograms *sub) {
+  alignas(32) uint8_t px[32];
+  int i = 0;
+  if (x_skip == 1) {
+    for (; i + 32 <= n; i += 32) {
+      _mm256_store_si256((__m256i *)px, _mm256_loadu_si256((const __m256i *)(row + i)));
+      for (int j = 0; j < 32; j += 4) sub->add4(px + j);
+    }
+  } else if (x_skip == 2) {
+    const __m256i even = _mm256_set1_epi16(0xff);
+    for (; i + 32 <= n; i += 32) {
+      __m256i a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(row + i * 2)), even);
+      __m256i b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(row + i * 2 + 32)), even);
+      _mm256_store_si256((__m256i *)px, _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+      for (int j = 0; j < 32; j += 4) sub->add4(px + j);
+    }
+  }
+  return i;
+}
+#elif defined(__aarch64__)
+static int histogram_row_neon(const uint8_t *row, int n, int x_skip, SubHistograms *sub) {
+  alignas(16) uint8_t px[16];
+  int i = 0;
+  if (x_skip == 1) {
+    for (; i + 16 <= n; i += 16) {
+      vst1q_u8(px, vld1q_u8(row + i));
+      for (int j = 0; j < 16; j += 4) sub->add4(px + j);
+    }
+  } else if (x_skip == 2) {
+    for (; i + 16 <= n; i += 16) {
+      vst1q_u8(px, vld2q_u8(row + i * 2).val[0]);
+      for (int j = 0; j < 16; j += 4) sub->add4(px + j);
+    }
+  }
+  return i;
+}
+#endif
+
+// n pixels of a row, starting at row[0] and x_skip apart
+static void histogram_row(const uint8_t *row, int n, int x_skip, SubHistograms *sub) {
+  int i = 0;
+#if defined(__x86_64__)
+  // the vector loads end at the last pixel, so they stay within the row
+  if (cpu_avx2) i = histogram_row_avx2(row, n - 1, x_skip, sub);
+#elif defined(__aarch64__)
+  i = histogram_row_neon(row, n - 1, x_skip, sub);
+#endif
+  uint8_t px[4];
+  for (; i + 4 <= n; i += 4) {
+    px[0] = row[i * x_skip];
+    px[1] = row[(i + 1) * x_skip];
+    px[2] = row[(i + 2) * x_skip];
+    px[3] = row[(i + 3) * x_skip];
+    sub->add4(px);
+  }
+  for (; i < n; ++i) {
+    sub->h[0][row[i * x_skip]]++;
+  }
+}
+
+static int sample_count(int start, int end, int skip) {
+  return end > start ? (end - start + skip - 1) / skip : 0;
+}
+
+void luma_histogram(const uint8_t *y, int stride, int x_start, int x_end, int x_skip, int y_start, int y_end, int y_skip, uint32_t hist[256]) {
+  assert(x_skip > 0 && y_skip > 0);
+  SubHistograms sub;
+  sub.clear();
+  const int n = sample_count(x_start, x_end, x_skip);
+  if (n > 0) {
+    for (int r = y_start; r < y_end; r += y_skip) {
+      histogram_row(y + r * stride + x_start, n, x_skip, &sub);
+    }
+  }
+  sub.merge(hist);
+}
+
+float histogram_median(const uint32_t hist[256]) {
+  uint32_t total = 0;
+  for (int i = 0; i < 256; ++i) total += hist[i];
+
+  int lum_med;
+  uint32_t lum_cur = 0;
+  for (lum_med = 255; lum_med >= 0; lum_med--) {
+    lum_cur += hist[lum_med];
+    if (lum_cur >= total / 2) {
+      break;
+    }
+  }
+  return lum_med / 256.0;
+}
+
+ExposureStats::ExposureStats(const std::vector<ExposureWindow> &windows, int x_skip, int y_skip, int row_phases)
+  : windows(windows), x_skip(x_skip), y_skip(y_skip), row_phases(row_phases) {
+  assert(x_skip > 0 && y_skip > 0 && row_phases > 0);
+  phase_hists.assign(windows.size() * row_phases, std::vector<uint32_t>(256));
+  totals.assign(windows.size(), std::vector<uint32_t>(256));
+}
+
+void ExposureStats::update(const uint8_t *y, int stride) {
+  int y_min = INT32_MAX, y_max = 0;
+  for (const auto &w : windows) {
+    y_min = std::min(y_min, w.y_start);
+    y_max = std::max(y_max, w.y_end);
+  }
+
+  std::vector<SubHistograms> subs(windows.size());
+  for (auto &sub : subs) sub.clear();
+  const int row_step = y_skip * row_phases;
+  // every row once, for all the windows it's sampled in
+  for (int r = y_min; r < y_max; ++r) {
+    const uint8_t *row = y + r * stride;
+    for (int i = 0; i < windows.size(); ++i) {
+      const ExposureWindow &w = windows[i];
+      if (r < w.y_start || r >= w.y_end || (r - w.y_start) % row_step != phase * y_skip) continue;
+      const int n = sample_count(w.x_start, w.x_end, x_skip);
+      if (n > 0) histogram_row(row + w.x_start, n, x_skip, &subs[i]);
+    }
+  }
+
+  // replace this phase's rows in the totals
+  for (int i = 0; i < windows.size(); ++i) {
+    std::vector<uint32_t> &hist = phase_hists[i * row_phases + phase];
+    std::vector<uint32_t> &total = totals[i];
+    for (int v = 0; v < 256; ++v) total[v] -= hist[v];
+    std::fill(hist.begin(), hist.end(), 0);
+    subs[i].merge(hist.data());
+    for (int v = 0; v < 256; ++v) total[v] += hist[v];
+  }
+  phase = (phase + 1) % row_phases;
+}
+
+float ExposureStats::weighted_median() const {
+  double combined[256] = {}, total = 0;
+  for (int i = 0; i < windows.size(); ++i) {
+    for (int v = 0; v < 256; ++v) combined[v] += totals[i][v] * (double)windows[i].weight;
+  }
+  for (int v = 0; v < 256; ++v) total += combined[v];
+
+  int lum_med;
+  double lum_cur = 0;
+  for (lum_med = 255; lum_med >= 0; lum_med--) {
+    lum_cur += combined[lum_med];
+    if (lum_cur >= total / 2) {
+      break;
+    }
+  }
+  return lum_med / 256.0;
+}
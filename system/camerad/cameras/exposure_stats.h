@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Adds the pixels of a rectangle, sampled every x_skip columns and y_skip
+// rows, to a 256 bin histogram.
+void luma_histogram(const uint8_t *y, int stride, int x_start, int x_end, int x_skip, int y_start, int y_end, int y_skip, uint32_t hist[256]);
+
+// the median of a histogram as a fraction of the range, like set_exposure_target
+float histogram_median(const uint32_t hist[256]);
+
+struct ExposureWindow {
+  int x_start, x_end, y_start, y_end;
+  float weight;  // per pixel, in the combined histogram
+};
+
+// Histograms of several windows of the luma, from one pass over the rows.
+// With row_phases > 1 only every row_phases'th sampled row is read per
+// frame, with the rows rotating between frames, and the histograms are
+// those of the last row_phases frames together.
+class ExposureStats {
+public:
+  ExposureStats(const std::vector<ExposureWindow> &windows, int x_skip, int y_skip, int row_phases = 1);
+  void update(const uint8_t *y, int stride);
+
+  const uint32_t *histogram(int window) const { return totals[window].data(); }
+  float median(int window) const { return histogram_median(histogram(window)); }
+  // the median of all windows, each pixel counting as its window's weight
+  float weighted_median() const;
+
+  const std::vector<ExposureWindow> windows;
+  const int x_skip, y_skip, row_phases;
+
+private:
+  int phase = 0;
+  std::vector<std::vector<uint32_t>> phase_hists;  // [window * row_phases + phase][256]
+  std::vector<std::vector<uint32_t>> totals;       // [window][256]
+};
@@ -0,0 +1,170 @@
+#include "system/camerad/cameras/jpeg_encoder.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// out[i] = src[i * 4 + 1] for 16 bit words, 8 at a time. That's the 2x2 block
+// (or the UV pair) the thumbnail keeps of every 4 pixels at a downscale of 4.
+#if defined(__x86_64__)
+static inline __m128i gather_words(const uint16_t *src) {
+  const __m128i mask = _mm_set_epi32(0, 0xffff, 0, 0xffff);
+  const __m128i bias = _mm_set1_epi32(0x8000);
+  __m128i w[4];
+  for (int i = 0; i < 4; ++i) {
+    // the second word of every 64 bits
+    w[i] = _mm_and_si128(_mm_srli_epi64(_mm_loadu_si128((const __m128i *)(src + i * 8)), 16), mask);
+  }
+  __m128i lo = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(w[0]), _mm_castsi128_ps(w[1]), _MM_SHUFFLE(2, 0, 2, 0)));
+  __m128i hi = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(w[2]), _mm_castsi128_ps(w[3]), _MM_SHUFFLE(2, 0, 2, 0)));
+  // SSE2 has no unsigned pack to 16 bits, pack the words minus 0x8000 and add it back
+  __m128i packed = _mm_packs_epi32(_mm_sub_epi32(lo, bias), _mm_sub_epi32(hi, bias));
+  return _mm_xor_si128(packed, _mm_set1_epi16((short)0x8000));
+}
+#endif
+
+static void sample_y_row(const uint16_t *src, uint16_t *dst, int n, int downscale) {
+  int i = 0;
+  if (downscale == 4) {
+#if defined(__x86_64__)
+    for (; i + 8 <= n; i += 8) {
+      _mm_storeu_si128((__m128i *)(dst + i), gather_words(src + i * 4));
+    }
+#elif defined(__aarch64__)
+    for (; i + 8 <= n; i += 8) {
+      vst1q_u16(dst + i, vld4q_u16(src + i * 4).val[1]);
+    }
+#endif
+  }
+  for (; i < n; ++i) {
+    dst[i] = src[i * downscale + (downscale - 1) / 2];
+  }
+}
+
+// the same samples as the luma, deinterleaved to U and V
+static void sample_uv_row(const uint16_t *src, uint8_t *dst_u, uint8_t *dst_v, int n, int downscale) {
+  int i = 0;
+  if (downscale == 4) {
+#if defined(__x86_64__)
+    const __m128i low_bytes = _mm_set1_epi16(0xff);
+    for (; i + 16 <= n; i += 16) {
+      __m128i a = gather_words(src + i * 4), b = gather_words(src + i * 4 + 32);
+      _mm_storeu_si128((__m128i *)(dst_u + i), _mm_packus_epi16(_mm_and_si128(a, low_bytes), _mm_and_si128(b, low_bytes)));
+      _mm_storeu_si128((__m128i *)(dst_v + i), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+#elif defined(__aarch64__)
+    for (; i + 8 <= n; i += 8) {
+      uint16x8_t w = vld4q_u16(src + i * 4).val[1];
+      vst1_u8(dst_u + i, vmovn_u16(w));
+      vst1_u8(dst_v + i, vshrn_n_u16(w, 8));
+    }
+#endif
+  }
+  for (; i < n; ++i) {
+    const uint16_t w = src[i * downscale + (downscale - 1) / 2];
+    dst_u[i] = w & 0xff;
+    dst_v[i] = w >> 8;
+  }
+}
+
+JpegEncoder::JpegEncoder(int width, int height, int downscale, int quality)
+  : width(width), height(height), downscale(downscale), out_width(width / downscale), out_height(height / downscale) {
+  assert(out_width % 2 == 0 && out_height % 2 == 0);
+  // the rows are padded to whole 16x16 MCUs
+  band_stride = (out_width + 15) & ~15;
+  band_y.resize(band_stride * 16);
+  band_u.resize(band_stride / 2 * 8);
+  band_v.resize(band_stride / 2 * 8);
+  for (int i = 0; i < 16; ++i) rows_y[i] = band_y.data() + i * band_stride;
+  for (int i = 0; i < 8; ++i) {
+    rows_u[i] = band_u.data() + i * band_stride / 2;
+    rows_v[i] = band_v.data() + i * band_stride / 2;
+  }
+
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+  cinfo.client_data = this;
+  dest.init_destination = init_destination;
+  dest.empty_output_buffer = empty_output_buffer;
+  dest.term_destination = term_destination;
+  cinfo.dest = &dest;
+
+  cinfo.image_width = out_width;
+  cinfo.image_height = out_height;
+  cinfo.input_components = 3;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_colorspace(&cinfo, JCS_YCbCr);
+  // configure sampling factors for yuv420.
+  cinfo.comp_info[0].h_samp_factor = 2;  // Y
+  cinfo.comp_info[0].v_samp_factor = 2;
+  cinfo.comp_info[1].h_samp_factor = 1;  // U
+  cinfo.comp_info[1].v_samp_factor = 1;
+  cinfo.comp_info[2].h_samp_factor = 1;  // V
+  cinfo.comp_info[2].v_samp_factor = 1;
+  cinfo.raw_data_in = TRUE;
+  jpeg_set_quality(&cinfo, quality, TRUE);
+}
+
+JpegEncoder::~JpegEncoder() {
+  jpeg_destroy_compress(&cinfo);
+}
+
+void JpegEncoder::sample_band(const uint8_t *y, const uint8_t *uv, int stride, int line) {
+  const int n = out_width / 2;
+  for (int i = 0; i < 16; ++i) {
+    // the rows past the bottom repeat the last one
+    const int r = std::min(line + i, out_height - 1);
+    const int src_row = ((r / 2) * downscale + (downscale - 1) / 2) * 2 + r % 2;
+    uint8_t *dst = rows_y[i];
+    sample_y_row((const uint16_t *)(y + src_row * stride), (uint16_t *)dst, n, downscale);
+    std::fill(dst + out_width, dst + band_stride, dst[out_width - 1]);
+  }
+  for (int i = 0; i < 8; ++i) {
+    const int r = std::min(line / 2 + i, out_height / 2 - 1);
+    const int src_row = r * downscale + (downscale - 1) / 2;
+    uint8_t *u = rows_u[i], *v = rows_v[i];
+    sample_uv_row((const uint16_t *)(uv + src_row * stride), u, v, n, downscale);
+    std::fill(u + n, u + band_stride / 2, u[n - 1]);
+    std::fill(v + n, v + band_stride / 2, v[n - 1]);
+  }
+}
+
+const std::vector<uint8_t> &JpegEncoder::encode(const uint8_t *y, const uint8_t *uv, int stride) {
+  assert(stride % 2 == 0);
+  jpeg_start_compress(&cinfo, TRUE);
+  JSAMPARRAY planes[3] = {rows_y, rows_u, rows_v};
+  for (int line = 0; line < out_height; line += 16) {
+    sample_band(y, uv, stride, line);
+    jpeg_write_raw_data(&cinfo, planes, 16);
+  }
+  jpeg_finish_compress(&cinfo);
+  return out;
+}
+
+// the output grows to the largest JPEG so far, and is reused after that
+void JpegEncoder::init_destination(j_compress_ptr cinfo) {
+  JpegEncoder *e = (JpegEncoder *)cinfo->client_data;
+  e->out.resize(std::max<size_t>(e->out.capacity(), 64 * 1024));
+  cinfo->dest->next_output_byte = e->out.data();
+  cinfo->dest->free_in_buffer = e->out.size();
+}
+
+boolean JpegEncoder::empty_output_buffer(j_compress_ptr cinfo) {
+  JpegEncoder *e = (JpegEncoder *)cinfo->client_data;
+  const size_t size = e->out.size();
+  e->out.resize(size * 2);
+  cinfo->dest->next_output_byte = e->out.data() + size;
+  cinfo->dest->free_in_buffer = size;
+  return TRUE;
+}
+
+void JpegEncoder::term_destination(j_compress_ptr cinfo) {
+  JpegEncoder *e = (JpegEncoder *)cinfo->client_data;
+  e->out.resize(e->out.size() - cinfo->dest->free_in_buffer);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include <jpeglib.h>
+
+// Encodes NV12 frames to downscaled JPEGs, keeping one 2x2 block of every
+// downscale x downscale pixels. The frame is sampled a band of 16 rows at a
+// time into raw YUV420 rows that go straight to libjpeg, and the compression
+// state and the output buffer are kept between frames.
+class JpegEncoder {
+public:
+  JpegEncoder(int width, int height, int downscale, int quality = 50);
+  ~JpegEncoder();
+  // the JPEG is valid until the next call
+  const std::vector<uint8_t> &encode(const uint8_t *y, const uint8_t *uv, int stride);
+
+  const int width, height, downscale;
+  const int out_width, out_height;
+
+private:
+  void sample_band(const uint8_t *y, const uint8_t *uv, int stride, int line);
+
+  static void init_destination(j_compress_ptr cinfo);
+  static boolean empty_output_buffer(j_compress_ptr cinfo);
+  static void term_destination(j_compress_ptr cinfo);
+
+  jpeg_compress_struct cinfo = {};
+  jpeg_error_mgr jerr = {};
+  jpeg_destination_mgr dest = {};
+  std::vector<uint8_t> out;
+
+  // a band of 16 rows, padded to whole blocks
+  int band_stride;
+  std::vector<uint8_t> band_y, band_u, band_v;
+  JSAMPROW rows_y[16], rows_u[8], rows_v[8];
+};
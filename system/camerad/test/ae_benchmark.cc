@@ -0,0 +1,79 @@
+// benchmark of the exposure histograms, on a synthetic 1928x1208 frame with the road and driver camera windows
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "common/timing.h"
+#include "system/camerad/cameras/exposure_stats.h"
+
+#define W 1928
+#define H 1208
+#define STRIDE 2048
+
+struct Rect {
+  const char *name;
+  int x_start, x_end, x_skip, y_start, y_end, y_skip;
+};
+
+// before: the pixel by pixel loop of set_exposure_target
+static void histogram_before(const uint8_t *y, const Rect &r, uint32_t hist[256]) {
+  for (int row = r.y_start; row < r.y_end; row += r.y_skip) {
+    for (int col = r.x_start; col < r.x_end; col += r.x_skip) {
+      hist[y[row * STRIDE + col]]++;
+    }
+  }
+}
+
+static void report(const char *name, std::vector<double> &ms, float median) {
+  std::sort(ms.begin(), ms.end());
+  printf("  %-24s median %.4f: p50 %.3f ms, p99 %.3f ms\n",
+         name, median, ms[ms.size() / 2], ms[std::min(ms.size() - 1, ms.size() * 99 / 100)]);
+}
+
+template <typename F>
+static void run(const char *name, int iterations, F f) {
+  std::vector<double> ms;
+  float median = 0;
+  for (int i = 0; i < iterations; ++i) {
+    const double start = millis_since_boot();
+    median = f();
+    ms.push_back(millis_since_boot() - start);
+  }
+  report(name, ms, median);
+}
+
+int main(int argc, char **argv) {
+  const int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+
+  std::vector<uint8_t> frame(STRIDE * H);
+  std::mt19937 gen(0);
+  for (int r = 0; r < H; ++r) {
+    for (int c = 0; c < W; ++c) frame[r * STRIDE + c] = ((r + c) / 8 + gen() % 32) & 0xff;
+  }
+  const uint8_t *y = frame.data();
+
+  printf("%dx%d, %d iterations\n", W, H, iterations);
+  for (const Rect &r : {Rect{"road", 96, 1734, 2, 160, 986, 2}, Rect{"driver", 96, 1832, 2, 242, 1148, 4}}) {
+    printf("%s: x %d-%d/%d y %d-%d/%d\n", r.name, r.x_start, r.x_end, r.x_skip, r.y_start, r.y_end, r.y_skip);
+    run("before", iterations, [&]() {
+      uint32_t hist[256] = {};
+      histogram_before(y, r, hist);
+      return histogram_median(hist);
+    });
+    run("luma_histogram", iterations, [&]() {
+      uint32_t hist[256] = {};
+      luma_histogram(y, STRIDE, r.x_start, r.x_end, r.x_skip, r.y_start, r.y_end, r.y_skip, hist);
+      return histogram_median(hist);
+    });
+    ExposureStats stats({{r.x_start, r.x_end, r.y_start, r.y_end, 1.0}}, r.x_skip, r.y_skip, 2);
+    run("ExposureStats 2 phases", iterations, [&]() {
+      stats.update(y, STRIDE);
+      return stats.weighted_median();
+    });
+  }
+  return 0;
+}
@@ -6,9 +6,87 @@
 
 #include <cmath>
 #include <cstring>
+#include <random>
+#include <tuple>
+#include <vector>
 
 #include "common/util.h"
 #include "system/camerad/cameras/camera_common.h"
+#include "system/camerad/cameras/exposure_stats.h"
+
+// the pixel by pixel histogram set_exposure_target used to build
+void reference_histogram(const uint8_t *y, int stride, int x_start, int x_end, int x_skip, int y_start, int y_end, int y_skip, uint32_t hist[256]) {
+  for (int r = y_start; r < y_end; r += y_skip) {
+    for (int c = x_start; c < x_end; c += x_skip) {
+      hist[y[r * stride + c]]++;
+    }
+  }
+}
+
+// the vectorized histograms match the reference exactly
+bool test_histograms(uint8_t *fb_y) {
+  std::mt19937 gen(0);
+  // noise with runs of equal pixels
+  for (int i = 0; i < W * H; ++i) fb_y[i] = (i / 7) % 3 == 0 ? 128 : gen() % 256;
+
+  bool passed = true;
+  int cnt = 0;
+  for (int x_skip = 1; x_skip <= 4; ++x_skip) {
+    for (int y_skip = 1; y_skip <= 3; ++y_skip) {
+      for (auto [x_start, x_end, y_start, y_end] : {std::tuple(0, W, 0, H), std::tuple(0, W - 1, 0, H - 1), std::tuple(3, 200, 5, 150),
+                                                     std::tuple(17, 18, 0, H), std::tuple(100, 100, 0, H), std::tuple(1, 66, 1, 2)}) {
+        uint32_t expected[256] = {}, hist[256] = {};
+        reference_histogram(fb_y, W, x_start, x_end, x_skip, y_start, y_end, y_skip, expected);
+        luma_histogram(fb_y, W, x_start, x_end, x_skip, y_start, y_end, y_skip, hist);
+        if (memcmp(expected, hist, sizeof(hist)) != 0) {
+          printf("histogram mismatch: x %d-%d/%d y %d-%d/%d\n", x_start, x_end, x_skip, y_start, y_end, y_skip);
+          passed = false;
+        }
+        cnt++;
+      }
+    }
+  }
+
+  // one window in one phase is the same histogram
+  const std::vector<ExposureWindow> windows = {{0, W - 1, 0, H - 1, 1.0}, {40, 200, 20, 140, 4.0}, {10, 30, 100, 160, 0.5}};
+  ExposureStats stats(windows, 2, 2);
+  stats.update(fb_y, W);
+  for (int i = 0; i < windows.size(); ++i) {
+    const ExposureWindow &w = windows[i];
+    uint32_t expected[256] = {};
+    reference_histogram(fb_y, W, w.x_start, w.x_end, 2, w.y_start, w.y_end, 2, expected);
+    if (memcmp(expected, stats.histogram(i), sizeof(expected)) != 0) {
+      printf("window %d histogram mismatch\n", i);
+      passed = false;
+    }
+  }
+
+  // over 3 frames the rows of the phases add up to the full histogram, and stay that way
+  ExposureStats rolling(windows, 2, 2, 3);
+  for (int frame = 0; frame < 7; ++frame) {
+    rolling.update(fb_y, W);
+    if (frame < 2) continue;
+    for (int i = 0; i < windows.size(); ++i) {
+      if (memcmp(stats.histogram(i), rolling.histogram(i), 256 * sizeof(uint32_t)) != 0) {
+        printf("rolling window %d histogram mismatch after %d frames\n", i, frame + 1);
+        passed = false;
+      }
+    }
+  }
+
+  // the weights: a bright window with a large weight pulls the median up
+  memset(fb_y, 20, W * H);
+  for (int r = 20; r < 100; ++r) memset(fb_y + r * W + 40, 200, 160);
+  ExposureStats weighted(windows, 2, 2);
+  weighted.update(fb_y, W);
+  if (weighted.median(0) != 20 / 256.0 || weighted.weighted_median() != 200 / 256.0) {
+    printf("weighted median %f, median of the full frame %f\n", weighted.weighted_median(), weighted.median(0));
+    passed = false;
+  }
+
+  printf("%d histograms bit exact: %s\n", cnt, passed ? "passed" : "failed");
+  return passed;
+}
 
 int main() {
   // set up fake camerabuf
@@ -62,6 +140,8 @@ int main() {
   }
   assert(passed);
 
+  assert(test_histograms(fb_y));
+
   delete[] fb_y;
   return 0;
 }
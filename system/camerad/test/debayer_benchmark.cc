@@ -0,0 +1,118 @@
+// benchmark of camerad's processing path on the CPU, on frames replayed from a file or
+// synthesized: the frames are queued on a road camera's CameraBuf and acquired, which
+// debayers them and sends them on VisionIPC, then exposure and thumbnail run on the output
+// usage: CPU_DEBAYER=1 debayer_benchmark [--ox] [--frames N] [raw frames]
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "common/timing.h"
+#include "system/camerad/cameras/camera_qcom2.h"
+#include "system/camerad/cameras/cpu_debayer.h"
+#include "system/camerad/cameras/exposure_stats.h"
+#include "system/camerad/cameras/jpeg_encoder.h"
+#include "system/camerad/test/fake_sensor.h"
+
+#define W 1928
+#define H 1208
+#define FRAME_STRIDE 2896
+#define YUV_STRIDE 2048
+#define UV_OFFSET (YUV_STRIDE * 1216)
+
+static void report(const char *name, std::vector<double> &ms) {
+  std::sort(ms.begin(), ms.end());
+  printf("  %-20s p50 %7.3f ms, p99 %7.3f ms, max %7.3f ms\n",
+         name, ms[ms.size() / 2], ms[std::min(ms.size() - 1, ms.size() * 99 / 100)], ms.back());
+}
+
+int main(int argc, char **argv) {
+  bool is_ox = false;
+  int frames = 200;
+  std::string fn;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--ox") == 0) {
+      is_ox = true;
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frames = atoi(argv[++i]);
+    } else {
+      fn = argv[i];
+    }
+  }
+  if (!env_cpu_debayer) {
+    printf("CameraBuf only debayers on the CPU with CPU_DEBAYER=1\n");
+    return 1;
+  }
+
+  // the AR0231 has 2 rows of registers on top and 10 of stats at the bottom, the OX03C10 2 and 14
+  const int offset = 2, extra_height = is_ox ? 16 : 12;
+  FakeSensor sensor(W, H, FRAME_STRIDE, offset, extra_height);
+  if (fn.empty()) {
+    sensor.synthesize(8);
+  } else if (!sensor.load(fn)) {
+    printf("%s isn't a multiple of %zu byte frames\n", fn.c_str(), sensor.frame_size());
+    return 1;
+  }
+
+  // the road camera, without an OpenCL device
+  VisionIpcServer vipc_server("debayer_benchmark");
+  CameraState road_cam;
+  road_cam.camera_id = is_ox ? CAMERA_ID_OX03C10 : CAMERA_ID_AR0231;
+  road_cam.camera_num = 1;
+  road_cam.ci = {.frame_width = W, .frame_height = H, .frame_stride = FRAME_STRIDE,
+                 .frame_offset = offset, .extra_height = (uint32_t)extra_height};
+  road_cam.buf.init(nullptr, nullptr, &road_cam, &vipc_server, FRAME_BUF_COUNT, VISION_STREAM_ROAD);
+
+  CpuDebayer reference(W, H, FRAME_STRIDE, offset, YUV_STRIDE, UV_OFFSET, is_ox, true, 1);
+  JpegEncoder jpeg(W, H, 4);
+  ExposureStats exposure({{96, 96 + 1734, 160, 160 + 986, 1.0}}, 2, 2);
+  std::vector<uint8_t> yuv(UV_OFFSET + YUV_STRIDE * H / 2);
+
+  printf("%s %dx%d, %d frames in the source, %d processed\n", is_ox ? "OX03C10" : "AR0231", W, H, sensor.frame_count(), frames);
+  std::vector<double> scalar_ms, debayer_ms, acquire_ms, exposure_ms, thumbnail_ms, total_ms;
+  for (int i = 0; i < std::min(frames, 20); ++i) {
+    const double start = millis_since_boot();
+    reference.run_reference(sensor.next(), yuv.data());
+    scalar_ms.push_back(millis_since_boot() - start);
+  }
+
+  float median = 0;
+  size_t thumbnail_size = 0;
+  for (int i = 0; i < frames; ++i) {
+    // the ISP writes the frame and handle_camera_event queues it, that's not timed
+    const int buf_idx = i % FRAME_BUF_COUNT;
+    memcpy(road_cam.buf.camera_bufs[buf_idx].addr, sensor.next(), sensor.frame_size());
+    road_cam.buf.camera_bufs_metadata[buf_idx] = {.frame_id = (uint32_t)i};
+    road_cam.buf.queue(buf_idx);
+
+    const double t0 = millis_since_boot();
+    if (!road_cam.buf.acquire()) {
+      printf("frame %d wasn't acquired\n", i);
+      return 1;
+    }
+    const double t1 = millis_since_boot();
+    const VisionBuf *b = road_cam.buf.cur_yuv_buf;
+    exposure.update(b->y, b->stride);
+    median = exposure.weighted_median();
+    const double t2 = millis_since_boot();
+    thumbnail_size = jpeg.encode(b->y, b->uv, b->stride).size();
+    const double t3 = millis_since_boot();
+    debayer_ms.push_back(road_cam.buf.cur_frame_data.processing_time * 1000.0);
+    acquire_ms.push_back(t1 - t0);
+    exposure_ms.push_back(t2 - t1);
+    thumbnail_ms.push_back(t3 - t2);
+    total_ms.push_back(t3 - t0);
+  }
+
+  report("debayer, scalar", scalar_ms);
+  report("debayer", debayer_ms);
+  report("acquire", acquire_ms);
+  report("exposure", exposure_ms);
+  report("thumbnail", thumbnail_ms);
+  report("total", total_ms);
+  printf("median luma %.3f, thumbnail %zu bytes, %.1f frames/s\n", median, thumbnail_size, 1000.0 / total_ms[total_ms.size() / 2]);
+  return 0;
+}
@@ -0,0 +1,231 @@
+// unittest for CpuDebayer, against a line by line port of debayer10 in real_debayer.cl
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "system/camerad/cameras/cpu_debayer.h"
+#include "system/camerad/test/fake_sensor.h"
+
+#define W 1928
+#define H 1208
+#define FRAME_STRIDE 2896
+#define FRAME_OFFSET 2
+#define EXTRA_HEIGHT 12
+#define YUV_STRIDE 2048
+#define UV_OFFSET (YUV_STRIDE * 1216)
+
+struct Config {
+  bool is_ox, vignetting;
+};
+
+// the kernel, with float3 and float4 spelled out
+struct float3_ {
+  float x, y, z;
+};
+
+static std::vector<float> ox03c10_lut;
+
+static float clampf(float v, float lo, float hi) { return std::fmin(std::fmax(v, lo), hi); }
+
+static uint8_t convert_uchar_sat(float v) {
+  if (!(v > 0)) return 0;
+  return v >= 255 ? 255 : (uint8_t)v;
+}
+
+static float color_correct_1(float x, bool is_ox) {
+  if (is_ox) {
+    return -0.507089f*expf(-12.54124638f*x)+0.9655f*powf(x,0.5f)-0.472597f*x+0.507089f;
+  }
+  // tone mapping params
+  const float gamma_k = 0.75;
+  const float gamma_b = 0.125;
+  const float mp = 0.01; // ideally midpoint should be adaptive
+  const float rk = 9 - 100*mp;
+
+  // poly approximation for s curve
+  return (x > mp) ?
+    ((rk * (x-mp) * (1-(gamma_k*mp+gamma_b)) * (1+1/(rk*(1-mp))) / (1+rk*(x-mp))) + gamma_k*mp + gamma_b) :
+    ((rk * (x-mp) * (gamma_k*mp+gamma_b) * (1+1/(rk*mp)) / (1-rk*(x-mp))) + gamma_k*mp + gamma_b);
+}
+
+static void color_correct(float3_ rgb, bool is_ox, uint8_t out[3]) {
+  rgb = {clampf(rgb.x, 0, 1), clampf(rgb.y, 0, 1), clampf(rgb.z, 0, 1)};
+  float3_ x;
+  if (is_ox) {
+    x = {rgb.x * 1.5664815f, rgb.x * -0.29808738f, rgb.x * -0.03973474f};
+    x = {x.x + rgb.y * -0.48672447f, x.y + rgb.y * 1.41914433f, x.z + rgb.y * -0.40295248f};
+    x = {x.x + rgb.z * -0.07975703f, x.y + rgb.z * -0.12105695f, x.z + rgb.z * 1.44268722f};
+  } else {
+    x = {rgb.x * 1.82717181f, rgb.x * -0.31231438f, rgb.x * 0.07307673f};
+    x = {x.x + rgb.y * -0.5743977f, x.y + rgb.y * 1.36858544f, x.z + rgb.y * -0.53183455f};
+    x = {x.x + rgb.z * -0.25277411f, x.y + rgb.z * -0.05627105f, x.z + rgb.z * 1.45875782f};
+  }
+  out[0] = convert_uchar_sat(color_correct_1(x.x, is_ox) * 255.0f);
+  out[1] = convert_uchar_sat(color_correct_1(x.y, is_ox) * 255.0f);
+  out[2] = convert_uchar_sat(color_correct_1(x.z, is_ox) * 255.0f);
+}
+
+static float get_vignetting_s(float r) {
+  if (r < 62500) {
+    return (1.0f + 0.0000008f*r);
+  } else if (r < 490000) {
+    return (0.9625f + 0.0000014f*r);
+  } else if (r < 1102500) {
+    return (1.26434f + 0.0000000000016f*r*r);
+  } else {
+    return (0.53503625f + 0.0000000000022f*r*r);
+  }
+}
+
+static void val4_from_12(const uint8_t *pvs, float gain, bool is_ox, float v[4]) {
+  const uint32_t parsed[4] = {((uint32_t)pvs[0]<<4) + (pvs[1]>>4),  // is from the previous 10 bit
+                              ((uint32_t)pvs[2]<<4) + (pvs[4]&0xF),
+                              ((uint32_t)pvs[3]<<4) + (pvs[4]>>4),
+                              ((uint32_t)pvs[5]<<4) + (pvs[7]&0xF)};
+  for (int i = 0; i < 4; ++i) {
+    if (is_ox) {
+      v[i] = clampf(ox03c10_lut[parsed[i]]*gain*256.0f, 0.0, 1.0);
+    } else {
+      float pv = ((float)parsed[i] - 168.0f) / (4096.0f - 168.0f);
+      v[i] = clampf(pv*gain, 0.0, 1.0);
+    }
+  }
+}
+
+static float get_k(float a, float b, float c, float d) {
+  return 2.0f - (std::fabs(a - b) + std::fabs(c - d));
+}
+
+static void debayer10(const uint8_t *in, uint8_t *out, int gid_x, int gid_y, Config cfg) {
+  const int y_top_mod = (gid_y == 0) ? 2: 0;
+  const int y_bot_mod = (gid_y == (H/2 - 1)) ? 1: 3;
+
+  float3_ rgb;
+  uint8_t rgb_out[4][3];
+
+  int start = (2 * gid_y - 1) * FRAME_STRIDE + (3 * gid_x - 2) + (FRAME_STRIDE * FRAME_OFFSET);
+
+  float gain = 1.0;
+  if (cfg.vignetting) {
+    int gx = (gid_x*2 - W/2);
+    int gy = (gid_y*2 - H/2);
+    gain = get_vignetting_s(gx*gx + gy*gy);
+  }
+
+  float va[4], vb[4], vc[4], vd[4];
+  val4_from_12(in + start + FRAME_STRIDE*y_top_mod, gain, cfg.is_ox, va);
+  val4_from_12(in + start + FRAME_STRIDE*1, gain, cfg.is_ox, vb);
+  val4_from_12(in + start + FRAME_STRIDE*2, gain, cfg.is_ox, vc);
+  val4_from_12(in + start + FRAME_STRIDE*y_bot_mod, gain, cfg.is_ox, vd);
+
+  if (gid_x == 0) {
+    va[0] = va[2];
+    vb[0] = vb[2];
+    vc[0] = vc[2];
+    vd[0] = vd[2];
+  } else if (gid_x == W/2 - 1) {
+    va[3] = va[1];
+    vb[3] = vb[1];
+    vc[3] = vc[1];
+    vd[3] = vd[1];
+  }
+
+  const float k01 = get_k(va[0], vb[1], va[2], vb[1]);
+  const float k02 = get_k(va[2], vb[1], vc[2], vb[1]);
+  const float k03 = get_k(vc[0], vb[1], vc[2], vb[1]);
+  const float k04 = get_k(va[0], vb[1], vc[0], vb[1]);
+  rgb.x = (k02*vb[2]+k04*vb[0])/(k02+k04); // R_G1
+  rgb.y = vb[1]; // G1(R)
+  rgb.z = (k01*va[1]+k03*vc[1])/(k01+k03); // B_G1
+  color_correct(rgb, cfg.is_ox, rgb_out[0]);
+
+  const float k11 = get_k(va[1], vc[1], va[3], vc[3]);
+  const float k12 = get_k(va[2], vb[1], vb[3], vc[2]);
+  const float k13 = get_k(va[1], va[3], vc[1], vc[3]);
+  const float k14 = get_k(va[2], vb[3], vc[2], vb[1]);
+  rgb.x = vb[2]; // R
+  rgb.y = (k11*(va[2]+vc[2])*0.5f+k13*(vb[3]+vb[1])*0.5f)/(k11+k13); // G_R
+  rgb.z = (k12*(va[3]+vc[1])*0.5f+k14*(va[1]+vc[3])*0.5f)/(k12+k14); // B_R
+  color_correct(rgb, cfg.is_ox, rgb_out[1]);
+
+  const float k21 = get_k(vb[0], vd[0], vb[2], vd[2]);
+  const float k22 = get_k(vb[1], vc[0], vc[2], vd[1]);
+  const float k23 = get_k(vb[0], vb[2], vd[0], vd[2]);
+  const float k24 = get_k(vb[1], vc[2], vd[1], vc[0]);
+  rgb.x = (k22*(vb[2]+vd[0])*0.5f+k24*(vb[0]+vd[2])*0.5f)/(k22+k24); // R_B
+  rgb.y = (k21*(vb[1]+vd[1])*0.5f+k23*(vc[2]+vc[0])*0.5f)/(k21+k23); // G_B
+  rgb.z = vc[1]; // B
+  color_correct(rgb, cfg.is_ox, rgb_out[2]);
+
+  const float k31 = get_k(vb[1], vc[2], vb[3], vc[2]);
+  const float k32 = get_k(vb[3], vc[2], vd[3], vc[2]);
+  const float k33 = get_k(vd[1], vc[2], vd[3], vc[2]);
+  const float k34 = get_k(vb[1], vc[2], vd[1], vc[2]);
+  rgb.x = (k31*vb[2]+k33*vd[2])/(k31+k33); // R_G2
+  rgb.y = vc[2]; // G2(B)
+  rgb.z = (k32*vc[3]+k34*vc[1])/(k32+k34); // B_G2
+  color_correct(rgb, cfg.is_ox, rgb_out[3]);
+
+  auto rgb_to_y = [](int r, int g, int b) { return ((((b * 13 + g * 65 + r * 33) + 64) >> 7) + 16); };
+  uint8_t *y = out + gid_y * 2 * YUV_STRIDE + gid_x * 2;
+  y[0] = rgb_to_y(rgb_out[0][0], rgb_out[0][1], rgb_out[0][2]);
+  y[1] = rgb_to_y(rgb_out[1][0], rgb_out[1][1], rgb_out[1][2]);
+  y[YUV_STRIDE] = rgb_to_y(rgb_out[2][0], rgb_out[2][1], rgb_out[2][2]);
+  y[YUV_STRIDE + 1] = rgb_to_y(rgb_out[3][0], rgb_out[3][1], rgb_out[3][2]);
+
+  auto average = [&](int c) { return (short)((rgb_out[0][c] + rgb_out[1][c] + rgb_out[2][c] + rgb_out[3][c] + 1) >> 1); };
+  const short ar = average(0), ag = average(1), ab = average(2);
+  uint8_t *uv = out + UV_OFFSET + gid_y * YUV_STRIDE + gid_x * 2;
+  uv[0] = (ab * 56 - ag * 37 - ar * 19 + 0x8080) >> 8;
+  uv[1] = (ar * 56 - ag * 47 - ab * 9 + 0x8080) >> 8;
+}
+
+static int count_diff(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b) {
+  int diff = 0;
+  for (int r = 0; r < H; ++r) {
+    diff += memcmp(&a[r * YUV_STRIDE], &b[r * YUV_STRIDE], W) != 0;
+  }
+  for (int r = 0; r < H / 2; ++r) {
+    diff += memcmp(&a[UV_OFFSET + r * YUV_STRIDE], &b[UV_OFFSET + r * YUV_STRIDE], W) != 0;
+  }
+  return diff;
+}
+
+int main() {
+  ox03c10_lut = read_ox03c10_lut("cameras/real_debayer.cl");
+  assert(ox03c10_lut.size() == 4096);
+
+  FakeSensor sensor(W, H, FRAME_STRIDE, FRAME_OFFSET, EXTRA_HEIGHT);
+  sensor.synthesize(2);
+  const size_t yuv_size = UV_OFFSET + YUV_STRIDE * H / 2;
+
+  bool passed = true;
+  for (Config cfg : {Config{false, false}, Config{false, true}, Config{true, false}, Config{true, true}}) {
+    CpuDebayer reference(W, H, FRAME_STRIDE, FRAME_OFFSET, YUV_STRIDE, UV_OFFSET, cfg.is_ox, cfg.vignetting, 1);
+    CpuDebayer threaded(W, H, FRAME_STRIDE, FRAME_OFFSET, YUV_STRIDE, UV_OFFSET, cfg.is_ox, cfg.vignetting, 3);
+    for (int f = 0; f < sensor.frame_count(); ++f) {
+      const uint8_t *raw = sensor.next();
+      std::vector<uint8_t> expected(yuv_size), out(yuv_size), out_reference(yuv_size);
+      for (int gid_y = 0; gid_y < H / 2; ++gid_y) {
+        for (int gid_x = 0; gid_x < W / 2; ++gid_x) debayer10(raw, expected.data(), gid_x, gid_y, cfg);
+      }
+      threaded.run(raw, out.data());
+      reference.run_reference(raw, out_reference.data());
+
+      double y_sum = 0;
+      for (int r = 0; r < H; ++r) {
+        for (int c = 0; c < W; ++c) y_sum += expected[r * YUV_STRIDE + c];
+      }
+      const int diff = count_diff(expected, out), diff_reference = count_diff(expected, out_reference);
+      printf("%s%s frame %d: mean Y %.1f, %d rows differ, %d in the scalar path\n", cfg.is_ox ? "OX03C10" : "AR0231",
+             cfg.vignetting ? " with vignetting" : "", f, y_sum / (W * H), diff, diff_reference);
+      passed = passed && diff == 0 && diff_reference == 0 && y_sum / (W * H) > 32 && y_sum / (W * H) < 224;
+    }
+  }
+  assert(passed);
+  printf("passed\n");
+  return 0;
+}
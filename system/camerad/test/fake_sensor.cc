@@ -0,0 +1,56 @@
+#include "system/camerad/test/fake_sensor.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <random>
+
+#include "common/util.h"
+
+FakeSensor::FakeSensor(int width, int height, int stride, int offset, int extra_height)
+  : width(width), height(height), stride(stride), offset(offset), extra_height(extra_height) {
+  assert(width % 2 == 0 && stride >= width * 3 / 2);
+}
+
+bool FakeSensor::load(const std::string &fn) {
+  std::string dat = util::read_file(fn);
+  if (dat.empty() || dat.size() % frame_size() != 0) return false;
+  frames.assign(dat.begin(), dat.end());
+  cur = 0;
+  return true;
+}
+
+// a scene moving sideways, with a gradient, hard edges and sensor noise
+void FakeSensor::synthesize(int count, int seed) {
+  std::mt19937 gen(seed);
+  std::normal_distribution<float> noise(0, 24);
+  frames.assign(frame_size() * count, 0);
+  for (int f = 0; f < count; ++f) {
+    uint8_t *frame = frames.data() + frame_size() * f;
+    for (int r = 0; r < height; ++r) {
+      uint8_t *row = frame + (r + offset) * stride;
+      for (int c = 0; c < width; c += 2) {
+        uint16_t px[2];
+        for (int i = 0; i < 2; ++i) {
+          const int x = c + i + f * 8;
+          // GRBG, the red and the blue a bit darker than the green
+          const bool green = (r % 2) == ((c + i) % 2);
+          const float scene = 0.1f + 0.6f * r / height + 0.3f * (((x / 96) + (r / 96)) % 2) + 0.1f * std::sin(x * 0.05f);
+          const float v = 168 + (4095 - 168) * scene * (green ? 0.5f : 0.3f) + noise(gen);
+          px[i] = std::clamp((int)v, 0, 4095);
+        }
+        row[c / 2 * 3 + 0] = px[0] >> 4;
+        row[c / 2 * 3 + 1] = px[1] >> 4;
+        row[c / 2 * 3 + 2] = (px[0] & 0xF) | ((px[1] & 0xF) << 4);
+      }
+    }
+  }
+  cur = 0;
+}
+
+const uint8_t *FakeSensor::next() {
+  assert(frame_count() > 0);
+  const uint8_t *frame = frames.data() + frame_size() * cur;
+  cur = (cur + 1) % frame_count();
+  return frame;
+}
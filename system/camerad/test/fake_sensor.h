@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Raw frames as the sensor sends them, 12 bit packed, for running the
+// processing path without a camera. Either replayed from a file of frames
+// back to back, as they are in the camera buffers (roadCameraState.image
+// with LOG_RAW_FRAMES=1), or a synthetic scene.
+class FakeSensor {
+public:
+  FakeSensor(int width, int height, int stride, int offset, int extra_height);
+  bool load(const std::string &fn);
+  void synthesize(int count, int seed = 0);
+  // the frames in a loop
+  const uint8_t *next();
+
+  size_t frame_size() const { return (size_t)stride * (height + extra_height); }
+  int frame_count() const { return frames.size() / frame_size(); }
+
+  const int width, height, stride, offset, extra_height;
+
+private:
+  std::vector<uint8_t> frames;
+  int cur = 0;
+};
@@ -0,0 +1,118 @@
+// benchmark of the thumbnail JPEG, on a synthetic 1928x1208 NV12 frame
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <jpeglib.h>
+
+#include "common/timing.h"
+#include "system/camerad/cameras/jpeg_encoder.h"
+
+#define W 1928
+#define H 1208
+#define STRIDE 2048
+
+// before: sampled to a full thumbnail, then compressed with a new context and output buffer
+static size_t encode_before(const uint8_t *y, const uint8_t *uv, int tw, int th) {
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[(tw * ((th + 15) & ~15) * 3) / 2]);
+  uint8_t *y_plane = buf.get();
+  uint8_t *u_plane = y_plane + tw * th;
+  uint8_t *v_plane = u_plane + (tw * th) / 4;
+  const int downscale = W / tw;
+  for (int hy = 0; hy < th / 2; hy++) {
+    for (int hx = 0; hx < tw / 2; hx++) {
+      int ix = hx * downscale + (downscale - 1) / 2;
+      int iy = hy * downscale + (downscale - 1) / 2;
+      y_plane[(hy * 2 + 0) * tw + (hx * 2 + 0)] = y[(iy * 2 + 0) * STRIDE + ix * 2 + 0];
+      y_plane[(hy * 2 + 0) * tw + (hx * 2 + 1)] = y[(iy * 2 + 0) * STRIDE + ix * 2 + 1];
+      y_plane[(hy * 2 + 1) * tw + (hx * 2 + 0)] = y[(iy * 2 + 1) * STRIDE + ix * 2 + 0];
+      y_plane[(hy * 2 + 1) * tw + (hx * 2 + 1)] = y[(iy * 2 + 1) * STRIDE + ix * 2 + 1];
+      u_plane[hy * tw / 2 + hx] = uv[iy * STRIDE + ix * 2 + 0];
+      v_plane[hy * tw / 2 + hx] = uv[iy * STRIDE + ix * 2 + 1];
+    }
+  }
+
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_compress(&cinfo);
+  uint8_t *out = nullptr;
+  unsigned long out_len = 0;
+  jpeg_mem_dest(&cinfo, &out, &out_len);
+  cinfo.image_width = tw;
+  cinfo.image_height = th;
+  cinfo.input_components = 3;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_colorspace(&cinfo, JCS_YCbCr);
+  cinfo.comp_info[0].h_samp_factor = 2;
+  cinfo.comp_info[0].v_samp_factor = 2;
+  cinfo.comp_info[1].h_samp_factor = 1;
+  cinfo.comp_info[1].v_samp_factor = 1;
+  cinfo.comp_info[2].h_samp_factor = 1;
+  cinfo.comp_info[2].v_samp_factor = 1;
+  cinfo.raw_data_in = TRUE;
+  jpeg_set_quality(&cinfo, 50, TRUE);
+  jpeg_start_compress(&cinfo, TRUE);
+  JSAMPROW rows_y[16], rows_u[8], rows_v[8];
+  JSAMPARRAY planes[3]{rows_y, rows_u, rows_v};
+  for (int line = 0; line < th; line += 16) {
+    for (int i = 0; i < 16; ++i) {
+      rows_y[i] = y_plane + (line + i) * tw;
+      if (i % 2 == 0) {
+        int offset = (tw / 2) * ((i + line) / 2);
+        rows_u[i / 2] = u_plane + offset;
+        rows_v[i / 2] = v_plane + offset;
+      }
+    }
+    jpeg_write_raw_data(&cinfo, planes, 16);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  free(out);
+  return out_len;
+}
+
+static void report(const char *name, std::vector<double> &ms, size_t size) {
+  std::sort(ms.begin(), ms.end());
+  printf("%-8s %zu bytes: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+         name, size, ms[ms.size() / 2], ms[std::min(ms.size() - 1, ms.size() * 99 / 100)], ms.back());
+}
+
+int main(int argc, char **argv) {
+  const int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+
+  std::vector<uint8_t> frame(STRIDE * H * 3 / 2);
+  std::mt19937 gen(0);
+  for (int r = 0; r < H * 3 / 2; ++r) {
+    for (int c = 0; c < W; ++c) frame[r * STRIDE + c] = ((r + c) / 4 + gen() % 24) & 0xff;
+  }
+
+  JpegEncoder jpeg(W, H, 4);
+  printf("%dx%d -> %dx%d, %d iterations\n", W, H, jpeg.out_width, jpeg.out_height, iterations);
+  const uint8_t *y = frame.data(), *uv = frame.data() + STRIDE * H;
+  {
+    std::vector<double> ms;
+    size_t size = 0;
+    for (int i = 0; i < iterations; ++i) {
+      const double start = millis_since_boot();
+      size = encode_before(y, uv, jpeg.out_width, jpeg.out_height);
+      ms.push_back(millis_since_boot() - start);
+    }
+    report("before", ms, size);
+  }
+  {
+    std::vector<double> ms;
+    size_t size = 0;
+    for (int i = 0; i < iterations; ++i) {
+      const double start = millis_since_boot();
+      size = jpeg.encode(y, uv, STRIDE).size();
+      ms.push_back(millis_since_boot() - start);
+    }
+    report("after", ms, size);
+  }
+  return 0;
+}
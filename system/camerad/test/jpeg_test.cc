@@ -0,0 +1,146 @@
+// unittest for JpegEncoder, against the thumbnail path it replaced
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include <jpeglib.h>
+
+#include "system/camerad/cameras/jpeg_encoder.h"
+
+#define W 1928
+#define H 1208
+#define STRIDE 2048
+#define DOWNSCALE 4
+
+// a gradient with noise and some hard edges, so a wrong sample shows
+void fill_frame(std::vector<uint8_t> &frame, int seed) {
+  std::mt19937 gen(seed);
+  uint8_t *y = frame.data(), *uv = frame.data() + STRIDE * H;
+  for (int r = 0; r < H; ++r) {
+    for (int c = 0; c < W; ++c) y[r * STRIDE + c] = ((r + c) / 8 + ((r / 64 + c / 64) % 2) * 96 + gen() % 32) & 0xff;
+  }
+  for (int r = 0; r < H / 2; ++r) {
+    for (int c = 0; c < W; c += 2) {
+      uv[r * STRIDE + c] = (64 + r / 4 + gen() % 16) & 0xff;
+      uv[r * STRIDE + c + 1] = (192 - c / 16 + gen() % 16) & 0xff;
+    }
+  }
+}
+
+// the sampling of the old yuv420_to_jpeg, the golden thumbnail
+void reference_sample(const std::vector<uint8_t> &frame, std::vector<uint8_t> &y_plane, std::vector<uint8_t> &u_plane, std::vector<uint8_t> &v_plane) {
+  const int tw = W / DOWNSCALE, th = H / DOWNSCALE;
+  const uint8_t *y = frame.data(), *uv = frame.data() + STRIDE * H;
+  y_plane.resize(tw * th);
+  u_plane.resize(tw * th / 4);
+  v_plane.resize(tw * th / 4);
+  for (int hy = 0; hy < th / 2; hy++) {
+    for (int hx = 0; hx < tw / 2; hx++) {
+      int ix = hx * DOWNSCALE + (DOWNSCALE - 1) / 2;
+      int iy = hy * DOWNSCALE + (DOWNSCALE - 1) / 2;
+      y_plane[(hy * 2 + 0) * tw + (hx * 2 + 0)] = y[(iy * 2 + 0) * STRIDE + ix * 2 + 0];
+      y_plane[(hy * 2 + 0) * tw + (hx * 2 + 1)] = y[(iy * 2 + 0) * STRIDE + ix * 2 + 1];
+      y_plane[(hy * 2 + 1) * tw + (hx * 2 + 0)] = y[(iy * 2 + 1) * STRIDE + ix * 2 + 0];
+      y_plane[(hy * 2 + 1) * tw + (hx * 2 + 1)] = y[(iy * 2 + 1) * STRIDE + ix * 2 + 1];
+      u_plane[hy * tw / 2 + hx] = uv[iy * STRIDE + ix * 2 + 0];
+      v_plane[hy * tw / 2 + hx] = uv[iy * STRIDE + ix * 2 + 1];
+    }
+  }
+}
+
+struct Planes {
+  int width = 0, height = 0;
+  std::vector<uint8_t> y, u, v;  // padded to whole MCUs, width rounded up to 16
+  int stride() const { return (width + 15) & ~15; }
+};
+
+// decodes to the YUV420 planes as they were encoded, without color conversion or upsampling
+Planes decode(const std::vector<uint8_t> &jpeg) {
+  jpeg_decompress_struct cinfo;
+  jpeg_error_mgr jerr;
+  cinfo.err = jpeg_std_error(&jerr);
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, jpeg.data(), jpeg.size());
+  jpeg_read_header(&cinfo, TRUE);
+  cinfo.raw_data_out = TRUE;
+  jpeg_start_decompress(&cinfo);
+
+  Planes p;
+  p.width = cinfo.output_width;
+  p.height = cinfo.output_height;
+  const int stride = p.stride(), rows = (p.height + 15) & ~15;
+  p.y.resize(stride * rows);
+  p.u.resize(stride / 2 * rows / 2);
+  p.v.resize(stride / 2 * rows / 2);
+  JSAMPROW y[16], u[8], v[8];
+  JSAMPARRAY planes[3] = {y, u, v};
+  for (int line = 0; line < rows; line += 16) {
+    for (int i = 0; i < 16; ++i) y[i] = p.y.data() + (line + i) * stride;
+    for (int i = 0; i < 8; ++i) {
+      u[i] = p.u.data() + (line / 2 + i) * stride / 2;
+      v[i] = p.v.data() + (line / 2 + i) * stride / 2;
+    }
+    jpeg_read_raw_data(&cinfo, planes, 16);
+  }
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return p;
+}
+
+double psnr(const uint8_t *a, int stride_a, const std::vector<uint8_t> &b, int width, int height) {
+  double se = 0;
+  for (int r = 0; r < height; ++r) {
+    for (int c = 0; c < width; ++c) {
+      const double d = a[r * stride_a + c] - b[r * width + c];
+      se += d * d;
+    }
+  }
+  return se == 0 ? 100 : 10 * std::log10(255.0 * 255.0 * width * height / se);
+}
+
+int main() {
+  const int tw = W / DOWNSCALE, th = H / DOWNSCALE;
+  std::vector<uint8_t> frame(STRIDE * H * 3 / 2), frame2(frame.size());
+  fill_frame(frame, 0);
+  fill_frame(frame2, 1);
+
+  JpegEncoder jpeg(W, H, DOWNSCALE);
+  assert(jpeg.out_width == tw && jpeg.out_height == th);
+  const std::vector<uint8_t> first = jpeg.encode(frame.data(), frame.data() + STRIDE * H, STRIDE);
+  assert(first.size() > 0);
+
+  // compared to the golden thumbnail
+  std::vector<uint8_t> ref_y, ref_u, ref_v;
+  reference_sample(frame, ref_y, ref_u, ref_v);
+  Planes p = decode(first);
+  assert(p.width == tw && p.height == th);
+  const double psnr_y = psnr(p.y.data(), p.stride(), ref_y, tw, th);
+  const double psnr_u = psnr(p.u.data(), p.stride() / 2, ref_u, tw / 2, th / 2);
+  const double psnr_v = psnr(p.v.data(), p.stride() / 2, ref_v, tw / 2, th / 2);
+  printf("%dx%d thumbnail, %zu bytes, PSNR Y %.2f U %.2f V %.2f dB\n", tw, th, first.size(), psnr_y, psnr_u, psnr_v);
+  assert(psnr_y > 25 && psnr_u > 25 && psnr_v > 25);
+
+  // a sampling off by a pixel, as a sanity check of the threshold
+  std::vector<uint8_t> shifted(frame.begin() + 2, frame.end());
+  shifted.resize(frame.size());
+  std::vector<uint8_t> shifted_y, shifted_u, shifted_v;
+  reference_sample(shifted, shifted_y, shifted_u, shifted_v);
+  const double psnr_shifted = psnr(p.y.data(), p.stride(), shifted_y, tw, th);
+  printf("PSNR Y against a shifted sampling %.2f dB\n", psnr_shifted);
+  assert(psnr_shifted < psnr_y - 3);
+
+  // the state and the buffer are reused, the output only depends on the frame
+  const std::vector<uint8_t> second = jpeg.encode(frame2.data(), frame2.data() + STRIDE * H, STRIDE);
+  assert(second != first);
+  assert(jpeg.encode(frame.data(), frame.data() + STRIDE * H, STRIDE) == first);
+  JpegEncoder jpeg2(W, H, DOWNSCALE);
+  assert(jpeg2.encode(frame.data(), frame.data() + STRIDE * H, STRIDE) == first);
+
+  printf("passed\n");
+  return 0;
+}
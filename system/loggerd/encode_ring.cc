@@ -0,0 +1,120 @@
+#include "system/loggerd/encode_ring.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <new>
+
+#include "common/util.h"
+
+std::string encode_ring_path(const std::string &service) {
+  // same location as the msgq socket of the service
+  const char *prefix = getenv("OPENPILOT_PREFIX");
+  return prefix ? util::string_format("/dev/shm/%s/%s.ring", prefix, service.c_str())
+                : util::string_format("/dev/shm/%s.ring", service.c_str());
+}
+
+EncodeRingWriter::EncodeRingWriter(const std::string &service, size_t capacity) : path(encode_ring_path(service)) {
+  map_size = sizeof(EncodeRingHeader) + capacity;
+
+  // create the ring under a temporary name so readers never map a partially initialized header.
+  // readers that still map the ring of a previous encoderd notice it's stale on the first missing packet
+  const std::string tmp_path = path + "." + util::random_string(8);
+  int fd = HANDLE_EINTR(::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0664));
+  assert(fd >= 0);
+  int err = ftruncate(fd, map_size);
+  assert(err == 0);
+  void *addr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  assert(addr != MAP_FAILED);
+  ::close(fd);
+
+  header = new (addr) EncodeRingHeader{};
+  header->capacity = capacity;
+  data = (uint8_t *)addr + sizeof(EncodeRingHeader);
+
+  err = rename(tmp_path.c_str(), path.c_str());
+  assert(err == 0);
+}
+
+EncodeRingWriter::~EncodeRingWriter() {
+  munmap(header, map_size);
+  unlink(path.c_str());
+}
+
+void EncodeRingWriter::push(uint32_t encode_id, const uint8_t *dat, size_t len) {
+  assert(len <= header->capacity);
+  EncodeRingSlot &slot = header->slots[encode_id % ENCODE_RING_SLOTS];
+  slot.seq.store(0, std::memory_order_relaxed);
+
+  // reserve the bytes before overwriting them, readers of older packets check write_pos after reading
+  const uint64_t pos = header->write_pos.load(std::memory_order_relaxed);
+  header->write_pos.store(pos + len, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  const size_t offset = pos % header->capacity;
+  const size_t first = std::min(len, header->capacity - offset);
+  memcpy(data + offset, dat, first);
+  memcpy(data, dat + first, len - first);
+
+  slot.pos.store(pos, std::memory_order_relaxed);
+  slot.len.store(len, std::memory_order_relaxed);
+  slot.seq.store(encode_id + 1ULL, std::memory_order_release);
+}
+
+bool EncodeRingReader::open() {
+  int fd = HANDLE_EINTR(::open(path.c_str(), O_RDONLY));
+  if (fd < 0) return false;
+
+  struct stat st = {};
+  void *addr = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > (off_t)sizeof(EncodeRingHeader)) {
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  ::close(fd);
+  if (addr == MAP_FAILED) return false;
+
+  map_size = st.st_size;
+  header = (const EncodeRingHeader *)addr;
+  data = (const uint8_t *)addr + sizeof(EncodeRingHeader);
+  assert(sizeof(EncodeRingHeader) + header->capacity == map_size);
+  return true;
+}
+
+void EncodeRingReader::close() {
+  if (header) {
+    munmap((void *)header, map_size);
+    header = nullptr;
+    data = nullptr;
+  }
+}
+
+std::optional<EncodePacket> EncodeRingReader::get(uint32_t encode_id, uint32_t len) const {
+  return header ? lookup(encode_id, len) : std::nullopt;
+}
+
+std::optional<EncodePacket> EncodeRingReader::lookup(uint32_t encode_id, uint32_t len) const {
+  const EncodeRingSlot &slot = header->slots[encode_id % ENCODE_RING_SLOTS];
+  const uint64_t seq = slot.seq.load(std::memory_order_acquire);
+  EncodePacket p = {.pos = slot.pos.load(std::memory_order_relaxed), .len = slot.len.load(std::memory_order_relaxed)};
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (seq != encode_id + 1ULL || slot.seq.load(std::memory_order_relaxed) != seq || p.len != len || !intact(p)) {
+    return std::nullopt;
+  }
+
+  const size_t offset = p.pos % header->capacity;
+  const size_t first = std::min<size_t>(len, header->capacity - offset);
+  p.iov[0] = {.iov_base = (void *)(data + offset), .iov_len = first};
+  p.iov[1] = {.iov_base = (void *)data, .iov_len = len - first};
+  p.iovcnt = len > first ? 2 : 1;
+  return p;
+}
+
+bool EncodeRingReader::intact(const EncodePacket &p) const {
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return header->write_pos.load(std::memory_order_relaxed) <= p.pos + header->capacity;
+}
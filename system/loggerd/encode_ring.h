@@ -0,0 +1,71 @@
+#pragma once
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+// Shared memory ring for encoded video packets. encoderd copies every packet
+// into the ring of its stream and only sends the EncodeIndex over msgq, loggerd
+// looks the packet up by encodeId and writes it to disk straight from the
+// mapping. A packet can wrap around the end of the ring, so it is described by
+// up to two iovecs.
+
+const uint32_t ENCODE_RING_SLOTS = 256;  // ~12s of packets at 20fps
+
+struct EncodeRingSlot {
+  std::atomic<uint64_t> seq;  // encode_id + 1 once the packet is complete, 0 while it's being written
+  std::atomic<uint64_t> pos;
+  std::atomic<uint32_t> len;
+};
+
+struct EncodeRingHeader {
+  uint64_t capacity;
+  std::atomic<uint64_t> write_pos;  // total bytes ever reserved, the packet at pos is intact while write_pos <= pos + capacity
+  EncodeRingSlot slots[ENCODE_RING_SLOTS];
+};
+// also read by tools/camerastream/encode_ring_bridge.py
+static_assert(sizeof(EncodeRingSlot) == 24 && sizeof(EncodeRingHeader) == 16 + ENCODE_RING_SLOTS * 24);
+
+struct EncodePacket {
+  uint64_t pos;
+  uint32_t len;
+  struct iovec iov[2];
+  int iovcnt;
+};
+
+std::string encode_ring_path(const std::string &service);
+
+class EncodeRingWriter {
+public:
+  EncodeRingWriter(const std::string &service, size_t capacity);
+  ~EncodeRingWriter();
+  void push(uint32_t encode_id, const uint8_t *dat, size_t len);
+
+private:
+  std::string path;
+  size_t map_size;
+  EncodeRingHeader *header;
+  uint8_t *data;
+};
+
+class EncodeRingReader {
+public:
+  EncodeRingReader(const std::string &service) : path(encode_ring_path(service)) { open(); }
+  ~EncodeRingReader() { close(); }
+  // a reader stays on the ring it mapped, a new one is needed to follow a restarted encoderd
+  std::optional<EncodePacket> get(uint32_t encode_id, uint32_t len) const;
+  bool intact(const EncodePacket &p) const;
+
+private:
+  bool open();
+  void close();
+  std::optional<EncodePacket> lookup(uint32_t encode_id, uint32_t len) const;
+
+  std::string path;
+  size_t map_size = 0;
+  const EncodeRingHeader *header = nullptr;
+  const uint8_t *data = nullptr;
+};
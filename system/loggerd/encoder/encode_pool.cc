@@ -0,0 +1,227 @@
+#include "system/loggerd/encoder/encode_pool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+
+#include "common/swaglog.h"
+#include "common/timing.h"
+#include "common/util.h"
+
+// ***** EncodePool *****
+
+EncodePool::EncodePool(int num_threads) {
+  assert(num_threads > 0);
+  for (int i = 0; i < num_threads; ++i) {
+    workers.emplace_back(new Worker);
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    threads.emplace_back(&EncodePool::worker_thread, this, i);
+  }
+}
+
+EncodePool::~EncodePool() {
+  {
+    std::lock_guard lk(lock);
+    exit = true;
+  }
+  cv.notify_all();
+  for (auto &t : threads) t.join();
+}
+
+void EncodePool::submit(std::function<void()> task, int worker) {
+  if (worker < 0) worker = next_worker++ % workers.size();
+  {
+    std::lock_guard lk(workers[worker]->lock);
+    workers[worker]->tasks.push_back(std::move(task));
+  }
+  {
+    std::lock_guard lk(lock);
+    queued++;
+  }
+  cv.notify_one();
+}
+
+bool EncodePool::pop(int idx, std::function<void()> &task) {
+  // the front of its own queue, or the back of another one
+  for (int i = 0; i < workers.size(); ++i) {
+    Worker &w = *workers[(idx + i) % workers.size()];
+    std::lock_guard lk(w.lock);
+    if (w.tasks.empty()) continue;
+    if (i == 0) {
+      task = std::move(w.tasks.front());
+      w.tasks.pop_front();
+    } else {
+      task = std::move(w.tasks.back());
+      w.tasks.pop_back();
+    }
+    return true;
+  }
+  return false;
+}
+
+void EncodePool::worker_thread(int idx) {
+  util::set_thread_name("encode_pool");
+  std::function<void()> task;
+  while (true) {
+    {
+      std::unique_lock lk(lock);
+      cv.wait(lk, [&] { return queued > 0 || exit; });
+      // exit once every task has run
+      if (queued == 0) break;
+      // there is at least one task in the queues for this thread
+      queued--;
+    }
+    bool ret = pop(idx, task);
+    assert(ret);
+    task();
+    task = nullptr;
+  }
+}
+
+// ***** FrameSync *****
+
+std::optional<uint32_t> FrameSync::arrive(int camera, uint32_t frame_id, int timeout_ms) {
+  std::unique_lock lk(lock);
+  if (!released) {
+    // add a small margin to the start frame id in case one of the cameras already dropped the next frame
+    start_frame_id = std::max(start_frame_id, expected > 1 ? frame_id + 2 : frame_id);
+    if (arrived.insert(camera).second) {
+      LOGD("camera %d encoder ready", camera);
+    }
+    if (arrived.size() >= expected) {
+      released = true;
+      cv.notify_all();
+    } else {
+      cv.wait_for(lk, std::chrono::milliseconds(timeout_ms), [&] { return released; });
+      if (!released) return std::nullopt;
+    }
+  }
+  return start_frame_id;
+}
+
+void FrameSync::leave() {
+  std::lock_guard lk(lock);
+  expected--;
+  if (!released && arrived.size() >= expected) {
+    released = true;
+    cv.notify_all();
+  }
+}
+
+// ***** EncodeStream *****
+
+FramePolicy frame_policy_from_string(const std::string &s) {
+  if (s == "drop") return FramePolicy::DROP;
+  if (s == "duplicate") return FramePolicy::DUPLICATE;
+  if (s != "wait") LOGE("unknown frame policy %s", s.c_str());
+  return FramePolicy::WAIT;
+}
+
+EncodeStream::EncodeStream(VideoEncoder *encoder, const char *name, EncodePool *pool, FramePolicy policy, int max_pending)
+  : encoder(encoder), name(name), pool(pool), policy(policy), max_pending(max_pending) {
+  assert(max_pending > 0);
+  last_report_ms = millis_since_boot();
+}
+
+EncodeStream::~EncodeStream() {
+  flush();
+}
+
+void EncodeStream::push(VisionBuf *buf, const VisionIpcBufExtra &extra, bool rotate) {
+  Frame frame = {.buf = buf, .extra = extra, .rotate = rotate, .queued_ms = millis_since_boot()};
+
+  std::unique_lock lk(lock);
+  if (policy == FramePolicy::WAIT) {
+    cv.wait(lk, [&] { return queue.size() < max_pending; });
+  } else if (queue.size() >= max_pending) {
+    // the encoder is behind, the oldest frame is dropped but its rotation is kept
+    Frame old = std::move(queue.front());
+    queue.pop_front();
+    Frame &next = queue.empty() ? frame : queue.front();
+    next.rotate |= old.rotate;
+    st.dropped++;
+    if (policy == FramePolicy::DUPLICATE) {
+      // the duplicates are encoded with the buffer of the next frame. keep the latest few, or an
+      // encoder that can't keep up would only fall further behind
+      old.dropped.push_back(old.extra);
+      const size_t n = std::min<size_t>(old.dropped.size(), max_pending);
+      next.dropped.assign(old.dropped.end() - n, old.dropped.end());
+    }
+  }
+  queue.push_back(std::move(frame));
+
+  if (!running) {
+    running = true;
+    pool->submit([this] { run(); });
+  }
+}
+
+void EncodeStream::flush() {
+  std::unique_lock lk(lock);
+  cv.wait(lk, [&] { return queue.empty() && !running; });
+}
+
+EncodeStream::Stats EncodeStream::stats() {
+  std::lock_guard lk(lock);
+  return st;
+}
+
+void EncodeStream::encode(VisionBuf *buf, VisionIpcBufExtra extra) {
+  if (encoder->encode_frame(buf, &extra) == -1) {
+    LOGE("%s: failed to encode frame. frame_id: %d", name.c_str(), extra.frame_id);
+  }
+}
+
+void EncodeStream::run() {
+  std::unique_lock lk(lock);
+  while (!queue.empty()) {
+    Frame frame = std::move(queue.front());
+    queue.pop_front();
+    lk.unlock();
+    cv.notify_all();
+
+    if (frame.rotate) {
+      encoder->encoder_close();
+      encoder->encoder_open(NULL);
+    }
+    for (auto &extra : frame.dropped) {
+      encode(frame.buf, extra);
+    }
+    encode(frame.buf, frame.extra);
+    // camerad reuses the buffers, a frame that waited too long may have been overwritten
+    const bool overwritten = frame.buf->get_frame_id() != frame.extra.frame_id;
+    const double latency_ms = millis_since_boot() - frame.queued_ms;
+
+    lk.lock();
+    st.frames += 1 + frame.dropped.size();
+    st.duplicated += frame.dropped.size();
+    st.overwritten += overwritten;
+    st.total_latency_ms += latency_ms;
+    st.max_latency_ms = std::max(st.max_latency_ms, latency_ms);
+    report_max_latency_ms = std::max(report_max_latency_ms, latency_ms);
+    if (millis_since_boot() - last_report_ms > 10000) {
+      report();
+    }
+  }
+  // notify with the lock held, flush() may destroy the stream as soon as it's released
+  running = false;
+  cv.notify_all();
+}
+
+void EncodeStream::report() {
+  const uint64_t frames = st.frames - last_report.frames;
+  const uint64_t dropped = st.dropped - last_report.dropped;
+  const uint64_t duplicated = st.duplicated - last_report.duplicated;
+  const uint64_t overwritten = st.overwritten - last_report.overwritten;
+  const double avg_latency_ms = (st.total_latency_ms - last_report.total_latency_ms) / std::max<uint64_t>(frames - duplicated, 1);
+  if (dropped > 0 || overwritten > 0) {
+    LOGW("%s: %lu frames, %lu dropped, %lu duplicated, %lu overwritten, latency avg %.1f ms max %.1f ms",
+         name.c_str(), frames, dropped, duplicated, overwritten, avg_latency_ms, report_max_latency_ms);
+  } else {
+    LOGD("%s: %lu frames, latency avg %.1f ms max %.1f ms", name.c_str(), frames, avg_latency_ms, report_max_latency_ms);
+  }
+  last_report = st;
+  last_report_ms = millis_since_boot();
+  report_max_latency_ms = 0;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cereal/visionipc/visionipc.h"
+#include "system/loggerd/encoder/encoder.h"
+
+// Runs tasks on a few threads. Every thread has its own queue, and takes from
+// the back of the others' queues when its own is empty.
+class EncodePool {
+public:
+  EncodePool(int num_threads);
+  ~EncodePool();
+  // worker -1 spreads the tasks over the threads
+  void submit(std::function<void()> task, int worker = -1);
+  int size() const { return workers.size(); }
+
+private:
+  struct Worker {
+    std::mutex lock;
+    std::deque<std::function<void()>> tasks;
+  };
+  bool pop(int idx, std::function<void()> &task);
+  void worker_thread(int idx);
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::vector<std::thread> threads;
+  std::atomic<uint32_t> next_worker = 0;
+  // only to sleep when all queues are empty
+  std::mutex lock;
+  std::condition_variable cv;
+  int queued = 0;
+  bool exit = false;
+};
+
+// Cameras wait here until all of them have frames, so that they start encoding
+// at the same frame id.
+class FrameSync {
+public:
+  FrameSync(int cameras) : expected(cameras) {}
+  // blocks for up to timeout_ms, call again with a newer frame id if it returns nullopt.
+  // once every camera arrived, returns the first frame id to encode
+  std::optional<uint32_t> arrive(int camera, uint32_t frame_id, int timeout_ms);
+  // for a camera that won't have frames
+  void leave();
+
+private:
+  std::mutex lock;
+  std::condition_variable cv;
+  int expected;
+  std::set<int> arrived;
+  uint32_t start_frame_id = 0;
+  bool released = false;
+};
+
+// What to do with a frame that comes in while the stream still has
+// ENCODE_MAX_PENDING frames to encode.
+enum class FramePolicy {
+  WAIT,       // block the camera thread until there is room
+  DROP,       // drop the oldest pending frame
+  DUPLICATE,  // drop the oldest pending frame, and encode the next frame in its place as well,
+              // so the file keeps one frame per camera frame
+};
+FramePolicy frame_policy_from_string(const std::string &s);
+
+const int ENCODE_MAX_PENDING = 2;
+
+// The frames of one encoder, encoded in order by the pool.
+class EncodeStream {
+public:
+  EncodeStream(VideoEncoder *encoder, const char *name, EncodePool *pool, FramePolicy policy, int max_pending = ENCODE_MAX_PENDING);
+  ~EncodeStream();
+  // queue a frame, rotate closes and reopens the encoder before it
+  void push(VisionBuf *buf, const VisionIpcBufExtra &extra, bool rotate);
+  // wait until the queued frames are encoded
+  void flush();
+
+  struct Stats {
+    uint64_t frames;      // encoded, including duplicates
+    uint64_t dropped, duplicated;
+    uint64_t overwritten;  // frames whose buffer was reused by camerad while they waited
+    double total_latency_ms, max_latency_ms;  // from push to encoded
+  };
+  Stats stats();
+
+private:
+  struct Frame {
+    VisionBuf *buf;
+    VisionIpcBufExtra extra;
+    bool rotate;
+    double queued_ms;
+    std::vector<VisionIpcBufExtra> dropped;  // encoded with this frame's buffer before it, for DUPLICATE
+  };
+  void run();
+  void encode(VisionBuf *buf, VisionIpcBufExtra extra);
+  void report();
+
+  VideoEncoder *encoder;
+  const std::string name;
+  EncodePool *pool;
+  const FramePolicy policy;
+  const int max_pending;
+
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<Frame> queue;
+  bool running = false;  // a pool task is encoding this stream
+  Stats st = {}, last_report = {};
+  double last_report_ms, report_max_latency_ms = 0;
+};
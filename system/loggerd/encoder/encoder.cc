@@ -1,6 +1,11 @@
+#include <algorithm>
 #include <cassert>
 #include "system/loggerd/encoder/encoder.h"
 
+// move the payloads out of the published messages, into a shared memory ring. loggerd reads them from
+// there, any other subscriber of the EncodeData services needs tools/camerastream/encode_ring_bridge.py
+const bool ENCODER_RING_DATA = getenv("ENCODER_RING_DATA") != NULL;
+
 VideoEncoder::~VideoEncoder() {}
 
 void VideoEncoder::publisher_init() {
@@ -9,6 +14,12 @@ void VideoEncoder::publisher_init() {
     (this->type == WideRoadCam ? "wideRoadEncodeData" :
     (this->in_width == this->out_width ? "roadEncodeData" : "qRoadEncodeData"));
   pm.reset(new PubMaster({service_name}));
+
+  if (!this->write && ENCODER_RING_DATA) {
+    // a few seconds of packets, and at least a few uncompressed frames for the lossless encoder on PC
+    size_t capacity = std::max<size_t>(this->bitrate / 8 * 10, this->out_width * this->out_height * 3 / 2 * 8);
+    ring.reset(new EncodeRingWriter(service_name, capacity));
+  }
 }
 
 void VideoEncoder::publisher_publish(VideoEncoder *e, int segment_num, uint32_t idx, VisionIpcBufExtra &extra,
@@ -27,12 +38,18 @@ void VideoEncoder::publisher_publish(VideoEncoder *e, int segment_num, uint32_t
   edata.setTimestampSof(extra.timestamp_sof);
   edata.setTimestampEof(extra.timestamp_eof);
   edata.setType(e->codec);
-  edata.setEncodeId(e->cnt++);
+  const uint32_t encode_id = e->cnt++;
+  edata.setEncodeId(encode_id);
   edata.setSegmentNum(segment_num);
   edata.setSegmentId(idx);
   edata.setFlags(flags);
   edata.setLen(dat.size());
-  edat.setData(dat);
+  if (e->ring) {
+    // the payload has to be in the ring before the index is published
+    e->ring->push(encode_id, dat.begin(), dat.size());
+  } else {
+    edat.setData(dat);
+  }
   if (flags & V4L2_BUF_FLAG_KEYFRAME) edat.setHeader(header);
 
   auto words = new kj::Array<capnp::word>(capnp::messageToFlatArray(msg));
@@ -7,6 +7,7 @@
 #include "cereal/messaging/messaging.h"
 #include "cereal/visionipc/visionipc.h"
 #include "common/queue.h"
+#include "system/loggerd/encode_ring.h"
 #include "system/loggerd/video_writer.h"
 #include "system/camerad/cameras/camera_common.h"
 
@@ -54,6 +55,7 @@ private:
   // publishing
   std::unique_ptr<PubMaster> pm;
   const char *service_name;
+  std::unique_ptr<EncodeRingWriter> ring;  // packet payloads with ENCODER_RING_DATA, the published messages only carry the index
 
   // writing support
   static void write_handler(VideoEncoder *e, const char *path);
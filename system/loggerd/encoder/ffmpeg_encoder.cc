@@ -5,39 +5,119 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
 
 #define __STDC_CONSTANT_MACROS
 
-#include "libyuv.h"
-
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
 }
 
 #include "common/swaglog.h"
 #include "common/util.h"
 
 const int env_debug_encoder = (getenv("DEBUG_ENCODER") != NULL) ? atoi(getenv("DEBUG_ENCODER")) : 0;
+// threads for the conversion and the codec of each encoder, encoderd runs up to four encoders
+const int env_encoder_threads = (getenv("ENCODER_THREADS") != NULL) ? atoi(getenv("ENCODER_THREADS")) :
+                                std::clamp((int)std::thread::hardware_concurrency() / 4, 1, 4);
+// encode the qcamera losslessly like the other cameras, instead of rate controlled h264
+const bool env_qcam_lossless = getenv("ENCODER_QCAM_LOSSLESS") != NULL;
+
+ConvertWorkers::ConvertWorkers(int num_threads) {
+  for (int i = 1; i < num_threads; ++i) {
+    threads.emplace_back(&ConvertWorkers::worker_thread, this);
+  }
+}
+
+ConvertWorkers::~ConvertWorkers() {
+  {
+    std::lock_guard lk(lock);
+    exit = true;
+  }
+  cv.notify_all();
+  for (auto &t : threads) t.join();
+}
+
+void ConvertWorkers::run(int num_stripes, const std::function<void(int)> &fn) {
+  if (threads.empty()) {
+    for (int i = 0; i < num_stripes; ++i) fn(i);
+    return;
+  }
+
+  uint64_t gen;
+  {
+    std::lock_guard lk(lock);
+    job = &fn;
+    stripes = remaining = num_stripes;
+    next_stripe = 0;
+    gen = ++generation;
+  }
+  cv.notify_all();
+  work(gen, fn);
+
+  std::unique_lock lk(lock);
+  done_cv.wait(lk, [&] { return remaining == 0; });
+  job = nullptr;
+}
+
+void ConvertWorkers::work(uint64_t gen, const std::function<void(int)> &fn) {
+  while (true) {
+    int stripe;
+    {
+      std::lock_guard lk(lock);
+      // a late worker must not take stripes of the next job
+      if (gen != generation || next_stripe >= stripes) return;
+      stripe = next_stripe++;
+    }
+    fn(stripe);
+    std::lock_guard lk(lock);
+    if (--remaining == 0) done_cv.notify_one();
+  }
+}
+
+void ConvertWorkers::worker_thread() {
+  util::set_thread_name("encoder_convert");
+  uint64_t seen = 0;
+  while (true) {
+    const std::function<void(int)> *fn;
+    uint64_t gen;
+    {
+      std::unique_lock lk(lock);
+      cv.wait(lk, [&] { return exit || generation != seen; });
+      if (exit) return;
+      seen = gen = generation;
+      fn = job;
+    }
+    if (fn) work(gen, *fn);
+  }
+}
+
+cereal::EncodeIndex::Type FfmpegEncoder::ffmpeg_codec(cereal::EncodeIndex::Type codec) {
+  if (codec == cereal::EncodeIndex::Type::QCAMERA_H264 && !env_qcam_lossless) {
+    if (avcodec_find_encoder_by_name("libx264")) return codec;
+    LOGW("libx264 not available, encoding the qcamera losslessly");
+  }
+  return cereal::EncodeIndex::Type::BIG_BOX_LOSSLESS;
+}
 
 void FfmpegEncoder::encoder_init() {
   frame = av_frame_alloc();
   assert(frame);
-  frame->format = AV_PIX_FMT_YUV420P;
-  frame->width = out_width;
-  frame->height = out_height;
-  frame->linesize[0] = out_width;
-  frame->linesize[1] = out_width/2;
-  frame->linesize[2] = out_width/2;
 
-  convert_buf.resize(in_width * in_height * 3 / 2);
-
-  if (in_width != out_width || in_height != out_height) {
-    downscale_buf.resize(out_width * out_height * 3 / 2);
+  converter.reset(new NV12Converter(in_width, in_height, out_width, out_height));
+  workers.reset(new ConvertWorkers(env_encoder_threads));
+  const int uv_size = ((out_width + 1) / 2) * ((out_height + 1) / 2);
+  frame_pool = av_buffer_pool_init(out_width * out_height + uv_size * 2 + AV_INPUT_BUFFER_PADDING_SIZE, NULL);
+  assert(frame_pool);
+  if (codec == cereal::EncodeIndex::Type::QCAMERA_H264) {
+    // a GOP per second, the QP changes between GOPs
+    rate_control.reset(new SegmentRateControl(bitrate, fps, SEGMENT_LENGTH * fps, fps));
   }
 
   publisher_init();
@@ -46,29 +126,58 @@ void FfmpegEncoder::encoder_init() {
 FfmpegEncoder::~FfmpegEncoder() {
   encoder_close();
   av_frame_free(&frame);
+  av_buffer_pool_uninit(&frame_pool);
 }
 
-void FfmpegEncoder::encoder_open(const char* path) {
-  const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_FFVHUFF);
+void FfmpegEncoder::codec_open() {
+  const AVCodec *codec = rate_control ? avcodec_find_encoder_by_name("libx264") : avcodec_find_encoder(AV_CODEC_ID_FFVHUFF);
 
   this->codec_ctx = avcodec_alloc_context3(codec);
   assert(this->codec_ctx);
-  this->codec_ctx->width = frame->width;
-  this->codec_ctx->height = frame->height;
+  this->codec_ctx->width = out_width;
+  this->codec_ctx->height = out_height;
   this->codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
   this->codec_ctx->time_base = (AVRational){ 1, fps };
+  this->codec_ctx->thread_count = env_encoder_threads;
+  this->codec_ctx->thread_type = FF_THREAD_SLICE | FF_THREAD_FRAME;
+  if (rate_control) {
+    // constant QP, set by the rate control at the start of every GOP. fixed GOPs without B frames,
+    // so that the packets come out in order and the GOPs line up with the QP changes
+    this->codec_ctx->gop_size = rate_control->gop_size;
+    this->codec_ctx->max_b_frames = 0;
+    this->codec_ctx->thread_type = FF_THREAD_SLICE;
+    // the SPS and PPS go in the extradata, for the header of the keyframes. they are repeated
+    // in every keyframe too, the PPS changes with the QP
+    this->codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    av_opt_set(this->codec_ctx->priv_data, "preset", "veryfast", 0);
+    av_opt_set(this->codec_ctx->priv_data, "x264-params", util::string_format("keyint=%d:min-keyint=%d:scenecut=0:repeat-headers=1", rate_control->gop_size, rate_control->gop_size).c_str(), 0);
+    av_opt_set_int(this->codec_ctx->priv_data, "qp", rate_control->qp(), 0);
+    codec_qp = rate_control->qp();
+  }
   int err = avcodec_open2(this->codec_ctx, codec, NULL);
   assert(err >= 0);
+}
+
+void FfmpegEncoder::encoder_open(const char* path) {
+  if (rate_control) rate_control->segment_start();
+  codec_open();
 
   writer_open(path);
   is_open = true;
   segment_num++;
   counter = 0;
+  frame_counter = 0;
 }
 
 void FfmpegEncoder::encoder_close() {
   if (!is_open) return;
 
+  // with frame threading the codec holds on to a few frames, they belong in this segment
+  int err = avcodec_send_frame(this->codec_ctx, NULL);
+  if (err < 0) LOGE("avcodec_send_frame flush error %d", err);
+  receive_packets();
+  pending_extra.clear();
+
   writer_close();
   avcodec_free_context(&codec_ctx);
   is_open = false;
@@ -78,76 +187,94 @@ int FfmpegEncoder::encode_frame(VisionBuf* buf, VisionIpcBufExtra *extra) {
   assert(buf->width == this->in_width);
   assert(buf->height == this->in_height);
 
-  uint8_t *cy = convert_buf.data();
-  uint8_t *cu = cy + in_width * in_height;
-  uint8_t *cv = cu + (in_width / 2) * (in_height / 2);
-  libyuv::NV12ToI420(buf->y, buf->stride,
-                     buf->uv, buf->stride,
-                     cy, in_width,
-                     cu, in_width/2,
-                     cv, in_width/2,
-                     in_width, in_height);
-
-  if (downscale_buf.size() > 0) {
-    uint8_t *out_y = downscale_buf.data();
-    uint8_t *out_u = out_y + frame->width * frame->height;
-    uint8_t *out_v = out_u + (frame->width / 2) * (frame->height / 2);
-    libyuv::I420Scale(cy, in_width,
-                      cu, in_width/2,
-                      cv, in_width/2,
-                      in_width, in_height,
-                      out_y, frame->width,
-                      out_u, frame->width/2,
-                      out_v, frame->width/2,
-                      frame->width, frame->height,
-                      libyuv::kFilterNone);
-    frame->data[0] = out_y;
-    frame->data[1] = out_u;
-    frame->data[2] = out_v;
+  // convert straight into a frame from the pool, split in stripes of rows across the workers
+  frame->buf[0] = av_buffer_pool_get(frame_pool);
+  assert(frame->buf[0]);
+  frame->format = AV_PIX_FMT_YUV420P;
+  frame->width = out_width;
+  frame->height = out_height;
+  frame->linesize[0] = out_width;
+  frame->linesize[1] = frame->linesize[2] = (out_width + 1) / 2;
+  frame->data[0] = frame->buf[0]->data;
+  frame->data[1] = frame->data[0] + out_width * out_height;
+  frame->data[2] = frame->data[1] + frame->linesize[1] * ((out_height + 1) / 2);
+
+  const int num_stripes = env_encoder_threads * 4;
+  const int stripe_rows = ((out_height + num_stripes - 1) / num_stripes + 1) & ~1;
+  workers->run(num_stripes, [&](int i) {
+    const int begin = i * stripe_rows, end = std::min(begin + stripe_rows, out_height);
+    if (begin < end) {
+      converter->convert(buf->y, buf->uv, buf->stride, frame->data[0], frame->data[1], frame->data[2], begin, end);
+    }
+  });
+
+  if (rate_control && rate_control->add_frame(frame->data[0], out_width, out_height, frame->linesize[0])) {
+    if (rate_control->qp() != codec_qp) {
+      // libx264 can't change a constant QP once it's open. the GOPs are closed, so the rest of the
+      // GOP is flushed out and the next one starts with a new encoder
+      int err = avcodec_send_frame(this->codec_ctx, NULL);
+      if (err < 0) LOGE("avcodec_send_frame flush error %d", err);
+      receive_packets();
+      avcodec_free_context(&codec_ctx);
+      codec_open();
+    }
+    frame->pict_type = AV_PICTURE_TYPE_I;
   } else {
-    frame->data[0] = cy;
-    frame->data[1] = cu;
-    frame->data[2] = cv;
+    frame->pict_type = AV_PICTURE_TYPE_NONE;
   }
-  frame->pts = counter*50*1000; // 50ms per frame
+
+  frame->pts = frame_counter++ * 50*1000; // 50ms per frame
+  pending_extra[frame->pts] = *extra;
 
   int ret = counter;
 
+  // the codec takes its own reference to the frame
   int err = avcodec_send_frame(this->codec_ctx, frame);
   if (err < 0) {
     LOGE("avcodec_send_frame error %d", err);
+    pending_extra.erase(frame->pts);
+    ret = -1;
+  }
+  av_frame_unref(frame);
+
+  if (ret >= 0 && receive_packets() < 0) {
     ret = -1;
   }
+  return ret;
+}
 
+int FfmpegEncoder::receive_packets() {
   AVPacket pkt;
   av_init_packet(&pkt);
   pkt.data = NULL;
   pkt.size = 0;
-  while (ret >= 0) {
-    err = avcodec_receive_packet(this->codec_ctx, &pkt);
-    if (err == AVERROR_EOF) {
-      break;
-    } else if (err == AVERROR(EAGAIN)) {
+  while (true) {
+    int err = avcodec_receive_packet(this->codec_ctx, &pkt);
+    if (err == AVERROR_EOF || err == AVERROR(EAGAIN)) {
       // Encoder might need a few frames on startup to get started. Keep going
-      ret = 0;
-      break;
+      return 0;
     } else if (err < 0) {
       LOGE("avcodec_receive_packet error %d", err);
-      ret = -1;
-      break;
+      return -1;
     }
 
+    auto it = pending_extra.find(pkt.pts);
+    assert(it != pending_extra.end());
+    VisionIpcBufExtra extra = it->second;
+    pending_extra.erase(it);
+
+    if (rate_control) rate_control->encoded(pkt.size);
     if (env_debug_encoder) {
-      printf("%20s got %8d bytes flags %8x idx %4d id %8d\n", this->filename, pkt.size, pkt.flags, counter, extra->frame_id);
+      printf("%20s got %8d bytes flags %8x idx %4d id %8d\n", this->filename, pkt.size, pkt.flags, counter, extra.frame_id);
     }
 
-    publisher_publish(this, segment_num, counter, *extra,
+    publisher_publish(this, segment_num, counter, extra,
       (pkt.flags & AV_PKT_FLAG_KEY) ? V4L2_BUF_FLAG_KEYFRAME : 0,
-      kj::arrayPtr<capnp::byte>(pkt.data, (size_t)0), // TODO: get the header
+      // the extradata of ffvhuff isn't used, the writer makes its own
+      kj::arrayPtr<capnp::byte>(codec_ctx->extradata, rate_control ? codec_ctx->extradata_size : 0),
       kj::arrayPtr<capnp::byte>(pkt.data, pkt.size));
 
     counter++;
+    av_packet_unref(&pkt);
   }
-  av_packet_unref(&pkt);
-  return ret;
 }
@@ -1,8 +1,14 @@
 #pragma once
 
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 extern "C" {
@@ -12,26 +18,61 @@ extern "C" {
 }
 
 #include "system/loggerd/encoder/encoder.h"
+#include "system/loggerd/encoder/nv12_convert.h"
+#include "system/loggerd/encoder/rate_control.h"
 #include "system/loggerd/loggerd.h"
 
+// Runs a job split in stripes on a few threads, the calling thread takes part.
+class ConvertWorkers {
+public:
+  ConvertWorkers(int num_threads);
+  ~ConvertWorkers();
+  void run(int num_stripes, const std::function<void(int)> &fn);
+
+private:
+  void work(uint64_t gen, const std::function<void(int)> &fn);
+  void worker_thread();
+
+  std::vector<std::thread> threads;
+  std::mutex lock;
+  std::condition_variable cv, done_cv;
+  const std::function<void(int)> *job = nullptr;
+  uint64_t generation = 0;
+  int stripes = 0, next_stripe = 0, remaining = 0;
+  bool exit = false;
+};
+
 class FfmpegEncoder : public VideoEncoder {
  public:
   FfmpegEncoder(const char* filename, CameraType type, int in_width, int in_height, int fps,
                 int bitrate, cereal::EncodeIndex::Type codec, int out_width, int out_height, bool write) :
-                VideoEncoder(filename, type, in_width, in_height, fps, bitrate, cereal::EncodeIndex::Type::BIG_BOX_LOSSLESS, out_width, out_height, write) { encoder_init(); }
+                VideoEncoder(filename, type, in_width, in_height, fps, bitrate, ffmpeg_codec(codec), out_width, out_height, write) { encoder_init(); }
   ~FfmpegEncoder();
   void encoder_init();
   int encode_frame(VisionBuf* buf, VisionIpcBufExtra *extra);
   void encoder_open(const char* path);
   void encoder_close();
 
+  // the qcamera is h264 with a per segment size budget when libx264 is available, everything else is lossless
+  static cereal::EncodeIndex::Type ffmpeg_codec(cereal::EncodeIndex::Type codec);
+
 private:
+  void codec_open();
+  int receive_packets();
+
   int segment_num = -1;
   int counter = 0;
+  int frame_counter = 0;
   bool is_open = false;
 
   AVCodecContext *codec_ctx;
   AVFrame *frame = NULL;
-  std::vector<uint8_t> convert_buf;
-  std::vector<uint8_t> downscale_buf;
+  // frames are refcounted, the codec threads release them back to the pool when they are done
+  AVBufferPool *frame_pool = NULL;
+  std::unique_ptr<NV12Converter> converter;
+  std::unique_ptr<ConvertWorkers> workers;
+  std::unique_ptr<SegmentRateControl> rate_control;  // h264 only
+  int codec_qp = -1;  // the QP libx264 was opened with
+  // frame info of the frames still in the codec, by pts
+  std::map<int64_t, VisionIpcBufExtra> pending_extra;
 };
@@ -0,0 +1,137 @@
+#include "system/loggerd/encoder/nv12_convert.h"
+
+#include <cassert>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "libyuv.h"
+
+// 16.16 fixed point step and start of point sampling, as in libyuv's ScaleSlope
+static void scale_slope(int src, int dst, int *start, int *step) {
+  *step = (int)(((int64_t)src << 16) / dst);
+  *start = *step >> 1;
+}
+
+static void scale_row_y(const uint8_t *src, const int32_t *xs, uint8_t *dst, int begin, int end) {
+  for (int i = begin; i < end; ++i) {
+    dst[i] = src[xs[i]];
+  }
+}
+
+static void scale_row_uv(const uint8_t *src, const int32_t *xs, uint8_t *dst_u, uint8_t *dst_v, int begin, int end) {
+  for (int i = begin; i < end; ++i) {
+    dst_u[i] = src[xs[i]];
+    dst_v[i] = src[xs[i] + 1];
+  }
+}
+
+#if defined(__x86_64__)
+// gathers one 32 bit word per column and keeps the low byte of 16 columns
+__attribute__((target("avx2"))) static inline __m128i pack_low_bytes(__m256i a, __m256i b) {
+  const __m256i mask = _mm256_set1_epi32(0xff);
+  __m256i words = _mm256_packus_epi32(_mm256_and_si256(a, mask), _mm256_and_si256(b, mask));
+  words = _mm256_permute4x64_epi64(words, 0xd8);
+  __m256i bytes = _mm256_permute4x64_epi64(_mm256_packus_epi16(words, words), 0xd8);
+  return _mm256_castsi256_si128(bytes);
+}
+
+__attribute__((target("avx2"))) static void scale_row_y_avx2(const uint8_t *src, const int32_t *xs, uint8_t *dst, int n) {
+  for (int i = 0; i < n; i += 16) {
+    __m256i a = _mm256_i32gather_epi32((const int *)src, _mm256_loadu_si256((const __m256i *)(xs + i)), 1);
+    __m256i b = _mm256_i32gather_epi32((const int *)src, _mm256_loadu_si256((const __m256i *)(xs + i + 8)), 1);
+    _mm_storeu_si128((__m128i *)(dst + i), pack_low_bytes(a, b));
+  }
+}
+
+__attribute__((target("avx2"))) static void scale_row_uv_avx2(const uint8_t *src, const int32_t *xs, uint8_t *dst_u, uint8_t *dst_v, int n) {
+  for (int i = 0; i < n; i += 16) {
+    __m256i a = _mm256_i32gather_epi32((const int *)src, _mm256_loadu_si256((const __m256i *)(xs + i)), 1);
+    __m256i b = _mm256_i32gather_epi32((const int *)src, _mm256_loadu_si256((const __m256i *)(xs + i + 8)), 1);
+    _mm_storeu_si128((__m128i *)(dst_u + i), pack_low_bytes(a, b));
+    _mm_storeu_si128((__m128i *)(dst_v + i), pack_low_bytes(_mm256_srli_epi32(a, 8), _mm256_srli_epi32(b, 8)));
+  }
+}
+#endif
+
+NV12Converter::NV12Converter(int in_width, int in_height, int out_width, int out_height)
+  : in_width(in_width), in_height(in_height), out_width(out_width), out_height(out_height) {
+  assert(out_width <= in_width && out_height <= in_height);
+  scaling = in_width != out_width || in_height != out_height;
+#if defined(__x86_64__)
+  avx2 = __builtin_cpu_supports("avx2");
+#else
+  avx2 = false;
+#endif
+
+  const int in_uv_width = (in_width + 1) / 2, out_uv_width = (out_width + 1) / 2;
+  int x0, dx;
+  scale_slope(in_width, out_width, &x0, &dx);
+  y_xs.resize(out_width);
+  for (int i = 0; i < out_width; ++i) y_xs[i] = (x0 + i * dx) >> 16;
+
+  scale_slope(in_uv_width, out_uv_width, &x0, &dx);
+  uv_xs.resize(out_uv_width);
+  for (int i = 0; i < out_uv_width; ++i) uv_xs[i] = ((x0 + i * dx) >> 16) * 2;
+
+  scale_slope(in_height, out_height, &y_y0, &y_dy);
+  scale_slope((in_height + 1) / 2, (out_height + 1) / 2, &uv_y0, &uv_dy);
+
+  // the gathers load 4 bytes, the columns close to the end of the row are done one by one
+  auto simd_width = [](const std::vector<int32_t> &xs, int row_bytes) {
+    int n = 0;
+    while (n < (int)xs.size() && xs[n] + 4 <= row_bytes) ++n;
+    return n & ~15;
+  };
+  y_simd_width = simd_width(y_xs, in_width);
+  uv_simd_width = simd_width(uv_xs, in_uv_width * 2);
+}
+
+void NV12Converter::convert(const uint8_t *y, const uint8_t *uv, int stride,
+                            uint8_t *dst_y, uint8_t *dst_u, uint8_t *dst_v,
+                            int row_begin, int row_end) const {
+  assert(row_begin % 2 == 0 && row_begin < row_end && row_end <= out_height);
+  if (scaling) {
+    scale_rows(y, uv, stride, dst_y, dst_u, dst_v, row_begin, row_end);
+  } else {
+    const int uv_stride = (out_width + 1) / 2;
+    libyuv::NV12ToI420(y + row_begin * stride, stride,
+                       uv + row_begin / 2 * stride, stride,
+                       dst_y + row_begin * out_width, out_width,
+                       dst_u + row_begin / 2 * uv_stride, uv_stride,
+                       dst_v + row_begin / 2 * uv_stride, uv_stride,
+                       out_width, row_end - row_begin);
+  }
+}
+
+void NV12Converter::scale_rows(const uint8_t *y, const uint8_t *uv, int stride,
+                               uint8_t *dst_y, uint8_t *dst_u, uint8_t *dst_v,
+                               int row_begin, int row_end) const {
+  for (int row = row_begin; row < row_end; ++row) {
+    const uint8_t *src = y + ((y_y0 + row * y_dy) >> 16) * stride;
+    uint8_t *dst = dst_y + row * out_width;
+#if defined(__x86_64__)
+    if (avx2) {
+      scale_row_y_avx2(src, y_xs.data(), dst, y_simd_width);
+      scale_row_y(src, y_xs.data(), dst, y_simd_width, out_width);
+      continue;
+    }
+#endif
+    scale_row_y(src, y_xs.data(), dst, 0, out_width);
+  }
+
+  const int uv_width = uv_xs.size();
+  for (int row = row_begin / 2; row < (row_end + 1) / 2; ++row) {
+    const uint8_t *src = uv + ((uv_y0 + row * uv_dy) >> 16) * stride;
+    uint8_t *u = dst_u + row * uv_width, *v = dst_v + row * uv_width;
+#if defined(__x86_64__)
+    if (avx2) {
+      scale_row_uv_avx2(src, uv_xs.data(), u, v, uv_simd_width);
+      scale_row_uv(src, uv_xs.data(), u, v, uv_simd_width, uv_width);
+      continue;
+    }
+#endif
+    scale_row_uv(src, uv_xs.data(), u, v, 0, uv_width);
+  }
+}
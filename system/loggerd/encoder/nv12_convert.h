@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Converts NV12 to I420 and downscales it with nearest sampling in one pass,
+// without an intermediate full resolution I420 buffer. The sampling positions
+// are those of libyuv's generic point sampling, so for the qcamera size the
+// output is identical to NV12ToI420 followed by I420Scale with kFilterNone
+// (libyuv samples 3/8 scales differently). Output rows can be
+// converted in independent stripes to split a frame across threads.
+class NV12Converter {
+public:
+  NV12Converter(int in_width, int in_height, int out_width, int out_height);
+  // convert the output rows [row_begin, row_end), row_begin must be even
+  void convert(const uint8_t *y, const uint8_t *uv, int stride,
+               uint8_t *dst_y, uint8_t *dst_u, uint8_t *dst_v,
+               int row_begin, int row_end) const;
+
+  const int in_width, in_height, out_width, out_height;
+
+private:
+  void scale_rows(const uint8_t *y, const uint8_t *uv, int stride,
+                  uint8_t *dst_y, uint8_t *dst_u, uint8_t *dst_v,
+                  int row_begin, int row_end) const;
+
+  bool scaling, avx2;
+  int y_y0, y_dy, uv_y0, uv_dy;  // 16.16 fixed point source row of the first output row, and the row step
+  std::vector<int32_t> y_xs, uv_xs;  // source byte offset in the row of every output column
+  int y_simd_width, uv_simd_width;   // columns that are safe to load 4 bytes at
+};
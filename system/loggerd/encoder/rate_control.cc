@@ -0,0 +1,105 @@
+#include "system/loggerd/encoder/rate_control.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdlib>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+uint64_t frame_sad(const uint8_t *a, int stride_a, const uint8_t *b, int stride_b, int width, int height) {
+  uint64_t sad = 0;
+  for (int r = 0; r < height; ++r, a += stride_a, b += stride_b) {
+    int c = 0;
+#if defined(__x86_64__)
+    __m128i acc = _mm_setzero_si128();
+    for (; c + 16 <= width; c += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i *)(a + c));
+      __m128i vb = _mm_loadu_si128((const __m128i *)(b + c));
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+    }
+    sad += _mm_cvtsi128_si64(acc) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+#elif defined(__aarch64__)
+    // 16 bit lanes hold 128 iterations, a row of up to 2048 pixels
+    uint16x8_t acc = vdupq_n_u16(0);
+    for (; c + 16 <= width && c < 2048; c += 16) {
+      acc = vpadalq_u8(acc, vabdq_u8(vld1q_u8(a + c), vld1q_u8(b + c)));
+    }
+    sad += vaddlvq_u16(acc);
+#endif
+    for (; c < width; ++c) {
+      sad += std::abs(a[c] - b[c]);
+    }
+  }
+  return sad;
+}
+
+SegmentRateControl::SegmentRateControl(int bitrate, int fps, int segment_frames, int gop_size, int min_qp, int max_qp)
+  : gop_size(gop_size), segment_frames(segment_frames), segment_bytes((double)bitrate / 8 * segment_frames / fps),
+    min_qp(min_qp), max_qp(max_qp) {
+  assert(gop_size > 0 && segment_frames > 0 && min_qp <= QP_REF && QP_REF <= max_qp);
+  // start from the assumption that an average scene comes out at the target at QP_REF
+  complexity = 4.0;
+  k = segment_bytes / segment_frames / (complexity + INTRA_COST);
+}
+
+void SegmentRateControl::segment_start() {
+  frames = 0;
+  bytes = 0;
+}
+
+double SegmentRateControl::weight(double c, int q) const {
+  return (c + INTRA_COST) * std::exp2((QP_REF - q) / 6.0);
+}
+
+bool SegmentRateControl::add_frame(const uint8_t *y, int width, int height, int stride) {
+  // the mean absolute difference with the previous frame
+  const size_t size = (size_t)width * height;
+  if (prev_y.size() == size) {
+    const double c = (double)frame_sad(y, stride, prev_y.data(), width, width, height) / size;
+    complexity += (c - complexity) * 0.2;
+  }
+  prev_y.resize(size);
+  for (int r = 0; r < height; ++r) {
+    std::copy(y + r * stride, y + r * stride + width, prev_y.begin() + r * width);
+  }
+
+  const bool gop_start = frames % gop_size == 0;
+  if (gop_start) start_gop();
+  pending.push_back(weight(complexity, cur_qp));
+  frames++;
+  return gop_start;
+}
+
+void SegmentRateControl::encoded(size_t size) {
+  bytes += size;
+  if (!pending.empty()) {
+    done_weight += pending.front();
+    done_bytes += size;
+    pending.pop_front();
+  }
+}
+
+void SegmentRateControl::start_gop() {
+  // learn from the frames that came out since the last GOP
+  if (done_weight > 0) {
+    k += (done_bytes / done_weight - k) * 0.5;
+    done_weight = done_bytes = 0;
+  }
+
+  // what's left of the budget, minus what's still in the codec, spread over the rest of the segment
+  double in_codec = 0;
+  for (double w : pending) in_codec += w * k;
+  const int frames_left = std::max(segment_frames - frames, gop_size);
+  const double nominal = segment_bytes / segment_frames * gop_size;
+  const double target = std::max((segment_bytes - bytes - in_codec) * gop_size / frames_left, nominal * 0.25);
+
+  // the QP at which the GOP is expected to hit the target, in steps of at most 4
+  const double expected = k * gop_size * weight(complexity, QP_REF);
+  const int q = std::lround(QP_REF - 6.0 * std::log2(target / expected));
+  cur_qp = std::clamp(q, std::max(min_qp, cur_qp - 4), std::min(max_qp, cur_qp + 4));
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// sum of absolute differences of two 8 bit planes
+uint64_t frame_sad(const uint8_t *a, int stride_a, const uint8_t *b, int stride_b, int width, int height);
+
+// Picks the QP of every GOP so that a segment comes out close to
+// bitrate * segment length bytes, whatever the scene.
+//
+// The size of a frame is modeled as k * (complexity + INTRA_COST) * 2^((QP_REF - qp) / 6),
+// where complexity is the mean absolute difference with the previous frame,
+// measured on the downscaled luma. k is learned from the encoded sizes.
+class SegmentRateControl {
+public:
+  SegmentRateControl(int bitrate, int fps, int segment_frames, int gop_size, int min_qp = 20, int max_qp = 44);
+  // a new segment starts with the next frame
+  void segment_start();
+  // the luma of the next frame to encode, returns true if it starts a GOP
+  bool add_frame(const uint8_t *y, int width, int height, int stride);
+  // the QP of the current GOP
+  int qp() const { return cur_qp; }
+  // a packet came out of the codec
+  void encoded(size_t bytes);
+
+  const int gop_size, segment_frames;
+  const double segment_bytes;
+
+  static constexpr int QP_REF = 30;
+  static constexpr double INTRA_COST = 2.0;
+
+private:
+  void start_gop();
+  double weight(double complexity, int qp) const;
+
+  const int min_qp, max_qp;
+  int cur_qp = QP_REF;
+  std::vector<uint8_t> prev_y;
+  int frames = 0;    // added in this segment
+  double bytes = 0;  // encoded in this segment
+  double complexity;  // recent average, per frame
+  double k;           // bytes per unit of weight
+  // the weights of the frames still in the codec, and of the frames that came out since k was updated
+  std::deque<double> pending;
+  double done_weight = 0, done_bytes = 0;
+};
@@ -1,47 +1,35 @@
 #include "system/loggerd/loggerd.h"
+#include "system/loggerd/encoder/encode_pool.h"
 
 ExitHandler do_exit;
 
+// encoding threads shared by all streams, and what to do with frames when a stream falls behind
+const int ENCODER_POOL_THREADS = util::getenv("ENCODER_POOL_THREADS", 4);
+const FramePolicy ENCODER_FRAME_POLICY = frame_policy_from_string(util::getenv("ENCODER_FRAME_POLICY", "wait"));
+
 struct EncoderdState {
-  int max_waiting = 0;
+  EncoderdState(int cameras) : sync(cameras), pool(ENCODER_POOL_THREADS) {}
 
-  // Sync logic for startup
-  std::atomic<int> encoders_ready = 0;
-  std::atomic<uint32_t> start_frame_id = 0;
-  bool camera_ready[WideRoadCam + 1] = {};
-  bool camera_synced[WideRoadCam + 1] = {};
+  // startup: all cameras start at the same frame id
+  FrameSync sync;
+  EncodePool pool;
 };
 
-// Handle initial encoder syncing by waiting for all encoders to reach the same frame id
-bool sync_encoders(EncoderdState *s, CameraType cam_type, uint32_t frame_id) {
-  if (s->camera_synced[cam_type]) return true;
-
-  if (s->max_waiting > 1 && s->encoders_ready != s->max_waiting) {
-    // add a small margin to the start frame id in case one of the encoders already dropped the next frame
-    update_max_atomic(s->start_frame_id, frame_id + 2);
-    if (std::exchange(s->camera_ready[cam_type], true) == false) {
-      ++s->encoders_ready;
-      LOGD("camera %d encoder ready", cam_type);
-    }
-    return false;
-  } else {
-    if (s->max_waiting == 1) update_max_atomic(s->start_frame_id, frame_id);
-    bool synced = frame_id >= s->start_frame_id;
-    s->camera_synced[cam_type] = synced;
-    if (!synced) LOGD("camera %d waiting for frame %d, cur %d", cam_type, (int)s->start_frame_id, frame_id);
-    return synced;
-  }
-}
-
-
 void encoder_thread(EncoderdState *s, const LogCameraInfo &cam_info) {
   util::set_thread_name(cam_info.filename);
 
   std::vector<Encoder *> encoders;
+  // main and qcamera are encoded independently on the pool
+  std::vector<std::unique_ptr<EncodeStream>> streams;
   VisionIpcClient vipc_client = VisionIpcClient("camerad", cam_info.stream_type, false);
 
+  std::optional<uint32_t> start_frame_id;
   int cur_seg = 0;
   while (!do_exit) {
+    // the queued frames point into the buffers of the previous connection
+    for (auto &stream : streams) {
+      stream->flush();
+    }
     if (!vipc_client.connect(false)) {
       util::sleep_for(5);
       continue;
@@ -58,16 +46,18 @@ void encoder_thread(EncoderdState *s, const LogCameraInfo &cam_info) {
                                       cam_info.fps, cam_info.bitrate,
                                       cam_info.is_h265 ? cereal::EncodeIndex::Type::FULL_H_E_V_C : cereal::EncodeIndex::Type::QCAMERA_H264,
                                       buf_info.width, buf_info.height, false));
+        streams.emplace_back(new EncodeStream(encoders.back(), cam_info.filename, &s->pool, ENCODER_FRAME_POLICY));
         // qcamera encoder
         if (cam_info.has_qcamera) {
           encoders.push_back(new Encoder(qcam_info.filename, cam_info.type, buf_info.width, buf_info.height,
                                         qcam_info.fps, qcam_info.bitrate,
                                         qcam_info.is_h265 ? cereal::EncodeIndex::Type::FULL_H_E_V_C : cereal::EncodeIndex::Type::QCAMERA_H264,
                                         qcam_info.frame_width, qcam_info.frame_height, false));
+          streams.emplace_back(new EncodeStream(encoders.back(), qcam_info.filename, &s->pool, ENCODER_FRAME_POLICY));
         }
       } else {
         LOGE("not initting empty encoder");
-        s->max_waiting--;
+        s->sync.leave();
         break;
       }
     }
@@ -92,33 +82,33 @@ void encoder_thread(EncoderdState *s, const LogCameraInfo &cam_info) {
       }
       lagging = false;
 
-      if (!sync_encoders(s, cam_info.type, extra.frame_id)) {
-        continue;
+      // wait for the other cameras, then skip to the common start frame
+      if (!start_frame_id) {
+        start_frame_id = s->sync.arrive(cam_info.type, extra.frame_id, 50);
+        if (!start_frame_id) continue;
+        LOGD("camera %d starting at frame %d, cur %d", cam_info.type, *start_frame_id, extra.frame_id);
       }
+      if (extra.frame_id < *start_frame_id) continue;
       if (do_exit) break;
 
       // do rotation if required
       const int frames_per_seg = SEGMENT_LENGTH * MAIN_FPS;
-      if (cur_seg >= 0 && extra.frame_id >= ((cur_seg + 1) * frames_per_seg) + s->start_frame_id) {
-        for (auto &e : encoders) {
-          e->encoder_close();
-          e->encoder_open(NULL);
-        }
+      bool rotate = false;
+      if (cur_seg >= 0 && extra.frame_id >= ((cur_seg + 1) * frames_per_seg) + *start_frame_id) {
+        rotate = true;
         ++cur_seg;
       }
 
       // encode a frame
-      for (int i = 0; i < encoders.size(); ++i) {
-        int out_id = encoders[i]->encode_frame(buf, &extra);
-
-        if (out_id == -1) {
-          LOGE("Failed to encode frame. frame_id: %d", extra.frame_id);
-        }
+      for (auto &stream : streams) {
+        stream->push(buf, extra, rotate);
       }
     }
   }
 
   LOG("encoder destroy");
+  // waits for the queued frames
+  streams.clear();
   for(auto &e : encoders) {
     e->encoder_close();
     delete e;
@@ -126,12 +116,11 @@ void encoder_thread(EncoderdState *s, const LogCameraInfo &cam_info) {
 }
 
 void encoderd_thread() {
-  EncoderdState s;
+  EncoderdState s(std::size(cameras_logged));
 
   std::vector<std::thread> encoder_threads;
   for (const auto &cam : cameras_logged) {
     encoder_threads.push_back(std::thread(encoder_thread, &s, cam));
-    s.max_waiting++;
   }
   for (auto &t : encoder_threads) t.join();
 }
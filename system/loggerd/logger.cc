@@ -1,9 +1,12 @@
 #include "system/loggerd/logger.h"
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <ftw.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
 #include <cstdint>
@@ -17,8 +20,198 @@
 
 #include "common/params.h"
 #include "common/swaglog.h"
+#include "common/timing.h"
 #include "common/version.h"
 
+// ***** RawFile *****
+
+RawFile::RawFile(const char* path, size_t prealloc_size, bool compress) : compress(compress) {
+#ifdef O_DIRECT
+  fd = HANDLE_EINTR(open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0664));
+  direct_io = fd >= 0;
+#endif
+  if (fd < 0) {
+    // O_DIRECT is not supported by every filesystem, e.g. tmpfs
+    fd = HANDLE_EINTR(open(path, O_WRONLY | O_CREAT | O_TRUNC, 0664));
+  }
+  assert(fd >= 0);
+
+#ifdef __linux__
+  if (prealloc_size > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, prealloc_size) != 0) {
+    LOGD("fallocate %s failed: %d", path, errno);
+  }
+#endif
+
+  for (auto buf : {&buffers[0], &buffers[1], &out}) {
+    int err = posix_memalign((void**)&buf->data, ALIGNMENT, buf == &out ? OUT_BUFFER_SIZE : BUFFER_SIZE);
+    assert(err == 0);
+  }
+  thread = std::thread(&RawFile::flush_thread, this);
+}
+
+RawFile::~RawFile() {
+  {
+    std::unique_lock lk(lock);
+    cv.wait(lk, [this] { return pending == nullptr; });
+    exit = true;
+  }
+  cv.notify_all();
+  thread.join();
+
+  pack(*cur, true);
+  write_out(true, true);
+
+  // release the unused preallocated space
+  int err = HANDLE_EINTR(ftruncate(fd, file_size));
+  assert(err == 0);
+  sync();
+  err = close(fd);
+  assert(err == 0);
+
+  for (auto buf : {&buffers[0], &buffers[1], &out}) free(buf->data);
+}
+
+void RawFile::write(const void* data, size_t size) {
+  // start a new buffer rather than splitting a message, so compressed streams end on message
+  // boundaries. only a message bigger than a buffer is split, and runs on over several streams
+  if (cur->size > 0 && cur->size + size > BUFFER_SIZE) {
+    swap_buffers(false, true);
+  }
+
+  unflushed = true;
+  const uint8_t* src = (const uint8_t*)data;
+  while (size > 0) {
+    const size_t n = std::min(size, BUFFER_SIZE - cur->size);
+    memcpy(cur->data + cur->size, src, n);
+    cur->size += n;
+    src += n;
+    size -= n;
+    if (cur->size == BUFFER_SIZE) {
+      swap_buffers(false, true);
+    }
+  }
+}
+
+void RawFile::flush(bool wait) {
+  if (unflushed || wait) {
+    // the buffer may be empty, with only the tail of the last one, or the open stream, left to write
+    swap_buffers(true, wait);
+    unflushed = false;
+  }
+  if (wait) {
+    std::unique_lock lk(lock);
+    cv.wait(lk, [this] { return pending == nullptr; });
+  }
+}
+
+void RawFile::swap_buffers(bool write_tail, bool end_stream) {
+  // hand the buffer to the flush thread, waiting only if it is still busy with the other one
+  std::unique_lock lk(lock);
+  cv.wait(lk, [this] { return pending == nullptr; });
+  pending = cur;
+  pending_tail = write_tail;
+  pending_end_stream = end_stream;
+  cur = (cur == &buffers[0]) ? &buffers[1] : &buffers[0];
+  cur->size = 0;
+  lk.unlock();
+  cv.notify_all();
+}
+
+void RawFile::sync() {
+  int err = HANDLE_EINTR(fdatasync(fd));
+  if (err != 0) LOGE("fdatasync failed: %d", errno);
+}
+
+void RawFile::flush_thread() {
+  util::set_thread_name("loggerd_flush");
+  std::unique_lock lk(lock);
+  while (true) {
+    cv.wait(lk, [this] { return pending != nullptr || exit; });
+    if (pending == nullptr) break;
+
+    Buffer* buf = pending;
+    const bool write_tail = pending_tail, end_stream = pending_end_stream;
+    lk.unlock();
+    pack(*buf, end_stream);
+    write_out(write_tail, false);
+    lk.lock();
+    pending = nullptr;
+    cv.notify_all();
+  }
+}
+
+void RawFile::pack(const Buffer& buf, bool end_stream) {
+  // every write_out leaves less than a block in out, so a whole buffer always fits after it
+  assert(out.size < ALIGNMENT);
+
+  if (!compress) {
+    memcpy(out.data + out.size, buf.data, buf.size);
+    out.size += buf.size;
+    return;
+  }
+  // an empty buffer only ends the stream, if one is open
+  if (buf.size == 0 && !(stream_open && end_stream)) return;
+
+  if (!stream_open) {
+    // the smallest blocks, the fastest to sort. this runs for every byte of the rlog
+    int err = BZ2_bzCompressInit(&strm, 1, 0, 30);
+    assert(err == BZ_OK);
+    stream_open = true;
+  }
+  strm.next_in = (char*)buf.data;
+  strm.avail_in = buf.size;
+  strm.next_out = (char*)out.data + out.size;
+  strm.avail_out = OUT_BUFFER_SIZE - out.size;
+  // a buffer and the block left over from an early flush fit in the output buffer, even if
+  // bzip2 grows them by ~1%
+  int err = BZ2_bzCompress(&strm, end_stream ? BZ_FINISH : BZ_RUN);
+  assert(err == (end_stream ? BZ_STREAM_END : BZ_RUN_OK));
+  assert(strm.avail_in == 0);
+  out.size = OUT_BUFFER_SIZE - strm.avail_out;
+  if (end_stream) {
+    BZ2_bzCompressEnd(&strm);
+    stream_open = false;
+  }
+}
+
+void RawFile::write_out(bool write_tail, bool final) {
+  // O_DIRECT writes whole blocks, the tail that doesn't fill one is kept for the next call
+  const size_t size = direct_io ? out.size & ~(ALIGNMENT - 1) : out.size;
+  write_at(out.data, size, file_size);
+  file_size += size;
+  memmove(out.data, out.data + size, out.size - size);
+  out.size -= size;
+
+  if (out.size > 0 && (write_tail || final)) {
+    // written padded, and again from the same offset once the block fills up
+    memset(out.data + out.size, 0, ALIGNMENT - out.size);
+    write_at(out.data, ALIGNMENT, file_size);
+    if (final) {
+      // the padding is not part of the file
+      file_size += out.size;
+      out.size = 0;
+    }
+  }
+}
+
+void RawFile::write_at(const uint8_t* data, size_t size, size_t offset) {
+  size_t written = 0;
+  while (written < size) {
+    ssize_t ret = HANDLE_EINTR(pwrite(fd, data + written, size - written, offset + written));
+    if (ret < 0 && errno == EINVAL && direct_io) {
+      // some filesystems accept O_DIRECT on open but not on write
+      direct_io = false;
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+      continue;
+    }
+    if (ret < 0) {
+      LOGE("failed to write file. errno=%d", errno);
+    }
+    assert(ret >= 0);
+    written += ret;
+  }
+}
+
 // ***** log metadata *****
 kj::Array<capnp::word> logger_build_init_data() {
   MessageBuilder msg;
@@ -92,12 +285,6 @@ std::string logger_get_route_name() {
   return route_name;
 }
 
-void log_init_data(LoggerState *s) {
-  auto bytes = s->init_data.asBytes();
-  logger_log(s, bytes.begin(), bytes.size(), s->has_qlog);
-}
-
-
 static void lh_log_sentinel(LoggerHandle *h, SentinelType type) {
   MessageBuilder msg;
   auto sen = msg.initEvent().initSentinel();
@@ -117,10 +304,46 @@ void logger_init(LoggerState *s, bool has_qlog) {
   s->has_qlog = has_qlog;
   s->route_name = logger_get_route_name();
   s->init_data = logger_build_init_data();
+  s->rotate_cnt = 0;
+  s->rotate_ms = s->max_rotate_ms = 0;
+}
+
+std::string logger_segment_path(LoggerState *s, const char* root_path, int part) {
+  return util::string_format("%s/%s--%d", root_path, s->route_name.c_str(), part);
+}
+
+// a segment opened ahead of time is marked while its directory is new, so one left behind
+// by a crash before it became the current segment can be told apart on the next start
+bool logger_create_preopened_dir(const std::string &segment_path) {
+  if (!util::create_directories(util::dir_name(segment_path), 0775)) return false;
+  if (mkdir(segment_path.c_str(), 0775) != 0) return errno == EEXIST;
+
+  int fd = HANDLE_EINTR(open((segment_path + "/" LOGGER_PREOPENED_MARKER).c_str(), O_WRONLY | O_CREAT, 0664));
+  if (fd >= 0) close(fd);
+  return true;
+}
+
+static int remove_path(const char *path, const struct stat *, int, struct FTW *) {
+  return remove(path);
+}
+
+void logger_remove_preopened(const char* root_path) {
+  DIR *d = opendir(root_path);
+  if (!d) return;
+  while (struct dirent *de = readdir(d)) {
+    const std::string segment_path = util::string_format("%s/%s", root_path, de->d_name);
+    if (de->d_name[0] != '.' && util::file_exists(segment_path + "/" LOGGER_PREOPENED_MARKER)) {
+      LOGW("removing %s, it was opened ahead of time and never used", segment_path.c_str());
+      nftw(segment_path.c_str(), remove_path, 16, FTW_DEPTH | FTW_PHYS);
+    }
+  }
+  closedir(d);
 }
 
-static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
+// opens the files of a segment and writes its metadata, without touching the current segment
+static LoggerHandle* logger_open(LoggerState *s, const char* root_path, int part, SentinelType start_sentinel, bool preopen) {
   LoggerHandle *h = NULL;
+  pthread_mutex_lock(&s->lock);
   for (int i=0; i<LOGGER_MAX_HANDLES; i++) {
     if (s->handles[i].refcnt == 0) {
       h = &s->handles[i];
@@ -128,63 +351,114 @@ static LoggerHandle* logger_open(LoggerState *s, const char* root_path) {
     }
   }
   assert(h);
+  pthread_mutex_init(&h->lock, NULL);
+  h->refcnt++;
+  pthread_mutex_unlock(&s->lock);
 
-  snprintf(h->segment_path, sizeof(h->segment_path),
-          "%s/%s--%d", root_path, s->route_name.c_str(), s->part);
-
-  snprintf(h->log_path, sizeof(h->log_path), "%s/rlog", h->segment_path);
-  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog", h->segment_path);
+  snprintf(h->segment_path, sizeof(h->segment_path), "%s", logger_segment_path(s, root_path, part).c_str());
+  snprintf(h->log_path, sizeof(h->log_path), "%s/rlog.bz2", h->segment_path);
+  snprintf(h->qlog_path, sizeof(h->qlog_path), "%s/qlog.bz2", h->segment_path);
   snprintf(h->lock_path, sizeof(h->lock_path), "%s.lock", h->log_path);
   h->end_sentinel_type = SentinelType::END_OF_SEGMENT;
   h->exit_signal = 0;
 
-  if (!util::create_directories(h->segment_path, 0775)) return nullptr;
-
-  FILE* lock_file = fopen(h->lock_path, "wb");
-  if (lock_file == NULL) return NULL;
+  FILE* lock_file = NULL;
+  if (preopen ? logger_create_preopened_dir(h->segment_path) : util::create_directories(h->segment_path, 0775)) {
+    lock_file = fopen(h->lock_path, "wb");
+  }
+  if (lock_file == NULL) {
+    pthread_mutex_lock(&s->lock);
+    h->refcnt--;
+    pthread_mutex_destroy(&h->lock);
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+  }
   fclose(lock_file);
 
-  h->log = std::make_unique<RawFile>(h->log_path);
+  h->log = std::make_unique<RawFile>(h->log_path, RLOG_PREALLOC_SIZE, true);
   if (s->has_qlog) {
-    h->q_log = std::make_unique<RawFile>(h->qlog_path);
+    h->q_log = std::make_unique<RawFile>(h->qlog_path, QLOG_PREALLOC_SIZE, true);
   }
 
-  pthread_mutex_init(&h->lock, NULL);
-  h->refcnt++;
+  // write beginning of log metadata
+  auto bytes = s->init_data.asBytes();
+  lh_log(h, bytes.begin(), bytes.size(), s->has_qlog);
+  lh_log_sentinel(h, start_sentinel);
   return h;
 }
 
+// removes a segment that was opened ahead of time and never used
+static void lh_discard(LoggerHandle* h) {
+  pthread_mutex_lock(&h->lock);
+  assert(h->refcnt == 1);
+  h->log.reset(nullptr);
+  h->q_log.reset(nullptr);
+  unlink(h->log_path);
+  unlink(h->qlog_path);
+  unlink(h->lock_path);
+  unlink((std::string(h->segment_path) + "/" LOGGER_PREOPENED_MARKER).c_str());
+  if (rmdir(h->segment_path) != 0) {
+    LOGW("failed to remove unused segment %s: %d", h->segment_path, errno);
+  }
+  h->refcnt--;
+  pthread_mutex_unlock(&h->lock);
+  pthread_mutex_destroy(&h->lock);
+}
+
+// Rotation only swaps the current handle for one that was opened in the background
+// while the previous segment was written. Closing the previous segment, which
+// flushes and syncs its files, is also left to the background.
 int logger_next(LoggerState *s, const char* root_path,
                             char* out_segment_path, size_t out_segment_path_len,
                             int* out_part) {
+  const double start_ts = millis_since_boot();
   bool is_start_of_route = !s->cur_handle;
-
-  pthread_mutex_lock(&s->lock);
-  s->part++;
-
-  LoggerHandle* next_h = logger_open(s, root_path);
+  const int part = s->part + 1;
+
+  LoggerHandle* next_h = NULL;
+  if (s->next_handle.valid()) {
+    // waits if it's still being opened
+    next_h = s->next_handle.get();
+    if (next_h && s->next_root != root_path) {
+      lh_discard(next_h);
+      next_h = NULL;
+    }
+  }
   if (!next_h) {
-    pthread_mutex_unlock(&s->lock);
-    return -1;
+    next_h = logger_open(s, root_path, part, is_start_of_route ? SentinelType::START_OF_ROUTE : SentinelType::START_OF_SEGMENT, false);
+    if (!next_h) return -1;
   }
+  // in use from here on, whichever of the loggers created the directory
+  unlink((std::string(next_h->segment_path) + "/" LOGGER_PREOPENED_MARKER).c_str());
 
-  if (s->cur_handle) {
-    lh_close(s->cur_handle);
-  }
+  pthread_mutex_lock(&s->lock);
+  LoggerHandle* prev_h = s->cur_handle;
   s->cur_handle = next_h;
+  s->part = part;
+  pthread_mutex_unlock(&s->lock);
 
   if (out_segment_path) {
     snprintf(out_segment_path, out_segment_path_len, "%s", next_h->segment_path);
   }
   if (out_part) {
-    *out_part = s->part;
+    *out_part = part;
   }
 
-  pthread_mutex_unlock(&s->lock);
-
-  // write beginning of log metadata
-  log_init_data(s);
-  lh_log_sentinel(s->cur_handle, is_start_of_route ? SentinelType::START_OF_ROUTE : SentinelType::START_OF_SEGMENT);
+  s->next_root = root_path;
+  s->next_handle = std::async(std::launch::async, [s, prev_h, root = s->next_root, part]() {
+    util::set_thread_name("loggerd_rotate");
+    if (prev_h) {
+      lh_close(prev_h);
+    }
+    return logger_open(s, root.c_str(), part + 1, SentinelType::START_OF_SEGMENT, true);
+  });
+
+  if (!is_start_of_route) {
+    const double ms = millis_since_boot() - start_ts;
+    s->rotate_cnt++;
+    s->rotate_ms = ms;
+    s->max_rotate_ms = std::max(s->max_rotate_ms, ms);
+  }
   return 0;
 }
 
@@ -209,6 +483,12 @@ void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog) {
 }
 
 void logger_close(LoggerState *s, ExitHandler *exit_handler) {
+  // this also waits for the previous segment to be closed
+  if (s->next_handle.valid()) {
+    LoggerHandle* h = s->next_handle.get();
+    if (h) lh_discard(h);
+  }
+
   pthread_mutex_lock(&s->lock);
   if (s->cur_handle) {
     s->cur_handle->exit_signal = exit_handler && exit_handler->signal.load();
@@ -218,6 +498,20 @@ void logger_close(LoggerState *s, ExitHandler *exit_handler) {
   pthread_mutex_unlock(&s->lock);
 }
 
+void logger_flush(LoggerState *s, bool wait) {
+  pthread_mutex_lock(&s->lock);
+  LoggerHandle* h = s->cur_handle;
+  if (h) {
+    pthread_mutex_lock(&h->lock);
+    h->log->flush(wait);
+    if (h->q_log) {
+      h->q_log->flush(wait);
+    }
+    pthread_mutex_unlock(&h->lock);
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog) {
   pthread_mutex_lock(&h->lock);
   assert(h->refcnt > 0);
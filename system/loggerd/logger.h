@@ -5,8 +5,13 @@
 
 #include <cstdint>
 #include <cstdio>
+#include <condition_variable>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <thread>
 
+#include <bzlib.h>
 #include <capnp/serialize.h>
 #include <kj/array.h>
 
@@ -18,26 +23,66 @@
 const std::string LOG_ROOT = Path::log_root();
 
 #define LOGGER_MAX_HANDLES 16
+#define RLOG_PREALLOC_SIZE (32 * 1024 * 1024)
+#define QLOG_PREALLOC_SIZE (2 * 1024 * 1024)
+// in a segment opened ahead of time until it becomes the current one
+#define LOGGER_PREOPENED_MARKER "preopened"
 
+// Log file writer. Messages are copied into a double buffer, and full buffers
+// are handed to a dedicated flush thread, so the caller never waits on the disk
+// unless both buffers are in flight. flush() hands over a partly filled buffer
+// too, loggerd does that every second so a crash loses at most that much.
+// With compression enabled the file is a sequence of bzip2 streams with 100k
+// blocks, one stream per full buffer. flush() doesn't end the stream, the
+// messages wait in the block being filled, so a crash also loses those. only
+// flush(true) ends it early. Buffers end on message boundaries unless a message
+// is bigger than a buffer, so a file cut short by a crash stays readable up to
+// its last complete block.
+// Space is preallocated with fallocate and the file is written with O_DIRECT
+// where the filesystem supports it. A failed write asserts, as fwrite did.
 class RawFile {
  public:
-  RawFile(const char* path) {
-    file = util::safe_fopen(path, "wb");
-    assert(file != nullptr);
-  }
-  ~RawFile() {
-    util::safe_fflush(file);
-    int err = fclose(file);
-    assert(err == 0);
-  }
-  inline void write(void* data, size_t size) {
-    int written = util::safe_fwrite(data, 1, size, file);
-    assert(written == size);
-  }
+  RawFile(const char* path, size_t prealloc_size = 0, bool compress = false);
+  ~RawFile();
+  void write(const void* data, size_t size);
   inline void write(kj::ArrayPtr<capnp::byte> array) { write(array.begin(), array.size()); }
+  // writes out what was buffered so far. if wait is set, the compressed stream is ended
+  // and it waits for everything to reach the page cache
+  void flush(bool wait = false);
+  void sync();
+
+  static constexpr size_t BUFFER_SIZE = 1024 * 1024;
+  static constexpr size_t OUT_BUFFER_SIZE = 2 * BUFFER_SIZE;
+  static constexpr size_t ALIGNMENT = 4096;
 
  private:
-  FILE* file = nullptr;
+  struct Buffer {
+    uint8_t* data = nullptr;
+    size_t size = 0;
+  };
+  void swap_buffers(bool write_tail, bool end_stream);
+  void flush_thread();
+  void pack(const Buffer& buf, bool end_stream);
+  void write_out(bool write_tail, bool final);
+  void write_at(const uint8_t* data, size_t size, size_t offset);
+
+  int fd = -1;
+  bool direct_io = false;
+  const bool compress;
+  size_t file_size = 0;
+  Buffer buffers[2];
+  Buffer out;  // bytes ready to be written, only touched by the flush thread
+  Buffer* cur = &buffers[0];
+  Buffer* pending = nullptr;
+  bool pending_tail = false;  // also write the O_DIRECT tail of out, padded to a block
+  bool pending_end_stream = false;
+  bz_stream strm = {};  // the compressed stream, open across buffers flushed early
+  bool stream_open = false;
+  bool unflushed = false;  // written since the last flush()
+  bool exit = false;
+  std::mutex lock;
+  std::condition_variable cv;
+  std::thread thread;
 };
 
 typedef cereal::Sentinel::SentinelType SentinelType;
@@ -64,10 +109,19 @@ typedef struct LoggerState {
 
   LoggerHandle handles[LOGGER_MAX_HANDLES];
   LoggerHandle* cur_handle;
+
+  // the next segment is opened, and the previous one closed, in the background. see logger_next
+  std::future<LoggerHandle*> next_handle;
+  std::string next_root;
+
+  // time spent in logger_next when rotating, the writers are blocked for this long
+  int rotate_cnt;
+  double rotate_ms, max_rotate_ms;
 } LoggerState;
 
 kj::Array<capnp::word> logger_build_init_data();
 std::string logger_get_route_name();
+std::string logger_segment_path(LoggerState *s, const char* root_path, int part);
 void logger_init(LoggerState *s, bool has_qlog);
 int logger_next(LoggerState *s, const char* root_path,
                             char* out_segment_path, size_t out_segment_path_len,
@@ -75,6 +129,9 @@ int logger_next(LoggerState *s, const char* root_path,
 LoggerHandle* logger_get_handle(LoggerState *s);
 void logger_close(LoggerState *s, ExitHandler *exit_handler=nullptr);
 void logger_log(LoggerState *s, uint8_t* data, size_t data_size, bool in_qlog);
+void logger_flush(LoggerState *s, bool wait = false);
+bool logger_create_preopened_dir(const std::string &segment_path);
+void logger_remove_preopened(const char* root_path);
 
 void lh_log(LoggerHandle* h, uint8_t* data, size_t data_size, bool in_qlog);
 void lh_close(LoggerHandle* h);
@@ -1,4 +1,7 @@
 #include "system/loggerd/loggerd.h"
+#include "system/loggerd/encode_ring.h"
+#include "system/loggerd/qlog_filter.h"
+#include "system/loggerd/scheduler.h"
 #include "system/loggerd/video_writer.h"
 
 ExitHandler do_exit;
@@ -21,6 +24,9 @@ void logger_rotate(LoggerdState *s) {
   s->ready_to_rotate = 0;
   s->last_rotate_tms = millis_since_boot();
   LOGW((s->logger.part == 0) ? "logging to %s" : "rotated to %s", s->segment_path);
+  if (s->logger.rotate_cnt > 0) {
+    LOGD("rotation took %.2f ms, max %.2f ms over %d rotations", s->logger.rotate_ms, s->logger.max_rotate_ms, s->logger.rotate_cnt);
+  }
 }
 
 void rotate_if_needed(LoggerdState *s) {
@@ -49,15 +55,50 @@ void rotate_if_needed(LoggerdState *s) {
 
 struct RemoteEncoder {
   std::unique_ptr<VideoWriter> writer;
+  // the file of the next segment is opened, and the one of the previous segment finished, in the background
+  std::future<std::unique_ptr<VideoWriter>> next_writer;
+  int next_writer_segment = -1;
+  std::future<void> prev_writer;
+  std::shared_ptr<EncodeRingReader> ring;  // shared with the packets queued in the writer
   int encoderd_segment_offset;
   int current_segment = -1;
   std::vector<Message *> q;
   int dropped_frames = 0;
+  int missing_packets = 0;  // overwritten in the encoder ring before loggerd got to them
   bool recording = false;
   bool marked_ready_to_rotate = false;
   bool seen_first_packet = false;
 };
 
+static VideoWriter *open_video_writer(const std::string &segment_path, const LogCameraInfo &cam_info, cereal::EncodeIndex::Type type) {
+  return new VideoWriter(segment_path.c_str(), cam_info.filename, type != cereal::EncodeIndex::Type::FULL_H_E_V_C,
+                         cam_info.frame_width, cam_info.frame_height, cam_info.fps, type);
+}
+
+// the writer for the current segment, normally opened during the previous one
+static std::unique_ptr<VideoWriter> take_video_writer(LoggerdState *s, RemoteEncoder &re, const LogCameraInfo &cam_info, cereal::EncodeIndex::Type type) {
+  std::unique_ptr<VideoWriter> writer;
+  if (re.next_writer.valid()) {
+    writer = re.next_writer.get();
+    if (re.next_writer_segment != s->rotate_segment) {
+      writer->discard();
+      writer.reset();
+    }
+  }
+  if (!writer) {
+    writer.reset(open_video_writer(s->segment_path, cam_info, type));
+  }
+
+  re.next_writer_segment = s->rotate_segment + 1;
+  const std::string next_path = logger_segment_path(&s->logger, LOG_ROOT.c_str(), re.next_writer_segment);
+  re.next_writer = std::async(std::launch::async, [next_path, &cam_info, type]() {
+    // the logger may not have created the directory yet
+    logger_create_preopened_dir(next_path);
+    return std::unique_ptr<VideoWriter>(open_video_writer(next_path, cam_info, type));
+  });
+  return writer;
+}
+
 int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct RemoteEncoder &re) {
   const LogCameraInfo &cam_info = (name == "driverEncodeData") ? cameras_logged[1] :
     ((name == "wideRoadEncodeData") ? cameras_logged[2] :
@@ -87,7 +128,9 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
     // if this is a new segment, we close any possible old segments, move to the new, and process any queued packets
     if (re.current_segment != s->rotate_segment) {
       if (re.recording) {
-        re.writer.reset();
+        // the destructor drains the queue of the writer thread, don't wait for it here
+        if (re.prev_writer.valid()) re.prev_writer.wait();
+        re.prev_writer = std::async(std::launch::async, [writer = std::move(re.writer)]() mutable { writer.reset(); });
         re.recording = false;
       }
       re.current_segment = s->rotate_segment;
@@ -112,9 +155,9 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
         }
         // if we aren't actually recording, don't create the writer
         if (cam_info.record) {
-          re.writer.reset(new VideoWriter(s->segment_path,
-            cam_info.filename, idx.getType() != cereal::EncodeIndex::Type::FULL_H_E_V_C,
-            cam_info.frame_width, cam_info.frame_height, cam_info.fps, idx.getType()));
+          const double start_ts = millis_since_boot();
+          re.writer = take_video_writer(s, re, cam_info, idx.getType());
+          LOGD("%s: writer for segment %d ready in %.2f ms", name.c_str(), s->rotate_segment.load(), millis_since_boot() - start_ts);
           // write the header
           auto header = edata.getHeader();
           re.writer->write((uint8_t *)header.begin(), header.size(), idx.getTimestampEof()/1000, true, false);
@@ -135,7 +178,22 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
     // if we are actually writing the video file, do so
     if (re.writer) {
       auto data = edata.getData();
-      re.writer->write((uint8_t *)data.begin(), data.size(), idx.getTimestampEof()/1000, false, flags & V4L2_BUF_FLAG_KEYFRAME);
+      if (data.size() > 0 || idx.getLen() == 0) {
+        re.writer->write((uint8_t *)data.begin(), data.size(), idx.getTimestampEof()/1000, false, flags & V4L2_BUF_FLAG_KEYFRAME);
+      } else {
+        // the payload is in the shared ring of encoderd, the writer writes it from there
+        auto pkt = re.ring ? re.ring->get(idx.getEncodeId(), idx.getLen()) : std::nullopt;
+        if (!pkt) {
+          // encoderd may have restarted with a new ring. the old one stays mapped until its queued packets are written
+          re.ring = std::make_shared<EncodeRingReader>(name);
+          pkt = re.ring->get(idx.getEncodeId(), idx.getLen());
+        }
+        if (pkt) {
+          re.writer->write(re.ring, *pkt, idx.getTimestampEof()/1000, flags & V4L2_BUF_FLAG_KEYFRAME);
+        } else {
+          LOGE("%s: packet %d missing in encoder ring, %d missing so far", name.c_str(), idx.getEncodeId(), ++re.missing_packets);
+        }
+      }
     }
 
     // put it in log stream as the idx packet
@@ -177,36 +235,30 @@ int handle_encoder_msg(LoggerdState *s, Message *msg, std::string &name, struct
 
 void loggerd_thread() {
   // setup messaging
-  typedef struct QlogState {
-    std::string name;
-    int counter, freq;
-    bool encoder;
-  } QlogState;
-  std::unordered_map<SubSocket*, QlogState> qlog_states;
   std::unordered_map<SubSocket*, struct RemoteEncoder> remote_encoders;
 
   std::unique_ptr<Context> ctx(Context::create());
-  std::unique_ptr<Poller> poller(Poller::create());
+  ServiceScheduler scheduler;
+  QlogFilter qlog_filter;
 
   // subscribe to all socks
-  for (const auto& it : services) {
-    const bool encoder = strcmp(it.name+strlen(it.name)-strlen("EncodeData"), "EncodeData") == 0;
-    if (!it.should_log && !encoder) continue;
+  assert(QLOG_FILTER_SERVICES == std::size(services));
+  for (int i = 0; i < std::size(services); ++i) {
+    const auto &it = services[i];
+    assert(strcmp(it.name, QLOG_FILTER_NAMES[i]) == 0);
+    const bool encoder = QLOG_FILTER_RULES[i].flags & QLOG_FILTER_ENCODER;
+    if (!(QLOG_FILTER_RULES[i].flags & QLOG_FILTER_LOGGED) && !encoder) continue;
     LOGD("logging %s (on port %d)", it.name, it.port);
 
     SubSocket * sock = SubSocket::create(ctx.get(), it.name);
     assert(sock != NULL);
-    poller->registerSocket(sock);
-    qlog_states[sock] = {
-      .name = it.name,
-      .counter = 0,
-      .freq = it.decimation,
-      .encoder = encoder,
-    };
+    // video has a deadline, give it a larger share when everything is backed up
+    scheduler.add(sock, it.name, encoder ? 4 : 1)->service = i;
   }
 
   LoggerdState s;
-  // init logger
+  // init logger, after removing the segment opened ahead of time by a loggerd that crashed
+  logger_remove_preopened(LOG_ROOT.c_str());
   logger_init(&s.logger, true);
   logger_rotate(&s);
   Params().put("CurrentRoute", s.logger.route_name);
@@ -220,43 +272,60 @@ void loggerd_thread() {
 
   uint64_t msg_count = 0, bytes_count = 0;
   double start_ts = millis_since_boot();
+  double last_report_ts = start_ts, last_flush_ts = start_ts;
+  const ServiceScheduler::Handler handle = [&](ServiceQueue &q, Message *msg) {
+    if (QLOG_FILTER_RULES[q.service].flags & QLOG_FILTER_ENCODER) {
+      s.last_camera_seen_tms = millis_since_boot();
+      bytes_count += handle_encoder_msg(&s, msg, q.name, remote_encoders[q.sock]);
+    } else {
+      // the qlog gets the same bytes as the rlog
+      const bool in_qlog = qlog_filter(q.service, (uint8_t *)msg->getData(), msg->getSize());
+      logger_log(&s.logger, (uint8_t *)msg->getData(), msg->getSize(), in_qlog);
+      bytes_count += msg->getSize();
+      delete msg;
+    }
+
+    rotate_if_needed(&s);
+
+    if ((++msg_count % 1000) == 0) {
+      double seconds = (millis_since_boot() - start_ts) / 1000.0;
+      LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count / seconds, bytes_count * 0.001 / seconds);
+    }
+  };
+
   while (!do_exit) {
-    // poll for new messages on all sockets
-    for (auto sock : poller->poll(1000)) {
-      if (do_exit) break;
-
-      // drain socket
-      int count = 0;
-      QlogState &qs = qlog_states[sock];
-      Message *msg = nullptr;
-      while (!do_exit && (msg = sock->receive(true))) {
-        const bool in_qlog = qs.freq != -1 && (qs.counter++ % qs.freq == 0);
-
-        if (qs.encoder) {
-          s.last_camera_seen_tms = millis_since_boot();
-          bytes_count += handle_encoder_msg(&s, msg, qs.name, remote_encoders[sock]);
-        } else {
-          logger_log(&s.logger, (uint8_t *)msg->getData(), msg->getSize(), in_qlog);
-          bytes_count += msg->getSize();
-          delete msg;
-        }
+    // wait for new messages, then serve the sockets in rounds until all of them are empty.
+    // sockets that become readable in between join the next round
+    scheduler.poll(1000);
+    while (!do_exit && scheduler.round(handle)) {
+      scheduler.poll(0);
+    }
 
-        rotate_if_needed(&s);
+    // the logs are buffered in loggerd until a buffer fills, a crash shouldn't lose more than a second
+    if (millis_since_boot() - last_flush_ts > 1000) {
+      logger_flush(&s.logger);
+      last_flush_ts = millis_since_boot();
+    }
 
-        if ((++msg_count % 1000) == 0) {
-          double seconds = (millis_since_boot() - start_ts) / 1000.0;
-          LOGD("%lu messages, %.2f msg/sec, %.2f KB/sec", msg_count, msg_count / seconds, bytes_count * 0.001 / seconds);
-        }
+    if (millis_since_boot() - last_report_ts > 10000) {
+      scheduler.report();
+      last_report_ts = millis_since_boot();
+    }
+  }
 
-        count++;
-        if (count >= 200) {
-          LOGD("large volume of '%s' messages", qs.name.c_str());
-          break;
-        }
-      }
+  // remove the files opened for the segment that never started, the logger removes its directory
+  for (auto &[sock, re] : remote_encoders) {
+    if (re.next_writer.valid()) {
+      auto writer = re.next_writer.get();
+      writer->discard();
     }
   }
 
+  if (do_exit.power_failure) {
+    // the buffered logs first, closing the segment takes longer
+    logger_flush(&s.logger, true);
+  }
+
   LOGW("closing logger");
   logger_close(&s.logger, &do_exit);
 
@@ -265,9 +334,6 @@ void loggerd_thread() {
     sync();
     LOGE("sync done");
   }
-
-  // messaging cleanup
-  for (auto &[sock, qs] : qlog_states) delete sock;
 }
 
 int main(int argc, char** argv) {
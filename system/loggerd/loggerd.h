@@ -6,6 +6,7 @@
 #include <cassert>
 #include <cerrno>
 #include <condition_variable>
+#include <future>
 #include <mutex>
 #include <string>
 #include <thread>
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "cereal/messaging/messaging.h"
+
+enum QlogFilterFlags : uint8_t {
+  QLOG_FILTER_LOGGED = 1 << 0,    // goes in the rlog
+  QLOG_FILTER_ENCODER = 1 << 1,   // video stream, its index goes in the logs
+  QLOG_FILTER_DECIMATE = 1 << 2,  // every nth message goes in the qlog
+  QLOG_FILTER_INTERVAL = 1 << 3,  // at most one message per interval goes in the qlog
+};
+
+struct QlogFilterRule {
+  uint8_t flags;
+  uint16_t decimation;
+  uint32_t interval_ms;
+};
+
+// QLOG_FILTER_RULES and QLOG_FILTER_NAMES, generated from cereal/services.py by qlog_filter.py
+#include "system/loggerd/qlog_filter_rules.h"
+
+const size_t QLOG_FILTER_SERVICES = sizeof(QLOG_FILTER_RULES) / sizeof(QLOG_FILTER_RULES[0]);
+
+// Decides which messages go in the qlog, by service index in services[].
+// The rules are a table built with the code, the only state is a counter per service.
+class QlogFilter {
+public:
+  QlogFilter() : state(QLOG_FILTER_SERVICES) {}
+
+  inline bool operator()(int service, const uint8_t *data, size_t size) {
+    const QlogFilterRule &rule = QLOG_FILTER_RULES[service];
+    if (rule.flags & QLOG_FILTER_DECIMATE) {
+      // counts down to the next message to keep, same as counter++ % decimation == 0
+      uint64_t &counter = state[service];
+      if (counter == 0) {
+        counter = rule.decimation - 1;
+        return true;
+      }
+      --counter;
+      return false;
+    }
+    if (rule.flags & QLOG_FILTER_INTERVAL) {
+      // the time the next message can be kept
+      uint64_t &next_ns = state[service];
+      const uint64_t mono_time = log_mono_time(data, size);
+      if (mono_time >= next_ns) {
+        next_ns = mono_time + rule.interval_ms * 1000000ULL;
+        return true;
+      }
+      return false;
+    }
+    return false;
+  }
+
+private:
+  static uint64_t log_mono_time(const uint8_t *data, size_t size) {
+    capnp::FlatArrayMessageReader cmsg(kj::ArrayPtr<capnp::word>((capnp::word *)data, size / sizeof(capnp::word)));
+    return cmsg.getRoot<cereal::Event>().getLogMonoTime();
+  }
+
+  std::vector<uint64_t> state;
+};
@@ -0,0 +1,43 @@
+#!/usr/bin/env python3
+from cereal.services import service_list
+
+# Services that go in the qlog at a fixed rate, no matter how often they're published.
+# ms between qlog messages, replaces the count based decimation from services.py
+QLOG_INTERVAL_MS = {
+  # depending on the receiver it runs at 1-10Hz
+  "gpsLocationExternal": 1000,
+}
+
+
+def build_header():
+  h = ""
+  h += "/* THIS IS AN AUTOGENERATED FILE, PLEASE EDIT system/loggerd/qlog_filter.py */\n"
+  h += "#pragma once\n\n"
+  h += "// same order as services[] in cereal/services.h\n"
+
+  rules, names = "", ""
+  for k, v in service_list.items():
+    flags = []
+    if v.should_log:
+      flags.append("QLOG_FILTER_LOGGED")
+    if k.endswith("EncodeData"):
+      flags.append("QLOG_FILTER_ENCODER")
+
+    decimation, interval_ms = 0, 0
+    if k in QLOG_INTERVAL_MS:
+      flags.append("QLOG_FILTER_INTERVAL")
+      interval_ms = QLOG_INTERVAL_MS[k]
+    elif v.decimation is not None:
+      flags.append("QLOG_FILTER_DECIMATE")
+      decimation = v.decimation
+
+    rules += "  {%s, %d, %d},\n" % (" | ".join(flags) or "0", decimation, interval_ms)
+    names += '  "%s",\n' % k
+
+  h += "static const QlogFilterRule QLOG_FILTER_RULES[] = {\n" + rules + "};\n\n"
+  h += "static const char *QLOG_FILTER_NAMES[] = {\n" + names + "};\n"
+  return h
+
+
+if __name__ == "__main__":
+  print(build_header())
@@ -0,0 +1,123 @@
+#include "system/loggerd/scheduler.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "common/swaglog.h"
+#include "common/timing.h"
+
+static uint64_t log_mono_time(Message *msg) {
+  try {
+    capnp::FlatArrayMessageReader cmsg(kj::ArrayPtr<capnp::word>((capnp::word *)msg->getData(), msg->getSize() / sizeof(capnp::word)));
+    return cmsg.getRoot<cereal::Event>().getLogMonoTime();
+  } catch (const kj::Exception &) {
+    return 0;
+  }
+}
+
+ServiceScheduler::ServiceScheduler(std::function<double()> clock_ms) : poller(Poller::create()), clock_ms(clock_ms) {
+  window_start_ms = clock_ms();
+}
+
+ServiceScheduler::~ServiceScheduler() {
+  for (auto &q : queues) delete q->sock;
+}
+
+ServiceQueue *ServiceScheduler::add(SubSocket *sock, const std::string &name, int weight) {
+  assert(sock != nullptr && weight > 0);
+  poller->registerSocket(sock);
+  auto &q = queues.emplace_back(new ServiceQueue{.sock = sock, .name = name, .weight = weight});
+  by_socket[sock] = q.get();
+  return q.get();
+}
+
+void ServiceScheduler::poll(int timeout_ms) {
+  for (auto sock : poller->poll(timeout_ms)) {
+    ServiceQueue *q = by_socket.at(sock);
+    if (!q->active) {
+      q->active = true;
+      active.push_back(q);
+    }
+  }
+}
+
+bool ServiceScheduler::round(const Handler &handle) {
+  update_rates();
+
+  next_active.clear();
+  for (ServiceQueue *q : active) {
+    q->deficit += std::max(SCHEDULER_MIN_QUANTUM, (int64_t)(q->rate * SCHEDULER_ROUND_MS / 1000.0)) * q->weight;
+
+    bool first = true, empty = false;
+    while (q->deficit > 0) {
+      Message *msg = q->sock->receive(true);
+      if (msg == nullptr) {
+        empty = true;
+        break;
+      }
+      const size_t size = msg->getSize();
+      q->deficit -= size;
+      q->window_bytes += size;
+      q->bytes += size;
+      q->msgs++;
+      q->max_depth = std::max(q->max_depth, ++q->depth);
+      // parsing every message only for the stats costs as much as logging it. the first message
+      // of the round is the oldest one waiting, so it's the latest and the only one measured
+      if (first) {
+        if (uint64_t t = log_mono_time(msg); t > 0) {
+          double lateness = (nanos_since_boot() - t) / 1e6;
+          q->lateness_ms += lateness;
+          q->lateness_samples++;
+          q->max_lateness_ms = std::max(q->max_lateness_ms, lateness);
+        }
+        first = false;
+      }
+      handle(*q, msg);
+    }
+
+    if (empty) {
+      // empty, the unused budget doesn't carry over
+      q->deficit = 0;
+      q->depth = 0;
+      q->active = false;
+    } else {
+      next_active.push_back(q);
+    }
+  }
+  active.swap(next_active);
+  return !active.empty();
+}
+
+void ServiceScheduler::update_rates() {
+  const double now = clock_ms();
+  const double dt = now - window_start_ms;
+  if (dt < SCHEDULER_RATE_WINDOW_MS) return;
+
+  for (auto &q : queues) {
+    const double rate = q->window_bytes / (dt / 1000.0);
+    q->rate = q->rate == 0 ? rate : 0.7 * q->rate + 0.3 * rate;
+    q->window_bytes = 0;
+  }
+  window_start_ms = now;
+}
+
+void ServiceScheduler::report(double lateness_warning_ms) {
+  const ServiceQueue *worst = nullptr;
+  for (auto &q : queues) {
+    if (q->max_lateness_ms > lateness_warning_ms) {
+      LOGW("%s: %lu msgs, %.1f KB/s, max depth %d, lateness avg %.1f ms max %.1f ms", q->name.c_str(), q->msgs,
+           q->rate / 1000.0, q->max_depth, q->lateness_ms / std::max<uint64_t>(q->lateness_samples, 1), q->max_lateness_ms);
+    }
+    if (!worst || q->max_lateness_ms > worst->max_lateness_ms) worst = q.get();
+  }
+  if (worst) {
+    LOGD("max lateness %.1f ms on %s", worst->max_lateness_ms, worst->name.c_str());
+  }
+
+  for (auto &q : queues) {
+    q->msgs = q->bytes = 0;
+    q->max_depth = 0;
+    q->lateness_ms = q->max_lateness_ms = 0;
+    q->lateness_samples = 0;
+  }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cereal/messaging/messaging.h"
+#include "common/timing.h"
+
+const double SCHEDULER_ROUND_MS = 5.0;      // each round a socket may read this much of its measured traffic
+const int64_t SCHEDULER_MIN_QUANTUM = 4096;  // bytes, for services that are idle or just started
+const double SCHEDULER_RATE_WINDOW_MS = 1000.0;
+
+struct ServiceQueue {
+  SubSocket *sock;
+  std::string name;
+  int weight;
+  int service = -1;  // index in services[], for the handler
+
+  // deficit round robin
+  int64_t deficit = 0;
+  bool active = false;
+  double rate = 0;  // bytes/s
+  uint64_t window_bytes = 0;
+
+  // stats since the last report
+  uint64_t msgs = 0, bytes = 0;
+  int depth = 0, max_depth = 0;  // messages read since the socket was last empty
+  double lateness_ms = 0, max_lateness_ms = 0;  // now - logMonoTime, of the first message read each round
+  uint64_t lateness_samples = 0;
+};
+
+// Reads the subscribed sockets in weighted deficit round robin. Every round a
+// socket gets a byte budget proportional to its weight and its measured rate,
+// and is read until the budget is spent or it's empty, so a burst on a high
+// rate service can't starve the others.
+class ServiceScheduler {
+public:
+  using Handler = std::function<void(ServiceQueue &, Message *)>;
+
+  // the rates are measured over windows of clock_ms, tests drive it themselves
+  ServiceScheduler(std::function<double()> clock_ms = millis_since_boot);
+  ~ServiceScheduler();
+  ServiceQueue *add(SubSocket *sock, const std::string &name, int weight = 1);
+  // wait up to timeout_ms for sockets to become readable and queue them for the next round
+  void poll(int timeout_ms);
+  // serve every queued socket once, handle takes ownership of the message. returns whether any socket has messages left
+  bool round(const Handler &handle);
+  // log services that fell behind and reset the stats
+  void report(double lateness_warning_ms = 100.0);
+  const std::vector<std::unique_ptr<ServiceQueue>> &services() const { return queues; }
+
+private:
+  void update_rates();
+
+  std::unique_ptr<Poller> poller;
+  std::vector<std::unique_ptr<ServiceQueue>> queues;
+  std::unordered_map<SubSocket *, ServiceQueue *> by_socket;
+  std::vector<ServiceQueue *> active, next_active;
+  const std::function<double()> clock_ms;
+  double window_start_ms;
+};
@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <iterator>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "common/prefix.h"
+#include "common/timing.h"
+#include "common/util.h"
+#include "system/loggerd/encoder/ffmpeg_encoder.h"
+#include "system/loggerd/loggerd.h"
+
+// Feeds synthetic camera frames to the encoders the same way encoderd does,
+// one thread per camera, and reports the throughput and the encode latency.
+// The first run is paced at 20Hz, the second one runs as fast as possible.
+// usage: benchmark_encoder [seconds]
+
+const int BUF_COUNT = 4;
+
+struct FakeCamera {
+  FakeCamera(int width, int height) {
+    const int stride = (width + 127) & ~127, scanlines = (height + 31) & ~31;
+    std::mt19937 gen(width);
+    for (auto &buf : bufs) {
+      buf.allocate(stride * scanlines * 3 / 2);
+      buf.init_yuv(width, height, stride, stride * scanlines);
+    }
+    // a moving gradient with some noise, so the codec has realistic work to do
+    for (int i = 0; i < BUF_COUNT; ++i) {
+      for (int r = 0; r < height; ++r) {
+        for (int c = 0; c < width; ++c) bufs[i].y[r * stride + c] = (r + c + i * 8 + gen() % 16) & 0xff;
+      }
+      for (int r = 0; r < height / 2; ++r) {
+        for (int c = 0; c < width; ++c) bufs[i].uv[r * stride + c] = (128 + (c % 2 ? r : c) / 16 + gen() % 4) & 0xff;
+      }
+    }
+  }
+  ~FakeCamera() {
+    for (auto &buf : bufs) buf.free();
+  }
+  VisionBuf bufs[BUF_COUNT];
+};
+
+struct Result {
+  std::mutex lock;
+  std::vector<double> latency_ms;
+  int frames = 0, late = 0;
+};
+
+void camera_thread(const LogCameraInfo &cam_info, int frame_cnt, bool paced, Result *result) {
+  FakeCamera camera(cam_info.frame_width, cam_info.frame_height);
+  std::vector<std::unique_ptr<Encoder>> encoders;
+  encoders.emplace_back(new Encoder(cam_info.filename, cam_info.type, cam_info.frame_width, cam_info.frame_height,
+                                    cam_info.fps, cam_info.bitrate, cereal::EncodeIndex::Type::FULL_H_E_V_C,
+                                    cam_info.frame_width, cam_info.frame_height, false));
+  if (cam_info.has_qcamera) {
+    encoders.emplace_back(new Encoder(qcam_info.filename, cam_info.type, cam_info.frame_width, cam_info.frame_height,
+                                      qcam_info.fps, qcam_info.bitrate, cereal::EncodeIndex::Type::QCAMERA_H264,
+                                      qcam_info.frame_width, qcam_info.frame_height, false));
+  }
+  for (auto &e : encoders) e->encoder_open(NULL);
+
+  std::vector<double> latency;
+  int late = 0;
+  const double frame_ms = 1000.0 / MAIN_FPS;
+  const double start = millis_since_boot();
+  for (int i = 0; i < frame_cnt; ++i) {
+    if (paced) {
+      double wait = start + i * frame_ms - millis_since_boot();
+      if (wait > 0) util::sleep_for(wait);
+    }
+
+    VisionIpcBufExtra extra = {};
+    extra.frame_id = i;
+    extra.timestamp_sof = nanos_since_boot();
+    extra.timestamp_eof = extra.timestamp_sof;
+    double t = millis_since_boot();
+    for (auto &e : encoders) {
+      int ret = e->encode_frame(&camera.bufs[i % BUF_COUNT], &extra);
+      assert(ret >= 0);
+    }
+    latency.push_back(millis_since_boot() - t);
+    late += latency.back() > frame_ms;
+  }
+  for (auto &e : encoders) e->encoder_close();
+
+  std::lock_guard lk(result->lock);
+  result->latency_ms.insert(result->latency_ms.end(), latency.begin(), latency.end());
+  result->frames += frame_cnt;
+  result->late += late;
+}
+
+void run(const char *name, int frame_cnt, bool paced) {
+  Result result;
+  std::vector<std::thread> threads;
+  const double start = millis_since_boot();
+  for (const auto &cam : cameras_logged) {
+    threads.emplace_back(camera_thread, cam, frame_cnt, paced, &result);
+  }
+  for (auto &t : threads) t.join();
+  const double seconds = (millis_since_boot() - start) / 1000.0;
+
+  auto &l = result.latency_ms;
+  std::sort(l.begin(), l.end());
+  auto percentile = [&](double p) { return l[std::min(l.size() - 1, (size_t)(p * l.size()))]; };
+  printf("%-8s %6d frames %8.1f frames/s  latency p50 %6.2f ms  p99 %6.2f ms  max %6.2f ms  over %.0f ms: %d\n",
+         name, result.frames, result.frames / seconds, percentile(0.5), percentile(0.99), l.back(), 1000.0 / MAIN_FPS, result.late);
+}
+
+int main(int argc, char **argv) {
+  const int seconds = argc > 1 ? atoi(argv[1]) : 10;
+  OpenpilotPrefix prefix;
+  printf("%zu cameras at %d Hz\n", std::size(cameras_logged), MAIN_FPS);
+  run("paced", seconds * MAIN_FPS, true);
+  run("max", seconds * MAIN_FPS, false);
+  return 0;
+}
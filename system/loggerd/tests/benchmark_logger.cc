@@ -0,0 +1,83 @@
+#include <cassert>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common/timing.h"
+#include "common/util.h"
+#include "system/loggerd/logger.h"
+
+// Measures the throughput of logger_log with message sizes similar to a drive,
+// compared to writing every message with fwrite under a mutex.
+// usage: benchmark_logger [log root] [messages]
+
+std::vector<std::string> build_messages(int count) {
+  // mostly small messages (can, carState, sensorEvents), some large ones (modelV2, liveTracks)
+  std::mt19937 gen(0);
+  std::discrete_distribution<int> kind({70, 25, 5});
+  const std::pair<int, int> sizes[] = {{64, 512}, {512, 4096}, {4096, 65536}};
+  std::vector<std::string> msgs(count);
+  for (auto &m : msgs) {
+    auto [lo, hi] = sizes[kind(gen)];
+    m.resize(std::uniform_int_distribution<int>(lo, hi)(gen) & ~7, 'x');
+  }
+  return msgs;
+}
+
+void report(const char *name, double ms, size_t msg_cnt, size_t bytes) {
+  printf("%-20s %8.1f ms %10.0f msg/s %8.1f MB/s %8.1f ns/msg\n", name, ms, msg_cnt / (ms / 1000.0),
+         bytes / 1e6 / (ms / 1000.0), ms * 1e6 / msg_cnt);
+}
+
+int main(int argc, char **argv) {
+  const std::string log_root = argc > 1 ? argv[1] : "/tmp/benchmark_logger";
+  const int msg_cnt = argc > 2 ? atoi(argv[2]) : 1000000;
+  const int segment_cnt = 5;
+  system(("rm -rf " + log_root).c_str());
+  util::create_directories(log_root, 0775);
+
+  const auto msgs = build_messages(msg_cnt);
+  size_t total_bytes = 0;
+  for (auto &m : msgs) total_bytes += m.size();
+
+  // baseline: one fwrite per message, twice for qlog messages
+  {
+    std::mutex lock;
+    double start = millis_since_boot();
+    for (int seg = 0; seg < segment_cnt; ++seg) {
+      FILE *rlog = util::safe_fopen((log_root + "/fwrite_rlog" + std::to_string(seg)).c_str(), "wb");
+      FILE *qlog = util::safe_fopen((log_root + "/fwrite_qlog" + std::to_string(seg)).c_str(), "wb");
+      for (int i = seg; i < msgs.size(); i += segment_cnt) {
+        std::lock_guard lk(lock);
+        util::safe_fwrite(msgs[i].data(), 1, msgs[i].size(), rlog);
+        if (i % 10 == 0) util::safe_fwrite(msgs[i].data(), 1, msgs[i].size(), qlog);
+      }
+      for (FILE *f : {rlog, qlog}) {
+        util::safe_fflush(f);
+        fdatasync(fileno(f));
+        fclose(f);
+      }
+    }
+    report("fwrite", millis_since_boot() - start, msgs.size(), total_bytes);
+  }
+
+  // logger_log, including rotation
+  {
+    LoggerState logger = {};
+    logger_init(&logger, true);
+    double start = millis_since_boot();
+    for (int seg = 0; seg < segment_cnt; ++seg) {
+      int err = logger_next(&logger, log_root.c_str(), nullptr, 0, nullptr);
+      assert(err == 0);
+      for (int i = seg; i < msgs.size(); i += segment_cnt) {
+        logger_log(&logger, (uint8_t *)msgs[i].data(), msgs[i].size(), i % 10 == 0);
+      }
+    }
+    logger_close(&logger);
+    report("logger_log", millis_since_boot() - start, msgs.size(), total_bytes);
+  }
+
+  system(("rm -rf " + log_root).c_str());
+  return 0;
+}
@@ -0,0 +1,199 @@
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "common/prefix.h"
+#include "common/util.h"
+#include "libyuv.h"
+#include "system/loggerd/encoder/ffmpeg_encoder.h"
+#include "system/loggerd/loggerd.h"
+
+// Encodes a recorded fcamera.hevc to qcamera segments through the rate control,
+// then decodes them and reports the size of every segment and its PSNR
+// against the downscaled input.
+// usage: benchmark_qcam_rate <fcamera.hevc> [output dir]
+// set LOGGERD_TEST=1 LOGGERD_SEGMENT_LENGTH=<seconds> for shorter segments
+
+class VideoDecoder {
+public:
+  VideoDecoder(const std::string &fn) {
+    if (avformat_open_input(&fmt_ctx, fn.c_str(), NULL, NULL) != 0) return;
+    if (avformat_find_stream_info(fmt_ctx, NULL) < 0) return;
+    stream = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    if (stream < 0) return;
+    const AVCodec *codec = avcodec_find_decoder(fmt_ctx->streams[stream]->codecpar->codec_id);
+    if (!codec) return;
+    codec_ctx = avcodec_alloc_context3(codec);
+    avcodec_parameters_to_context(codec_ctx, fmt_ctx->streams[stream]->codecpar);
+    if (avcodec_open2(codec_ctx, codec, NULL) < 0) return;
+    frame = av_frame_alloc();
+    pkt = av_packet_alloc();
+  }
+  ~VideoDecoder() {
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    avcodec_free_context(&codec_ctx);
+    avformat_close_input(&fmt_ctx);
+  }
+  bool valid() const { return frame != NULL; }
+
+  // the next frame in YUV420P, NULL at the end
+  AVFrame *next() {
+    while (true) {
+      int err = avcodec_receive_frame(codec_ctx, frame);
+      if (err == 0) {
+        assert(frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUVJ420P);
+        return frame;
+      }
+      if (err != AVERROR(EAGAIN)) return NULL;
+
+      if (av_read_frame(fmt_ctx, pkt) < 0) {
+        avcodec_send_packet(codec_ctx, NULL);
+        continue;
+      }
+      if (pkt->stream_index == stream) avcodec_send_packet(codec_ctx, pkt);
+      av_packet_unref(pkt);
+    }
+  }
+
+private:
+  AVFormatContext *fmt_ctx = NULL;
+  AVCodecContext *codec_ctx = NULL;
+  AVFrame *frame = NULL;
+  AVPacket *pkt = NULL;
+  int stream = -1;
+};
+
+struct Segment {
+  size_t bytes = 0;
+  int frames = 0, decoded = 0;
+  double psnr = 0;
+};
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("usage: %s <fcamera.hevc> [output dir]\n", argv[0]);
+    return 1;
+  }
+  const std::string out_dir = argc > 2 ? argv[2] : "/tmp/benchmark_qcam_rate";
+  system(("rm -rf " + out_dir).c_str());
+  if (FfmpegEncoder::ffmpeg_codec(cereal::EncodeIndex::Type::QCAMERA_H264) != cereal::EncodeIndex::Type::QCAMERA_H264) {
+    printf("the qcamera isn't encoded with libx264, nothing to rate control\n");
+    return 1;
+  }
+
+  VideoDecoder input(argv[1]);
+  if (!input.valid()) {
+    printf("failed to open %s\n", argv[1]);
+    return 1;
+  }
+  OpenpilotPrefix prefix;
+  const int segment_frames = SEGMENT_LENGTH * qcam_info.fps;
+  const int qw = qcam_info.frame_width, qh = qcam_info.frame_height;
+  std::vector<Segment> segments;
+
+  // encode
+  {
+    std::unique_ptr<FfmpegEncoder> encoder;
+    VisionBuf buf = {};
+    int frame_id = 0;
+    while (AVFrame *f = input.next()) {
+      if (!encoder) {
+        buf.allocate(f->width * f->height * 3 / 2);
+        buf.init_yuv(f->width, f->height, f->width, f->width * f->height);
+        encoder.reset(new FfmpegEncoder(qcam_info.filename, RoadCam, f->width, f->height, qcam_info.fps, qcam_info.bitrate,
+                                        cereal::EncodeIndex::Type::QCAMERA_H264, qw, qh, true));
+      }
+      if (frame_id % segment_frames == 0) {
+        encoder->encoder_close();
+        const std::string path = util::string_format("%s/%zu", out_dir.c_str(), segments.size());
+        util::create_directories(path, 0775);
+        encoder->encoder_open(path.c_str());
+        segments.push_back({});
+      }
+      libyuv::I420ToNV12(f->data[0], f->linesize[0], f->data[1], f->linesize[1], f->data[2], f->linesize[2],
+                         buf.y, buf.stride, buf.uv, buf.stride, f->width, f->height);
+      VisionIpcBufExtra extra = {.frame_id = (uint32_t)frame_id};
+      int ret = encoder->encode_frame(&buf, &extra);
+      assert(ret >= 0);
+      segments.back().frames++;
+      frame_id++;
+    }
+    if (encoder) {
+      encoder->encoder_close();
+      buf.free();
+    }
+  }
+  if (segments.empty()) {
+    printf("no frames in %s\n", argv[1]);
+    return 1;
+  }
+
+  // decode the segments along with the input again, and compare the luma
+  VideoDecoder reference(argv[1]);
+  std::unique_ptr<NV12Converter> converter;
+  std::vector<uint8_t> nv12, y(qw * qh), u(qw * qh / 4 + qw), v(qw * qh / 4 + qw);
+  for (int i = 0; i < segments.size(); ++i) {
+    Segment &seg = segments[i];
+    const std::string fn = util::string_format("%s/%d/%s", out_dir.c_str(), i, qcam_info.filename);
+    struct stat st = {};
+    stat(fn.c_str(), &st);
+    seg.bytes = st.st_size;
+
+    VideoDecoder output(fn);
+    double mse_sum = 0;
+    for (int n = 0; n < seg.frames; ++n) {
+      AVFrame *ref = reference.next();
+      assert(ref);
+      if (!converter) {
+        converter.reset(new NV12Converter(ref->width, ref->height, qw, qh));
+        nv12.resize(ref->width * ref->height * 3 / 2);
+      }
+      uint8_t *ref_uv = nv12.data() + ref->width * ref->height;
+      libyuv::I420ToNV12(ref->data[0], ref->linesize[0], ref->data[1], ref->linesize[1], ref->data[2], ref->linesize[2],
+                         nv12.data(), ref->width, ref_uv, ref->width, ref->width, ref->height);
+      converter->convert(nv12.data(), ref_uv, ref->width, y.data(), u.data(), v.data(), 0, qh);
+
+      AVFrame *out = output.valid() ? output.next() : NULL;
+      if (!out) continue;
+      double se = 0;
+      for (int r = 0; r < qh; ++r) {
+        for (int c = 0; c < qw; ++c) {
+          const int d = out->data[0][r * out->linesize[0] + c] - y[r * qw + c];
+          se += d * d;
+        }
+      }
+      mse_sum += se / (qw * qh);
+      seg.decoded++;
+    }
+    const double mse = mse_sum / std::max(seg.decoded, 1);
+    seg.psnr = mse > 0 ? 10 * std::log10(255.0 * 255.0 / mse) : 100;
+  }
+
+  // only full segments count for the size variance
+  const double target = (double)qcam_info.bitrate / 8 * SEGMENT_LENGTH;
+  std::vector<double> sizes;
+  double psnr_sum = 0;
+  for (int i = 0; i < segments.size(); ++i) {
+    const Segment &seg = segments[i];
+    printf("segment %3d: %5d frames (%5d decoded) %9zu bytes %6.1f%% of target  PSNR %5.2f dB\n",
+           i, seg.frames, seg.decoded, seg.bytes, seg.bytes * 100.0 / target, seg.psnr);
+    if (seg.frames == segment_frames) sizes.push_back(seg.bytes);
+    psnr_sum += seg.psnr;
+  }
+  if (!sizes.empty()) {
+    double mean = 0, var = 0;
+    for (double s : sizes) mean += s / sizes.size();
+    for (double s : sizes) var += (s - mean) * (s - mean) / sizes.size();
+    auto [lo, hi] = std::minmax_element(sizes.begin(), sizes.end());
+    printf("%zu full segments of %d s, target %.0f bytes: mean %.0f stddev %.0f (%.1f%%) min %.0f max %.0f\n",
+           sizes.size(), SEGMENT_LENGTH, target, mean, std::sqrt(var), std::sqrt(var) * 100 / mean, *lo, *hi);
+  }
+  printf("mean PSNR %.2f dB\n", psnr_sum / segments.size());
+  return 0;
+}
@@ -0,0 +1,101 @@
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cereal/messaging/messaging.h"
+#include "cereal/services.h"
+#include "common/timing.h"
+#include "common/util.h"
+#include "system/loggerd/qlog_filter.h"
+#include "tools/replay/util.h"
+
+// Replays a recorded rlog through the qlog filter, compared to the
+// per socket decimation counters loggerd used before it.
+// usage: benchmark_qlog_filter <rlog or rlog.bz2> [passes]
+
+struct LoggedMessage {
+  int service;
+  const uint8_t *data;
+  size_t size;
+};
+
+void report(const char *name, double ms, size_t msg_cnt, size_t qlog_cnt) {
+  printf("%-20s %8.1f ms %8.1f ns/msg %10zu in qlog\n", name, ms, ms * 1e6 / msg_cnt, qlog_cnt);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("usage: %s <rlog or rlog.bz2> [passes]\n", argv[0]);
+    return 1;
+  }
+  const int passes = argc > 2 ? atoi(argv[2]) : 100;
+
+  std::string raw = util::read_file(argv[1]);
+  if (std::string(argv[1]).find(".bz2") != std::string::npos) raw = decompressBZ2(raw);
+  if (raw.empty()) {
+    printf("failed to read %s\n", argv[1]);
+    return 1;
+  }
+
+  // the service of each event, as loggerd knows it from the socket
+  auto event_struct = capnp::Schema::from<cereal::Event>().asStruct();
+  std::vector<int> service_idx(event_struct.getUnionFields().size(), -1);
+  for (int i = 0; i < std::size(services); ++i) {
+    KJ_IF_MAYBE(field, event_struct.findFieldByName(services[i].name)) {
+      service_idx[field->getProto().getDiscriminantValue()] = i;
+    }
+  }
+
+  std::vector<LoggedMessage> msgs;
+  kj::ArrayPtr<const capnp::word> words((const capnp::word *)raw.data(), raw.size() / sizeof(capnp::word));
+  while (words.size() > 0) {
+    capnp::FlatArrayMessageReader reader(words);
+    const int service = service_idx[(uint16_t)reader.getRoot<cereal::Event>().which()];
+    const size_t size = (reader.getEnd() - words.begin()) * sizeof(capnp::word);
+    if (service != -1 && (QLOG_FILTER_RULES[service].flags & QLOG_FILTER_LOGGED)) {
+      msgs.push_back({service, (const uint8_t *)words.begin(), size});
+    }
+    words = kj::arrayPtr(reader.getEnd(), words.end());
+  }
+  printf("%zu logged messages in %s, %d passes\n", msgs.size(), argv[1], passes);
+  if (msgs.empty()) return 1;
+  const size_t msg_cnt = msgs.size() * passes;
+
+  // before: a counter per socket in a hash map, looked up for every message
+  {
+    struct QlogState {
+      std::string name;
+      int counter, freq;
+      bool encoder;
+    };
+    std::unordered_map<const void *, QlogState> qlog_states;
+    for (int i = 0; i < std::size(services); ++i) {
+      qlog_states[&services[i]] = {.name = services[i].name, .counter = 0, .freq = services[i].decimation, .encoder = false};
+    }
+
+    size_t qlog_cnt = 0;
+    double start = millis_since_boot();
+    for (int pass = 0; pass < passes; ++pass) {
+      for (const auto &m : msgs) {
+        QlogState &qs = qlog_states[&services[m.service]];
+        qlog_cnt += qs.freq != -1 && (qs.counter++ % qs.freq == 0);
+      }
+    }
+    report("services map", millis_since_boot() - start, msg_cnt, qlog_cnt);
+  }
+
+  {
+    QlogFilter filter;
+    size_t qlog_cnt = 0;
+    double start = millis_since_boot();
+    for (int pass = 0; pass < passes; ++pass) {
+      for (const auto &m : msgs) {
+        qlog_cnt += filter(m.service, m.data, m.size);
+      }
+    }
+    report("filter table", millis_since_boot() - start, msg_cnt, qlog_cnt);
+  }
+
+  return 0;
+}
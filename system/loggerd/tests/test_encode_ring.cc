@@ -0,0 +1,82 @@
+#include <random>
+#include <string>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "common/prefix.h"
+#include "system/loggerd/encode_ring.h"
+
+static std::string packet_bytes(const EncodePacket &p) {
+  std::string ret;
+  for (int i = 0; i < p.iovcnt; ++i) ret.append((const char *)p.iov[i].iov_base, p.iov[i].iov_len);
+  return ret;
+}
+
+TEST_CASE("EncodeRing") {
+  OpenpilotPrefix prefix;
+  const size_t capacity = 1000;
+  std::mt19937 gen(0);
+  auto random_packet = [&](size_t len) {
+    std::string s(len, 0);
+    for (auto &c : s) c = gen();
+    return s;
+  };
+
+  EncodeRingWriter writer("roadEncodeData", capacity);
+  EncodeRingReader reader("roadEncodeData");
+
+  SECTION("packets wrap around the end of the ring") {
+    for (uint32_t id = 0; id < 100; ++id) {
+      const std::string dat = random_packet(1 + id * 7 % 300);
+      writer.push(id, (const uint8_t *)dat.data(), dat.size());
+      auto p = reader.get(id, dat.size());
+      REQUIRE(p);
+      REQUIRE(reader.intact(*p));
+      REQUIRE(packet_bytes(*p) == dat);
+    }
+  }
+
+  SECTION("overwritten packets are not returned") {
+    const std::string first = random_packet(400);
+    writer.push(0, (const uint8_t *)first.data(), first.size());
+    auto p = reader.get(0, first.size());
+    REQUIRE(p);
+
+    const std::string second = random_packet(400);
+    writer.push(1, (const uint8_t *)second.data(), second.size());
+    REQUIRE(reader.intact(*p));
+    writer.push(2, (const uint8_t *)second.data(), second.size());
+    REQUIRE(!reader.intact(*p));
+    REQUIRE(!reader.get(0, first.size()));
+    REQUIRE(reader.get(2, second.size()));
+  }
+
+  SECTION("missing packets and mismatched lengths") {
+    const std::string dat = random_packet(100);
+    writer.push(5, (const uint8_t *)dat.data(), dat.size());
+    REQUIRE(!reader.get(4, dat.size()));
+    REQUIRE(!reader.get(5, dat.size() + 1));
+    REQUIRE(!reader.get(5 + ENCODE_RING_SLOTS, dat.size()));
+    REQUIRE(reader.get(5, dat.size()));
+  }
+
+  SECTION("a new reader follows a restarted writer") {
+    const std::string old_dat = random_packet(100);
+    writer.push(0, (const uint8_t *)old_dat.data(), old_dat.size());
+    auto old_p = reader.get(0, old_dat.size());
+    REQUIRE(old_p);
+
+    EncodeRingWriter restarted("roadEncodeData", capacity * 2);
+    const std::string dat = random_packet(1500);
+    restarted.push(0, (const uint8_t *)dat.data(), dat.size());
+    REQUIRE(!reader.get(0, dat.size()));
+    EncodeRingReader reopened("roadEncodeData");
+    auto p = reopened.get(0, dat.size());
+    REQUIRE(p);
+    REQUIRE(packet_bytes(*p) == dat);
+
+    // packets of the old ring stay readable while it's mapped
+    REQUIRE(reader.intact(*old_p));
+    REQUIRE(packet_bytes(*old_p) == old_dat);
+  }
+}
@@ -112,7 +112,7 @@ class TestEncoder(unittest.TestCase):
 
         # Check encodeIdx
         if encode_idx_name is not None:
-          rlog_path = f"{route_prefix_path}--{i}/rlog"
+          rlog_path = f"{route_prefix_path}--{i}/rlog.bz2"
           msgs = [m for m in LogReader(rlog_path) if m.which() == encode_idx_name]
           encode_msgs = [getattr(m, encode_idx_name) for m in msgs]
 
@@ -144,9 +144,11 @@ class TestEncoder(unittest.TestCase):
 
     try:
       for i in trange(num_segments):
-        # poll for next segment
+        # poll for the segment to be finished. the next segment's directory is created ahead of time,
+        # the files are done once their locks are removed
         with Timeout(int(SEGMENT_LENGTH*10), error_msg=f"timed out waiting for segment {i}"):
-          while Path(f"{route_prefix_path}--{i+1}") not in Path(ROOT).iterdir():
+          while Path(f"{route_prefix_path}--{i+2}") not in Path(ROOT).iterdir() or \
+                any(Path(f"{route_prefix_path}--{i}").glob("*.lock")):
             time.sleep(0.1)
         check_seg(i)
     finally:
@@ -0,0 +1,391 @@
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "cereal/messaging/messaging.h"
+#include "cereal/visionipc/visionipc_client.h"
+#include "cereal/visionipc/visionipc_server.h"
+#include "common/prefix.h"
+#include "common/util.h"
+#include "system/loggerd/encoder/encode_pool.h"
+#include "system/loggerd/encoder/ffmpeg_encoder.h"
+
+// records the frames it's given, and takes encode_ms for each of them
+class FakeEncoder : public VideoEncoder {
+public:
+  FakeEncoder(int encode_ms) : VideoEncoder("fake", RoadCam, 0, 0, 20, 0, cereal::EncodeIndex::Type::FULL_H_E_V_C, 0, 0, false), encode_ms(encode_ms) {}
+  int encode_frame(VisionBuf *buf, VisionIpcBufExtra *extra) {
+    util::sleep_for(encode_ms);
+    std::lock_guard lk(lock);
+    frame_ids.push_back(extra->frame_id);
+    return 0;
+  }
+  void encoder_open(const char *path) {
+    std::lock_guard lk(lock);
+    opened_at.push_back(frame_ids.size());
+  }
+  void encoder_close() {}
+
+  const int encode_ms;
+  std::mutex lock;
+  std::vector<uint32_t> frame_ids;
+  std::vector<size_t> opened_at;  // the number of frames encoded before each encoder_open
+};
+
+// a FakeEncoder that holds every frame in encode_frame until it's opened
+class GatedEncoder : public FakeEncoder {
+public:
+  GatedEncoder() : FakeEncoder(0) {}
+  int encode_frame(VisionBuf *buf, VisionIpcBufExtra *extra) {
+    {
+      std::unique_lock lk(gate_lock);
+      entered = true;
+      gate_cv.notify_all();
+      gate_cv.wait(lk, [&] { return is_open; });
+    }
+    return FakeEncoder::encode_frame(buf, extra);
+  }
+  // until a frame is held
+  void wait_entered() {
+    std::unique_lock lk(gate_lock);
+    gate_cv.wait(lk, [&] { return entered; });
+  }
+  void open() {
+    std::lock_guard lk(gate_lock);
+    is_open = true;
+    gate_cv.notify_all();
+  }
+
+private:
+  std::mutex gate_lock;
+  std::condition_variable gate_cv;
+  bool entered = false, is_open = false;
+};
+
+TEST_CASE("EncodePool") {
+  SECTION("runs every task") {
+    EncodePool pool(4);
+    std::atomic<int> cnt = 0;
+    for (int i = 0; i < 1000; ++i) {
+      pool.submit([&] { ++cnt; });
+    }
+    while (cnt < 1000) util::sleep_for(1);
+    REQUIRE(cnt == 1000);
+  }
+  SECTION("idle threads take the tasks of a busy one") {
+    std::mutex lock;
+    std::set<std::thread::id> ids;
+    std::atomic<int> cnt = 0;
+    {
+      EncodePool pool(4);
+      for (int i = 0; i < 40; ++i) {
+        pool.submit([&] {
+          util::sleep_for(5);
+          std::lock_guard lk(lock);
+          ids.insert(std::this_thread::get_id());
+          ++cnt;
+        }, 0);
+      }
+      // the destructor runs the queued tasks
+    }
+    REQUIRE(cnt == 40);
+    REQUIRE(ids.size() > 1);
+  }
+}
+
+TEST_CASE("FrameSync") {
+  SECTION("all cameras start at the same frame") {
+    FrameSync sync(3);
+    std::vector<uint32_t> start(3);
+    std::vector<std::thread> threads;
+    for (int cam = 0; cam < 3; ++cam) {
+      threads.emplace_back([&, cam] {
+        util::sleep_for(cam * 20);
+        uint32_t frame_id = 100 + cam;
+        std::optional<uint32_t> ret;
+        while (!(ret = sync.arrive(cam, frame_id++, 10))) {}
+        start[cam] = *ret;
+      });
+    }
+    for (auto &t : threads) t.join();
+    REQUIRE(start[0] == start[1]);
+    REQUIRE(start[1] == start[2]);
+    REQUIRE(start[0] >= 102 + 2);
+  }
+  SECTION("a camera without frames doesn't hold up the others") {
+    FrameSync sync(2);
+    REQUIRE(!sync.arrive(0, 10, 1));
+    sync.leave();
+    REQUIRE(sync.arrive(0, 11, 1) == 12);
+  }
+  SECTION("a single camera starts right away") {
+    FrameSync sync(1);
+    REQUIRE(sync.arrive(0, 10, 1) == 10);
+  }
+}
+
+TEST_CASE("EncodeStream") {
+  const int frame_cnt = 100;
+  VisionBuf buf;
+  buf.allocate(64);
+  EncodePool pool(2);
+
+  auto push_frames = [&](EncodeStream &stream) {
+    for (int i = 0; i < frame_cnt; ++i) {
+      VisionIpcBufExtra extra = {.frame_id = (uint32_t)i};
+      buf.set_frame_id(i);
+      stream.push(&buf, extra, i > 0 && i % 25 == 0);
+    }
+    stream.flush();
+  };
+
+  SECTION("wait encodes every frame") {
+    FakeEncoder encoder(2);
+    EncodeStream stream(&encoder, "fake", &pool, FramePolicy::WAIT);
+    push_frames(stream);
+    REQUIRE(encoder.frame_ids.size() == frame_cnt);
+    for (int i = 0; i < frame_cnt; ++i) REQUIRE(encoder.frame_ids[i] == i);
+    REQUIRE(encoder.opened_at == std::vector<size_t>{25, 50, 75});
+    REQUIRE(stream.stats().frames == frame_cnt);
+    REQUIRE(stream.stats().dropped == 0);
+  }
+
+  // the encoder is held on frame 0 until the other frames are pushed, frames 1 to 7 don't fit in the
+  // queue. frames 3 and 5 rotate, and are dropped, frame 9 rotates too
+  auto push_stalled = [&](GatedEncoder &encoder, EncodeStream &stream) {
+    for (int i = 0; i < 10; ++i) {
+      VisionIpcBufExtra extra = {.frame_id = (uint32_t)i};
+      buf.set_frame_id(i);
+      stream.push(&buf, extra, i == 3 || i == 5 || i == 9);
+      if (i == 0) encoder.wait_entered();
+    }
+    encoder.open();
+    stream.flush();
+  };
+
+  SECTION("drop keeps up with a slow encoder") {
+    GatedEncoder encoder;
+    EncodeStream stream(&encoder, "fake", &pool, FramePolicy::DROP);
+    push_stalled(encoder, stream);
+    const auto st = stream.stats();
+    // the queue is bounded, only the newest frames are left in it
+    REQUIRE(encoder.frame_ids == std::vector<uint32_t>{0, 8, 9});
+    REQUIRE(st.frames == 3);
+    REQUIRE(st.dropped == 7);
+    REQUIRE(st.duplicated == 0);
+    // rotations aren't lost with the frames
+    REQUIRE(encoder.opened_at == std::vector<size_t>{1, 2});
+  }
+  SECTION("duplicate fills in the dropped frames") {
+    GatedEncoder encoder;
+    EncodeStream stream(&encoder, "fake", &pool, FramePolicy::DUPLICATE);
+    push_stalled(encoder, stream);
+    const auto st = stream.stats();
+    // the latest dropped frames are encoded again with the buffer of the next one
+    REQUIRE(encoder.frame_ids == std::vector<uint32_t>{0, 6, 7, 8, 9});
+    REQUIRE(st.frames == 5);
+    REQUIRE(st.dropped == 7);
+    REQUIRE(st.duplicated == 2);
+    REQUIRE(encoder.opened_at == std::vector<size_t>{1, 4});
+  }
+  buf.free();
+}
+
+TEST_CASE("encode synthetic VisionIpc frames with FfmpegEncoder") {
+  OpenpilotPrefix prefix;
+  const int width = 256, height = 128, frame_cnt = 60;
+  const int cameras = 2;
+  const VisionStreamType stream_types[] = {VISION_STREAM_ROAD, VISION_STREAM_DRIVER};
+  const CameraType camera_types[] = {RoadCam, DriverCam};
+  const char *services[] = {"roadEncodeData", "driverEncodeData"};
+
+  VisionIpcServer server("camerad");
+  for (auto type : stream_types) {
+    server.create_buffers(type, 4, false, width, height);
+  }
+  server.start_listener();
+
+  std::unique_ptr<Context> ctx(Context::create());
+  std::vector<std::unique_ptr<SubSocket>> socks;
+  for (auto service : services) {
+    socks.emplace_back(SubSocket::create(ctx.get(), service));
+  }
+
+  // the camera threads, like encoderd's
+  EncodePool pool(4);
+  FrameSync sync(cameras);
+  std::vector<EncodeStream::Stats> stats(cameras);
+  std::vector<std::thread> threads;
+  for (int cam = 0; cam < cameras; ++cam) {
+    threads.emplace_back([&, cam] {
+      VisionIpcClient client("camerad", stream_types[cam], false);
+      while (!client.connect(false)) util::sleep_for(5);
+      FfmpegEncoder encoder("test", camera_types[cam], width, height, 20, 1000000, cereal::EncodeIndex::Type::BIG_BOX_LOSSLESS, width, height, false);
+      encoder.encoder_open(NULL);
+      {
+        EncodeStream stream(&encoder, services[cam], &pool, FramePolicy::WAIT);
+        std::optional<uint32_t> start;
+        VisionIpcBufExtra extra;
+        while (true) {
+          VisionBuf *buf = client.recv(&extra, 1000);
+          if (!buf) break;
+          if (!start && !(start = sync.arrive(cam, extra.frame_id, 50))) continue;
+          if (extra.frame_id < *start) continue;
+          stream.push(buf, extra, false);
+        }
+        stream.flush();
+        stats[cam] = stream.stats();
+      }
+      encoder.encoder_close();
+    });
+  }
+
+  // the second camera starts a few frames late
+  for (int i = 0; i < frame_cnt; ++i) {
+    for (int cam = 0; cam < cameras; ++cam) {
+      if (cam == 1 && i < 5) continue;
+      VisionBuf *buf = server.get_buffer(stream_types[cam]);
+      memset(buf->y, i * 4, width * height);
+      memset(buf->uv, 128, width * height / 2);
+      VisionIpcBufExtra extra = {.frame_id = (uint32_t)i};
+      server.send(buf, &extra);
+    }
+    util::sleep_for(1000 / MAIN_FPS);
+  }
+  for (auto &t : threads) t.join();
+
+  std::set<uint32_t> first_frame_ids;
+  for (int cam = 0; cam < cameras; ++cam) {
+    INFO(services[cam]);
+    REQUIRE(stats[cam].frames > 0);
+    REQUIRE(stats[cam].dropped == 0);
+
+    std::vector<uint32_t> frame_ids;
+    while (Message *msg = socks[cam]->receive(true)) {
+      capnp::FlatArrayMessageReader reader({(capnp::word *)msg->getData(), msg->getSize() / sizeof(capnp::word)});
+      auto event = reader.getRoot<cereal::Event>();
+      auto edata = cam == 0 ? event.getRoadEncodeData() : event.getDriverEncodeData();
+      frame_ids.push_back(edata.getIdx().getFrameId());
+      delete msg;
+    }
+    // a packet for every frame
+    REQUIRE(frame_ids.size() == stats[cam].frames);
+    first_frame_ids.insert(frame_ids.front());
+    REQUIRE(frame_ids.back() == frame_cnt - 1);
+    for (int i = 1; i < frame_ids.size(); ++i) REQUIRE(frame_ids[i] == frame_ids[i - 1] + 1);
+  }
+  REQUIRE(first_frame_ids.size() == 1);
+}
+
+// the number of frames that decode from a video file
+static int decoded_frames(const std::string &fn) {
+  AVFormatContext *fmt_ctx = NULL;
+  if (avformat_open_input(&fmt_ctx, fn.c_str(), NULL, NULL) != 0) return -1;
+  int frames = -1;
+  int stream = avformat_find_stream_info(fmt_ctx, NULL) >= 0 ? av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0) : -1;
+  const AVCodec *codec = stream >= 0 ? avcodec_find_decoder(fmt_ctx->streams[stream]->codecpar->codec_id) : NULL;
+  AVCodecContext *codec_ctx = codec ? avcodec_alloc_context3(codec) : NULL;
+  if (codec_ctx && avcodec_parameters_to_context(codec_ctx, fmt_ctx->streams[stream]->codecpar) >= 0 &&
+      avcodec_open2(codec_ctx, codec, NULL) >= 0) {
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    frames = 0;
+    bool eof = false;
+    while (true) {
+      int err = avcodec_receive_frame(codec_ctx, frame);
+      if (err == 0) {
+        frames++;
+      } else if (err == AVERROR(EAGAIN) && !eof) {
+        if (av_read_frame(fmt_ctx, pkt) < 0) {
+          eof = true;
+          avcodec_send_packet(codec_ctx, NULL);
+        } else {
+          if (pkt->stream_index == stream) avcodec_send_packet(codec_ctx, pkt);
+          av_packet_unref(pkt);
+        }
+      } else {
+        break;
+      }
+    }
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+  }
+  avcodec_free_context(&codec_ctx);
+  avformat_close_input(&fmt_ctx);
+  return frames;
+}
+
+TEST_CASE("FfmpegEncoder qcamera") {
+  if (FfmpegEncoder::ffmpeg_codec(cereal::EncodeIndex::Type::QCAMERA_H264) != cereal::EncodeIndex::Type::QCAMERA_H264) {
+    WARN("libx264 not available, the qcamera is lossless");
+    return;
+  }
+  OpenpilotPrefix prefix;
+  const int width = 512, height = 256, qw = 256, qh = 128, frame_cnt = MAIN_FPS * 4;
+  const std::string path = "/tmp/test_encoderd_qcam";
+  VisionBuf buf;
+  buf.allocate(width * height * 3 / 2);
+  buf.init_yuv(width, height, width, width * height);
+
+  std::unique_ptr<Context> ctx(Context::create());
+  std::unique_ptr<SubSocket> sock(SubSocket::create(ctx.get(), "qRoadEncodeData"));
+
+  // four GOPs of noise, at a bitrate way under and way over what it takes at the first QP
+  auto encode = [&](int bitrate) {
+    const std::string dir = path + "/" + std::to_string(bitrate);
+    util::create_directories(dir, 0775);
+    std::mt19937 gen(0);
+    FfmpegEncoder encoder(qcam_info.filename, RoadCam, width, height, MAIN_FPS, bitrate, cereal::EncodeIndex::Type::QCAMERA_H264, qw, qh, true);
+    encoder.encoder_open(dir.c_str());
+    for (int i = 0; i < frame_cnt; ++i) {
+      for (int p = 0; p < width * height; ++p) buf.y[p] = gen();
+      memset(buf.uv, 128, width * height / 2);
+      VisionIpcBufExtra extra = {.frame_id = (uint32_t)i};
+      REQUIRE(encoder.encode_frame(&buf, &extra) >= 0);
+    }
+    encoder.encoder_close();
+    return dir + "/" + qcam_info.filename;
+  };
+
+  SECTION("the keyframes have the SPS and PPS as their header, and the file remuxes") {
+    const std::string fn = encode(qcam_info.bitrate);
+    int keyframes = 0;
+    while (Message *msg = sock->receive(true)) {
+      capnp::FlatArrayMessageReader reader({(capnp::word *)msg->getData(), msg->getSize() / sizeof(capnp::word)});
+      auto edata = reader.getRoot<cereal::Event>().getQRoadEncodeData();
+      if (edata.getIdx().getFlags() & V4L2_BUF_FLAG_KEYFRAME) {
+        auto header = edata.getHeader();
+        REQUIRE(header.size() > 4);
+        REQUIRE(memcmp(header.begin(), "\x00\x00\x00\x01", 4) == 0);
+        REQUIRE((header[4] & 0x1f) == 7);
+        keyframes++;
+      }
+      delete msg;
+    }
+    REQUIRE(keyframes == frame_cnt / MAIN_FPS);
+    REQUIRE(decoded_frames(fn) == frame_cnt);
+  }
+  SECTION("the QP of the rate control takes effect") {
+    struct stat low = {}, high = {};
+    const std::string low_fn = encode(10000), high_fn = encode(100000000);
+    REQUIRE(stat(low_fn.c_str(), &low) == 0);
+    REQUIRE(stat(high_fn.c_str(), &high) == 0);
+    // with the QP of the first GOP for all of them, the files would come out the same
+    REQUIRE(low.st_size * 2 < high.st_size);
+    REQUIRE(decoded_frames(low_fn) == frame_cnt);
+    REQUIRE(decoded_frames(high_fn) == frame_cnt);
+  }
+  buf.free();
+  system(("rm -rf " + path).c_str());
+}
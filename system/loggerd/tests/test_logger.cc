@@ -19,10 +19,10 @@ void verify_segment(const std::string &route_path, int segment, int max_segment,
   SentinelType begin_sentinel = segment == 0 ? SentinelType::START_OF_ROUTE : SentinelType::START_OF_SEGMENT;
   SentinelType end_sentinel = segment == max_segment - 1 ? SentinelType::END_OF_ROUTE : SentinelType::END_OF_SEGMENT;
 
-  REQUIRE(!util::file_exists(segment_path + "/rlog.lock"));
-  for (const char *fn : {"/rlog", "/qlog"}) {
+  REQUIRE(!util::file_exists(segment_path + "/rlog.bz2.lock"));
+  for (const char *fn : {"/rlog.bz2", "/qlog.bz2"}) {
     const std::string log_file = segment_path + fn;
-    std::string log = util::read_file(log_file);
+    std::string log = decompressBZ2(util::read_file(log_file));
     REQUIRE(!log.empty());
     int event_cnt = 0, i = 0;
     kj::ArrayPtr<const capnp::word> words((capnp::word *)log.data(), log.size() / sizeof(capnp::word));
@@ -79,7 +79,7 @@ TEST_CASE("logger") {
     const int segment_cnt = 100;
     for (int i = 0; i < segment_cnt; ++i) {
       REQUIRE(logger_next(&logger, log_root.c_str(), segment_path, sizeof(segment_path), &segment) == 0);
-      REQUIRE(util::file_exists(std::string(segment_path) + "/rlog.lock"));
+      REQUIRE(util::file_exists(std::string(segment_path) + "/rlog.bz2.lock"));
       REQUIRE(segment == i);
       write_msg(logger.cur_handle);
     }
@@ -145,3 +145,142 @@ TEST_CASE("logger") {
     }
   }
 }
+
+TEST_CASE("logger rotation gap") {
+  // tmpfs, so the gap is the time spent in logger_next rather than waiting on the disk
+  const std::string log_root = "/dev/shm/test_logger_rotation";
+  system(("rm " + log_root + " -rf").c_str());
+
+  LoggerState logger = {};
+  logger_init(&logger, true);
+  const int segment_cnt = 1000;
+  for (int i = 0; i < segment_cnt; ++i) {
+    REQUIRE(logger_next(&logger, log_root.c_str(), nullptr, 0, nullptr) == 0);
+    for (int j = 0; j < 100; ++j) {
+      write_msg(logger.cur_handle);
+    }
+    // the rest of the segment, the next one is opened in the meantime
+    usleep(2000);
+  }
+  ExitHandler do_exit;
+  do_exit.signal = 1;
+  logger_close(&logger, &do_exit);
+
+  INFO("max rotation gap " << logger.max_rotate_ms << " ms");
+  REQUIRE(logger.rotate_cnt == segment_cnt - 1);
+  REQUIRE(logger.max_rotate_ms < 10.0);
+
+  // the segment opened ahead of time for after the last one is removed
+  const std::string route_path = log_root + "/" + logger.route_name;
+  REQUIRE(!util::file_exists(route_path + "--" + std::to_string(segment_cnt)));
+  for (int i = 0; i < segment_cnt; ++i) {
+    verify_segment(route_path, i, segment_cnt, 100);
+  }
+  system(("rm " + log_root + " -rf").c_str());
+}
+
+TEST_CASE("logger segment opened ahead of time") {
+  const std::string log_root = "/tmp/test_logger_preopen";
+  system(("rm " + log_root + " -rf").c_str());
+
+  LoggerState logger = {};
+  logger_init(&logger, true);
+  const std::string route_path = log_root + "/" + logger.route_name;
+  const std::string marker = "/" LOGGER_PREOPENED_MARKER;
+
+  REQUIRE(logger_next(&logger, log_root.c_str(), nullptr, 0, nullptr) == 0);
+  logger.next_handle.wait();
+  REQUIRE(!util::file_exists(route_path + "--0" + marker));
+  REQUIRE(util::file_exists(route_path + "--1" + marker));
+
+  // marked until it becomes the current segment
+  REQUIRE(logger_next(&logger, log_root.c_str(), nullptr, 0, nullptr) == 0);
+  logger.next_handle.wait();
+  REQUIRE(!util::file_exists(route_path + "--1" + marker));
+  REQUIRE(util::file_exists(route_path + "--2" + marker));
+  logger_close(&logger);
+  REQUIRE(!util::file_exists(route_path + "--2"));
+
+  // what a crash leaves behind, removed when loggerd starts again
+  const std::string stale = route_path + "--2";
+  REQUIRE(logger_create_preopened_dir(stale));
+  for (const char *fn : {"/rlog.bz2", "/rlog.bz2.lock", "/fcamera.hevc", "/fcamera.hevc.lock"}) {
+    REQUIRE(util::write_file((stale + fn).c_str(), "x", 1, O_WRONLY | O_CREAT) == 0);
+  }
+  logger_remove_preopened(log_root.c_str());
+  REQUIRE(!util::file_exists(stale));
+  REQUIRE(util::file_exists(route_path + "--0/rlog.bz2"));
+  REQUIRE(util::file_exists(route_path + "--1/rlog.bz2"));
+  system(("rm " + log_root + " -rf").c_str());
+}
+
+TEST_CASE("RawFile compression") {
+  const std::string fn = "/tmp/test_rawfile.bz2";
+  std::string expected;
+  {
+    RawFile f(fn.c_str(), 0, true);
+    for (int i = 0; i < 20000; ++i) {
+      MessageBuilder msg;
+      msg.initEvent().initClocks().setWallTimeNanos(i);
+      auto bytes = msg.toBytes();
+      f.write(bytes.begin(), bytes.size());
+      expected.append((char *)bytes.begin(), bytes.size());
+      // also write messages larger than the buffer
+      if (i % 5000 == 0) {
+        std::string large = util::random_string(RawFile::BUFFER_SIZE * 2 + i);
+        f.write(large.data(), large.size());
+        expected += large;
+      }
+    }
+  }
+  const std::string compressed = util::read_file(fn);
+  REQUIRE(compressed.size() < expected.size());
+  REQUIRE(decompressBZ2(compressed) == expected);
+
+  // a file cut short by a crash is readable up to its last complete stream
+  const std::string truncated = decompressBZ2(compressed.substr(0, compressed.size() - 1000));
+  REQUIRE(truncated.size() > 0);
+  REQUIRE(truncated.size() < expected.size());
+  REQUIRE(expected.compare(0, truncated.size(), truncated) == 0);
+  unlink(fn.c_str());
+}
+
+TEST_CASE("RawFile flush") {
+  const bool compress = GENERATE(false, true);
+  const std::string fn = "/tmp/test_rawfile_flush";
+  std::string expected;
+  RawFile f(fn.c_str(), 0, compress);
+  for (int i = 0; i < 5; ++i) {
+    std::string msg = util::random_string(1000 + i * 5000);
+    f.write(msg.data(), msg.size());
+    expected += msg;
+
+    // everything written so far is in the file, without waiting for a buffer to fill
+    f.flush(true);
+    const std::string content = compress ? decompressBZ2(util::read_file(fn)) : util::read_file(fn);
+    REQUIRE(content.size() >= expected.size());
+    REQUIRE(content.compare(0, expected.size(), expected) == 0);
+  }
+  unlink(fn.c_str());
+}
+
+TEST_CASE("RawFile flush keeps the compressed stream open") {
+  const std::string fn = "/tmp/test_rawfile_timed_flush";
+  std::string expected;
+  {
+    RawFile f(fn.c_str(), 0, true);
+    for (int i = 0; i < 100; ++i) {
+      std::string msg = "message " + std::to_string(i) + std::string(100, 'x');
+      f.write(msg.data(), msg.size());
+      expected += msg;
+      f.flush();
+    }
+  }
+  // one bzip2 stream, not one per flush
+  const std::string compressed = util::read_file(fn);
+  size_t streams = 0;
+  for (size_t pos = 0; (pos = compressed.find("BZh1", pos)) != std::string::npos; ++pos) ++streams;
+  REQUIRE(streams == 1);
+  REQUIRE(decompressBZ2(compressed) == expected);
+  unlink(fn.c_str());
+}
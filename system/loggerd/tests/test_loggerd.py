@@ -16,6 +16,7 @@ from common.basedir import BASEDIR
 from common.params import Params
 from common.timeout import Timeout
 from system.loggerd.config import ROOT
+from system.loggerd.qlog_filter import QLOG_INTERVAL_MS
 from selfdrive.manager.process_config import managed_processes
 from system.version import get_version
 from tools.lib.logreader import LogReader
@@ -116,7 +117,7 @@ class TestLoggerd(unittest.TestCase):
     os.environ["LOGGERD_TEST"] = "1"
     Params().put("RecordFront", "1")
 
-    expected_files = {"rlog", "qlog", "qcamera.ts", "fcamera.hevc", "dcamera.hevc", "ecamera.hevc"}
+    expected_files = {"rlog.bz2", "qlog.bz2", "qcamera.ts", "fcamera.hevc", "dcamera.hevc", "ecamera.hevc"}
     streams = [(VisionStreamType.VISION_STREAM_ROAD, (*tici_f_frame_size, 2048*2346, 2048, 2048*1216), "roadCameraState"),
                (VisionStreamType.VISION_STREAM_DRIVER, (*tici_d_frame_size, 2048*2346, 2048, 2048*1216), "driverCameraState"),
                (VisionStreamType.VISION_STREAM_WIDE_ROAD, (*tici_e_frame_size, 2048*2346, 2048, 2048*1216), "wideRoadCameraState")]
@@ -216,7 +217,7 @@ class TestLoggerd(unittest.TestCase):
     time.sleep(1)
     managed_processes["loggerd"].stop()
 
-    qlog_path = os.path.join(self._get_latest_log_dir(), "qlog")
+    qlog_path = os.path.join(self._get_latest_log_dir(), "qlog.bz2")
     lr = list(LogReader(qlog_path))
 
     # check initData and sentinel
@@ -233,6 +234,11 @@ class TestLoggerd(unittest.TestCase):
       if s in no_qlog_services:
         # check services with no specific decimation aren't in qlog
         self.assertEqual(recv_cnt, 0, f"got {recv_cnt} {s} msgs in qlog")
+      elif s in QLOG_INTERVAL_MS:
+        # check logged messages are at least the interval apart
+        log_times = [m.logMonoTime for m in recv_msgs[s]]
+        self.assertGreater(recv_cnt, 0, f"got no {s} msgs in qlog")
+        self.assertTrue(all(np.diff(log_times) >= QLOG_INTERVAL_MS[s] * 1e6), f"{s} msgs in qlog closer than {QLOG_INTERVAL_MS[s]} ms")
       else:
         # check logged message count matches decimation
         expected_cnt = (len(msgs) - 1) // service_list[s].decimation + 1
@@ -262,7 +268,7 @@ class TestLoggerd(unittest.TestCase):
     time.sleep(2)
     managed_processes["loggerd"].stop()
 
-    lr = list(LogReader(os.path.join(self._get_latest_log_dir(), "rlog")))
+    lr = list(LogReader(os.path.join(self._get_latest_log_dir(), "rlog.bz2")))
 
     # check initData and sentinel
     self._check_init_data(lr)
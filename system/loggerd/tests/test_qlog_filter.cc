@@ -0,0 +1,70 @@
+#include <cstring>
+#include <iterator>
+
+#include "catch2/catch.hpp"
+#include "cereal/messaging/messaging.h"
+#include "cereal/services.h"
+#include "system/loggerd/qlog_filter.h"
+
+static kj::Array<capnp::word> event_at(uint64_t mono_time) {
+  MessageBuilder msg;
+  msg.initEvent().setLogMonoTime(mono_time);
+  return capnp::messageToFlatArray(msg);
+}
+
+TEST_CASE("QlogFilter") {
+  QlogFilter filter;
+
+  SECTION("the rules match services[]") {
+    REQUIRE(QLOG_FILTER_SERVICES == std::size(services));
+    for (int i = 0; i < std::size(services); ++i) {
+      const QlogFilterRule &rule = QLOG_FILTER_RULES[i];
+      INFO(services[i].name);
+      REQUIRE(strcmp(services[i].name, QLOG_FILTER_NAMES[i]) == 0);
+      REQUIRE(bool(rule.flags & QLOG_FILTER_LOGGED) == services[i].should_log);
+      if (rule.flags & QLOG_FILTER_DECIMATE) {
+        REQUIRE(rule.decimation == services[i].decimation);
+      } else if (!(rule.flags & QLOG_FILTER_INTERVAL)) {
+        REQUIRE(services[i].decimation == -1);
+      }
+    }
+  }
+
+  SECTION("count based decimation") {
+    auto event = event_at(0);
+    const uint8_t *data = (const uint8_t *)event.begin();
+    for (int i = 0; i < std::size(services); ++i) {
+      const QlogFilterRule &rule = QLOG_FILTER_RULES[i];
+      if (rule.flags & QLOG_FILTER_INTERVAL) continue;
+      INFO(services[i].name);
+      for (int n = 0; n < 1000; ++n) {
+        const bool expected = (rule.flags & QLOG_FILTER_DECIMATE) && n % rule.decimation == 0;
+        REQUIRE(filter(i, data, event.size() * sizeof(capnp::word)) == expected);
+      }
+    }
+  }
+
+  SECTION("time based decimation") {
+    for (int i = 0; i < std::size(services); ++i) {
+      const QlogFilterRule &rule = QLOG_FILTER_RULES[i];
+      if (!(rule.flags & QLOG_FILTER_INTERVAL)) continue;
+      INFO(services[i].name);
+
+      // the rate changes halfway, and then there's a gap
+      const uint64_t interval_ns = rule.interval_ms * 1000000ULL;
+      uint64_t t = 1000000000ULL, last_kept = 0;
+      int kept = 0;
+      for (int n = 0; n < 2000; ++n) {
+        t += n < 1000 ? interval_ns / 10 : interval_ns / 4;
+        if (n == 1500) t += interval_ns * 5;
+        auto event = event_at(t);
+        if (filter(i, (const uint8_t *)event.begin(), event.size() * sizeof(capnp::word))) {
+          REQUIRE((kept == 0 || t - last_kept >= interval_ns));
+          last_kept = t;
+          ++kept;
+        }
+      }
+      REQUIRE(kept == 100 + 250);
+    }
+  }
+}
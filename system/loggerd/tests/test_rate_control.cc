@@ -0,0 +1,78 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <deque>
+#include <random>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "system/loggerd/encoder/rate_control.h"
+
+TEST_CASE("frame_sad") {
+  std::mt19937 gen(0);
+  for (int width : {1, 15, 16, 17, 526, 1928}) {
+    const int height = 7, stride_a = width + 3, stride_b = width + 64;
+    std::vector<uint8_t> a(stride_a * height), b(stride_b * height);
+    for (auto &v : a) v = gen();
+    for (auto &v : b) v = gen();
+
+    uint64_t expected = 0;
+    for (int r = 0; r < height; ++r) {
+      for (int c = 0; c < width; ++c) expected += std::abs(a[r * stride_a + c] - b[r * stride_b + c]);
+    }
+    INFO("width " << width);
+    REQUIRE(frame_sad(a.data(), stride_a, b.data(), stride_b, width, height) == expected);
+  }
+}
+
+TEST_CASE("SegmentRateControl") {
+  // a codec whose frame sizes follow the complexity of the scene, with some noise and a few frames of delay
+  const int fps = 20, segment_frames = 60 * fps, width = 64, height = 32;
+  const double scenes[] = {4, 1, 1, 20, 20, 6, 0.5, 12};
+  std::mt19937 gen(0);
+  std::lognormal_distribution<double> noise(0, 0.3);
+  auto frame_bytes = [&](double complexity, int qp, bool keyframe) {
+    return 300 * (complexity + (keyframe ? 30 : 0.5)) * std::exp2((28 - qp) / 6.0) * noise(gen);
+  };
+
+  auto run = [&](bool controlled) {
+    SegmentRateControl rc(256000, fps, segment_frames, fps);
+    std::vector<uint8_t> y(width * height);
+    std::vector<double> sizes;
+    std::deque<double> in_codec;
+    for (double complexity : scenes) {
+      rc.segment_start();
+      double size = 0;
+      for (int i = 0; i < segment_frames; ++i) {
+        // consecutive frames differ by the complexity on average
+        for (int p = 0; p < y.size(); ++p) y[p] = 100 + (i % 2) * (p % 2 ? std::floor(complexity) : std::ceil(complexity));
+        const bool keyframe = rc.add_frame(y.data(), width, height, width);
+        in_codec.push_back(frame_bytes(complexity, controlled ? rc.qp() : SegmentRateControl::QP_REF, keyframe));
+        if (in_codec.size() > 3) {
+          rc.encoded(in_codec.front());
+          size += in_codec.front();
+          in_codec.pop_front();
+        }
+      }
+      // flushed at the end of the segment
+      for (double b : in_codec) {
+        rc.encoded(b);
+        size += b;
+      }
+      in_codec.clear();
+      sizes.push_back(size);
+    }
+    return sizes;
+  };
+
+  const double target = 256000 / 8 * 60;
+  const auto fixed = run(false);
+  const auto controlled = run(true);
+  const auto [min_fixed, max_fixed] = std::minmax_element(fixed.begin(), fixed.end());
+  REQUIRE(*max_fixed / *min_fixed > 4);
+  // the first segment starts from a guess
+  for (int i = 1; i < controlled.size(); ++i) {
+    INFO("segment " << i << " " << controlled[i] << " bytes, fixed QP " << fixed[i] << " bytes");
+    REQUIRE(std::abs(controlled[i] - target) < target * 0.15);
+  }
+}
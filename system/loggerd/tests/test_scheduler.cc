@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <iterator>
+#include <unordered_map>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "cereal/messaging/messaging.h"
+#include "common/prefix.h"
+#include "system/loggerd/scheduler.h"
+
+struct Backlog {
+  const char *name;
+  int weight;
+  int count;
+  size_t size;
+};
+
+// a backlog on every socket before the first round, served with a clock that only moves when the test moves it
+TEST_CASE("ServiceScheduler") {
+  OpenpilotPrefix prefix;
+  const Backlog backlogs[] = {
+    {"roadEncodeData", 4, 200, 8192},
+    {"can", 1, 200, 8192},
+    {"carState", 1, 20, 64},
+    {"controlsState", 1, 20, 64},
+  };
+  const int n = std::size(backlogs);
+
+  double now_ms = 0;
+  std::unique_ptr<Context> ctx(Context::create());
+  ServiceScheduler scheduler([&] { return now_ms; });
+  std::unordered_map<ServiceQueue *, int> idx;
+  for (int i = 0; i < n; ++i) {
+    idx[scheduler.add(SubSocket::create(ctx.get(), backlogs[i].name), backlogs[i].name, backlogs[i].weight)] = i;
+  }
+
+  // every message is numbered in its logMonoTime
+  std::vector<std::unique_ptr<PubSocket>> pubs;
+  auto send = [&](int i, uint64_t seq) {
+    MessageBuilder msg;
+    auto event = msg.initEvent();
+    event.setLogMonoTime(seq);
+    event.initLogMessage(backlogs[i].size);
+    auto bytes = msg.toBytes();
+    pubs[i]->send((char *)bytes.begin(), bytes.size());
+  };
+  for (int i = 0; i < n; ++i) {
+    pubs.emplace_back(PubSocket::create(ctx.get(), backlogs[i].name));
+  }
+  for (int i = 0; i < n; ++i) {
+    for (int j = 1; j <= backlogs[i].count; ++j) send(i, j);
+  }
+
+  struct Handled {
+    int round, service;
+    uint64_t seq;
+    size_t size;
+  };
+  std::vector<Handled> handled;
+  int round = 0;
+  const ServiceScheduler::Handler handle = [&](ServiceQueue &q, Message *msg) {
+    capnp::FlatArrayMessageReader cmsg(kj::ArrayPtr<capnp::word>((capnp::word *)msg->getData(), msg->getSize() / sizeof(capnp::word)));
+    handled.push_back({round, idx.at(&q), cmsg.getRoot<cereal::Event>().getLogMonoTime(), msg->getSize()});
+    delete msg;
+  };
+  scheduler.poll(100);
+  while (scheduler.round(handle)) {
+    round++;
+    scheduler.poll(0);
+  }
+
+  std::vector<std::vector<uint64_t>> seqs(n);
+  std::vector<int> last_round(n, -1), rounds_served(n);
+  std::vector<size_t> total_bytes(n), max_size(n);
+  for (auto &h : handled) {
+    seqs[h.service].push_back(h.seq);
+    if (h.round != last_round[h.service]) rounds_served[h.service]++;
+    last_round[h.service] = h.round;
+    total_bytes[h.service] += h.size;
+    max_size[h.service] = std::max(max_size[h.service], h.size);
+  }
+
+  SECTION("every message is handled once, in order") {
+    for (int i = 0; i < n; ++i) {
+      INFO(backlogs[i].name);
+      REQUIRE(seqs[i].size() == (size_t)backlogs[i].count);
+      for (size_t j = 0; j < seqs[i].size(); ++j) REQUIRE(seqs[i][j] == j + 1);
+    }
+  }
+
+  SECTION("a round reads at most the quantum and one message more") {
+    // the clock didn't move, so there is no measured rate and the quantum is the minimum
+    std::vector<std::vector<size_t>> round_bytes(n, std::vector<size_t>(round + 1));
+    for (auto &h : handled) round_bytes[h.service][h.round] += h.size;
+    for (int i = 0; i < n; ++i) {
+      INFO(backlogs[i].name);
+      REQUIRE(*std::max_element(round_bytes[i].begin(), round_bytes[i].end()) <= SCHEDULER_MIN_QUANTUM * backlogs[i].weight + max_size[i]);
+    }
+  }
+
+  SECTION("the small backlogs don't wait behind the large ones") {
+    REQUIRE(last_round[2] == 0);
+    REQUIRE(last_round[3] == 0);
+    REQUIRE(last_round[0] > 10);
+    REQUIRE(last_round[1] > 10);
+  }
+
+  SECTION("the large backlogs share the rounds by weight") {
+    const int shared_rounds = std::min(last_round[0], last_round[1]);
+    size_t video = 0, can = 0;
+    for (auto &h : handled) {
+      if (h.round >= shared_rounds) continue;
+      if (h.service == 0) video += h.size;
+      if (h.service == 1) can += h.size;
+    }
+    REQUIRE(can > 0);
+    REQUIRE(video > 3 * can);
+    REQUIRE(video < 5 * can);
+  }
+
+  SECTION("the lateness is sampled once for every round a socket is read") {
+    for (auto &q : scheduler.services()) {
+      const int i = idx.at(q.get());
+      INFO(backlogs[i].name);
+      REQUIRE(q->msgs == (uint64_t)backlogs[i].count);
+      REQUIRE(q->lateness_samples == rounds_served[i]);
+      REQUIRE(q->max_depth > 0);
+    }
+  }
+
+  SECTION("the rates are measured over the clock's window") {
+    now_ms += SCHEDULER_RATE_WINDOW_MS;
+    send(2, backlogs[2].count + 1);
+    scheduler.poll(100);
+    while (scheduler.round(handle)) scheduler.poll(0);
+    for (auto &q : scheduler.services()) {
+      const int i = idx.at(q.get());
+      INFO(backlogs[i].name);
+      REQUIRE(q->rate == Approx(total_bytes[i] * 1000.0 / SCHEDULER_RATE_WINDOW_MS));
+    }
+  }
+}
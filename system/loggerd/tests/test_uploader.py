@@ -144,6 +144,18 @@ class TestUploader(UploaderTestCase):
       uploaded = uploader.UPLOAD_ATTR_NAME in os.listxattr(f_path.replace('.bz2', ''))
       self.assertFalse(uploaded, "File upload when locked")
 
+  def test_no_upload_preopened_segment(self):
+    f_paths = self.gen_files(lock=False, boot=False)
+    self.make_file_with_data(self.seg_dir, uploader.PREOPENED_MARKER, 0)
+
+    self.start_thread()
+    time.sleep(5)
+    self.join_thread()
+
+    for f_path in f_paths:
+      uploaded = uploader.UPLOAD_ATTR_NAME in os.listxattr(f_path.replace('.bz2', ''))
+      self.assertFalse(uploaded, "File upload from a segment opened ahead of time")
+
   def test_clear_locks_on_startup(self):
     f_paths = self.gen_files(lock=True, boot=False)
     self.start_thread()
@@ -0,0 +1,145 @@
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "catch2/catch.hpp"
+#include "common/prefix.h"
+#include "common/timing.h"
+#include "common/util.h"
+#include "system/loggerd/video_writer.h"
+
+// a writer on slow storage
+class SlowVideoWriter : public VideoWriter {
+public:
+  SlowVideoWriter(const std::string &path, int max_delay_ms, size_t arena_size)
+    : VideoWriter(path.c_str(), "fcamera.hevc", false, 1928, 1208, 20, cereal::EncodeIndex::Type::FULL_H_E_V_C, arena_size),
+      max_delay_ms(max_delay_ms) {}
+  ~SlowVideoWriter() { flush(); }
+
+  std::vector<long long> timestamps;
+  std::mutex hold;  // stops the writer while it's locked
+
+protected:
+  void write_packet(const struct iovec *iov, int iovcnt, long long timestamp, bool codecconfig, bool keyframe) override {
+    std::lock_guard lk(hold);
+    if (max_delay_ms > 0) util::sleep_for(gen() % (max_delay_ms + 1));
+    timestamps.push_back(timestamp);
+    VideoWriter::write_packet(iov, iovcnt, timestamp, codecconfig, keyframe);
+  }
+
+  const int max_delay_ms;
+  std::mt19937 gen{0};
+};
+
+TEST_CASE("VideoWriter") {
+  const std::string path = "/tmp/test_video_writer";
+  system(("rm " + path + " -rf").c_str());
+  util::create_directories(path, 0775);
+  const std::string video_file = path + "/fcamera.hevc";
+
+  std::mt19937 gen(0);
+  auto random_packet = [&](size_t len) {
+    std::string s(len, 0);
+    for (auto &c : s) c = gen();
+    return s;
+  };
+
+  SECTION("no packets are dropped or reordered when the writer falls behind") {
+    const size_t arena_size = 256 * 1024;
+    auto writer = std::make_unique<SlowVideoWriter>(path, 5, arena_size);
+    std::string expected;
+    const int packet_cnt = 500;
+    for (int i = 0; i < packet_cnt; ++i) {
+      // some packets are larger than the free space in the arena, and a few larger than the whole arena
+      const size_t len = i % 100 == 99 ? arena_size + 1 : 1 + gen() % (64 * 1024);
+      const std::string dat = random_packet(len);
+      writer->write((uint8_t *)dat.data(), dat.size(), i, i == 0, i % 20 == 0);
+      expected += dat;
+    }
+    writer->flush();
+
+    auto stats = writer->stats();
+    REQUIRE(stats.packets == packet_cnt);
+    REQUIRE(stats.stalls > 0);
+    REQUIRE(stats.max_queued_bytes <= arena_size);
+    REQUIRE(stats.max_queued <= VIDEO_WRITER_QUEUE_SIZE);
+    REQUIRE(writer->timestamps.size() == packet_cnt);
+    for (int i = 0; i < packet_cnt; ++i) {
+      REQUIRE(writer->timestamps[i] == i);
+    }
+
+    writer.reset();
+    REQUIRE(util::read_file(video_file) == expected);
+    REQUIRE(!util::file_exists(video_file + ".lock"));
+  }
+
+  SECTION("writes don't wait for slow storage while there is room in the queue") {
+    auto writer = std::make_unique<SlowVideoWriter>(path, 50, VIDEO_WRITER_ARENA_SIZE);
+    const std::string dat = random_packet(100 * 1024);
+    double start = millis_since_boot();
+    for (int i = 0; i < 20; ++i) {
+      writer->write((uint8_t *)dat.data(), dat.size(), i, false, false);
+    }
+    REQUIRE(millis_since_boot() - start < 50);
+    REQUIRE(writer->stats().stalls == 0);
+
+    // the destructor waits for the queue to drain
+    writer.reset();
+    REQUIRE(util::read_file(video_file).size() == dat.size() * 20);
+  }
+
+  SECTION("packets are written from the encoder ring") {
+    OpenpilotPrefix prefix;
+    EncodeRingWriter ring_writer("roadEncodeData", 1000);
+    auto ring = std::make_shared<EncodeRingReader>("roadEncodeData");
+    std::string expected;
+    {
+      VideoWriter writer(path.c_str(), "fcamera.hevc", false, 1928, 1208, 20, cereal::EncodeIndex::Type::FULL_H_E_V_C);
+      for (uint32_t id = 0; id < 20; ++id) {
+        // some wrap around the end of the ring
+        const std::string dat = random_packet(1 + id * 53 % 300);
+        ring_writer.push(id, (const uint8_t *)dat.data(), dat.size());
+        auto pkt = ring->get(id, dat.size());
+        REQUIRE(pkt);
+        writer.write(ring, *pkt, id, id == 0);
+        writer.flush();
+        expected += dat;
+      }
+      REQUIRE(writer.stats().overwritten == 0);
+    }
+    REQUIRE(util::read_file(video_file) == expected);
+  }
+
+  SECTION("packets overwritten in the encoder ring are dropped") {
+    OpenpilotPrefix prefix;
+    EncodeRingWriter ring_writer("roadEncodeData", 1000);
+    auto ring = std::make_shared<EncodeRingReader>("roadEncodeData");
+    std::vector<std::string> packets;
+    {
+      // the writer is held on the first packet while the ring wraps around
+      SlowVideoWriter writer(path, 0, VIDEO_WRITER_ARENA_SIZE);
+      writer.hold.lock();
+      const std::string first = random_packet(400);
+      ring_writer.push(0, (const uint8_t *)first.data(), first.size());
+      writer.write((uint8_t *)first.data(), first.size(), 0, true, false);
+      for (uint32_t id = 1; id <= 5; ++id) {
+        packets.push_back(random_packet(400));
+        ring_writer.push(id, (const uint8_t *)packets.back().data(), packets.back().size());
+        auto pkt = ring->get(id, packets.back().size());
+        REQUIRE(pkt);
+        writer.write(ring, *pkt, id, false);
+      }
+      writer.hold.unlock();
+      writer.flush();
+      REQUIRE(writer.stats().overwritten == 3);
+      REQUIRE(writer.timestamps.size() == 6);
+      packets.insert(packets.begin(), first);
+    }
+    // only the last two packets still fit in the ring
+    REQUIRE(util::read_file(video_file) == packets[0] + packets[4] + packets[5]);
+  }
+
+  system(("rm " + path + " -rf").c_str());
+}
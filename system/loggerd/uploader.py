@@ -26,6 +26,7 @@ UPLOAD_ATTR_NAME = 'user.upload'
 UPLOAD_ATTR_VALUE = b'1'
 
 UPLOAD_QLOG_QCAM_MAX_SIZE = 100 * 1e6  # MB
+PREOPENED_MARKER = 'preopened'  # LOGGER_PREOPENED_MARKER in logger.h
 
 allow_sleep = bool(os.getenv("UPLOADER_SLEEP", "1"))
 force_wifi = os.getenv("FORCEWIFI") is not None
@@ -107,7 +108,8 @@ class Uploader:
       except OSError:
         continue
 
-      if any(name.endswith(".lock") for name in names):
+      # a segment loggerd opened ahead of time is removed by loggerd if it was never used
+      if any(name.endswith(".lock") or name == PREOPENED_MARKER for name in names):
         continue
 
       for name in sorted(names, key=self.get_upload_sort):
@@ -1,13 +1,21 @@
 #pragma clang diagnostic ignored "-Wdeprecated-declarations"
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
+#include <cstring>
+#include <vector>
 
 #include "system/loggerd/video_writer.h"
 #include "common/swaglog.h"
+#include "common/timing.h"
 #include "common/util.h"
 
-VideoWriter::VideoWriter(const char *path, const char *filename, bool remuxing, int width, int height, int fps, cereal::EncodeIndex::Type codec)
-  : remuxing(remuxing) {
+VideoWriter::VideoWriter(const char *path, const char *filename, bool remuxing, int width, int height, int fps, cereal::EncodeIndex::Type codec,
+                         size_t arena_size)
+  : remuxing(remuxing), arena(new uint8_t[arena_size]), arena_size(arena_size) {
   raw = codec == cereal::EncodeIndex::Type::BIG_BOX_LOSSLESS;
   vid_path = util::string_format("%s/%s", path, filename);
   lock_path = util::string_format("%s/%s.lock", path, filename);
@@ -46,20 +54,170 @@ VideoWriter::VideoWriter(const char *path, const char *filename, bool remuxing,
     assert(err >= 0);
 
   } else {
-    this->of = util::safe_fopen(this->vid_path.c_str(), "wb");
-    assert(this->of);
+    this->fd = HANDLE_EINTR(open(this->vid_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0664));
+    assert(this->fd >= 0);
   }
+
+  thread = std::thread(&VideoWriter::writer_thread, this);
 }
 
 void VideoWriter::write(uint8_t *data, int len, long long timestamp, bool codecconfig, bool keyframe) {
-  if (of && data) {
-    size_t written = util::safe_fwrite(data, 1, len, of);
-    if (written != len) {
-      LOGE("failed to write file.errno=%d", errno);
+  if (!data) len = 0;
+  if ((size_t)len > arena_size) {
+    // doesn't fit in the arena, write it from this thread once the queue is empty
+    LOGW("%s: packet of %d bytes is larger than the arena", vid_path.c_str(), len);
+    flush();
+    struct iovec iov = {.iov_base = data, .iov_len = (size_t)len};
+    write_packet(&iov, 1, timestamp, codecconfig, keyframe);
+    write_stats.packets++;
+    write_stats.bytes += len;
+    return;
+  }
+
+  // packets are contiguous in the arena, skip the end of it if the packet doesn't fit
+  uint64_t pos = arena_head;
+  if (pos % arena_size + len > arena_size) pos += arena_size - pos % arena_size;
+  wait_for_room(pos + len);
+
+  memcpy(arena.get() + pos % arena_size, data, len);
+  arena_head = pos + len;
+  queue_packet({.pos = pos, .len = (size_t)len, .timestamp = timestamp, .codecconfig = codecconfig, .keyframe = keyframe});
+}
+
+void VideoWriter::write(std::shared_ptr<const EncodeRingReader> ring, const EncodePacket &pkt, long long timestamp, bool keyframe) {
+  wait_for_room(arena_head);
+  queue_packet({.pos = arena_head, .len = pkt.len, .timestamp = timestamp, .codecconfig = false, .keyframe = keyframe,
+                .ring = std::move(ring), .ring_pkt = pkt});
+}
+
+void VideoWriter::wait_for_room(uint64_t arena_end) {
+  const uint64_t idx = head.load(std::memory_order_relaxed);
+  auto has_space = [&]() {
+    return arena_end - arena_tail.load(std::memory_order_acquire) <= arena_size &&
+           idx - tail.load(std::memory_order_acquire) < VIDEO_WRITER_QUEUE_SIZE;
+  };
+  if (!has_space()) {
+    // backpressure, the writer thread is behind
+    double start = millis_since_boot();
+    std::unique_lock lk(lock);
+    cv.wait(lk, has_space);
+    write_stats.stalls++;
+    write_stats.stall_ms += millis_since_boot() - start;
+  }
+}
+
+void VideoWriter::queue_packet(QueuedPacket pkt) {
+  const uint64_t idx = head.load(std::memory_order_relaxed);
+  const size_t len = pkt.len;
+  queue[idx % VIDEO_WRITER_QUEUE_SIZE] = std::move(pkt);
+  {
+    std::lock_guard lk(lock);
+    head.store(idx + 1, std::memory_order_release);
+  }
+  cv.notify_all();
+
+  write_stats.packets++;
+  write_stats.bytes += len;
+  write_stats.max_queued = std::max<int>(write_stats.max_queued, idx + 1 - tail.load(std::memory_order_relaxed));
+  write_stats.max_queued_bytes = std::max<size_t>(write_stats.max_queued_bytes, arena_head - arena_tail.load(std::memory_order_relaxed));
+}
+
+void VideoWriter::flush() {
+  std::unique_lock lk(lock);
+  cv.wait(lk, [&] { return tail.load() == head.load(); });
+}
+
+void VideoWriter::writer_thread() {
+  util::set_thread_name("video_writer");
+  while (true) {
+    const uint64_t idx = tail.load(std::memory_order_relaxed);
+    {
+      std::unique_lock lk(lock);
+      cv.wait(lk, [&] { return exit || head.load(std::memory_order_acquire) != idx; });
+      // exit once everything is written
+      if (head.load(std::memory_order_acquire) == idx) break;
     }
+
+    QueuedPacket &pkt = queue[idx % VIDEO_WRITER_QUEUE_SIZE];
+    const uint64_t arena_end = pkt.ring ? pkt.pos : pkt.pos + pkt.len;
+    if (pkt.ring) {
+      write_ring_packet(pkt);
+      // the ring of an encoderd that has restarted is unmapped with its last packet
+      pkt.ring.reset();
+    } else {
+      struct iovec iov = {.iov_base = arena.get() + pkt.pos % arena_size, .iov_len = pkt.len};
+      write_packet(&iov, 1, pkt.timestamp, pkt.codecconfig, pkt.keyframe);
+    }
+    {
+      std::lock_guard lk(lock);
+      arena_tail.store(arena_end, std::memory_order_release);
+      tail.store(idx + 1, std::memory_order_release);
+    }
+    cv.notify_all();
   }
+}
 
+void VideoWriter::write_ring_packet(const QueuedPacket &pkt) {
+  // encoderd may have overwritten the packet by now, or do it while it's being written
   if (remuxing) {
+    // the muxer gets a copy, checked before it's muxed
+    ring_copy.clear();
+    for (int i = 0; i < pkt.ring_pkt.iovcnt; ++i) {
+      const uint8_t *base = (const uint8_t *)pkt.ring_pkt.iov[i].iov_base;
+      ring_copy.insert(ring_copy.end(), base, base + pkt.ring_pkt.iov[i].iov_len);
+    }
+    if (pkt.ring->intact(pkt.ring_pkt)) {
+      struct iovec iov = {.iov_base = ring_copy.data(), .iov_len = ring_copy.size()};
+      write_packet(&iov, 1, pkt.timestamp, false, pkt.keyframe);
+      return;
+    }
+  } else {
+    // written straight from the ring, and taken back if it changed underneath
+    const off_t offset = lseek(fd, 0, SEEK_CUR);
+    write_packet(pkt.ring_pkt.iov, pkt.ring_pkt.iovcnt, pkt.timestamp, false, pkt.keyframe);
+    if (pkt.ring->intact(pkt.ring_pkt)) return;
+
+    if (HANDLE_EINTR(ftruncate(fd, offset)) != 0 || lseek(fd, offset, SEEK_SET) != offset) {
+      LOGE("%s: failed to take back an overwritten packet. errno=%d", vid_path.c_str(), errno);
+    }
+  }
+  LOGE("%s: packet at %lu overwritten in encoder ring before it was written, dropped", vid_path.c_str(), pkt.ring_pkt.pos);
+  overwritten++;
+}
+
+static bool write_all(int fd, const struct iovec *iov, int iovcnt) {
+  struct iovec v[2];
+  assert(iovcnt <= 2);
+  std::copy(iov, iov + iovcnt, v);
+
+  struct iovec *cur = v;
+  while (iovcnt > 0) {
+    ssize_t ret = HANDLE_EINTR(::writev(fd, cur, iovcnt));
+    if (ret < 0) return false;
+    // a short write can end in the middle of a buffer
+    while (iovcnt > 0 && (size_t)ret >= cur->iov_len) {
+      ret -= cur->iov_len;
+      cur++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      cur->iov_base = (uint8_t *)cur->iov_base + ret;
+      cur->iov_len -= ret;
+    }
+  }
+  return true;
+}
+
+void VideoWriter::write_packet(const struct iovec *iov, int iovcnt, long long timestamp, bool codecconfig, bool keyframe) {
+  if (fd >= 0 && !write_all(fd, iov, iovcnt)) {
+    LOGE("failed to write file.errno=%d", errno);
+  }
+
+  if (remuxing) {
+    // packets for the muxer are always in one piece
+    assert(iovcnt == 1);
+    const uint8_t *data = (const uint8_t *)iov[0].iov_base;
+    const size_t len = iov[0].iov_len;
     if (codecconfig) {
       if (len > 0) {
         codec_ctx->extradata = (uint8_t*)av_mallocz(len + AV_INPUT_BUFFER_PADDING_SIZE);
@@ -76,7 +234,7 @@ void VideoWriter::write(uint8_t *data, int len, long long timestamp, bool codecc
 
       AVPacket pkt;
       av_init_packet(&pkt);
-      pkt.data = data;
+      pkt.data = (uint8_t *)data;
       pkt.size = len;
 
       enum AVRounding rnd = static_cast<enum AVRounding>(AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
@@ -89,7 +247,7 @@ void VideoWriter::write(uint8_t *data, int len, long long timestamp, bool codecc
 
       // TODO: can use av_write_frame for non raw?
       int err = av_interleaved_write_frame(ofmt_ctx, &pkt);
-      if (err < 0) { LOGW("ts encoder write issue len: %d ts: %lu", len, timestamp); }
+      if (err < 0) { LOGW("ts encoder write issue len: %zu ts: %lld", len, timestamp); }
 
       av_packet_unref(&pkt);
     }
@@ -97,18 +255,40 @@ void VideoWriter::write(uint8_t *data, int len, long long timestamp, bool codecc
 }
 
 VideoWriter::~VideoWriter() {
+  {
+    std::lock_guard lk(lock);
+    exit = true;
+  }
+  cv.notify_all();
+  thread.join();
+
+  const Stats st = stats();
+  if (st.stalls > 0 || st.overwritten > 0) {
+    LOGW("%s: %lu packets %lu bytes, writer fell behind %lu times for %.1f ms, max queued %d packets %zu bytes, %lu overwritten in the encoder ring",
+         vid_path.c_str(), st.packets, st.bytes, st.stalls, st.stall_ms, st.max_queued, st.max_queued_bytes, st.overwritten);
+  } else {
+    LOGD("%s: %lu packets %lu bytes, max queued %d packets %zu bytes",
+         vid_path.c_str(), st.packets, st.bytes, st.max_queued, st.max_queued_bytes);
+  }
+
   if (this->remuxing) {
     if (this->raw) { avcodec_close(this->codec_ctx); }
-    int err = av_write_trailer(this->ofmt_ctx);
-    if (err != 0) LOGE("av_write_trailer failed %d", err);
+    // there's no header to finish if nothing was written
+    if (!discarded) {
+      int err = av_write_trailer(this->ofmt_ctx);
+      if (err != 0) LOGE("av_write_trailer failed %d", err);
+    }
     avcodec_free_context(&this->codec_ctx);
-    err = avio_closep(&this->ofmt_ctx->pb);
+    int err = avio_closep(&this->ofmt_ctx->pb);
     if (err != 0) LOGE("avio_closep failed %d", err);
     avformat_free_context(this->ofmt_ctx);
   } else {
-    util::safe_fflush(this->of);
-    fclose(this->of);
-    this->of = nullptr;
+    close(this->fd);
+    this->fd = -1;
+  }
+  if (discarded) {
+    assert(write_stats.packets == 0);
+    unlink(this->vid_path.c_str());
   }
   unlink(this->lock_path.c_str());
 }
@@ -1,6 +1,15 @@
 #pragma once
 
+#include <sys/uio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -8,19 +17,87 @@ extern "C" {
 }
 
 #include "cereal/messaging/messaging.h"
+#include "system/loggerd/encode_ring.h"
+
+const size_t VIDEO_WRITER_ARENA_SIZE = 8 * 1024 * 1024;  // ~6s of fcamera
+const int VIDEO_WRITER_QUEUE_SIZE = 128;
 
+// Writes and muxes the packets of one video file on its own thread, so slow
+// storage doesn't stall the caller. write() copies the packet into an arena
+// and queues it, it only blocks when the arena or the queue is full. Packets
+// in the ring of encoderd are queued without a copy and written from the ring,
+// one that encoderd overwrote before it was written is dropped. The
+// destructor writes everything that is still queued.
 class VideoWriter {
 public:
-  VideoWriter(const char *path, const char *filename, bool remuxing, int width, int height, int fps, cereal::EncodeIndex::Type codec);
+  VideoWriter(const char *path, const char *filename, bool remuxing, int width, int height, int fps, cereal::EncodeIndex::Type codec,
+              size_t arena_size = VIDEO_WRITER_ARENA_SIZE);
   void write(uint8_t *data, int len, long long timestamp, bool codecconfig, bool keyframe);
-  ~VideoWriter();
+  // the ring stays mapped until the packet is written
+  void write(std::shared_ptr<const EncodeRingReader> ring, const EncodePacket &pkt, long long timestamp, bool keyframe);
+  // wait until all queued packets are written
+  void flush();
+  // for a writer opened ahead of time that is never used, its file is deleted instead of finalized on destruction
+  void discard() { discarded = true; }
+  virtual ~VideoWriter();
+
+  struct Stats {
+    uint64_t packets, bytes;
+    uint64_t stalls;     // writes that had to wait for the writer thread
+    double stall_ms;     // total time spent waiting
+    int max_queued;      // deepest the queue has been, in packets
+    size_t max_queued_bytes;
+    uint64_t overwritten;  // packets from the encoder ring that were overwritten before they were written
+  };
+  Stats stats() const {  // from the thread calling write()
+    Stats st = write_stats;
+    st.overwritten = overwritten.load();
+    return st;
+  }
+
+protected:
+  // runs on the writer thread. subclasses that override it must flush() in their destructor
+  virtual void write_packet(const struct iovec *iov, int iovcnt, long long timestamp, bool codecconfig, bool keyframe);
+
 private:
+  struct QueuedPacket {
+    uint64_t pos;  // position in the arena, counted since the start
+    size_t len;
+    long long timestamp;
+    bool codecconfig, keyframe;
+    // or where it is in the encoder ring, it takes no room in the arena then
+    std::shared_ptr<const EncodeRingReader> ring;
+    EncodePacket ring_pkt;
+  };
+  void wait_for_room(uint64_t arena_end);
+  void queue_packet(QueuedPacket pkt);
+  void write_ring_packet(const QueuedPacket &pkt);
+  void writer_thread();
+
   std::string vid_path, lock_path;
 
-  FILE *of = nullptr;
+  int fd = -1;
 
   AVCodecContext *codec_ctx;
   AVFormatContext *ofmt_ctx;
   AVStream *out_stream;
   bool remuxing, raw;
-};
\ No newline at end of file
+  bool discarded = false;
+
+  // single producer single consumer ring of packets, the payloads are contiguous in the arena
+  std::unique_ptr<uint8_t[]> arena;
+  const size_t arena_size;
+  QueuedPacket queue[VIDEO_WRITER_QUEUE_SIZE];
+  std::atomic<uint64_t> head = 0, tail = 0;  // packets queued, packets written
+  std::atomic<uint64_t> arena_tail = 0;      // arena bytes released by the writer thread
+  uint64_t arena_head = 0;                   // arena bytes reserved by the producer
+  // only to sleep on an empty or full ring
+  std::mutex lock;
+  std::condition_variable cv;
+  bool exit = false;
+  std::thread thread;
+
+  std::vector<uint8_t> ring_copy;  // the muxer gets packets from the ring in one piece
+  Stats write_stats = {};
+  std::atomic<uint64_t> overwritten = 0;  // counted on the writer thread
+};
@@ -1,5 +1,10 @@
 #include "tools/cabana/dbc/dbc.h"
-#include "tools/cabana/util.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include <QStringList>
 
 uint qHash(const MessageId &item) {
   return qHash(item.source) ^ qHash(item.address);
@@ -58,12 +63,49 @@ double get_raw_value(const uint8_t *data, size_t data_size, const cabana::Signal
     bits -= size;
     i = sig.is_little_endian ? i - 1 : i + 1;
   }
-  if (sig.is_signed) {
+  if (sig.is_signed && sig.size > 0 && sig.size < 64) {
     val -= ((val >> (sig.size - 1)) & 0x1) ? (1ULL << sig.size) : 0;
   }
   return val * sig.factor + sig.offset;
 }
 
+// SignalDecoder
+
+cabana::SignalDecoder::SignalDecoder(const cabana::Signal &sig) : sig(&sig) {
+  lo_byte = std::min(sig.lsb, sig.msb) / 8;
+  hi_byte = std::max(sig.lsb, sig.msb) / 8;
+  mask = sig.size >= 64 ? ~0ULL : (1ULL << sig.size) - 1;
+  sign_bit = sig.size > 0 ? 1ULL << (sig.size - 1) : 0;
+  // signals spanning more than 8 bytes don't fit into one 64-bit window
+  fast_path = sig.size > 0 && sig.size < 64 && hi_byte - lo_byte + 1 <= 8;
+}
+
+double cabana::SignalDecoder::value(const uint8_t *data, size_t data_size) const {
+  if (!fast_path || data_size < 8 || hi_byte >= data_size) {
+    return get_raw_value(data, data_size, *sig);
+  }
+
+  // the 8 bytes holding the signal, starting early enough to stay inside the frame
+  const int start = std::min<int>(lo_byte, data_size - 8);
+  uint64_t v;
+  memcpy(&v, data + start, sizeof(v));
+  if (sig->is_little_endian) {
+    v >>= sig->lsb - start * 8;
+  } else {
+    // big endian signals run from the msb in the first byte to the lsb in the last
+    v = __builtin_bswap64(v) >> ((start + 7 - hi_byte) * 8 + sig->lsb % 8);
+  }
+  v &= mask;
+  int64_t val = (sig->is_signed && (v & sign_bit)) ? (int64_t)(v | ~mask) : (int64_t)v;
+  return val * sig->factor + sig->offset;
+}
+
+void cabana::SignalDecoder::decode(const uint8_t *const *data, const uint8_t *sizes, size_t count, double *out) const {
+  for (size_t i = 0; i < count; ++i) {
+    out[i] = value(data[i], sizes[i]);
+  }
+}
+
 bool cabana::operator==(const cabana::Signal &l, const cabana::Signal &r) {
   return l.name == r.name && l.size == r.size &&
          l.start_bit == r.start_bit &&
@@ -95,3 +137,13 @@ std::pair<int, int> getSignalRange(const cabana::Signal *s) {
 }
 
 std::vector<std::string> allDBCNames() { return get_dbc_names(); }
+
+int num_decimals(double num) {
+  const QString string = QString::number(num);
+  const QStringList split = string.split('.');
+  if (split.size() == 1) {
+    return 0;
+  } else {
+    return split[1].size();
+  }
+}
@@ -74,6 +74,24 @@ namespace cabana {
 
   bool operator==(const cabana::Signal &l, const cabana::Signal &r);
   inline bool operator!=(const cabana::Signal &l, const cabana::Signal &r) { return !(l == r); }
+
+  // Decodes one signal over many frames. The byte window, shift and mask are
+  // computed once, so a frame of at least 8 bytes is one unaligned 64-bit load,
+  // a shift and a mask. Shorter frames and signals over more than 8 bytes go
+  // through get_raw_value. The frames are scattered through the log, so decode()
+  // is a plain loop over them rather than SIMD.
+  class SignalDecoder {
+  public:
+    explicit SignalDecoder(const cabana::Signal &sig);
+    double value(const uint8_t *data, size_t data_size) const;
+    void decode(const uint8_t *const *data, const uint8_t *sizes, size_t count, double *out) const;
+
+  private:
+    const cabana::Signal *sig;
+    int lo_byte, hi_byte;
+    uint64_t mask, sign_bit;
+    bool fast_path;
+  };
 }
 
 // Helper functions
@@ -83,3 +101,4 @@ int bigEndianBitIndex(int index);
 void updateSigSizeParamsFromRange(cabana::Signal &s, int start_bit, int size);
 std::pair<int, int> getSignalRange(const cabana::Signal *s);
 std::vector<std::string> allDBCNames();
+int num_decimals(double num);
@@ -0,0 +1,200 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QTextStream>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+#include <atomic>
+#include <unordered_map>
+
+#include "tools/cabana/dbc/dbcmanager.h"
+#include "tools/replay/logreader.h"
+#include "tools/replay/route.h"
+#include "tools/replay/util.h"
+
+// Headless signal extraction: decode selected DBC signals from every segment
+// of one or more routes and write them as one CSV file per segment.
+
+struct SignalColumn {
+  const cabana::Signal *sig;
+  cabana::SignalDecoder decoder;
+};
+
+struct MsgPlan {
+  QString name;
+  std::vector<SignalColumn> columns;
+};
+
+struct SegmentJob {
+  QString route;
+  int seg_num;
+  QString log_file;
+};
+
+struct ExtractStats {
+  std::atomic<uint64_t> segments = 0;
+  std::atomic<uint64_t> failed = 0;
+  std::atomic<uint64_t> frames = 0;
+  std::atomic<uint64_t> values = 0;
+  std::atomic<uint64_t> decode_ns = 0;
+};
+
+static std::unordered_map<uint32_t, MsgPlan> buildPlan(const QStringList &filter) {
+  std::unordered_map<uint32_t, MsgPlan> plan;
+  for (auto &[id, _] : dbc()->getMessages(0)) {
+    // signal pointers must refer to the DBCFile, not to the copies returned by getMessages()
+    const cabana::Msg *msg = dbc()->msg(id);
+    for (auto sig : msg->getSignals()) {
+      if (filter.empty() || filter.contains(msg->name) || filter.contains(msg->name + "." + sig->name)) {
+        auto &p = plan[id.address];
+        p.name = msg->name;
+        p.columns.push_back({.sig = sig, .decoder = cabana::SignalDecoder(*sig)});
+      }
+    }
+  }
+  return plan;
+}
+
+static bool extractSegment(const SegmentJob &job, const std::unordered_map<uint32_t, MsgPlan> &plan,
+                           const SourceSet &buses, const QString &out_dir, ExtractStats &stats) {
+  LogReader log;
+  if (!log.load(job.log_file.toStdString(), nullptr, {cereal::Event::Which::CAN}, true, 0, 3)) {
+    rWarning("failed to load %s", job.log_file.toStdString().c_str());
+    return false;
+  }
+
+  // gather the payloads of each message into contiguous columns
+  struct Frames {
+    std::vector<uint64_t> mono_time;
+    std::vector<const uint8_t *> dat;
+    std::vector<uint8_t> size;
+  };
+  std::map<MessageId, Frames> frames;
+  for (const Event *e : log.events) {
+    for (const auto &c : e->event.getCan()) {
+      if (!buses.empty() && !buses.contains(c.getSrc())) continue;
+      if (plan.find(c.getAddress()) == plan.end()) continue;
+
+      auto &f = frames[{.source = (uint8_t)c.getSrc(), .address = c.getAddress()}];
+      auto dat = c.getDat();
+      f.mono_time.push_back(e->mono_time);
+      f.dat.push_back((const uint8_t *)dat.begin());
+      f.size.push_back(dat.size());
+    }
+  }
+
+  QString fn = QString("%1/%2--%3.csv").arg(out_dir, QString(job.route).replace('|', '_')).arg(job.seg_num);
+  QFile file(fn);
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    rWarning("failed to open %s", fn.toStdString().c_str());
+    return false;
+  }
+  QTextStream stream(&file);
+  stream.setRealNumberPrecision(12);
+  stream << "mono_time,source,address,message,signal,value\n";
+
+  std::vector<double> values;
+  for (auto &[id, f] : frames) {
+    const auto &p = plan.at(id.address);
+    const QString prefix = QString("%1,%2,%3,").arg(id.source).arg(id.address, 1, 16).arg(p.name);
+    values.resize(f.dat.size());
+    for (auto &col : p.columns) {
+      QElapsedTimer timer;
+      timer.start();
+      col.decoder.decode(f.dat.data(), f.size.data(), f.dat.size(), values.data());
+      stats.decode_ns += timer.nsecsElapsed();
+
+      for (size_t i = 0; i < values.size(); ++i) {
+        stream << f.mono_time[i] << ',' << prefix << col.sig->name << ',' << values[i] << '\n';
+      }
+      stats.values += values.size();
+    }
+    stats.frames += f.dat.size();
+  }
+  return stream.status() == QTextStream::Ok;
+}
+
+int main(int argc, char *argv[]) {
+  QCoreApplication app(argc, argv);
+  QCoreApplication::setApplicationName("cabana_extract");
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription("Extract DBC signals from routes without the GUI.");
+  parser.addHelpOption();
+  parser.addPositionalArgument("routes", "the drives to extract. find your drives at connect.comma.ai", "route...");
+  parser.addOption({"dbc", "dbc file, or the name of an opendbc file", "dbc"});
+  parser.addOption({"signals", "comma separated list of MESSAGE or MESSAGE.SIGNAL to extract. default is all", "signals"});
+  parser.addOption({"bus", "comma separated list of buses to extract. default is all", "bus"});
+  parser.addOption({"data_dir", "local directory with routes", "data_dir"});
+  parser.addOption({"qlog", "read qlogs instead of rlogs"});
+  parser.addOption({{"o", "out"}, "output directory. default is the current directory", "out"});
+  parser.addOption({{"j", "jobs"}, "number of segments to decode in parallel. default is the number of cores", "jobs"});
+  parser.process(app);
+
+  const QStringList routes = parser.positionalArguments();
+  if (routes.empty() || !parser.isSet("dbc")) {
+    parser.showHelp(1);
+  }
+
+  QString dbc_file = parser.value("dbc");
+  if (!QFile::exists(dbc_file)) {
+    dbc_file = QString("%1/%2.dbc").arg(OPENDBC_FILE_PATH, dbc_file);
+  }
+  QString error;
+  if (!dbc()->open(SOURCE_ALL, dbc_file, &error)) {
+    fprintf(stderr, "failed to open dbc %s: %s\n", dbc_file.toStdString().c_str(), error.toStdString().c_str());
+    return 1;
+  }
+
+  const QStringList filter = parser.value("signals").split(",", QString::SkipEmptyParts);
+  const auto plan = buildPlan(filter);
+  if (plan.empty()) {
+    fprintf(stderr, "no signals to extract\n");
+    return 1;
+  }
+
+  SourceSet buses;
+  for (const auto &b : parser.value("bus").split(",", QString::SkipEmptyParts)) {
+    buses.insert(b.toUInt());
+  }
+
+  const QString out_dir = parser.isSet("out") ? parser.value("out") : QDir::currentPath();
+  QDir().mkpath(out_dir);
+  if (parser.isSet("jobs")) {
+    QThreadPool::globalInstance()->setMaxThreadCount(std::max(1, parser.value("jobs").toInt()));
+  }
+
+  QList<SegmentJob> jobs;
+  for (const auto &r : routes) {
+    Route route(r, parser.value("data_dir"));
+    if (!route.load()) {
+      fprintf(stderr, "failed to load route %s\n", r.toStdString().c_str());
+      continue;
+    }
+    for (const auto &[n, files] : route.segments()) {
+      const QString &log_file = parser.isSet("qlog") || files.rlog.isEmpty() ? files.qlog : files.rlog;
+      if (!log_file.isEmpty()) {
+        jobs.push_back({.route = route.name(), .seg_num = n, .log_file = log_file});
+      }
+    }
+  }
+
+  ExtractStats stats;
+  QElapsedTimer timer;
+  timer.start();
+  QtConcurrent::blockingMap(jobs, [&](const SegmentJob &job) {
+    bool success = extractSegment(job, plan, buses, out_dir, stats);
+    (success ? stats.segments : stats.failed) += 1;
+  });
+
+  const double elapsed = timer.elapsed() / 1000.0;
+  printf("extracted %lu segments (%lu failed) in %.2f s using %d threads\n",
+         stats.segments.load(), stats.failed.load(), elapsed, QThreadPool::globalInstance()->maxThreadCount());
+  printf("  %lu frames, %lu values: %.0f frames/s, %.1f segments/s, decode %.1f ns/value\n",
+         stats.frames.load(), stats.values.load(), stats.frames / std::max(elapsed, 1e-3),
+         stats.segments / std::max(elapsed, 1e-3), stats.decode_ns / (double)std::max<uint64_t>(stats.values, 1));
+  return stats.failed > 0 ? 1 : 0;
+}
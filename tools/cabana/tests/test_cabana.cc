@@ -1,4 +1,6 @@
 
+#include <random>
+
 #include "opendbc/can/common.h"
 #undef INFO
 #include "catch2/catch.hpp"
@@ -30,6 +32,55 @@ TEST_CASE("DBCFile::generateDBC") {
   }
 }
 
+TEST_CASE("SignalDecoder") {
+  DBCManager dbc(nullptr);
+  dbc.open({0}, QString("%1/%2.dbc").arg(OPENDBC_FILE_PATH, "toyota_new_mc_pt_generated"));
+
+  LogReader log;
+  REQUIRE(log.load(TEST_RLOG_URL, nullptr, {cereal::Event::Which::CAN}, true));
+  std::map<uint32_t, std::pair<std::vector<const uint8_t *>, std::vector<uint8_t>>> frames;
+  for (auto e : log.events) {
+    for (const auto &c : e->event.getCan()) {
+      if (c.getSrc() == 0 && dbc.msg({.source = 0, .address = c.getAddress()})) {
+        auto &[dat, sizes] = frames[c.getAddress()];
+        dat.push_back((const uint8_t *)c.getDat().begin());
+        sizes.push_back(c.getDat().size());
+      }
+    }
+  }
+  REQUIRE(frames.size() > 0);
+
+  for (auto &[address, f] : frames) {
+    auto &[dat, sizes] = f;
+    for (auto sig : dbc.msg({.source = 0, .address = address})->getSignals()) {
+      std::vector<double> values(dat.size());
+      cabana::SignalDecoder(*sig).decode(dat.data(), sizes.data(), dat.size(), values.data());
+      for (int i = 0; i < dat.size(); ++i) {
+        REQUIRE(values[i] == get_raw_value(dat[i], sizes[i], *sig));
+      }
+    }
+  }
+}
+
+TEST_CASE("SignalDecoder every bit range") {
+  std::mt19937 gen(0);
+  for (int frame_size : {1, 5, 8, 12, 64}) {
+    for (bool little_endian : {true, false}) {
+      for (int size = 1; size <= 64; ++size) {
+        for (int start = 0; start + size <= frame_size * 8; ++start) {
+          cabana::Signal sig = {.is_signed = (bool)(gen() & 1), .factor = 1, .offset = 0, .is_little_endian = little_endian};
+          updateSigSizeParamsFromRange(sig, start, size);
+          cabana::SignalDecoder decoder(sig);
+
+          uint8_t dat[64];
+          std::generate(std::begin(dat), std::end(dat), [&]() { return gen(); });
+          REQUIRE(decoder.value(dat, frame_size) == get_raw_value(dat, frame_size, sig));
+        }
+      }
+    }
+  }
+}
+
 TEST_CASE("Parse can messages") {
   DBCManager dbc(nullptr);
   dbc.open({0}, "toyota_new_mc_pt_generated");
@@ -0,0 +1,178 @@
+#include "tools/cabana/thumbnails.h"
+
+#include <QBuffer>
+#include <QDataStream>
+#include <QFile>
+#include <QSaveFile>
+#include <QtConcurrent>
+
+#include "libyuv.h"
+
+#include "tools/replay/filereader.h"
+#include "tools/replay/util.h"
+
+const uint32_t THUMBNAIL_CACHE_VERSION = 1;
+const int QCAMERA_FPS = 20;
+const int SEGMENT_LENGTH = 60;
+
+ThumbnailService::ThumbnailService(int thumbnail_height, QObject *parent) : thumbnail_height(thumbnail_height), QObject(parent) {
+  pool.setMaxThreadCount(std::max(2, QThread::idealThreadCount() / 2));
+}
+
+ThumbnailService::~ThumbnailService() {
+  abort();
+}
+
+void ThumbnailService::abort() {
+  abort_ = true;
+  pool.clear();
+  pool.waitForDone();
+  abort_ = false;
+}
+
+void ThumbnailService::start(const Route *route, double route_start_time) {
+  abort();
+  {
+    std::lock_guard lk(lock);
+    thumbnails.clear();
+    alerts.clear();
+  }
+  route_start_ns = route_start_time * 1e9;
+
+  // load from the end of the route so the maximum time is known as early as possible
+  const auto &segments = route->segments();
+  for (auto it = segments.rbegin(); it != segments.rend(); ++it) {
+    QtConcurrent::run(&pool, this, &ThumbnailService::loadSegment, it->first, it->second, it == segments.rbegin());
+  }
+}
+
+void ThumbnailService::loadSegment(int seg_num, const SegmentFile &files, bool is_last) {
+  const std::string qlog = files.qlog.toStdString();
+  const std::string cache_file = cacheFilePath((qlog.empty() ? files.qcamera : files.qlog).toStdString()) + ".thumbnails";
+  const bool cached = loadCache(cache_file);
+
+  QMap<uint64_t, QImage> images;
+  std::set<cereal::Event::Which> allow = {cereal::Event::Which::CONTROLS_STATE};
+  if (!cached) allow.insert(cereal::Event::Which::THUMBNAIL);
+
+  LogReader log;
+  if (!qlog.empty() && log.load(qlog, &abort_, allow, true, 0, 3)) {
+    if (is_last && !log.events.empty()) {
+      emit updateMaximumTime(log.events.back()->mono_time / 1e9 - route_start_ns / 1e9);
+    }
+    for (auto ev = log.events.cbegin(); ev != log.events.cend() && !abort_; ++ev) {
+      if ((*ev)->which == cereal::Event::Which::THUMBNAIL) {
+        auto thumb = (*ev)->event.getThumbnail();
+        auto data = thumb.getThumbnail();
+        if (QImage img; img.loadFromData(data.begin(), data.size(), "jpeg")) {
+          images[thumb.getTimestampEof()] = scaled(img);
+        }
+      } else if ((*ev)->which == cereal::Event::Which::CONTROLS_STATE) {
+        auto cs = (*ev)->event.getControlsState();
+        if (cs.getAlertType().size() > 0 && cs.getAlertText1().size() > 0) {
+          std::lock_guard lk(lock);
+          alerts.emplace((*ev)->mono_time, AlertInfo{cs.getAlertStatus(), cs.getAlertText1().cStr(), cs.getAlertText2().cStr()});
+        }
+      }
+    }
+  }
+
+  if (cached || abort_) return;
+
+  // thumbnails were not logged in older routes, decode them from qcamera
+  if (images.empty() && !files.qcamera.isEmpty()) {
+    images = decodeQcamera(seg_num, files.qcamera);
+  }
+  if (!images.empty() && !abort_) {
+    saveCache(cache_file, images);
+    addThumbnails(images);
+  }
+}
+
+QMap<uint64_t, QImage> ThumbnailService::decodeQcamera(int seg_num, const QString &qcamera) {
+  QMap<uint64_t, QImage> images;
+  FrameReader fr;
+  if (!fr.load(qcamera.toStdString(), false, &abort_, true, 0, 3)) return images;
+
+  // decoding keyframes only keeps this cheap. fall back to one frame per second if there is no GOP structure
+  const int step = fr.keyFrameCount() > 1 ? 1 : QCAMERA_FPS;
+  const int scaled_width = thumbnail_height * fr.width / fr.height;
+  std::vector<uint8_t> yuv(fr.getYUVSize());
+  std::vector<uint8_t> argb(fr.width * fr.height * 4);
+  for (int i = 0; i < fr.getFrameCount() && !abort_; i += step) {
+    if ((step == 1 && !fr.isKeyFrame(i)) || !fr.get(i, yuv.data())) continue;
+
+    const uint8_t *y = yuv.data();
+    const uint8_t *uv = y + fr.width * fr.height;
+    libyuv::NV12ToARGB(y, fr.width, uv, fr.width, argb.data(), fr.width * 4, fr.width, fr.height);
+    QImage img(scaled_width, thumbnail_height, QImage::Format_RGB32);
+    libyuv::ARGBScale(argb.data(), fr.width * 4, fr.width, fr.height,
+                      img.bits(), img.bytesPerLine(), img.width(), img.height(), libyuv::kFilterBilinear);
+    uint64_t mono_time = route_start_ns + (seg_num * SEGMENT_LENGTH + i / (double)QCAMERA_FPS) * 1e9;
+    images[mono_time] = img;
+  }
+  return images;
+}
+
+bool ThumbnailService::loadCache(const std::string &cache_file) {
+  QFile f(QString::fromStdString(cache_file));
+  if (!f.open(QIODevice::ReadOnly)) return false;
+
+  QDataStream stream(&f);
+  uint32_t version = 0;
+  int32_t height = 0;
+  QMap<quint64, QByteArray> jpegs;
+  stream >> version >> height >> jpegs;
+  if (stream.status() != QDataStream::Ok || version != THUMBNAIL_CACHE_VERSION || height != thumbnail_height) {
+    return false;
+  }
+
+  QMap<uint64_t, QImage> images;
+  for (auto it = jpegs.cbegin(); it != jpegs.cend() && !abort_; ++it) {
+    if (QImage img; img.loadFromData(it.value(), "jpeg")) {
+      images[it.key()] = img;
+    }
+  }
+  addThumbnails(images);
+  return true;
+}
+
+void ThumbnailService::addThumbnails(const QMap<uint64_t, QImage> &images) {
+  std::lock_guard lk(lock);
+  for (auto it = images.cbegin(); it != images.cend(); ++it) {
+    thumbnails[it.key()] = it.value();
+  }
+}
+
+void ThumbnailService::saveCache(const std::string &cache_file, const QMap<uint64_t, QImage> &images) {
+  QMap<quint64, QByteArray> jpegs;
+  for (auto it = images.cbegin(); it != images.cend(); ++it) {
+    QBuffer buf(&jpegs[it.key()]);
+    buf.open(QIODevice::WriteOnly);
+    it.value().save(&buf, "jpeg", 90);
+  }
+
+  QSaveFile f(QString::fromStdString(cache_file));
+  if (f.open(QIODevice::WriteOnly)) {
+    QDataStream stream(&f);
+    stream << THUMBNAIL_CACHE_VERSION << (int32_t)thumbnail_height << jpegs;
+    if (!f.commit()) {
+      rWarning("failed to write thumbnail cache %s", cache_file.c_str());
+    }
+  }
+}
+
+QImage ThumbnailService::thumbnail(uint64_t mono_time) {
+  std::lock_guard lk(lock);
+  auto it = thumbnails.lowerBound(mono_time);
+  return it != thumbnails.end() ? it.value() : QImage{};
+}
+
+AlertInfo ThumbnailService::alert(uint64_t mono_time) {
+  std::lock_guard lk(lock);
+  auto it = alerts.lower_bound(mono_time);
+  if (it != alerts.end() && (it->first - mono_time) < 1e9) {
+    return it->second;
+  }
+  return {};
+}
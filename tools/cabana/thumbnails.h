@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <mutex>
+
+#include <QImage>
+#include <QMap>
+#include <QThreadPool>
+
+#include "tools/replay/route.h"
+
+struct AlertInfo {
+  cereal::ControlsState::AlertStatus status;
+  QString text1;
+  QString text2;
+};
+
+// Loads the thumbnails and alerts of a route on a worker pool. Thumbnails come
+// from the qlog when they were logged, otherwise they are decoded from qcamera
+// keyframes. The scaled results are cached on disk next to the download cache.
+class ThumbnailService : public QObject {
+  Q_OBJECT
+
+public:
+  ThumbnailService(int thumbnail_height, QObject *parent = nullptr);
+  ~ThumbnailService();
+  void start(const Route *route, double route_start_time);
+  void abort();
+  QImage thumbnail(uint64_t mono_time);
+  AlertInfo alert(uint64_t mono_time);
+
+signals:
+  void updateMaximumTime(double sec);
+
+private:
+  void loadSegment(int seg_num, const SegmentFile &files, bool is_last);
+  bool loadCache(const std::string &cache_file);
+  void saveCache(const std::string &cache_file, const QMap<uint64_t, QImage> &images);
+  void addThumbnails(const QMap<uint64_t, QImage> &images);
+  QMap<uint64_t, QImage> decodeQcamera(int seg_num, const QString &qcamera);
+  QImage scaled(const QImage &img) const { return img.scaledToHeight(thumbnail_height, Qt::SmoothTransformation); }
+
+  const int thumbnail_height;
+  uint64_t route_start_ns = 0;
+  QThreadPool pool;
+  std::atomic<bool> abort_ = false;
+  std::mutex lock;
+  QMap<uint64_t, QImage> thumbnails;
+  std::map<uint64_t, AlertInfo> alerts;
+};
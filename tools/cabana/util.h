@@ -121,5 +121,3 @@ private:
   QString icon_str;
   int theme;
 };
-
-int num_decimals(double num);
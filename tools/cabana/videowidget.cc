@@ -6,7 +6,6 @@
 #include <QStackedLayout>
 #include <QStyleOptionSlider>
 #include <QVBoxLayout>
-#include <QtConcurrent>
 
 const int MIN_VIDEO_HEIGHT = 100;
 const int THUMBNAIL_MARGIN = 3;
@@ -141,14 +140,8 @@ void VideoWidget::updateState() {
   if (!slider->isSliderDown()) {
     slider->setValue(can->currentSec() * 1000);
   }
-  std::lock_guard lk(slider->thumbnail_lock);
   uint64_t mono_time = (can->currentSec() + can->routeStartTime()) * 1e9;
-  auto it = slider->alerts.lower_bound(mono_time);
-  if (it != slider->alerts.end() && (it->first - mono_time) < 1e9) {
-    alert_label->showAlert(it->second);
-  } else {
-    alert_label->showAlert({});
-  }
+  alert_label->showAlert(slider->thumbnails.alert(mono_time));
 }
 
 void VideoWidget::updatePlayBtnState() {
@@ -157,7 +150,7 @@ void VideoWidget::updatePlayBtnState() {
 }
 
 // Slider
-Slider::Slider(QWidget *parent) : timer(this), thumbnail_label(parent), QSlider(Qt::Horizontal, parent) {
+Slider::Slider(QWidget *parent) : timer(this), thumbnails(MIN_VIDEO_HEIGHT - THUMBNAIL_MARGIN * 2, this), thumbnail_label(parent), QSlider(Qt::Horizontal, parent) {
   timer.callOnTimeout([this]() {
     timeline = can->getTimeline();
     std::sort(timeline.begin(), timeline.end(), sortTimelineBasedOnEventPriority);
@@ -165,53 +158,29 @@ Slider::Slider(QWidget *parent) : timer(this), thumbnail_label(parent), QSlider(
   });
   setMouseTracking(true);
   QObject::connect(can, &AbstractStream::streamStarted, this, &Slider::streamStarted);
+  QObject::connect(&thumbnails, &ThumbnailService::updateMaximumTime, this, &Slider::updateMaximumTime);
 }
 
 Slider::~Slider() {
-  abort_load_thumbnail = true;
-  thumnail_future.waitForFinished();
+  thumbnails.abort();
 }
 
 void Slider::streamStarted() {
-  abort_load_thumbnail = true;
-  thumnail_future.waitForFinished();
-  abort_load_thumbnail = false;
-  thumbnails.clear();
   timeline.clear();
+  pixmaps.clear();
   timer.start(2000);
-  thumnail_future = QtConcurrent::run(this, &Slider::loadThumbnails);
+  thumbnails.start(can->route(), can->routeStartTime());
 }
 
-void Slider::loadThumbnails() {
-  const auto &segments = can->route()->segments();
-  double max_time = 0;
-  for (auto it = segments.rbegin(); it != segments.rend() && !abort_load_thumbnail; ++it) {
-    LogReader log;
-    std::string qlog = it->second.qlog.toStdString();
-    if (!qlog.empty() && log.load(qlog, &abort_load_thumbnail, {cereal::Event::Which::THUMBNAIL, cereal::Event::Which::CONTROLS_STATE}, true, 0, 3)) {
-      if (max_time == 0 && !log.events.empty()) {
-        max_time = (*(log.events.rbegin()))->mono_time / 1e9 - can->routeStartTime();
-        emit updateMaximumTime(max_time);
-      }
-      for (auto ev = log.events.cbegin(); ev != log.events.cend() && !abort_load_thumbnail; ++ev) {
-        if ((*ev)->which == cereal::Event::Which::THUMBNAIL) {
-          auto thumb = (*ev)->event.getThumbnail();
-          auto data = thumb.getThumbnail();
-          if (QPixmap pm; pm.loadFromData(data.begin(), data.size(), "jpeg")) {
-            pm = pm.scaledToHeight(MIN_VIDEO_HEIGHT - THUMBNAIL_MARGIN * 2, Qt::SmoothTransformation);
-            std::lock_guard lk(thumbnail_lock);
-            thumbnails[thumb.getTimestampEof()] = pm;
-          }
-        } else if ((*ev)->which == cereal::Event::Which::CONTROLS_STATE) {
-          auto cs = (*ev)->event.getControlsState();
-          if (cs.getAlertType().size() > 0 && cs.getAlertText1().size() > 0) {
-            std::lock_guard lk(thumbnail_lock);
-            alerts.emplace((*ev)->mono_time, AlertInfo{cs.getAlertStatus(), cs.getAlertText1().cStr(), cs.getAlertText2().cStr()});
-          }
-        }
-      }
-    }
+QPixmap Slider::thumbnailPixmap(uint64_t mono_time) {
+  QImage img = thumbnails.thumbnail(mono_time);
+  if (img.isNull()) return {};
+
+  auto it = pixmaps.find(img.cacheKey());
+  if (it == pixmaps.end()) {
+    it = pixmaps.insert(img.cacheKey(), QPixmap::fromImage(img));
   }
+  return it.value();
 }
 
 void Slider::sliderChange(QAbstractSlider::SliderChange change) {
@@ -260,20 +229,11 @@ void Slider::mousePressEvent(QMouseEvent *e) {
 }
 
 void Slider::mouseMoveEvent(QMouseEvent *e) {
-  QPixmap thumb;
-  AlertInfo alert;
   int pos = std::clamp(e->pos().x(), 0, width());
   double seconds = (minimum() + pos * ((maximum() - minimum()) / (double)width())) / 1000.0;
-  {
-    std::lock_guard lk(thumbnail_lock);
-    uint64_t mono_time = (seconds + can->routeStartTime()) * 1e9;
-    auto it = thumbnails.lowerBound(mono_time);
-    if (it != thumbnails.end()) thumb = it.value();
-    auto alert_it = alerts.lower_bound(mono_time);
-    if (alert_it != alerts.end() && (alert_it->first - mono_time) < 1e9) {
-      alert = alert_it->second;
-    }
-  }
+  uint64_t mono_time = (seconds + can->routeStartTime()) * 1e9;
+  QPixmap thumb = thumbnailPixmap(mono_time);
+  AlertInfo alert = thumbnails.alert(mono_time);
   int x = std::clamp(pos - thumb.width() / 2, THUMBNAIL_MARGIN, rect().right() - thumb.width() - THUMBNAIL_MARGIN);
   int y = -thumb.height();
   thumbnail_label.showPixmap(mapToParent({x, y}), utils::formatSeconds(seconds), thumb, alert);
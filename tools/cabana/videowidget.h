@@ -1,10 +1,7 @@
 #pragma once
 
-#include <atomic>
-#include <mutex>
-
+#include <QHash>
 #include <QHBoxLayout>
-#include <QFuture>
 #include <QLabel>
 #include <QPushButton>
 #include <QSlider>
@@ -12,12 +9,7 @@
 
 #include "selfdrive/ui/qt/widgets/cameraview.h"
 #include "tools/cabana/streams/abstractstream.h"
-
-struct AlertInfo {
-  cereal::ControlsState::AlertStatus status;
-  QString text1;
-  QString text2;
-};
+#include "tools/cabana/thumbnails.h"
 
 class InfoLabel : public QWidget {
 public:
@@ -47,16 +39,14 @@ private:
   void sliderChange(QAbstractSlider::SliderChange change) override;
   void paintEvent(QPaintEvent *ev) override;
   void streamStarted();
-  void loadThumbnails();
+  QPixmap thumbnailPixmap(uint64_t mono_time);
 
   double max_sec = 0;
   int slider_x = -1;
   std::vector<std::tuple<int, int, TimelineType>> timeline;
-  std::mutex thumbnail_lock;
-  std::atomic<bool> abort_load_thumbnail = false;
-  QMap<uint64_t, QPixmap> thumbnails;
-  std::map<uint64_t, AlertInfo> alerts;
-  QFuture<void> thumnail_future;
+  ThumbnailService thumbnails;
+  // the thumbnails converted so far, by QImage::cacheKey()
+  QHash<qint64, QPixmap> pixmaps;
   InfoLabel thumbnail_label;
   QTimer timer;
   friend class VideoWidget;
@@ -101,6 +101,7 @@ def main(addr, cams, nvidia=False):
     p.join()
 
 if __name__ == "__main__":
+  # if encoderd runs with ENCODER_RING_DATA, run encode_ring_bridge.py on the device for the EncodeData services
   parser = argparse.ArgumentParser(description="Decode video streams and broadcast on VisionIPC")
   parser.add_argument("addr", help="Address of comma three")
   parser.add_argument("--nvidia", action="store_true", help="Use nvidia instead of ffmpeg")
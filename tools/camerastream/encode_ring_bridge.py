@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+import os
+import mmap
+import struct
+import argparse
+
+import cereal.messaging as messaging
+
+# with ENCODER_RING_DATA set, encoderd only sends the EncodeIndex over msgq, the packets are in a
+# shared memory ring per stream (system/loggerd/encode_ring.h). run this on the device instead of
+# the bridge for the EncodeData services, it puts the packets back in the messages and sends them
+# over ZMQ for compressed_vipc.py
+
+ENCODE_RING_SLOTS = 256
+SLOT = struct.Struct("<QQI4x")  # seq, pos, len
+HEADER = struct.Struct("<QQ")   # capacity, write_pos
+DATA_OFFSET = HEADER.size + ENCODE_RING_SLOTS * SLOT.size
+
+
+class EncodeRing:
+  def __init__(self, service):
+    prefix = os.getenv("OPENPILOT_PREFIX")
+    self.path = f"/dev/shm/{prefix}/{service}.ring" if prefix else f"/dev/shm/{service}.ring"
+    self.buf = None
+
+  def open(self):
+    try:
+      with open(self.path, "rb") as f:
+        self.buf = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    except (OSError, ValueError):
+      self.buf = None
+
+  def lookup(self, encode_id, length):
+    capacity, _ = HEADER.unpack_from(self.buf, 0)
+    slot_offset = HEADER.size + (encode_id % ENCODE_RING_SLOTS) * SLOT.size
+    seq, pos, slot_len = SLOT.unpack_from(self.buf, slot_offset)
+    if seq != encode_id + 1 or slot_len != length:
+      return None
+
+    offset = pos % capacity
+    first = min(length, capacity - offset)
+    dat = self.buf[DATA_OFFSET + offset:DATA_OFFSET + offset + first] + self.buf[DATA_OFFSET:DATA_OFFSET + length - first]
+
+    # the packet may have been overwritten while it was copied
+    _, write_pos = HEADER.unpack_from(self.buf, 0)
+    if SLOT.unpack_from(self.buf, slot_offset)[0] != seq or write_pos > pos + capacity:
+      return None
+    return dat
+
+  def get(self, encode_id, length):
+    dat = self.lookup(encode_id, length) if self.buf is not None else None
+    if dat is None:
+      # encoderd may have restarted with a new ring
+      self.open()
+      if self.buf is not None:
+        dat = self.lookup(encode_id, length)
+    return dat
+
+
+def main(services):
+  poller = messaging.Poller()
+  socks = {s: messaging.sub_sock(s, poller=poller, conflate=False) for s in services}
+  os.environ["ZMQ"] = "1"
+  messaging.context = messaging.Context()
+  pm = messaging.PubMaster(services)
+  rings = {s: EncodeRing(s) for s in services}
+  missing = {s: 0 for s in services}
+
+  while 1:
+    ready = poller.poll(100)
+    for s, sock in socks.items():
+      if sock not in ready:
+        continue
+      for evt in messaging.drain_sock(sock):
+        msg = evt.as_builder()
+        edat = getattr(msg, s)
+        if len(edat.data) == 0 and edat.idx.len > 0:
+          dat = rings[s].get(edat.idx.encodeId, edat.idx.len)
+          if dat is None:
+            missing[s] += 1
+            print(f"{s}: packet {edat.idx.encodeId} missing in encoder ring, {missing[s]} missing so far")
+            continue
+          edat.data = dat
+        pm.send(s, msg)
+
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description="Send the EncodeData services with their packets over ZMQ")
+  parser.add_argument("--cams", default="0,1,2", help="Cameras to send")
+  args = parser.parse_args()
+
+  all_services = ["roadEncodeData", "wideRoadEncodeData", "driverEncodeData"]
+  main([all_services[int(x)] for x in args.cams.split(",")])
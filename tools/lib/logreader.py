@@ -73,6 +73,26 @@ class MultiLogIterator:
     self.__init__(self._log_paths, sort_by_time=self.sort_by_time)
 
 
+def decompress_log(dat):
+  # loggerd writes a log as a sequence of bzip2 streams. a log cut short by a crash is read up to
+  # where it stops, its last stream may be truncated or followed by the zero padding of O_DIRECT
+  out = []
+  while dat:
+    d = bz2.BZ2Decompressor()
+    try:
+      out.append(d.decompress(dat))
+    except OSError:
+      if not out:
+        raise
+      warnings.warn("Corrupted bz2 stream detected", RuntimeWarning)
+      break
+    if not d.eof:
+      warnings.warn("Truncated bz2 stream detected", RuntimeWarning)
+      break
+    dat = d.unused_data
+  return b''.join(out)
+
+
 class LogReader:
   def __init__(self, fn, canonicalize=True, only_union_types=False, sort_by_time=False, dat=None):
     self.data_version = None
@@ -89,7 +109,7 @@ class LogReader:
         dat = f.read()
 
     if ext == ".bz2" or dat.startswith(b'BZh9'):
-      dat = bz2.decompress(dat)
+      dat = decompress_log(dat)
 
     ents = capnp_log.Event.read_multiple_bytes(dat)
 
@@ -1,10 +1,12 @@
 #!/usr/bin/env python
+import bz2
 import unittest
 import requests
 import tempfile
 
 from collections import defaultdict
 import numpy as np
+from cereal import messaging
 from tools.lib.framereader import FrameReader
 from tools.lib.logreader import LogReader
 
@@ -31,6 +33,21 @@ class TestReaders(unittest.TestCase):
     lr_url = LogReader("https://github.com/commaai/comma2k19/blob/master/Example_1/b0c9d2329ad1606b%7C2018-08-02--08-34-47/40/raw_log.bz2?raw=true")
     _check_data(lr_url)
 
+  def test_logreader_truncated(self):
+    # a log cut short by a crash, as loggerd writes it: a bzip2 stream per buffer, the last one
+    # truncated, or complete and followed by the zero padding of O_DIRECT
+    msgs = [messaging.new_message('clocks').to_bytes() for _ in range(2000)]
+    streams = [bz2.compress(b''.join(msgs[i:i+500])) for i in range(0, len(msgs), 500)]
+
+    for dat, expected in ((b''.join(streams)[:-(len(streams[-1]) // 2)], 1500), (b''.join(streams) + b'\0' * 3000, 2000)):
+      with tempfile.NamedTemporaryFile(suffix=".bz2") as fp:
+        fp.write(dat)
+        fp.flush()
+
+        lr = list(LogReader(fp.name))
+        self.assertEqual(len(lr), expected)
+        self.assertTrue(all(m.which() == 'clocks' for m in lr))
+
   @unittest.skip("skip for bandwidth reasons")
   def test_framereader(self):
     def _check_data(f):
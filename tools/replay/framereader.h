@@ -25,6 +25,8 @@ public:
   bool get(int idx, uint8_t *yuv);
   int getYUVSize() const { return width * height * 3 / 2; }
   size_t getFrameCount() const { return packets.size(); }
+  int keyFrameCount() const { return key_frames_count_; }
+  bool isKeyFrame(int idx) const { return packets[idx]->flags & AV_PKT_FLAG_KEY; }
   bool valid() const { return valid_; }
 
   int width = 0, height = 0;
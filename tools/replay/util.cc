@@ -266,27 +266,47 @@ std::string decompressBZ2(const std::byte *in, size_t in_size, std::atomic<bool>
   strm.next_in = (char *)in;
   strm.avail_in = in_size;
   std::string out(in_size * 5, '\0');
+  size_t out_size = 0;
   do {
-    strm.next_out = (char *)(&out[strm.total_out_lo32]);
-    strm.avail_out = out.size() - strm.total_out_lo32;
+    strm.next_out = (char *)(&out[out_size]);
+    strm.avail_out = out.size() - out_size;
 
     const char *prev_write_pos = strm.next_out;
     bzerror = BZ2_bzDecompress(&strm);
+    out_size = strm.next_out - out.data();
+
+    if (bzerror == BZ_STREAM_END && strm.avail_in > 0) {
+      // logs written by loggerd are a sequence of bzip2 streams. one cut short by a crash
+      // may have the zero padding of its last O_DIRECT block after them
+      if (strm.next_in[0] == '\0') {
+        rWarning("decompressBZ2 error : content is truncated");
+        break;
+      }
+      char *next_in = strm.next_in;
+      unsigned int avail_in = strm.avail_in;
+      BZ2_bzDecompressEnd(&strm);
+      bzerror = BZ2_bzDecompressInit(&strm, 0, 0);
+      assert(bzerror == BZ_OK);
+      strm.next_in = next_in;
+      strm.avail_in = avail_in;
+      continue;
+    }
+
     if (bzerror == BZ_OK && prev_write_pos == strm.next_out) {
-      // content is corrupt
+      // content is corrupt, or the last stream was cut short because the device lost power while logging
       bzerror = BZ_STREAM_END;
-      rWarning("decompressBZ2 error : content is corrupt");
+      rWarning(strm.avail_in == 0 ? "decompressBZ2 error : content is truncated" : "decompressBZ2 error : content is corrupt");
       break;
     }
 
-    if (bzerror == BZ_OK && strm.avail_in > 0 && strm.avail_out == 0) {
+    if (bzerror == BZ_OK && strm.avail_out == 0) {
       out.resize(out.size() * 2);
     }
   } while (bzerror == BZ_OK && !(abort && *abort));
 
   BZ2_bzDecompressEnd(&strm);
   if (bzerror == BZ_STREAM_END && !(abort && *abort)) {
-    out.resize(strm.total_out_lo32);
+    out.resize(out_size);
     return out;
   }
   return {};